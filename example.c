@@ -7,6 +7,8 @@ int main() {
     int ret;
     char *dest_str;
     long dest_str_len;
+    inkf_ctx *ctx;
+    char dest_buf[256];
 
     ret = inkf("こんにちは", strlen("こんにちは"),
                &dest_str, &dest_str_len, "-We");
@@ -17,5 +19,17 @@ int main() {
     printf("dest_str=[%s]\n", dest_str);
 
     inkf_free_str(dest_str);
+
+    /* convert many texts with the same options */
+    ctx = inkf_open("-Wj");
+    ret = inkf_convert(ctx, "こんにちは", strlen("こんにちは"),
+                       dest_buf, sizeof(dest_buf), &dest_str_len);
+
+    printf("This is ISO-2022-JP text.\n");
+    printf("ret=%d\n", ret);
+    printf("dest_str_len=%ld\n", dest_str_len);
+    printf("dest_str=[%s]\n", dest_buf);
+
+    inkf_close(ctx);
     return 0;
 }
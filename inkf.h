@@ -8,9 +8,35 @@
 #ifndef _INKF_H_
 #define _INKF_H_
 
+#include <stddef.h>
+
 int inkf(const char *src_str, long src_str_len,
          char **dest_str, long *dest_str_len, const char *option_str);
 
+/* Convert into dest_buf; returns -2 and sets *dest_str_len if dest_buf is too small
+   (dest_buf may then hold a part of the text). The last encoder writes into dest_buf
+   when its worst case fits there; otherwise, and for UTF-8, UTF-16, UTF-32, UTF-7,
+   between japanese character sets, with MIME, CSV, JSON, regex, MD5 or SHA-1 output
+   and in iconv builds, the text is converted aside and copied. Asking the size with
+   a NULL dest_buf costs a whole conversion. */
+int inkf_buf(const char *src_str, long src_str_len,
+             char *dest_buf, long dest_buf_size, long *dest_str_len, const char *option_str);
+
 void inkf_free_str(char *str);
 
+/* Allocator of dest_str of inkf() (set once before converting) */
+void inkf_set_allocator(void *(*alloc_func)(size_t size), void (*free_func)(void *ptr));
+
+/* Converter context: options are parsed once by inkf_open() and the
+   context is only read by inkf_convert(). Use one context per thread.
+   inkf_convert() fills dest_buf as inkf_buf() does. */
+typedef struct inkf_ctx inkf_ctx;
+
+inkf_ctx *inkf_open(const char *option_str);
+
+int inkf_convert(inkf_ctx *ctx, const char *src_str, long src_str_len,
+                 char *dest_buf, long dest_buf_size, long *dest_str_len);
+
+void inkf_close(inkf_ctx *ctx);
+
 #endif
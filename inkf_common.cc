@@ -9,6 +9,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "apolloron.h"
 #include "inkf_common.h"
@@ -22,6 +31,54 @@ const char *INKF_VERSION  = "2.1.8";
 const char *INKF_COPY     = "Copyright (C) 2002-2025 Masashi Astro Tachibana";
 const char *INKF_DEF_OUT  = "inkf.out";
 
+#define INKF_STREAM_BUF_SIZE  65536L           // size of each read of input
+#define INKF_MAP_SLICE_SIZE   (1024L * 1024L)  // size of each slice of mapped input
+#define INKF_STREAM_LINE_MAX  (1024L * 1024L)  // UTF-8 held back until line end
+#define INKF_JOB_SLICE_SIZE   (4L * 1024L * 1024L) // share of each job in a slice of input
+#define INKF_JOBS_MAX         256              // upper limit of -P/--jobs
+#define INKF_JOBS_WINDOW      4                // converted files held per job
+#define INKF_SINK_BUF_SIZE    (1024L * 1024L)  // output gathered before each write
+#define INKF_SINK_ALIGN       4096             // alignment of the output buffer
+#define INKF_COPY_SIZE        (64L * 1024L * 1024L) // size of each copy in the kernel
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+        (2 < __GLIBC__ || (__GLIBC__ == 2 && 27 <= __GLIBC_MINOR__))
+#define INKF_COPY_FILE_RANGE  1
+#else
+#define INKF_COPY_FILE_RANGE  0
+#endif
+
+typedef struct {
+    int fd;             // output descriptor (-1: kept in memory)
+    char *buf;          // pending output (aligned to INKF_SINK_ALIGN)
+    long length;
+    long capacity;
+    char *tmp_filename; // temporary file which replaces the original one
+    int error;          // a write has failed
+} TSink;
+
+typedef struct {
+    TSink sink;
+    int done;
+} TJob;
+
+typedef struct {
+    const TOption *option;
+    bool charset_autodetect_pre;
+    bool overwrite;
+    int count;
+    int next;
+    int written;
+    int window;
+    TJob *jobs;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} TJobQueue;
+
+// allocator of inkf_lib_exec() output (NULL: new/delete)
+static void *(*output_alloc)(size_t size) = NULL;
+static void (*output_free)(void *ptr) = NULL;
+
 const char *RETURN_STR[] = {
     "\n",   // default retuen code
     "\n",   // LF
@@ -29,10 +86,45 @@ const char *RETURN_STR[] = {
     "\r"    // CR
 };
 
-static void guess(const String &str, const char *input_charset, char *buf);
+static int guess(const String &str, const char *input_charset, long limit, char *buf);
+static void guess_head(FILE *fpin, const char *input_charset, long limit, char *buf);
+static void guess_file(const char *filename, const char *input_charset, long limit, char *buf);
 static void convert(String &str, const TOption *option);
+static bool convert_into(String &str, const TOption *option,
+                         char *output_buf, long output_buf_size, long *output_length);
+static bool is_streamable(const TOption *option);
+static bool is_stateful(int charset_handle);
+static bool is_passthrough(const TOption *option);
+static bool is_sortable_file(const char *filename, const TOption *option);
+static int sort_csv_file(const char *filename, TSink *sink, const TOption *option,
+                         const char *input_charset);
+static void convert_stream(FILE *fpin, TSink *sink, const TOption *option);
+static const char *map_input(FILE *fp, long *length);
+static int convert_file_stream(const char *filename, TSink *sink, const TOption *option);
+static void convert_file(const char *filename, TSink *sink, const TOption *option,
+                         bool charset_autodetect_pre);
+static void *convert_files_worker(void *arg);
+static int convert_files_parallel(TSink *sink, const TOption *option,
+                                  bool charset_autodetect_pre);
+static bool sink_open(TSink *sink, int fd);
+static bool sink_open_temp(TSink *sink, const char *filename);
+static void sink_write(TSink *sink, const char *data, long length);
+static int sink_flush(TSink *sink);
+static void sink_passthrough(TSink *sink, int fd_in);
+static int sink_close(TSink *sink);
+static int sink_commit(TSink *sink, const char *filename, bool sync);
+static void sink_discard(TSink *sink);
+static int write_vector(int fd, struct iovec *iov, int count);
+static bool has_utf8_stage(const TOption *option);
+static void convert_utf8(String &u8str, const TOption *option);
+static bool remove_single_return(String &u8str, const TOption *option);
+static long utf8_stage_length(const char *str, long length, bool finish);
+static int set_jobs(TOption *option, const char *value);
 static void set_input_charset_by_env(char *input_charset);
 static void set_output_charset(char *output_charset, const char *input_charset, String &str);
+static void get_csv_column(String &csv_column, const TOption *option);
+static int lib_exec(const char *input_str, long input_str_len, String &ret_str,
+                    const TOption *option);
 static void get_help(char *buf);
 static void get_version(char *buf);
 static void get_copy(char *buf);
@@ -40,10 +132,11 @@ static void get_copy(char *buf);
 
 extern "C" int inkf_command_exec(const TOption *option) {
     int retval = 0;
-    FILE *fpin = stdin, *fpout = stdout;
+    FILE *fpin = stdin;
+    TSink sink;
     String tmp_str;
-    char buf[4096 + 1], *p;
-    int i, j, l;
+    char buf[4096 + 1];
+    int i, l, fd;
 
     // check option
     if (option == (TOption *)NULL) {
@@ -74,61 +167,27 @@ extern "C" int inkf_command_exec(const TOption *option) {
 
     // open output stream
     if (option->output_filename != NULL && option->output_filename[0] != '\0') {
-        fpout = fopen(option->output_filename, "wb");
-        if (fpout == (FILE *)NULL) {
+        fd = open(option->output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
             fprintf(stderr, "Cannot open the output file '%s'.\n", option->output_filename);
+            retval = -1;
+            goto exec_command_exit;
         }
+    } else {
+        fflush(stdout);
+        fd = fileno(stdout);
     }
+    sink_open(&sink, fd);
 
     // conversion
     if (option->input_filenames == (char **)NULL) {
 
         // read from stdin
-        if (option->mime_decode == MIME_NONE && option->mime_encode == MIME_NONE &&
-                !option->flag_guess && !option->flag_html_to_plain && !option->flag_midi &&
-                !option->flag_md5 && !option->flag_sha1 &&
-                !option->flag_sort_csv && !option->flag_sort_csv_r &&
-                !option->flag_format_json && !option->flag_minify_json &&
-                !option->flag_re_match &&
-                strncasecmp(option->input_charset, "AUTODETECT", 10) != 0 &&
-                strncasecmp(option->input_charset, "UTF-16", 6) != 0 &&
-                strncasecmp(option->input_charset, "UTF16", 5) != 0 &&
-                strncasecmp(option->input_charset, "UTF-32", 6) != 0 &&
-                strncasecmp(option->input_charset, "UTF32", 5) != 0 &&
-                strcasecmp(option->output_charset, "UTF-8_BOM") != 0 &&
-                !(!strncasecmp(option->output_charset, "UTF-16", 6) ||
-                !strncasecmp(option->output_charset, "UTF16", 5) ||
-                !strncasecmp(option->output_charset, "UTF-32", 6) ||
-                !strncasecmp(option->output_charset, "UTF32", 5))) {
-            while (!feof(fpin)) {
-                tmp_str = "";
-                while (!feof(fpin)) {
-                    l = fread(buf, 1, 4096, fpin);
-                    buf[l] = '\0';
-                    p = strrchr(buf, '\n');
-                    if (p != NULL) {
-                        j = p - buf + 1;
-                        tmp_str.add(buf, j);
-                        convert(tmp_str, option);
-                        if (tmp_str.isBinary()) {
-                            fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
-                        } else {
-                            fwrite(tmp_str.c_str(), 1, tmp_str.len(), fpout);
-                        }
-                        tmp_str = buf + j;
-                    } else {
-                        tmp_str.add(buf);
-                    }
-                }
-                if (0 < tmp_str.len()) {
-                    convert(tmp_str, option);
-                    if (tmp_str.isBinary()) {
-                        fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
-                    } else {
-                        fwrite(tmp_str.c_str(), 1, tmp_str.len(), fpout);
-                    }
-                }
-            }
+        if (is_streamable(option)) {
+            convert_stream(fpin, &sink, option);
+        } else if (option->flag_guess && 0 < option->guess_limit) {
+            guess_head(fpin, option->input_charset, option->guess_limit, buf);
+            sink_write(&sink, buf, strlen(buf));
         } else {
             tmp_str = "";
             while (!feof(fpin)) {
@@ -140,17 +199,17 @@ extern "C" int inkf_command_exec(const TOption *option) {
                 tmp_str.addBinary(buf, l);
             }
             if (option->flag_guess) {
-                guess(tmp_str, option->input_charset, buf);
-                fwrite(buf, 1, strlen(buf), fpout);
+                guess(tmp_str, option->input_charset, 0, buf);
+                sink_write(&sink, buf, strlen(buf));
             } else if (option->flag_midi) {
                 tmp_str = tmp_str.toMIDI();
-                fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
+                sink_write(&sink, tmp_str.c_str(), tmp_str.binaryLength());
             } else if (0 < tmp_str.len() || 0 < tmp_str.binaryLength()) {
                 convert(tmp_str, option);
                 if (tmp_str.isBinary()) {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
+                    sink_write(&sink, tmp_str.c_str(), tmp_str.binaryLength());
                 } else {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.len(), fpout);
+                    sink_write(&sink, tmp_str.c_str(), tmp_str.len());
                 }
             }
         }
@@ -162,96 +221,32 @@ extern "C" int inkf_command_exec(const TOption *option) {
             charset_autodetect_pre = true;
         }
 
-        tmp_str.useAsBinary(0);
-
-        // read from file(s) or specified URL
-        for (i = 0; option->input_filenames[i] != NULL; i++) {
-            char input_charset[32];
-            strncpy(input_charset, option->input_charset, 31);
-            input_charset[31] = '\0';
-            if (charset_autodetect_pre) {
-                strcpy(input_charset, "AUTODETECT");
-            }
-#if __OPENSSL == 1
-            if (!strncasecmp(option->input_filenames[i], "http://", 7) ||
-                    !strncasecmp(option->input_filenames[i], "https://", 8)) {
-#else
-            if (!strncasecmp(option->input_filenames[i], "http://", 7)) {
-#endif
-                HTTPClient hc;
-                tmp_str = hc.getURL(option->input_filenames[i]);
-                strncpy(input_charset, hc.getOrigCharset().c_str(), 31);
-                input_charset[31] = '\0';
-            } else if (!strncasecmp(option->input_filenames[i], "ftp://", 6)) {
-                FTPStream fs;
-                String host;
-                String port = 21;
-                String path;
-                long x;
-                host = option->input_filenames[i]+6;
-                x = host.search(":");
-                if (0 <= x) {
-                    host = host.mid(0, x);
-                }
-                x = host.search("/");
-                if (0 <= x) {
-                    path = host.mid(x);
-                    host = host.mid(0, x);
-                }
-                if (fs.login("anonymous", "user@example.com", host, port)) {
-                    fs.passive();
-                    tmp_str = fs.receiveBuffer(path);
-                    fs.logout();
-                }
-            } else {
-                tmp_str.loadFile(option->input_filenames[i]);
-            }
-            if ((option->output_filename == NULL || option->output_filename[0] == '\0') &&
-                    option->flag_overwrite) {
-                fpout = fopen(option->input_filenames[i], "wb");
-                if (fpout == (FILE *)NULL) {
-                    fprintf(stderr, "Cannot open the output file '%s'.\n",
-                            option->input_filenames[i]);
-                    continue;
-                }
-            }
-            if (option->flag_guess) {
-                guess(tmp_str, input_charset, buf);
-                fwrite(buf, 1, strlen(buf), fpout);
-            } else if (option->flag_midi) {
-                tmp_str = tmp_str.toMIDI();
-                fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
-                if (!((option->output_filename == NULL || option->output_filename[0] == '\0') &&
-                    option->flag_overwrite)) {
-                    break;
-                }
-            } else if (0 < tmp_str.len()) {
-                if (charset_autodetect_pre) {
-                    TOption tmp_option;
-                    memcpy(&tmp_option, option, sizeof(TOption));
-                    strcpy(tmp_option.input_charset, input_charset);
-                    convert(tmp_str, &tmp_option);
-                } else {
-                    convert(tmp_str, option);
-                }
-                if (tmp_str.isBinary()) {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
+        // convert independent files on a worker pool, or one by one
+        if (convert_files_parallel(&sink, option, charset_autodetect_pre) != 0) {
+            // read from file(s) or specified URL
+            for (i = 0; option->input_filenames[i] != NULL; i++) {
+                if ((option->output_filename == NULL || option->output_filename[0] == '\0') &&
+                        option->flag_overwrite) {
+                    convert_file(option->input_filenames[i], (TSink *)NULL, option,
+                                 charset_autodetect_pre);
                 } else {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.len(), fpout);
+                    convert_file(option->input_filenames[i], &sink, option,
+                                 charset_autodetect_pre);
+                    if (option->flag_midi) {
+                        break;
+                    }
                 }
             }
-            if ((option->output_filename == NULL || option->output_filename[0] == '\0') &&
-                    option->flag_overwrite) {
-                fclose(fpout);
-                fpout = (FILE *)NULL;
-            }
         }
     }
 
     // close output stream
-    if (option->output_filename != NULL && option->output_filename[0] != '\0' &&
-            fpout != (FILE *)NULL) {
-        fclose(fpout);
+    if (sink_close(&sink) != 0) {
+        fprintf(stderr, "Cannot write the output.\n");
+        retval = -1;
+    }
+    if (option->output_filename != NULL && option->output_filename[0] != '\0') {
+        close(fd);
     }
 
 exec_command_exit:
@@ -264,11 +259,96 @@ exec_command_exit:
 extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
                              char **output_str, long *output_str_len,
                              const TOption *option) {
+    String ret_str;
+    long length;
+    int retval;
+
+    retval = lib_exec(input_str, input_str_len, ret_str, option);
+
+    length = ret_str.isBinary()?ret_str.binaryLength():ret_str.len();
+    if (output_str_len) *output_str_len = length;
+    if (output_str) {
+        *output_str = (output_alloc != NULL)?(char *)output_alloc(length + 1):new char [length+1];
+        if (*output_str != (char *)NULL) {
+            memcpy(*output_str, ret_str.c_str(), length);
+            (*output_str)[length] = '\0';
+        } else {
+            if (output_str_len) *output_str_len = 0;
+            retval = -1;
+        }
+    }
+    ret_str.clear();
+
+    return retval;
+}
+
+
+extern "C" int inkf_lib_exec_buf(const char *input_str, long input_str_len,
+                                 char *output_buf, long output_buf_size, long *output_str_len,
+                                 const TOption *option) {
+    String ret_str;
+    long length;
+    int retval;
+
+    retval = 0;
+    if (option != (TOption *)NULL && 0 < input_str_len &&
+            !option->flag_show_help && !option->flag_show_version &&
+            !option->flag_guess && !option->flag_midi &&
+            option->input_filenames == (char **)NULL &&
+            (option->output_filename == NULL || option->output_filename[0] == '\0')) {
+        // the last encoder writes into output_buf when its worst case fits
+        ret_str.setBinary(input_str, input_str_len);
+        length = 0;
+        if (convert_into(ret_str, option, output_buf, output_buf_size, &length)) {
+            if (output_str_len) *output_str_len = (0 <= length)?length:0;
+            if (length < 0) {
+                return -1;
+            }
+            if (output_buf == (char *)NULL || output_buf_size <= length) {
+                /* The buffer is too small: output_str_len tells the length to hold. */
+                return -2;
+            }
+            return 0;
+        }
+    } else {
+        retval = lib_exec(input_str, input_str_len, ret_str, option);
+    }
+
+    length = ret_str.isBinary()?ret_str.binaryLength():ret_str.len();
+    if (output_str_len) *output_str_len = length;
+    if (retval != 0) {
+        if (output_str_len) *output_str_len = 0;
+        return retval;
+    }
+    if (output_buf == (char *)NULL || output_buf_size <= length) {
+        /* The buffer is too small: output_str_len tells the length to hold. */
+        return -2;
+    }
+    memcpy(output_buf, ret_str.c_str(), length);
+    output_buf[length] = '\0';
+
+    return 0;
+}
+
+
+extern "C" void inkf_lib_set_allocator(void *(*alloc_func)(size_t size),
+                                       void (*free_func)(void *ptr)) {
+    if (alloc_func == NULL || free_func == NULL) {
+        output_alloc = NULL;
+        output_free = NULL;
+    } else {
+        output_alloc = alloc_func;
+        output_free = free_func;
+    }
+}
+
+
+static int lib_exec(const char *input_str, long input_str_len, String &ret_str,
+                    const TOption *option) {
     int retval = 0;
     FILE *fpout = stdout;
-    String tmp_str, ret_str;
+    String tmp_str;
     char buf[4096 + 1];
-    long length;
     int i;
 
     if (input_str_len == 0) {
@@ -315,32 +395,29 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
     // conversion
     if (option->input_filenames == (char **)NULL) {
 
-        // read from input_str
-        tmp_str.setBinary(input_str, input_str_len);
+        // read from input_str (converted in ret_str unless it goes to a file)
+        String &str = (fpout != stdout)?tmp_str:ret_str;
+        str.setBinary(input_str, input_str_len);
         if (option->flag_guess) {
-            guess(tmp_str, option->input_charset, buf);
+            guess(str, option->input_charset, option->guess_limit, buf);
             if (fpout != stdout) {
                 fwrite(buf, 1, strlen(buf), fpout);
             } else {
                 ret_str = buf;
             }
         } else if (option->flag_midi) {
-            tmp_str = tmp_str.toMIDI();
+            str = str.toMIDI();
             if (fpout != stdout) {
-                fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
-            } else {
-                ret_str = tmp_str;
+                fwrite(str.c_str(), 1, str.binaryLength(), fpout);
             }
-        } else if (0 < tmp_str.len() || 0 < tmp_str.binaryLength()) {
-            convert(tmp_str, option);
+        } else if (0 < str.len() || 0 < str.binaryLength()) {
+            convert(str, option);
             if (fpout != stdout) {
-                if (tmp_str.isBinary()) {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.binaryLength(), fpout);
+                if (str.isBinary()) {
+                    fwrite(str.c_str(), 1, str.binaryLength(), fpout);
                 } else {
-                    fwrite(tmp_str.c_str(), 1, tmp_str.len(), fpout);
+                    fwrite(str.c_str(), 1, str.len(), fpout);
                 }
-            } else {
-                ret_str = tmp_str;
             }
         }
     } else {
@@ -356,6 +433,7 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
         // read from file(s) or specified URL
         for (i = 0; option->input_filenames[i] != NULL; i++) {
             char input_charset[32];
+            bool guessed = false;
             strncpy(input_charset, option->input_charset, 31);
             input_charset[31] = '\0';
             if (charset_autodetect_pre) {
@@ -392,6 +470,10 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
                     tmp_str = fs.receiveBuffer(path);
                     fs.logout();
                 }
+            } else if (option->flag_guess && 0 < option->guess_limit) {
+                // read only the head of the file
+                guess_file(option->input_filenames[i], input_charset, option->guess_limit, buf);
+                guessed = true;
             } else {
                 tmp_str.loadFile(option->input_filenames[i]);
             }
@@ -406,7 +488,9 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
                 }
             }
             if (option->flag_guess) {
-                guess(tmp_str, input_charset, buf);
+                if (!guessed) {
+                    guess(tmp_str, input_charset, option->guess_limit, buf);
+                }
                 if (fpout != stdout) {
                     fwrite(buf, 1, strlen(buf), fpout);
                 } else {
@@ -428,6 +512,7 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
                     TOption tmp_option;
                     memcpy(&tmp_option, option, sizeof(TOption));
                     strcpy(tmp_option.input_charset, input_charset);
+                    tmp_option.input_charset_handle = charsetHandle(input_charset);
                     convert(tmp_str, &tmp_option);
                 } else {
                     convert(tmp_str, option);
@@ -458,24 +543,6 @@ extern "C" int inkf_lib_exec(const char *input_str, long input_str_len,
 
 exec_lib_exit:
     tmp_str.clear();
-    if (ret_str.isBinary()) {
-        length = ret_str.binaryLength();
-        if (output_str_len) *output_str_len = length;
-        if (output_str) {
-            *output_str = new char [length+1];
-            memcpy(*output_str, ret_str.c_str(), length);
-            (*output_str)[length] = '\0';
-        }
-    } else {
-        length = ret_str.len();
-        if (output_str_len) *output_str_len = length;
-        if (output_str) {
-            *output_str = new char [length+1];
-            strncpy(*output_str, ret_str.c_str(), length);
-            (*output_str)[length] = '\0';
-        }
-    }
-    ret_str.clear();
 
     return retval;
 }
@@ -483,6 +550,10 @@ exec_lib_exit:
 
 extern "C" void inkf_free_output_str(char *output_str) {
     if (output_str != (char *)NULL) {
+        if (output_free != NULL) {
+            output_free(output_str);
+            return;
+        }
         delete [] output_str;
         output_str = (char *)NULL;
     }
@@ -498,7 +569,10 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
     option->flag_show_help = 0;
     option->flag_show_version = 0;
     option->flag_guess = 0;
+    option->guess_limit = 0;
     option->flag_overwrite = 0;
+    option->jobs = 1;
+    option->flag_sync = 0;
     option->flag_html_to_plain = 0;
     option->flag_hankaku_ascii = 0;
     option->flag_zenkaku_ascii = 0;
@@ -512,6 +586,7 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
     option->flag_sort_csv = 0;
     option->flag_sort_csv_r = 0;
     option->csv_column = NULL;
+    option->sort_memory = SHEET_SORT_MEMORY;
     option->flag_format_json = 0;
     option->flag_minify_json = 0;
     option->flag_re_match = 0;
@@ -520,6 +595,8 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
     option->flag_no_return = 0;
     strcpy(option->input_charset, "AUTODETECT");
     option->output_charset[0] = '\0';
+    option->input_charset_handle = CHARSET_AUTODETECT;
+    option->output_charset_handle = CHARSET_UNKNOWN;
     option->mime_decode = MIME_NONE;
     option->mime_encode = MIME_NONE;
     option->line_mode = LINE_MODE_NOCONVERSION;
@@ -538,6 +615,20 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
             }
             if (!strcasecmp(argv[i], "--guess")) {
                 option->flag_guess = 1;
+            } else if (!strncasecmp(argv[i], "--guess-limit=", 14)) {
+                char *end;
+                option->flag_guess = 1;
+                option->guess_limit = strtol(argv[i]+14, &end, 10);
+                if (*end == 'K' || *end == 'k') {
+                    option->guess_limit *= 1024L;
+                    end++;
+                } else if (*end == 'M' || *end == 'm') {
+                    option->guess_limit *= 1024L*1024L;
+                    end++;
+                }
+                if (end == argv[i]+14 || *end != '\0' || option->guess_limit <= 0) {
+                    return -8; // invalid parameter
+                }
             } else if (!strncasecmp(argv[i], "--ic=", 5)) {
                 strncpy(option->input_charset, argv[i]+5, 31);
                 option->input_charset[31] = '\0';
@@ -546,6 +637,12 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
                 option->output_charset[31] = '\0';
             } else if (!strcasecmp(argv[i], "--overwrite")) {
                 option->flag_overwrite = 1;
+            } else if (!strcasecmp(argv[i], "--sync")) {
+                option->flag_sync = 1;
+            } else if (!strncasecmp(argv[i], "--jobs=", 7)) {
+                if (set_jobs(option, argv[i]+7) != 0) {
+                    return -9; // invalid parameter
+                }
             } else if (!strcasecmp(argv[i], "--html-to-plain")) {
                 option->flag_html_to_plain = 1;
             } else if (!strcasecmp(argv[i], "--hankaku-ascii")) {
@@ -578,6 +675,19 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
                 if (option->csv_column[0] == '\0') {
                     return -2; // invalid parameter
                 }
+            } else if (!strncasecmp(argv[i], "--sort-csv-memory=", 18)) {
+                char *end;
+                option->sort_memory = strtol(argv[i]+18, &end, 10);
+                if (*end == 'K' || *end == 'k') {
+                    option->sort_memory *= 1024L;
+                    end++;
+                } else if (*end == 'M' || *end == 'm') {
+                    option->sort_memory *= 1024L*1024L;
+                    end++;
+                }
+                if (end == argv[i]+18 || *end != '\0' || option->sort_memory <= 0) {
+                    return -11; // invalid parameter
+                }
             } else if (!strcasecmp(argv[i], "--format-json")) {
                 option->flag_format_json = 1;
             } else if (!strcasecmp(argv[i], "--minify-json")) {
@@ -605,6 +715,22 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
                     case 'g':
                         option->flag_guess = 1;
                         break;
+                    case 'P':
+                        if (argv[i][j+1] != '\0') {
+                            if (set_jobs(option, &(argv[i][j+1])) != 0) {
+                                return -10; // invalid parameter
+                            }
+                            j = strlen(argv[i]) - 1;
+                        } else if (i + 1 < argc) {
+                            if (set_jobs(option, argv[i+1]) != 0) {
+                                return -10; // invalid parameter
+                            }
+                            i++;
+                            j = strlen(argv[i]) - 1;
+                        } else {
+                            return -10; // invalid parameter
+                        }
+                        break;
                     case 'f':
                         if (argv[i][j+1] == '\0' && i + 1 < argc) {
                             strncpy(option->input_charset, argv[i+1], 31);
@@ -833,6 +959,10 @@ extern "C" int inkf_set_option(TOption *option, int argc, const char **argv) {
         option->output_filename = INKF_DEF_OUT;
     }
 
+    // resolve names of character sets once
+    option->input_charset_handle = charsetHandle(option->input_charset);
+    option->output_charset_handle = charsetHandle(option->output_charset);
+
     return 0;
 }
 
@@ -845,17 +975,18 @@ extern "C" void inkf_free_option(TOption *option) {
 }
 
 
-static void guess(const String &str, const char *input_charset, char *buf) {
+static int guess(const String &str, const char *input_charset, long limit, char *buf) {
     const char *charcode;
     const char *retcode;
     long i, length;
     char endian = 'L';
+    int confidence = CHARSET_CONFIDENCE_HIGH; // 0 < limit only
 
     if (input_charset != NULL && !strncasecmp(input_charset, "AUTODETECT", 10)) {
         if (strcasestr(input_charset, "JP")) {
-            charcode = str.detectCharSetJP();
+            charcode = (0 < limit)?str.detectCharSetJP(limit, &confidence):str.detectCharSetJP();
         } else {
-            charcode = str.detectCharSet();
+            charcode = (0 < limit)?str.detectCharSet(limit, &confidence):str.detectCharSet();
         }
 
         // for compatibility with nkf 2.x
@@ -950,20 +1081,88 @@ static void guess(const String &str, const char *input_charset, char *buf) {
             retcode = "CR";
         }
     }
-    sprintf(buf, "%s (%s)\n", charcode, retcode);
+    if (0 < limit) {
+        sprintf(buf, "%s (%s) [%s]\n", charcode, retcode,
+                (confidence == CHARSET_CONFIDENCE_HIGH)?"high":
+                (confidence == CHARSET_CONFIDENCE_MEDIUM)?"medium":"low");
+    } else {
+        sprintf(buf, "%s (%s)\n", charcode, retcode);
+    }
+
+    return confidence;
+}
+
+
+static void guess_head(FILE *fpin, const char *input_charset, long limit, char *buf) {
+    String head;
+    char *rbuf;
+    long want, l;
+    int confidence;
+
+    // read in growing steps until the guess settles or limit bytes are read
+    rbuf = new char [INKF_STREAM_BUF_SIZE];
+    head.useAsBinary(0);
+    want = INKF_STREAM_BUF_SIZE;
+    while (true) {
+        if (limit < want) {
+            want = limit;
+        }
+        // one more byte tells whether the input goes on
+        while (head.binaryLength() <= want) {
+            l = want + 1 - head.binaryLength();
+            l = (long)fread(rbuf, 1, (INKF_STREAM_BUF_SIZE < l)?INKF_STREAM_BUF_SIZE:l, fpin);
+            if (l <= 0) {
+                break;
+            }
+            head.addBinary(rbuf, l);
+        }
+        confidence = guess(head, input_charset, want, buf);
+        if (confidence != CHARSET_CONFIDENCE_LOW || head.binaryLength() <= want || limit <= want) {
+            break;
+        }
+        want *= 2;
+    }
+    delete [] rbuf;
+}
+
+
+static void guess_file(const char *filename, const char *input_charset, long limit, char *buf) {
+    FILE *fpin;
+
+    fpin = fopen(filename, "rb");
+    if (fpin == (FILE *)NULL) {
+        // same as an empty file
+        guess(String(""), input_charset, limit, buf);
+        return;
+    }
+    guess_head(fpin, input_charset, limit, buf);
+    fclose(fpin);
 }
 
 
 static void convert(String &str, const TOption *option) {
+    convert_into(str, option, (char *)NULL, 0L, (long *)NULL);
+}
+
+
+/* Convert str, and let the last encoder write into output_buf when no
+   stage follows it. Returns true if the text went to output_buf
+   (output_length is set, as snprintf), false if it is left in str. */
+static bool convert_into(String &str, const TOption *option,
+                         char *output_buf, long output_buf_size, long *output_length) {
     String u8str, csv_column, re_pattern;
     Sheet csv_sheet;
     char input_charset[32], tmp_input_charset[32];
     char tmp_output_charset[32];
+    TCharset src_charset, dest_charset;
     bool append_return = false;
+    bool direct;
     char r[4];
 
     strncpy(input_charset, option->input_charset, 31);
     input_charset[31] = '\0';
+    src_charset = (TCharset)option->input_charset_handle;
+    dest_charset = (TCharset)option->output_charset_handle;
 
     if (option->mime_decode == MIME_BASE64) {
         str = str.decodeBASE64();
@@ -978,6 +1177,7 @@ static void convert(String &str, const TOption *option) {
                 str = str.decodeMIME(input_charset, "UTF-8");
             }
             strcpy(input_charset, "UTF-8");
+            src_charset = CHARSET_UTF8;
             append_return = true;
         } else if (str[0] != '=') {
             str = str.decodeBASE64();
@@ -986,93 +1186,92 @@ static void convert(String &str, const TOption *option) {
         }
     }
 
-    if (!(!strcasecmp(input_charset, "AUTODETECT") && option->output_charset[0] == '\0')) {
-        str = str.strconv(input_charset, option->output_charset);
-    }
-    if (option->flag_html_to_plain) {
-        str = str.convertHTMLToPlain(option->output_charset, option->output_charset);
-    }
-    if (option->flag_hankaku_ascii) {
-        str = str.changeWidth("a", option->output_charset, option->output_charset);
-    } else if (option->flag_zenkaku_ascii) {
-        str = str.changeWidth("A", option->output_charset, option->output_charset);
-    }
-    if (option->flag_hiragana) {
-        str = str.changeWidth("HI", option->output_charset, option->output_charset);
-    } else if (option->flag_katakana) {
-        str = str.changeWidth("J", option->output_charset, option->output_charset);
-    }
-    if (option->flag_hankaku_katakana) {
-        str = str.changeWidth("k", option->output_charset, option->output_charset);
-    } else if (option->flag_zenkaku_katakana) {
-        str = str.changeWidth("K", option->output_charset, option->output_charset);
-    }
-    if (option->line_mode != LINE_MODE_NOCONVERSION) {
-        u8str = str.strconv(option->output_charset, "UTF-8");
-        u8str = u8str.changeReturnCode(RETURN_STR[option->line_mode]);
-        str = u8str.strconv("UTF-8", option->output_charset);
+    // nothing but the character set conversion is left after the text stages
+    direct = (output_length != NULL && append_return == false &&
+              option->mime_encode == MIME_NONE &&
+              !option->flag_sort_csv && !option->flag_sort_csv_r &&
+              !option->flag_format_json && !option->flag_minify_json &&
+              !option->flag_re_match && !option->flag_md5 && !option->flag_sha1);
+
+    if (option->flag_html_to_plain || has_utf8_stage(option)) {
+        // decode once, filter UTF-8 through all text stages, and encode once
+        // (as the stream path, a guessed charset is decoded before the stages too)
+        if (option->output_charset[0] == '\0') {
+            dest_charset = CHARSET_UTF8;
+        }
+        if (src_charset != CHARSET_UNKNOWN) {
+            u8str = str.strconv(src_charset, CHARSET_UTF8);
+        } else {
+            // unregistered name is passed as it is (for iconv)
+            u8str = str.strconv(input_charset, "UTF-8");
+        }
+        if (option->flag_html_to_plain) {
+            u8str = u8str.convertHTMLToPlain("UTF-8", "UTF-8");
+        }
+        convert_utf8(u8str, option);
+        if (option->mime_encode != MIME_NONE) {
+            remove_single_return(u8str, option);
+        }
+        if (direct) {
+            *output_length = u8str.strconv(CHARSET_UTF8, dest_charset, output_buf, output_buf_size);
+            u8str.clear();
+            str.clear();
+            return true;
+        }
+        str = u8str.strconv(CHARSET_UTF8, dest_charset);
         u8str.clear();
+    } else {
+        if (src_charset == CHARSET_UNKNOWN) {
+            // unregistered name is passed as it is (for iconv)
+            str = str.strconv(input_charset, option->output_charset);
+        } else if (!(src_charset == CHARSET_AUTODETECT && option->output_charset[0] == '\0')) {
+            if (direct) {
+                *output_length = str.strconv(src_charset, dest_charset, output_buf, output_buf_size);
+                str.clear();
+                return true;
+            }
+            str = str.strconv(src_charset, dest_charset);
+        }
+        if (option->mime_encode != MIME_NONE) {
+            if (dest_charset == CHARSET_UNKNOWN) {
+                u8str = str.strconv(option->output_charset, "UTF-8");
+            } else {
+                u8str = str.strconv(dest_charset, CHARSET_UTF8);
+            }
+            if (remove_single_return(u8str, option)) {
+                str = u8str.strconv(CHARSET_UTF8, dest_charset);
+            }
+            u8str.clear();
+        }
     }
     str.gc();
     if (option->mime_encode == MIME_BASE64) {
-        u8str = str.strconv(option->output_charset, "UTF-8");
-        if (0 < u8str.len() && option->flag_no_return_param == false && u8str.search("\n") == u8str.searchR("\n") && u8str[u8str.len()-1] == '\n'){
-            str = u8str.changeReturnCode("").strconv("UTF-8", option->output_charset);
-        }
         str = str.encodeBASE64();
     } else if (option->mime_encode == MIME_QUOTED_PRINTABLE) {
-        u8str = str.strconv(option->output_charset, "UTF-8");
-        if (0 < u8str.len() && option->flag_no_return_param == false && u8str.search("\n") == u8str.searchR("\n") && u8str[u8str.len()-1] == '\n'){
-            str = u8str.changeReturnCode("").strconv("UTF-8", option->output_charset);
-        }
         str = str.encodeQuotedPrintable();
     } else if (option->mime_encode == MIME_BASE64_FULL) {
-        u8str = str.strconv(option->output_charset, "UTF-8");
-        if (0 < u8str.len() && option->flag_no_return_param == false && u8str.search("\n") == u8str.searchR("\n") && u8str[u8str.len()-1] == '\n'){
-            str = u8str.changeReturnCode("").strconv("UTF-8", option->output_charset);
-        }
-        u8str.clear();
         sprintf(r, "%s\t", RETURN_STR[option->line_mode]);
         str = str.encodeMIME(option->output_charset,
                 option->output_charset, 72, r, 'B');
         append_return = true;
     } else if (option->mime_encode == MIME_QUOTED_PRINTABLE_FULL) {
-        u8str = str.strconv(option->output_charset, "UTF-8");
-        if (0 < u8str.len() && option->flag_no_return_param ==false && u8str.search("\n") == u8str.searchR("\n") && u8str[u8str.len()-1] == '\n'){
-            str = u8str.changeReturnCode("").strconv("UTF-8", option->output_charset);
-        }
-        u8str.clear();
         sprintf(r, "%s\t", RETURN_STR[option->line_mode]);
         str = str.encodeMIME(option->output_charset,
                 option->output_charset, 72, r, 'Q');
         append_return = true;
     } else if (option->flag_sort_csv) {
+        csv_sheet.setThreads(option->jobs);
         csv_sheet.setCSV(str, option->output_charset, "UTF-8");
-        set_input_charset_by_env(tmp_input_charset);
-        if (2 <= strlen(option->csv_column) && option->csv_column[0] == '"' &&
-                option->csv_column[strlen(option->csv_column)-1] == '"') {
-            csv_column = option->csv_column;
-            csv_column = csv_column.mid(1, csv_column.len()-2).unescapeQuote(tmp_input_charset, "UTF-8");
-        } else {
-            csv_column = option->csv_column;
-            csv_column = csv_column.strconv(tmp_input_charset, "UTF-8");
-        }
+        get_csv_column(csv_column, option);
         csv_sheet.sort(csv_column.c_str());
         strcpy(tmp_output_charset, option->output_charset);
         set_output_charset(tmp_output_charset, input_charset, str);
         str = csv_sheet.getCSV("UTF-8", tmp_output_charset,
                 RETURN_STR[option->line_mode]);
     } else if (option->flag_sort_csv_r) {
+        csv_sheet.setThreads(option->jobs);
         csv_sheet.setCSV(str, option->output_charset, "UTF-8");
-        set_input_charset_by_env(tmp_input_charset);
-        if (2 <= strlen(option->csv_column) && option->csv_column[0] == '"' &&
-                option->csv_column[strlen(option->csv_column)-1] == '"') {
-            csv_column = option->csv_column;
-            csv_column = csv_column.mid(1, csv_column.len()-2).unescapeQuote(tmp_input_charset, "UTF-8");
-        } else {
-            csv_column = option->csv_column;
-            csv_column = csv_column.strconv(tmp_input_charset, "UTF-8");
-        }
+        get_csv_column(csv_column, option);
         csv_sheet.sortr(csv_column.c_str());
         strcpy(tmp_output_charset, option->output_charset);
         set_output_charset(tmp_output_charset, input_charset, str);
@@ -1133,19 +1332,833 @@ static void convert(String &str, const TOption *option) {
         }
     }
     str.gc();
+
+    return false;
 }
 
 
-static void set_input_charset_by_env(char *input_charset) {
-    const char *env_lang;
-    env_lang = getenv("LANG");
-    if (env_lang != NULL) {
-        if (strcasestr(env_lang, "UTF-8") != NULL) {
-            strcpy(input_charset, "UTF-8");
-        } else if (strcasestr(env_lang, "eucJP") != NULL) {
-            strcpy(input_charset, "EUC-JP");
-        } else if (strcasestr(env_lang, "SJIS") != NULL ||
-                !strcasecmp(env_lang, "ja_JP.PCK")) {
+static bool is_streamable(const TOption *option) {
+    if (option->mime_decode != MIME_NONE || option->mime_encode != MIME_NONE ||
+            option->flag_guess || option->flag_html_to_plain || option->flag_midi ||
+            option->flag_md5 || option->flag_sha1 ||
+            option->flag_sort_csv || option->flag_sort_csv_r ||
+            option->flag_format_json || option->flag_minify_json ||
+            option->flag_re_match) {
+        // these need the whole document
+        return false;
+    }
+    return true;
+}
+
+
+static bool is_stateful(int charset_handle) {
+    // shift states run over line ends, so these are converted on one thread
+    return (charset_handle == CHARSET_JIS || charset_handle == CHARSET_UTF7 ||
+            charset_handle == CHARSET_UTF7_IMAP);
+}
+
+
+static bool is_passthrough(const TOption *option) {
+    int handle = option->input_charset_handle;
+
+    if (!is_streamable(option) || has_utf8_stage(option)) {
+        return false;
+    }
+    if (option->output_charset[0] == '\0') {
+        // no output charset: the input is written as it is, except that Unicode is cleaned UTF-8
+        return !(handle == CHARSET_UTF8 || handle == CHARSET_UTF8_BOM ||
+                 (CHARSET_UTF16 <= handle && handle <= CHARSET_UTF32LE_BOM));
+    }
+
+    // same charset whose conversion is a plain copy (UTF-8 is cleaned, UTF-16/32 take BOM)
+    return (handle == option->output_charset_handle &&
+            handle != CHARSET_UNKNOWN && handle != CHARSET_AUTODETECT &&
+            handle != CHARSET_AUTODETECT_JP && handle != CHARSET_UTF8 &&
+            handle != CHARSET_UTF8_BOM && !is_stateful(handle) &&
+            !(CHARSET_UTF16 <= handle && handle <= CHARSET_UTF32LE_BOM));
+}
+
+
+static bool is_sortable_file(const char *filename, const TOption *option) {
+    struct stat st;
+
+    if (!(option->flag_sort_csv || option->flag_sort_csv_r) ||
+            option->mime_decode != MIME_NONE || option->mime_encode != MIME_NONE ||
+            option->flag_html_to_plain || has_utf8_stage(option) ||
+            option->flag_md5 || option->flag_sha1 || option->flag_midi || option->flag_guess ||
+            option->input_charset_handle == CHARSET_UNKNOWN ||
+            (option->output_charset[0] != '\0' &&
+             option->output_charset_handle == CHARSET_UNKNOWN)) {
+        return false;
+    }
+
+    // only local file larger than the memory for sorting is sorted in runs
+    if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    return (option->sort_memory < (long)st.st_size);
+}
+
+
+static int sort_csv_file(const char *filename, TSink *sink, const TOption *option,
+                         const char *input_charset) {
+    Sheet csv_sheet;
+    List colnames;
+    String csv_column;
+    const char *tmp_dir;
+    char *tmp_filename;
+    long keys;
+    int fd;
+
+    tmp_dir = getenv("TMPDIR");
+    if (tmp_dir == NULL || tmp_dir[0] == '\0') {
+        tmp_dir = "/tmp";
+    }
+    tmp_filename = new char [strlen(tmp_dir) + 16];
+    sprintf(tmp_filename, "%s/inkfXXXXXX", tmp_dir);
+    fd = mkstemp(tmp_filename);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot sort the input file '%s'.\n", filename);
+        delete [] tmp_filename;
+        return -1;
+    }
+
+    get_csv_column(csv_column, option);
+    colnames.add(csv_column);
+    csv_sheet.setThreads(option->jobs);
+    keys = csv_sheet.sortCSVFile(filename, tmp_filename, colnames,
+                                 option->flag_sort_csv?"s":"S",
+                                 input_charset, option->output_charset,
+                                 RETURN_STR[option->line_mode], option->sort_memory);
+    unlink(tmp_filename);
+    delete [] tmp_filename;
+    if (keys < 0) {
+        // partial output of an I/O error is not written
+        fprintf(stderr, "Cannot sort the input file '%s'.\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    // unknown column is not sorted, as it is in memory
+    sink_passthrough(sink, fd);
+    close(fd);
+
+    return 0;
+}
+
+
+static void convert_stream(FILE *fpin, TSink *sink, const TOption *option) {
+    CharsetStream cs;
+    String out, u8str, u8pending, u8rest;
+    const char *output_charset, *data, *input;
+    char *buf;
+    long l, n, length, pos, slice;
+    bool utf8_stage;
+
+    if (is_passthrough(option)) {
+        sink_passthrough(sink, fileno(fpin));
+        return;
+    }
+
+    utf8_stage = has_utf8_stage(option);
+
+    output_charset = option->output_charset;
+    if (utf8_stage && output_charset[0] == '\0') {
+        // width and line conversion output UTF-8 when no charset is given
+        output_charset = "UTF-8";
+    }
+    cs.open(option->input_charset, output_charset);
+
+    // with jobs, each slice is cut at line ends and converted on the threads
+    cs.setThreads(option->jobs);
+
+    // a regular file is converted from its mapping without a copy
+    data = map_input(fpin, &length);
+    if (1 < option->jobs && !is_stateful(option->input_charset_handle) &&
+            !is_stateful(option->output_charset_handle)) {
+        slice = INKF_JOB_SLICE_SIZE * option->jobs;
+    } else {
+        slice = (data != NULL)?INKF_MAP_SLICE_SIZE:INKF_STREAM_BUF_SIZE;
+    }
+    buf = (data == NULL)?new char [slice]:NULL;
+    pos = 0;
+    out.useAsBinary(0);
+    u8pending.useAsBinary(0);
+    for (;;) {
+        if (data != NULL) {
+            input = data + pos;
+            l = (slice < length - pos)?slice:(length - pos);
+            pos += l;
+        } else {
+            input = buf;
+            l = (long)fread(buf, 1, slice, fpin);
+        }
+        if (!utf8_stage) {
+            if (0 < l) {
+                cs.write(input, l, out);
+            } else {
+                cs.flush(out);
+            }
+        } else {
+            if (0 < l) {
+                cs.decode(input, l, u8pending);
+            } else {
+                cs.decodeFlush(u8pending);
+            }
+            n = utf8_stage_length(u8pending.c_str(), u8pending.binaryLength(), l <= 0);
+            if (0 < n) {
+                u8str.setBinary(u8pending.c_str(), n);
+                u8rest.setBinary(u8pending.c_str() + n, u8pending.binaryLength() - n);
+                u8pending.setBinary(u8rest.c_str(), u8rest.binaryLength());
+                convert_utf8(u8str, option);
+                if (u8str.isBinary()) {
+                    cs.encode(u8str.c_str(), u8str.binaryLength(), out);
+                } else {
+                    cs.encode(u8str.c_str(), u8str.len(), out);
+                }
+            }
+            if (l <= 0) {
+                cs.encodeFlush(out);
+            }
+        }
+        if (0 < out.binaryLength()) {
+            sink_write(sink, out.c_str(), out.binaryLength());
+            out.useAsBinary(0);
+        }
+        if (l <= 0) {
+            break;
+        }
+    }
+    if (data != NULL) {
+        munmap((void *)data, length);
+    } else {
+        delete [] buf;
+    }
+    cs.clear();
+}
+
+
+static const char *map_input(FILE *fp, long *length) {
+    struct stat st;
+    void *data;
+
+    // pipes, empty files and files read halfway are read with fread()
+    *length = 0;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+            (off_t)(long)st.st_size != st.st_size || lseek(fileno(fp), 0, SEEK_CUR) != 0) {
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    *length = (long)st.st_size;
+
+    return (const char *)data;
+}
+
+
+static bool sink_open(TSink *sink, int fd) {
+    void *buf;
+
+    sink->fd = fd;
+    sink->length = 0;
+    sink->capacity = (0 <= fd)?INKF_SINK_BUF_SIZE:INKF_STREAM_BUF_SIZE;
+    sink->tmp_filename = NULL;
+    sink->error = 0;
+    if (posix_memalign(&buf, INKF_SINK_ALIGN, (size_t)sink->capacity) != 0) {
+        sink->buf = NULL;
+        sink->capacity = 0;
+        sink->error = 1;
+        return false;
+    }
+    sink->buf = (char *)buf;
+
+    return true;
+}
+
+
+static bool sink_open_temp(TSink *sink, const char *filename) {
+    char *tmp_filename;
+    int fd;
+
+    tmp_filename = new char [strlen(filename) + 12];
+    sprintf(tmp_filename, "%s.inkfXXXXXX", filename);
+    fd = mkstemp(tmp_filename);
+    if (fd < 0 || !sink_open(sink, fd)) {
+        fprintf(stderr, "Cannot open the output file '%s'.\n", filename);
+        if (0 <= fd) {
+            close(fd);
+            unlink(tmp_filename);
+        }
+        delete [] tmp_filename;
+        return false;
+    }
+    sink->tmp_filename = tmp_filename;
+
+    return true;
+}
+
+
+static void sink_write(TSink *sink, const char *data, long length) {
+    struct iovec iov[2];
+    void *buf;
+    long capacity;
+
+    if (length <= 0 || sink->buf == NULL) {
+        return;
+    }
+    if (sink->length + length <= sink->capacity) {
+        memcpy(sink->buf + sink->length, data, length);
+        sink->length += length;
+        return;
+    }
+
+    if (sink->fd < 0) {
+        // kept in memory: the buffer grows
+        capacity = sink->capacity;
+        while (capacity < sink->length + length) {
+            capacity *= 2;
+        }
+        if (posix_memalign(&buf, INKF_SINK_ALIGN, (size_t)capacity) != 0) {
+            sink->error = 1;
+            return;
+        }
+        memcpy(buf, sink->buf, sink->length);
+        free(sink->buf);
+        sink->buf = (char *)buf;
+        sink->capacity = capacity;
+        memcpy(sink->buf + sink->length, data, length);
+        sink->length += length;
+        return;
+    }
+
+    // pending output and the new segment go out in one call, without a copy
+    iov[0].iov_base = sink->buf;
+    iov[0].iov_len = (size_t)sink->length;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = (size_t)length;
+    if (write_vector(sink->fd, iov, 2) != 0) {
+        sink->error = 1;
+    }
+    sink->length = 0;
+}
+
+
+static int sink_flush(TSink *sink) {
+    struct iovec iov[1];
+
+    if (0 <= sink->fd && 0 < sink->length) {
+        iov[0].iov_base = sink->buf;
+        iov[0].iov_len = (size_t)sink->length;
+        if (write_vector(sink->fd, iov, 1) != 0) {
+            sink->error = 1;
+        }
+        sink->length = 0;
+    }
+
+    return sink->error?-1:0;
+}
+
+
+static void sink_passthrough(TSink *sink, int fd_in) {
+    char *buf;
+    ssize_t n;
+
+    sink_flush(sink);
+
+    n = -1;
+#ifdef __linux__
+    // the kernel copies the input to the output without user space
+    if (0 <= sink->fd) {
+#if INKF_COPY_FILE_RANGE == 1
+        while ((n = copy_file_range(fd_in, NULL, sink->fd, NULL, INKF_COPY_SIZE, 0)) != 0) {
+            if (n < 0 && errno != EINTR) {
+                break;
+            }
+        }
+#endif
+        // regular file to pipe or terminal, or where copy_file_range() is refused
+        while (n != 0 && (n = sendfile(sink->fd, fd_in, NULL, INKF_COPY_SIZE)) != 0) {
+            if (n < 0 && errno != EINTR) {
+                break;
+            }
+        }
+    }
+#endif
+    if (n == 0) {
+        return;
+    }
+
+    // pipes and memory are copied through the buffer
+    buf = new char [INKF_STREAM_BUF_SIZE];
+    while ((n = read(fd_in, buf, INKF_STREAM_BUF_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sink_write(sink, buf, n);
+    }
+    delete [] buf;
+}
+
+
+static int sink_close(TSink *sink) {
+    int ret;
+
+    ret = sink_flush(sink);
+    if (sink->buf != NULL) {
+        free(sink->buf);
+        sink->buf = NULL;
+    }
+    sink->length = 0;
+    sink->capacity = 0;
+
+    return ret;
+}
+
+
+static int sink_commit(TSink *sink, const char *filename, bool sync) {
+    struct stat st;
+    int ret;
+
+    ret = sink_close(sink);
+    if (stat(filename, &st) == 0) {
+        fchmod(sink->fd, st.st_mode & 07777);
+    }
+    if (ret == 0 && sync && fdatasync(sink->fd) != 0) {
+        ret = -1;
+    }
+    if (close(sink->fd) != 0) {
+        ret = -1;
+    }
+    if (ret != 0 || rename(sink->tmp_filename, filename) != 0) {
+        fprintf(stderr, "Cannot open the output file '%s'.\n", filename);
+        unlink(sink->tmp_filename);
+        ret = -1;
+    }
+    delete [] sink->tmp_filename;
+    sink->tmp_filename = NULL;
+
+    return ret;
+}
+
+
+static void sink_discard(TSink *sink) {
+    sink_close(sink);
+    close(sink->fd);
+    unlink(sink->tmp_filename);
+    delete [] sink->tmp_filename;
+    sink->tmp_filename = NULL;
+}
+
+
+static int write_vector(int fd, struct iovec *iov, int count) {
+    ssize_t n;
+
+    while (0 < count) {
+        n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // skip what was written, a partial write continues in the middle of a segment
+        while (0 < count && iov->iov_len <= (size_t)n) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (0 < count) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+
+static int convert_file_stream(const char *filename, TSink *sink, const TOption *option) {
+    FILE *fpin;
+
+    fpin = fopen(filename, "rb");
+    if (fpin == (FILE *)NULL) {
+        fprintf(stderr, "Cannot open the input file '%s'.\n", filename);
+        return -1;
+    }
+    convert_stream(fpin, sink, option);
+    fclose(fpin);
+
+    return 0;
+}
+
+
+static void convert_file(const char *filename, TSink *sink, const TOption *option,
+                         bool charset_autodetect_pre) {
+    TSink tmp_sink;
+    String tmp_str;
+    char buf[4096 + 1];
+    char input_charset[32];
+    bool guessed = false;
+    bool overwrite = (sink == (TSink *)NULL);
+
+    // overwrite: write a temporary file, which replaces the input when completed
+    if (overwrite) {
+        if (!sink_open_temp(&tmp_sink, filename)) {
+            return;
+        }
+        sink = &tmp_sink;
+    }
+
+    strncpy(input_charset, option->input_charset, 31);
+    input_charset[31] = '\0';
+    if (charset_autodetect_pre) {
+        strcpy(input_charset, "AUTODETECT");
+    }
+    if (is_streamable(option) &&
+            strncasecmp(filename, "http://", 7) != 0 &&
+            strncasecmp(filename, "https://", 8) != 0 &&
+            strncasecmp(filename, "ftp://", 6) != 0) {
+        if (convert_file_stream(filename, sink, option) != 0) {
+            if (overwrite) {
+                sink_discard(sink);
+            }
+        } else if (overwrite) {
+            sink_commit(sink, filename, option->flag_sync);
+        }
+        return;
+    }
+    if (is_sortable_file(filename, option)) {
+        // CSV larger than the memory for sorting is merged from sorted runs
+        if (sort_csv_file(filename, sink, option, input_charset) != 0) {
+            if (overwrite) {
+                sink_discard(sink);
+            }
+        } else if (overwrite) {
+            sink_commit(sink, filename, option->flag_sync);
+        }
+        return;
+    }
+    tmp_str.useAsBinary(0);
+#if __OPENSSL == 1
+    if (!strncasecmp(filename, "http://", 7) ||
+            !strncasecmp(filename, "https://", 8)) {
+#else
+    if (!strncasecmp(filename, "http://", 7)) {
+#endif
+        HTTPClient hc;
+        tmp_str = hc.getURL(filename);
+        strncpy(input_charset, hc.getOrigCharset().c_str(), 31);
+        input_charset[31] = '\0';
+    } else if (!strncasecmp(filename, "ftp://", 6)) {
+        FTPStream fs;
+        String host;
+        String port = 21;
+        String path;
+        long x;
+        host = filename+6;
+        x = host.search(":");
+        if (0 <= x) {
+            host = host.mid(0, x);
+        }
+        x = host.search("/");
+        if (0 <= x) {
+            path = host.mid(x);
+            host = host.mid(0, x);
+        }
+        if (fs.login("anonymous", "user@example.com", host, port)) {
+            fs.passive();
+            tmp_str = fs.receiveBuffer(path);
+            fs.logout();
+        }
+    } else if (option->flag_guess && 0 < option->guess_limit) {
+        // read only the head of the file
+        guess_file(filename, input_charset, option->guess_limit, buf);
+        guessed = true;
+    } else if (tmp_str.loadFile(filename) < 0) {
+        fprintf(stderr, "Cannot open the input file '%s'.\n", filename);
+        if (overwrite) {
+            sink_discard(sink);
+        }
+        return;
+    }
+    if (option->flag_guess) {
+        if (!guessed) {
+            guess(tmp_str, input_charset, option->guess_limit, buf);
+        }
+        sink_write(sink, buf, strlen(buf));
+    } else if (option->flag_midi) {
+        tmp_str = tmp_str.toMIDI();
+        sink_write(sink, tmp_str.c_str(), tmp_str.binaryLength());
+    } else if (0 < tmp_str.len()) {
+        if (charset_autodetect_pre) {
+            TOption tmp_option;
+            memcpy(&tmp_option, option, sizeof(TOption));
+            strcpy(tmp_option.input_charset, input_charset);
+            tmp_option.input_charset_handle = charsetHandle(input_charset);
+            convert(tmp_str, &tmp_option);
+        } else {
+            convert(tmp_str, option);
+        }
+        if (tmp_str.isBinary()) {
+            sink_write(sink, tmp_str.c_str(), tmp_str.binaryLength());
+        } else {
+            sink_write(sink, tmp_str.c_str(), tmp_str.len());
+        }
+    }
+    if (overwrite) {
+        sink_commit(sink, filename, option->flag_sync);
+    }
+}
+
+
+static void *convert_files_worker(void *arg) {
+    TJobQueue *queue = (TJobQueue *)arg;
+    TOption job_option;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->next < queue->count &&
+                queue->written + queue->window <= queue->next) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        }
+        if (queue->count <= queue->next) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+
+        // every file is converted with its own option and buffers
+        memcpy(&job_option, queue->option, sizeof(TOption));
+        job_option.jobs = 1;
+        if (queue->overwrite) {
+            convert_file(queue->option->input_filenames[i], (TSink *)NULL, &job_option,
+                         queue->charset_autodetect_pre);
+        } else if (sink_open(&queue->jobs[i].sink, -1)) {
+            convert_file(queue->option->input_filenames[i], &queue->jobs[i].sink, &job_option,
+                         queue->charset_autodetect_pre);
+        } else {
+            fprintf(stderr, "Cannot open the output buffer for '%s'.\n",
+                    queue->option->input_filenames[i]);
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->jobs[i].done = 1;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return NULL;
+}
+
+
+static int convert_files_parallel(TSink *sink, const TOption *option,
+                                  bool charset_autodetect_pre) {
+    TJobQueue queue;
+    pthread_t *threads;
+    int count, jobs, started, i;
+
+    // remote input, MIDI and the regular expression engine stay sequential
+    if (option->jobs <= 1 || option->flag_midi || option->flag_re_match) {
+        return -1;
+    }
+    for (count = 0; option->input_filenames[count] != NULL; count++) {
+        if (!strncasecmp(option->input_filenames[count], "http://", 7) ||
+                !strncasecmp(option->input_filenames[count], "https://", 8) ||
+                !strncasecmp(option->input_filenames[count], "ftp://", 6)) {
+            return -1;
+        }
+    }
+    if (count <= 1) {
+        return -1;
+    }
+    jobs = (option->jobs < count)?option->jobs:count;
+
+    queue.option = option;
+    queue.charset_autodetect_pre = charset_autodetect_pre;
+    queue.overwrite = ((option->output_filename == NULL || option->output_filename[0] == '\0') &&
+                       option->flag_overwrite);
+    queue.count = count;
+    queue.next = 0;
+    queue.written = 0;
+    queue.window = jobs * INKF_JOBS_WINDOW;
+    queue.jobs = new TJob [count];
+    for (i = 0; i < count; i++) {
+        queue.jobs[i].sink.buf = NULL;
+        queue.jobs[i].sink.length = 0;
+        queue.jobs[i].done = 0;
+    }
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+
+    threads = new pthread_t [jobs];
+    for (started = 0; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, convert_files_worker, &queue) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        pthread_cond_destroy(&queue.cond);
+        pthread_mutex_destroy(&queue.mutex);
+        delete [] threads;
+        delete [] queue.jobs;
+        return -1;
+    }
+
+    // write the results in the order of the input files
+    for (i = 0; i < count; i++) {
+        pthread_mutex_lock(&queue.mutex);
+        while (!queue.jobs[i].done) {
+            pthread_cond_wait(&queue.cond, &queue.mutex);
+        }
+        queue.written = i + 1;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.mutex);
+        if (queue.jobs[i].sink.buf != NULL) {
+            sink_write(sink, queue.jobs[i].sink.buf, queue.jobs[i].sink.length);
+            sink_close(&queue.jobs[i].sink);
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.mutex);
+    delete [] threads;
+    delete [] queue.jobs;
+
+    return 0;
+}
+
+
+static bool has_utf8_stage(const TOption *option) {
+    return (option->flag_hankaku_ascii || option->flag_zenkaku_ascii ||
+            option->flag_hiragana || option->flag_katakana ||
+            option->flag_hankaku_katakana || option->flag_zenkaku_katakana ||
+            option->line_mode != LINE_MODE_NOCONVERSION);
+}
+
+
+static void convert_utf8(String &u8str, const TOption *option) {
+    if (option->flag_hankaku_ascii) {
+        u8str = u8str.changeWidth("a", "UTF-8", "UTF-8");
+    } else if (option->flag_zenkaku_ascii) {
+        u8str = u8str.changeWidth("A", "UTF-8", "UTF-8");
+    }
+    if (option->flag_hiragana) {
+        u8str = u8str.changeWidth("HI", "UTF-8", "UTF-8");
+    } else if (option->flag_katakana) {
+        u8str = u8str.changeWidth("J", "UTF-8", "UTF-8");
+    }
+    if (option->flag_hankaku_katakana) {
+        u8str = u8str.changeWidth("k", "UTF-8", "UTF-8");
+    } else if (option->flag_zenkaku_katakana) {
+        u8str = u8str.changeWidth("K", "UTF-8", "UTF-8");
+    }
+    if (option->line_mode != LINE_MODE_NOCONVERSION) {
+        u8str = u8str.changeReturnCode(RETURN_STR[option->line_mode]);
+    }
+    u8str.gc();
+}
+
+
+static bool remove_single_return(String &u8str, const TOption *option) {
+    // a single line to be MIME encoded loses its return code
+    if (0 < u8str.len() && option->flag_no_return_param == false &&
+            u8str.search("\n") == u8str.searchR("\n") && u8str[u8str.len()-1] == '\n') {
+        u8str = u8str.changeReturnCode("");
+        return true;
+    }
+    return false;
+}
+
+
+static long utf8_stage_length(const char *str, long length, bool finish) {
+    long i;
+
+    if (finish) {
+        return length;
+    }
+
+    // convert up to the last line end
+    for (i = length; 0 < i; i--) {
+        if (str[i - 1] == '\n') {
+            return i;
+        }
+    }
+
+    if (length < INKF_STREAM_LINE_MAX) {
+        return 0;
+    }
+
+    // too long line: cut at a character boundary
+    i = length;
+    while (0 < i && (str[i - 1] & 0xC0) == 0x80) {
+        i--;
+    }
+    if (0 < i && (str[i - 1] & 0x80)) {
+        i--;
+    }
+    // keep CR (may be followed by LF) and half-width katakana (may be followed by voiced mark)
+    while (0 < i) {
+        if (str[i - 1] == '\r') {
+            i--;
+        } else if (3 <= i && (unsigned char)str[i - 3] == 0xEF &&
+                   (((unsigned char)str[i - 2] == 0xBD && 0xA1 <= (unsigned char)str[i - 1]) ||
+                    ((unsigned char)str[i - 2] == 0xBE && (unsigned char)str[i - 1] <= 0x9F))) {
+            i -= 3;
+        } else {
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+static int set_jobs(TOption *option, const char *value) {
+    char *end;
+    long jobs;
+
+    // 0 means one job per online processor
+    jobs = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || jobs < 0 || INKF_JOBS_MAX < jobs) {
+        return -1;
+    }
+    if (jobs == 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs < 1) {
+            jobs = 1;
+        } else if (INKF_JOBS_MAX < jobs) {
+            jobs = INKF_JOBS_MAX;
+        }
+    }
+    option->jobs = (int)jobs;
+
+    return 0;
+}
+
+
+static void set_input_charset_by_env(char *input_charset) {
+    const char *env_lang;
+    env_lang = getenv("LANG");
+    if (env_lang != NULL) {
+        if (strcasestr(env_lang, "UTF-8") != NULL) {
+            strcpy(input_charset, "UTF-8");
+        } else if (strcasestr(env_lang, "eucJP") != NULL) {
+            strcpy(input_charset, "EUC-JP");
+        } else if (strcasestr(env_lang, "SJIS") != NULL ||
+                !strcasecmp(env_lang, "ja_JP.PCK")) {
             strcpy(input_charset, "SHIFT_JIS");
         } else if (strcasestr(env_lang, "ja") != NULL) {
             strcpy(input_charset, "AUTODETECT_JP");
@@ -1170,6 +2183,21 @@ static void set_output_charset(char *output_charset, const char *input_charset,
 }
 
 
+static void get_csv_column(String &csv_column, const TOption *option) {
+    char tmp_input_charset[32];
+
+    // column name is written in the charset of the terminal
+    set_input_charset_by_env(tmp_input_charset);
+    csv_column = option->csv_column;
+    if (2 <= csv_column.len() && csv_column[0] == '"' &&
+            csv_column[csv_column.len()-1] == '"') {
+        csv_column = csv_column.mid(1, csv_column.len()-2).unescapeQuote(tmp_input_charset, "UTF-8");
+    } else {
+        csv_column = csv_column.strconv(tmp_input_charset, "UTF-8");
+    }
+}
+
+
 static void get_help(char *buf) {
     sprintf(buf, 
       "Usage:  %s -[flags] [--] [in file/in URL] .. [out file for -O flag]\n"
@@ -1220,15 +2248,19 @@ static void get_help(char *buf) {
       " --hankaku-katakana     Convert JISX0208 Katakana to Hankaku Kana\n"
       " --html-to-plain        Convert HTML to Plain Text\n"
       " -g --guess     Guess the input code\n"
+      " --guess-limit=<size>   Guess from the head of input (up to size[K/M] bytes)\n"
       " --midi         Create MIDI object from MML like music sequencial text\n"
       " --md5          Calc MD5 sum\n"
       " --sha1         Calc SHA-1 sum\n"
       " --sort-csv=<column>    Sort CSV\n"
       " --sort-csv-r=<column>  Sort CSV (reverse)\n"
+      " --sort-csv-memory=<size> Sort larger CSV file through temporary files (size[K/M])\n"
       " --format-json  Reformat JSON\n"
       " --minify-json  Minify JSON\n"
       " --re-match=<pattern>   Regular Expression match\n"
       " --overwrite    Overwrite original listed files by filtered result\n"
+      " --sync         Flush overwritten files to the disk before replacing them\n"
+      " -P <n> --jobs=<n>      Convert files or large input on n threads (0: all)\n"
       " -v --version   Print the version\n"
       " --help/-V      Print this help / configuration\n"
       , INKF_PROGNAME, INKF_DEF_OUT);
@@ -8,6 +8,8 @@
 #ifndef _INKF_COMMON_H_
 #define _INKF_COMMON_H_
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,7 +34,10 @@ typedef struct {
     int flag_show_help;
     int flag_show_version;
     int flag_guess;
+    long guess_limit;
     int flag_overwrite;
+    int jobs;
+    int flag_sync;
     int flag_html_to_plain;
     int flag_hankaku_ascii;
     int flag_zenkaku_ascii;
@@ -46,6 +51,7 @@ typedef struct {
     int flag_sort_csv;
     int flag_sort_csv_r;
     const char *csv_column;
+    long sort_memory;
     int flag_format_json;
     int flag_minify_json;
     int flag_re_match;
@@ -54,6 +60,8 @@ typedef struct {
     int flag_no_return;
     char input_charset[32];
     char output_charset[32];
+    int input_charset_handle;
+    int output_charset_handle;
     TMIME mime_decode;
     TMIME mime_encode;
     TLineMode line_mode;
@@ -66,6 +74,10 @@ int inkf_command_exec(const TOption *option);
 int inkf_lib_exec(const char *input_str, long input_str_len,
                   char **output_str, long *output_str_len,
                   const TOption *option);
+int inkf_lib_exec_buf(const char *input_str, long input_str_len,
+                      char *output_buf, long output_buf_size, long *output_str_len,
+                      const TOption *option);
+void inkf_lib_set_allocator(void *(*alloc_func)(size_t size), void (*free_func)(void *ptr));
 void inkf_free_output_str(char *output_str);
 int inkf_set_option(TOption *option, int argc, const char **argv);
 void inkf_free_option(TOption *option);
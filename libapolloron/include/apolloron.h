@@ -89,6 +89,67 @@ class List;
 class Keys;
 
 
+/*----------------------------------------------------------------------------*/
+/* Character set handle                                                       */
+/*----------------------------------------------------------------------------*/
+/*! @brief Character set resolved from its name once (see charsetHandle()).
+ */
+typedef enum {
+    CHARSET_UNKNOWN = 0,    // not registered (converted as it is)
+    CHARSET_AUTODETECT,
+    CHARSET_AUTODETECT_JP,
+    CHARSET_ASCII,
+    CHARSET_UTF8,
+    CHARSET_UTF8_BOM,
+    CHARSET_UTF7,
+    CHARSET_UTF7_IMAP,
+    CHARSET_UTF16,          // big endian, or byte order of BOM
+    CHARSET_UTF16BE,
+    CHARSET_UTF16LE,
+    CHARSET_UTF16BE_BOM,
+    CHARSET_UTF16LE_BOM,
+    CHARSET_UTF32,          // big endian, or byte order of BOM
+    CHARSET_UTF32BE,
+    CHARSET_UTF32LE,
+    CHARSET_UTF32BE_BOM,
+    CHARSET_UTF32LE_BOM,
+    CHARSET_SJIS,
+    CHARSET_EUCJP,
+    CHARSET_EUCJPMS,
+    CHARSET_JIS,
+    CHARSET_EUCKR,
+    CHARSET_GBK,
+    CHARSET_BIG5,
+    CHARSET_ISO8859_1,
+    CHARSET_ISO8859_2,
+    CHARSET_ISO8859_3,
+    CHARSET_ISO8859_4,
+    CHARSET_ISO8859_5,
+    CHARSET_ISO8859_6,
+    CHARSET_ISO8859_7,
+    CHARSET_ISO8859_8,
+    CHARSET_ISO8859_9,
+    CHARSET_ISO8859_10,
+    CHARSET_ISO8859_11,
+    CHARSET_ISO8859_13,
+    CHARSET_ISO8859_14,
+    CHARSET_ISO8859_15,
+    CHARSET_ISO8859_16,
+    CHARSET_KOI8_R,
+    CHARSET_KOI8_U,
+    CHARSET_CP1251,
+    CHARSET_CP1252,
+    CHARSET_CP1258,
+    CHARSET_MAX
+} TCharset;
+
+TCharset charsetHandle(const char *charset);
+const char* charsetName(TCharset charset);
+
+// Display width (0, 1 or 2) of each character of UTF-8 text
+long widths(const char *str, long length, unsigned char *out);
+
+
 /*----------------------------------------------------------------------------*/
 /* String class                                                               */
 /*----------------------------------------------------------------------------*/
@@ -105,8 +166,12 @@ protected:
     bool nLengthRenewRecommended; // this is true if the length of string is uncertain
     String ***pTmp; // Temporary String
     long *pTmpLen; // Number of array of temporary String
+    const String *pTmpOwner; // String holding this as a temporary String (or NULL)
     virtual String *tmpStr() const; // Reference of temporary String
     virtual bool clearTmpStr() const; // Deletion of all temporary String
+    virtual bool releaseTmpStr(const String *tmp) const; // Deletion of a temporary String
+    virtual bool ownsTmpStr(const String *tmp) const; // Check if tmp is deleted with temporary Strings
+    virtual bool take(String &value); // Take memory of value (value gets the old memory)
     virtual bool pTextReplace(char *str, long text_len, long binary_len, long capacity); // Replacement pText
     virtual bool resize(long); // Change the size of allocated memory
     virtual bool nLengthRenew(); // renew nLength
@@ -120,6 +185,9 @@ public:
     String(int value);
     String(char value);
     String(double value);
+#if __cplusplus >= 201103L
+    String(String &&value);
+#endif
     virtual ~String();
 
     // Deletion of String instance
@@ -190,6 +258,10 @@ public:
     virtual const String& operator = (int value);
     virtual const String& operator = (char value);
     virtual const String& operator = (double value);
+#if __cplusplus >= 201103L
+    // Moving a temporary String releases it (ex. str = std::move(src.strconv(...)))
+    virtual const String& operator = (String &&value);
+#endif
 
     // Comparison
     virtual int compare(const String &value) const;
@@ -379,10 +451,19 @@ public:
 
     // Character code conversion
     virtual String& strconv(const char *src_charset, const char *dest_charset) const;
+    virtual String& strconv(TCharset src_charset, TCharset dest_charset) const;
+    virtual String& strconv(const char *src_charset, const char *dest_charset, int threads) const;
+    virtual String& strconv(TCharset src_charset, TCharset dest_charset, int threads) const;
+    virtual long strconv(TCharset src_charset, TCharset dest_charset, char *buf, long size) const;
 
     // Character code detection
     virtual const char* detectCharSet() const;
     virtual const char* detectCharSetJP() const;
+#define CHARSET_CONFIDENCE_LOW    0  /* limit reached before the result settled */
+#define CHARSET_CONFIDENCE_MEDIUM 1  /* result settled on a prefix */
+#define CHARSET_CONFIDENCE_HIGH   2  /* whole text judged, or BOM found */
+    virtual const char* detectCharSet(long limit, int *confidence=NULL) const;
+    virtual const char* detectCharSetJP(long limit, int *confidence=NULL) const;
 
     // return code (CR/LF/CRLF)
     virtual String& changeReturnCode(const char * return_str="\n") const;
@@ -400,7 +481,7 @@ public:
     virtual bool isWcMatchAll(const char *wildcard) const;
 
     // Multi-line string processing
-    virtual String& uniq() const;
+    virtual String& uniq(bool adjacent=false) const;
 
     // Files
     virtual long loadFile(const String& filename);
@@ -430,6 +511,68 @@ public:
 String operator + (const char* value1, const String& value2);
 
 
+/*----------------------------------------------------------------------------*/
+/* CharsetStream class                                                        */
+/*----------------------------------------------------------------------------*/
+/*! @brief Class of incremental character set converter.
+ */
+class CharsetStream {
+protected:
+    char srcCharset[32]; // Character set of input (resolved after detection)
+    char destCharset[32]; // Character set of output
+    TCharset srcHandle; // Handle of srcCharset
+    TCharset destHandle; // Handle of destCharset
+    int srcType; // Kind of input encoding
+    int destType; // Kind of output encoding
+    char srcEndian; // Byte order of UTF-16/32 input ('b' or 'l')
+    char destEndian; // Byte order of UTF-16/32 output ('b' or 'l')
+    bool destBOM; // Output starts with BOM
+    bool inputStarted; // Something has already been decoded
+    bool outputStarted; // Something has already been encoded
+    int jisMode; // ISO-2022-JP shift state at the head of pending input
+    bool utf7Shifted; // UTF-7 base64 state at the head of pending input
+    long detectSize; // Bytes buffered for AUTODETECT
+    int threads; // Threads to convert each chunk of stateless input
+    char *pSrcBuf; // Pending input which is not decoded yet
+    long nSrcLen;
+    long nSrcCapacity;
+    char *pUtf8Buf; // Pending UTF-8 which is not encoded yet
+    long nUtf8Len;
+    long nUtf8Capacity;
+    virtual const char* detect(bool finish); // Resolve AUTODETECT
+    virtual char* takeSrcChunk(bool finish, long length, long &chunk_length); // Cut pending input
+    virtual bool decodeBuffer(bool finish, String &utf8_out); // Decode pending input
+    virtual bool encodeBuffer(bool finish, String &out); // Encode pending UTF-8
+    virtual bool convertBuffer(bool finish, String &out); // Convert pending input
+public:
+    CharsetStream();
+    CharsetStream(const char *src_charset, const char *dest_charset);
+    virtual ~CharsetStream();
+
+    // Deletion of object instance
+    virtual bool clear();
+
+    // Setup of character sets
+    virtual bool open(const char *src_charset, const char *dest_charset);
+    virtual bool setDetectSize(long size);
+    virtual bool setThreads(int threads);
+    virtual const char* srcCharSet() const;
+    virtual const char* destCharSet() const;
+
+    // Input bytes to UTF-8 (appended to utf8_out)
+    virtual bool decode(const char *data, long length, String &utf8_out);
+    virtual bool decodeFlush(String &utf8_out);
+
+    // UTF-8 to output bytes (appended to out)
+    virtual bool encode(const char *utf8, long length, String &out);
+    virtual bool encodeFlush(String &out);
+
+    // Input bytes to output bytes (appended to out)
+    virtual bool write(const char *data, long length, String &out);
+    virtual bool flush(String &out);
+};
+
+
 /*----------------------------------------------------------------------------*/
 /* List class                                                                 */
 /*----------------------------------------------------------------------------*/
@@ -486,6 +629,15 @@ typedef struct {
     String *value;
 } Element;
 
+// Slot of hash table of Keys
+typedef struct {
+    unsigned long hash; // hash of key
+    Element *element; // element of key (NULL: empty)
+} KeySlot;
+
+// Node of tree of elements of Keys (defined in Keys.cc)
+struct KeyNode;
+
 /*----------------------------------------------------------------------------*/
 /* Keys class                                                                 */
 /*----------------------------------------------------------------------------*/
@@ -493,11 +645,21 @@ typedef struct {
  */
 class Keys {
 protected:
-    long nElementTotal[64];
-    long nElementCapacity[64];
-    Element ***pElement; // (pointers of array) x 64
+    long nElementTotal;
+    struct KeyNode *pRoot; // B+ tree of elements (in order of key)
+    long nSlotCapacity; // power of 2
+    KeySlot *pSlot; // open addressing hash table of elements
+    char *pKeyPool; // chunks of key strings
+    long nKeyPoolLeft;
+    long nKeyPoolUsed; // bytes of key strings in the chunks
+    long nKeyPoolDead; // bytes of deleted key strings in the chunks
     String *tmpString; // temporary string
     String *emptyString; // empty string to retuen if not found
+    long findSlot(const char *key, long keyLen, unsigned long hash) const;
+    void addSlot(unsigned long hash, Element *element);
+    void removeSlot(long slot);
+    char *poolKey(const char *key, long keyLen);
+    void compactKeyPool();
 public:
     Keys();
     Keys(const Keys & keys);
@@ -559,16 +721,36 @@ public:
 /*----------------------------------------------------------------------------*/
 /* Sheet class                                                                */
 /*----------------------------------------------------------------------------*/
+// Cells of a column of Sheet
+typedef struct {
+    char *arena; // values of cells (NULL terminated, one after another)
+    long arenaLength;
+    long arenaCapacity;
+    long arenaUnused; // bytes of overwritten values
+    long *offsets; // offset of the value of each row in arena (-1: empty)
+} SheetColumn;
+
+#define SHEET_SORT_MEMORY  (256L * 1024L * 1024L) /* memory for each run of sortCSVFile() */
+
 /*! @brief Class of sheet.
  */
 class Sheet {
 protected:
     List columns; // Column names (with order)
-    Keys **pRows; // Rows
+    SheetColumn *pCols; // Cells of each column (in order of columns)
+    long colsCapacity;
     long rowsMax;
     long rowsCapacity;
-    String *tmpString; // temporary string
     String *tmpCSVString; // temporary string for getCSV()
+    int threads; // Threads to sort rows
+    const char *cell(long col, long row) const;
+    void storeCell(long col, long row, const char *value, long length);
+    void compactCol(long col);
+    bool growRows(long rows);
+    bool sortRows(const String &colname, int order);
+    bool sortRowsByCols(const long *cols, const char *orders, long keys);
+    long keyCols(const List &colnames, const char *orders, long *cols, char *key_orders);
+    bool writeRun(int fd, const long *cols, const char *orders, long keys);
 public:
     Sheet();
     Sheet(Sheet & sheet);
@@ -603,8 +785,8 @@ public:
     virtual bool delRow(long row);
 
     // Get or set value
-    virtual String& getValue(const String &colname, long row);
-    virtual String& getValue(long col, long row);
+    virtual const String getValue(const String &colname, long row);
+    virtual const String getValue(long col, long row);
     virtual bool setValue(const String &colname, long row, const String &value);
     virtual bool setValue(long col, long row, const String &value);
 
@@ -612,16 +794,19 @@ public:
     virtual long searchRow(const String &colname, const String &value);
 
     // Sort
+    virtual bool setThreads(int threads);
     virtual bool sort(const String &colname);
     virtual bool sortr(const String &colname);
     virtual bool sortnum(const String &colname);
     virtual bool sortnumr(const String &colname);
+    virtual bool sortByCols(const List &colnames, const char *orders);
 
     // CSV
     virtual String& getCSV(const char * src_charset="UTF-8", const char * dest_charset="UTF-8", const char * return_str="\n");
     virtual bool setCSV(const String &csv, const char * src_charset="UTF-8", const char * dest_charset="UTF-8");
     virtual bool loadCSV(const String &filename, const char * src_charset="UTF-8", const char * dest_charset="UTF-8");
     virtual bool saveCSV(const String &filename, const char * src_charset="UTF-8", const char * dest_charset="UTF-8", const char * return_str="\n");
+    virtual long sortCSVFile(const String &src_filename, const String &dest_filename, const List &colnames, const char *orders, const char * src_charset="AUTODETECT", const char * dest_charset="UTF-8", const char * return_str="\n", long memory_limit=SHEET_SORT_MEMORY);
 };
 
 
@@ -0,0 +1,1020 @@
+/******************************************************************************/
+/*! @file CharsetStream.cc
+    @brief CharsetStream class
+    @author Masashi Astro Tachibana, Apolloron Project.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apolloron.h"
+#include "charset.h"
+
+#define CHARSETSTREAM_DETECT_SIZE (1024L * 1024L)
+#define CHARSETSTREAM_MIN_CAPACITY 4096L
+
+namespace apolloron {
+
+// Kind of encoding
+enum {
+    CS_NONE = 0,   // no conversion
+    CS_AUTO,       // not detected yet
+    CS_SINGLE,     // single byte character sets (ISO-8859-x, KOI8-x, CP125x, ASCII)
+    CS_UTF8,
+    CS_UTF7,
+    CS_UTF7_IMAP,
+    CS_UTF16,
+    CS_UTF32,
+    CS_SJIS,
+    CS_EUCJP,
+    CS_JIS,
+    CS_EUCKR,
+    CS_GBK,
+    CS_BIG5
+};
+
+// Shift state of ISO-2022-JP
+enum {
+    JIS_ROMAN = 0,
+    JIS_KANJI,
+    JIS_KANA
+};
+
+// BASE64 alphabet of UTF-7 (64 means "not in alphabet")
+static const unsigned char utf7_base64[256] = {
+    //  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // 0
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // 1
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 63, 64, 64, 63, // 2
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64, // 3
+    64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 4
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64, // 5
+    64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, // 6
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64, // 7
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // 8
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // 9
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // A
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // B
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // C
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // D
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, // E
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64  // F
+};
+
+
+/*! Get kind of encoding from the handle of character set
+    @param charset  Name of character set
+    @param handle   Handle of the character set
+    @return Kind of encoding (CS_xxx)
+ */
+static int charset_type(const char *charset, TCharset handle) {
+    if (charset == NULL || charset[0] == '\0') {
+        return CS_NONE;
+    }
+    switch (CHARSET_INFO[handle].family) {
+    case CHARSET_AUTODETECT:
+    case CHARSET_AUTODETECT_JP:
+        return CS_AUTO;
+    case CHARSET_UTF16:
+        return CS_UTF16;
+    case CHARSET_UTF32:
+        return CS_UTF32;
+    case CHARSET_UTF7_IMAP:
+        return CS_UTF7_IMAP;
+    case CHARSET_UTF7:
+        return CS_UTF7;
+    case CHARSET_UTF8:
+        return CS_UTF8;
+    case CHARSET_JIS:
+        return CS_JIS;
+    case CHARSET_EUCJP:
+    case CHARSET_EUCJPMS:
+        return CS_EUCJP;
+    case CHARSET_SJIS:
+        return CS_SJIS;
+    case CHARSET_EUCKR:
+        return CS_EUCKR;
+    case CHARSET_GBK:
+        return CS_GBK;
+    case CHARSET_BIG5:
+        return CS_BIG5;
+    default:
+        break;
+    }
+    return CS_SINGLE;
+}
+
+
+/*! Append bytes to a pending buffer (geometric growth)
+    @param buf       Pointer of buffer
+    @param length    Pointer of used size of buffer
+    @param capacity  Pointer of allocated size of buffer
+    @param data      Bytes to append
+    @param size      Size of data
+    @return void
+ */
+static void buffer_append(char **buf, long *length, long *capacity, const char *data, long size) {
+    if (*capacity < *length + size + 1) {
+        long new_capacity;
+        char *tmp;
+        new_capacity = (*capacity) * 2;
+        if (new_capacity < *length + size + 1) {
+            new_capacity = *length + size + 1;
+        }
+        if (new_capacity < CHARSETSTREAM_MIN_CAPACITY) {
+            new_capacity = CHARSETSTREAM_MIN_CAPACITY;
+        }
+        tmp = new char [new_capacity];
+        if (*buf != NULL) {
+            memcpy(tmp, *buf, *length);
+            delete [] *buf;
+        }
+        *buf = tmp;
+        *capacity = new_capacity;
+    }
+    if (0 < size) {
+        memcpy(*buf + *length, data, size);
+    }
+    *length += size;
+    (*buf)[*length] = '\0';
+}
+
+
+/*! Remove bytes from the head of a pending buffer
+    @param buf     Buffer
+    @param length  Pointer of used size of buffer
+    @param size    Size to remove
+    @return void
+ */
+static void buffer_consume(char *buf, long *length, long size) {
+    if (*length <= size) {
+        *length = 0;
+    } else {
+        memmove(buf, buf + size, *length - size);
+        *length -= size;
+    }
+    if (buf != NULL) {
+        buf[*length] = '\0';
+    }
+}
+
+
+/*! Length of UTF-8 text without an incomplete character at the end
+    @param str     UTF-8 text
+    @param length  Size of str
+    @return Size which consists of complete characters
+ */
+static long utf8_complete_length(const char *str, long length) {
+    long i, size;
+
+    // step as utf8_clean() does, so broken sequences are cut at the same place
+    i = 0;
+    while (i < length) {
+        size = utf8_len(str[i]);
+        if (length < i + size) {
+            return i;
+        }
+        i += size;
+    }
+    return length;
+}
+
+
+/*! Length of text up to the last character after which the encoder of a stateful
+    character set is back to its initial state
+    @param type    Type of output character set
+    @param str     Text (the byte never appears inside a multibyte character)
+    @param length  Size of str
+    @return Size to convert now (length for stateless character sets, 0 if none)
+ */
+static long encoder_reset_length(int type, const char *str, long length) {
+    char c;
+
+    if (type == CS_JIS || type == CS_UTF7) {
+        // ISO-2022-JP is back to ASCII and UTF-7 leaves BASE64 at a line end
+        c = '\n';
+    } else if (type == CS_UTF7_IMAP) {
+        // a line end is BASE64 encoded in modified UTF-7, but a space is not
+        c = ' ';
+    } else {
+        return length;
+    }
+    while (0 < length && str[length - 1] != c) {
+        length--;
+    }
+    return length;
+}
+
+
+/*! Check if the last UTF-16 unit of 8 UTF-7 BASE64 characters is a high surrogate
+    @param p  8 characters of BASE64
+    @retval true  high surrogate
+    @retval false other
+ */
+static bool utf7_high_surrogate(const unsigned char *p) {
+    unsigned long unit;
+
+    unit = ((unsigned long)(utf7_base64[p[5]] & 0x0F) << 12) |
+           ((unsigned long)utf7_base64[p[6]] << 6) |
+           (unsigned long)utf7_base64[p[7]];
+
+    return (0xD800UL <= unit && unit <= 0xDBFFUL);
+}
+
+
+/*! Constructor of CharsetStream.
+    @param void
+    @return void
+ */
+CharsetStream::CharsetStream() {
+    (*this).pSrcBuf = NULL;
+    (*this).nSrcLen = 0;
+    (*this).nSrcCapacity = 0;
+    (*this).pUtf8Buf = NULL;
+    (*this).nUtf8Len = 0;
+    (*this).nUtf8Capacity = 0;
+    (*this).detectSize = CHARSETSTREAM_DETECT_SIZE;
+    (*this).threads = 1;
+    (*this).open("AUTODETECT", "");
+}
+
+
+/*! Constructor of CharsetStream.
+    @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @return void
+ */
+CharsetStream::CharsetStream(const char *src_charset, const char *dest_charset) {
+    (*this).pSrcBuf = NULL;
+    (*this).nSrcLen = 0;
+    (*this).nSrcCapacity = 0;
+    (*this).pUtf8Buf = NULL;
+    (*this).nUtf8Len = 0;
+    (*this).nUtf8Capacity = 0;
+    (*this).detectSize = CHARSETSTREAM_DETECT_SIZE;
+    (*this).threads = 1;
+    (*this).open(src_charset, dest_charset);
+}
+
+
+/*! Destructor of CharsetStream.
+    @param void
+    @return void
+ */
+CharsetStream::~CharsetStream() {
+    (*this).clear();
+}
+
+
+/*! Delete instance of CharsetStream
+    @param void
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::clear() {
+    if ((*this).pSrcBuf != NULL) {
+        delete [] (*this).pSrcBuf;
+        (*this).pSrcBuf = NULL;
+    }
+    (*this).nSrcLen = 0;
+    (*this).nSrcCapacity = 0;
+
+    if ((*this).pUtf8Buf != NULL) {
+        delete [] (*this).pUtf8Buf;
+        (*this).pUtf8Buf = NULL;
+    }
+    (*this).nUtf8Len = 0;
+    (*this).nUtf8Capacity = 0;
+
+    (*this).inputStarted = false;
+    (*this).outputStarted = false;
+    (*this).jisMode = JIS_ROMAN;
+    (*this).utf7Shifted = false;
+
+    return true;
+}
+
+
+/*! Set character sets and reset the conversion state
+    @param src_charset  Character set of input. (ex. "UTF-8", "AUTODETECT", etc..)
+    @param dest_charset Character set of output. ("" means the same as input, UTF-8 for Unicode input)
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::open(const char *src_charset, const char *dest_charset) {
+    (*this).clear();
+
+    if (src_charset == NULL || src_charset[0] == '\0') {
+        src_charset = "AUTODETECT";
+    }
+    if (dest_charset == NULL) {
+        dest_charset = "";
+    }
+    strncpy((*this).srcCharset, src_charset, 31);
+    (*this).srcCharset[31] = '\0';
+    strncpy((*this).destCharset, dest_charset, 31);
+    (*this).destCharset[31] = '\0';
+
+    (*this).srcHandle = charsetHandle((*this).srcCharset);
+    (*this).destHandle = charsetHandle((*this).destCharset);
+    (*this).srcType = charset_type((*this).srcCharset, (*this).srcHandle);
+    (*this).destType = charset_type((*this).destCharset, (*this).destHandle);
+
+    // no output character set: Unicode is output as UTF-8 like String::strconv()
+    if ((*this).destType == CS_NONE && ((*this).srcType == CS_UTF8 ||
+            (*this).srcType == CS_UTF16 || (*this).srcType == CS_UTF32)) {
+        strcpy((*this).destCharset, "UTF-8");
+        (*this).destHandle = charsetHandle((*this).destCharset);
+        (*this).destType = CS_UTF8;
+    }
+
+    // UTF-16/32 without byte order is big endian unless it has BOM
+    (*this).srcEndian = (CHARSET_INFO[(*this).srcHandle].endian == 'l')?'l':'b';
+    (*this).destEndian = (CHARSET_INFO[(*this).destHandle].endian == 'l')?'l':'b';
+
+    if ((*this).destType == CS_UTF16 || (*this).destType == CS_UTF32 ||
+            (*this).destType == CS_UTF8) {
+        (*this).destBOM = CHARSET_INFO[(*this).destHandle].bom;
+    } else {
+        (*this).destBOM = false;
+    }
+
+    return true;
+}
+
+
+/*! Set size of input which is buffered for AUTODETECT
+    @param size  Size in bytes
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::setDetectSize(long size) {
+    if (size <= 0) {
+        return false;
+    }
+    (*this).detectSize = size;
+    return true;
+}
+
+
+/*! Set number of threads which convert each chunk of input
+    @param threads  Number of threads (large chunks of stateless character sets
+                    are cut at line ends and converted at once)
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::setThreads(int threads) {
+    if (threads <= 0) {
+        return false;
+    }
+    (*this).threads = threads;
+    return true;
+}
+
+
+/*! Character set of input (detected one after AUTODETECT is resolved)
+    @param void
+    @return Character set
+ */
+const char* CharsetStream::srcCharSet() const {
+    return (*this).srcCharset;
+}
+
+
+/*! Character set of output
+    @param void
+    @return Character set
+ */
+const char* CharsetStream::destCharSet() const {
+    return (*this).destCharset;
+}
+
+
+/*! Resolve AUTODETECT from the buffered head of input
+    @param finish  true if no more input follows
+    @return Character set to decode pending input with, or NULL if more input is needed
+ */
+const char* CharsetStream::detect(bool finish) {
+    const unsigned char *s;
+    const char *charset;
+    long i;
+
+    if ((*this).srcType != CS_AUTO) {
+        return (*this).srcCharset;
+    }
+    if ((*this).nSrcLen <= 0 || (!finish && (*this).nSrcLen < (*this).detectSize)) {
+        return NULL;
+    }
+
+    s = (const unsigned char *)(*this).pSrcBuf;
+    charset = NULL;
+    if (!(*this).inputStarted && 4 <= (*this).nSrcLen) {
+        if (s[0] == 0xFF && s[1] == 0xFE && (s[2] != 0x00 || s[3] != 0x00)) {
+            charset = STR_UTF16LE;
+        } else if (s[0] == 0xFE && s[1] == 0xFF && (s[2] != 0x00 || s[3] != 0x00)) {
+            charset = STR_UTF16BE;
+        } else if (s[0] == 0xFF && s[1] == 0xFE && s[2] == 0x00 && s[3] == 0x00) {
+            charset = STR_UTF32LE;
+        } else if (s[0] == 0x00 && s[1] == 0x00 && s[2] == 0xFE && s[3] == 0xFF) {
+            charset = STR_UTF32BE;
+        }
+    }
+    if (charset == NULL) {
+        if ((*this).srcHandle == CHARSET_AUTODETECT_JP) {
+            charset = jis_auto_detect((*this).pSrcBuf, (*this).nSrcLen);
+        } else {
+            charset = auto_detect((*this).pSrcBuf, (*this).nSrcLen);
+        }
+    }
+
+    // Plain 7bit text tells nothing; pass it and keep detecting
+    if (!finish && !strcmp(charset, STR_ASCII)) {
+        for (i = 0; i < (*this).nSrcLen; i++) {
+            if (s[i] == 0x00 || s[i] == 0x1B || 0x80 <= s[i]) {
+                break;
+            }
+        }
+        if (i == (*this).nSrcLen) {
+            return STR_ASCII;
+        }
+    }
+
+    strncpy((*this).srcCharset, charset, 31);
+    (*this).srcCharset[31] = '\0';
+    (*this).srcHandle = charsetHandle((*this).srcCharset);
+    (*this).srcType = charset_type((*this).srcCharset, (*this).srcHandle);
+    (*this).srcEndian = (CHARSET_INFO[(*this).srcHandle].endian == 'l')?'l':'b';
+
+    return (*this).srcCharset;
+}
+
+
+/*! Cut the head of pending input which consists of complete characters
+    @param finish        true if no more input follows
+    @param length        Size of the head of pending input to cut from
+    @param chunk_length  Size of returned chunk
+    @return Chunk of input which can be converted independently (NULL if nothing)
+ */
+char* CharsetStream::takeSrcChunk(bool finish, long length, long &chunk_length) {
+    const unsigned char *s;
+    const char *prefix;
+    char *chunk;
+    long i, j, k, run, cut, prefix_len;
+    int mode;
+    bool shifted;
+    unsigned char c, sc;
+
+    chunk_length = 0;
+    if ((*this).nSrcLen < length) {
+        length = (*this).nSrcLen;
+    }
+    if (length <= 0) {
+        return NULL;
+    }
+
+    s = (const unsigned char *)(*this).pSrcBuf;
+    mode = (*this).jisMode;
+    shifted = (*this).utf7Shifted;
+    cut = length;
+
+    switch ((*this).srcType) {
+        case CS_UTF8:
+            cut = utf8_complete_length((*this).pSrcBuf, length);
+            break;
+        case CS_UTF16:
+            cut = length - (length % 2);
+            if (2 <= cut) {
+                c = ((*this).srcEndian == 'l')?s[cut - 1]:s[cut - 2];
+                if (0xD8 <= c && c <= 0xDB) {
+                    cut -= 2;
+                }
+            }
+            break;
+        case CS_UTF32:
+            cut = length - (length % 4);
+            break;
+        case CS_SJIS:
+            i = 0;
+            while (i < length) {
+                if (issjis1(s[i])) {
+                    if (length <= i + 1) break;
+                    i += 2;
+                } else {
+                    i++;
+                }
+            }
+            cut = i;
+            break;
+        case CS_EUCJP:
+            i = 0;
+            while (i < length) {
+                if (s[i] == 0x8F) {
+                    if (length <= i + 2) break;
+                    i += 3;
+                } else if (iseuc(s[i])) {
+                    if (length <= i + 1) break;
+                    i += 2;
+                } else {
+                    i++;
+                }
+            }
+            cut = i;
+            break;
+        case CS_EUCKR:
+        case CS_BIG5:
+            i = 0;
+            while (i < length) {
+                if (0x81 <= s[i] && s[i] <= 0xFE) {
+                    if (length <= i + 1) break;
+                    i += 2;
+                } else {
+                    i++;
+                }
+            }
+            cut = i;
+            break;
+        case CS_GBK:
+            i = 0;
+            while (i < length) {
+                if (0x81 <= s[i] && s[i] <= 0xFE) {
+                    if (length <= i + 1) break;
+                    if (0x30 <= s[i + 1] && s[i + 1] <= 0x39) {
+                        if (length <= i + 3) break;
+                        i += 4;
+                    } else {
+                        i += 2;
+                    }
+                } else {
+                    i++;
+                }
+            }
+            cut = i;
+            break;
+        case CS_JIS:
+            i = 0;
+            cut = 0;
+            while (i < length) {
+                c = s[i];
+                if (c == 0x1B) {
+                    if (length <= i + 2) break;
+                    if (s[i + 1] == '$' && (s[i + 2] == 'B' || s[i + 2] == '@')) {
+                        mode = JIS_KANJI;
+                        i += 3;
+                        cut = i;
+                        continue;
+                    } else if (s[i + 1] == '(' && s[i + 2] == 'I') {
+                        mode = JIS_KANA;
+                        i += 3;
+                        cut = i;
+                        continue;
+                    } else if (s[i + 1] == '(' &&
+                               (s[i + 2] == 'J' || s[i + 2] == 'B' || s[i + 2] == 'H')) {
+                        mode = JIS_ROMAN;
+                        i += 3;
+                        cut = i;
+                        continue;
+                    }
+                    // sequence error is treated as a normal byte
+                } else if (c == 0x0E) {
+                    mode = JIS_KANA;
+                    i++;
+                    cut = i;
+                    continue;
+                } else if (c == 0x0F) {
+                    mode = JIS_ROMAN;
+                    i++;
+                    cut = i;
+                    continue;
+                }
+                if (mode == JIS_KANJI) {
+                    if (length <= i + 1) break;
+                    i += 2;
+                } else {
+                    i++;
+                }
+                cut = i;
+            }
+            break;
+        case CS_UTF7:
+        case CS_UTF7_IMAP:
+            sc = ((*this).srcType == CS_UTF7)?'+':'&';
+            i = 0;
+            run = 0;
+            cut = 0;
+            while (i < length) {
+                if (!shifted) {
+                    if (s[i] == sc) {
+                        if (length <= i + 1) break;
+                        if (s[i + 1] != '-') {
+                            shifted = true;
+                            run = i + 1;
+                        }
+                    }
+                    i++;
+                    cut = i;
+                    continue;
+                }
+                j = i;
+                while (j < length && utf7_base64[s[j]] != 64) {
+                    j++;
+                }
+                if (j < length) {
+                    if (s[j] == '-') j++;
+                    shifted = false;
+                    i = j;
+                    cut = i;
+                    continue;
+                }
+                // BASE64 run continues: cut at a 8 characters (3 UTF-16 units) boundary
+                // which does not split a surrogate pair, and leave at least 1 character
+                k = ((j - run) / 8) * 8;
+                if (run + k == j) k -= 8;
+                while (0 < k && utf7_high_surrogate(s + run + k - 8)) {
+                    k -= 8;
+                }
+                if (0 < k) {
+                    cut = run + k;
+                }
+                break;
+            }
+            break;
+        default:
+            cut = length;
+            break;
+    }
+
+    if (finish) {
+        cut = length;
+        mode = JIS_ROMAN;
+        shifted = false;
+    }
+    if (cut <= 0) {
+        return NULL;
+    }
+
+    prefix = "";
+    if ((*this).srcType == CS_JIS) {
+        if ((*this).jisMode == JIS_KANJI) {
+            prefix = "\x1B$B";
+        } else if ((*this).jisMode == JIS_KANA) {
+            prefix = "\x1B(I";
+        }
+        (*this).jisMode = mode;
+    } else if ((*this).srcType == CS_UTF7 || (*this).srcType == CS_UTF7_IMAP) {
+        if ((*this).utf7Shifted) {
+            prefix = ((*this).srcType == CS_UTF7)?"+":"&";
+        }
+        (*this).utf7Shifted = shifted;
+    }
+    prefix_len = strlen(prefix);
+
+    chunk = new char [prefix_len + cut + 1];
+    memcpy(chunk, prefix, prefix_len);
+    memcpy(chunk + prefix_len, (*this).pSrcBuf, cut);
+    chunk[prefix_len + cut] = '\0';
+    chunk_length = prefix_len + cut;
+
+    buffer_consume((*this).pSrcBuf, &((*this).nSrcLen), cut);
+
+    return chunk;
+}
+
+
+/*! Decode complete characters of pending input to UTF-8
+    @param finish    true if no more input follows
+    @param utf8_out  UTF-8 text is appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::decodeBuffer(bool finish, String &utf8_out) {
+    const char *charset;
+    char *chunk, *buf;
+    long chunk_length, buf_length;
+
+    charset = (*this).detect(finish);
+    if (charset == NULL) {
+        return true;
+    }
+
+    if ((*this).srcType == CS_AUTO) {
+        // 7bit text while detecting
+        utf8_out.addBinary((*this).pSrcBuf, (*this).nSrcLen);
+        buffer_consume((*this).pSrcBuf, &((*this).nSrcLen), (*this).nSrcLen);
+        return true;
+    }
+
+    chunk = (*this).takeSrcChunk(finish, (*this).nSrcLen, chunk_length);
+    if (chunk == NULL) {
+        return true;
+    }
+
+    if ((*this).srcType == CS_UTF16) {
+        if (!(*this).inputStarted && 2 <= chunk_length) {
+            if ((unsigned char)chunk[0] == 0xFF && (unsigned char)chunk[1] == 0xFE) {
+                (*this).srcEndian = 'l';
+            } else if ((unsigned char)chunk[0] == 0xFE && (unsigned char)chunk[1] == 0xFF) {
+                (*this).srcEndian = 'b';
+            }
+        }
+        buf = utf16_to_utf8(chunk, chunk_length, (*this).srcEndian, &buf_length);
+    } else if ((*this).srcType == CS_UTF32) {
+        if (!(*this).inputStarted && 4 <= chunk_length) {
+            if ((unsigned char)chunk[0] == 0xFF && (unsigned char)chunk[1] == 0xFE &&
+                    chunk[2] == 0x00 && chunk[3] == 0x00) {
+                (*this).srcEndian = 'l';
+            } else if (chunk[0] == 0x00 && chunk[1] == 0x00 &&
+                    (unsigned char)chunk[2] == 0xFE && (unsigned char)chunk[3] == 0xFF) {
+                (*this).srcEndian = 'b';
+            }
+        }
+        buf = utf32_to_utf8(chunk, chunk_length, (*this).srcEndian, &buf_length);
+    } else if ((*this).srcHandle != CHARSET_UNKNOWN) {
+        buf = charset_convert(chunk, chunk_length, (*this).srcHandle, CHARSET_UTF8, &buf_length,
+                              (*this).threads);
+    } else {
+        // unregistered name is passed as it is (for iconv)
+        buf = charset_convert(chunk, chunk_length, charset, STR_UTF8, &buf_length);
+    }
+    (*this).inputStarted = true;
+    delete [] chunk;
+
+    if (buf != NULL) {
+        utf8_out.addBinary(buf, buf_length);
+        delete [] buf;
+    }
+
+    return true;
+}
+
+
+/*! Encode complete characters of pending UTF-8 to the output character set
+    @param finish  true if no more input follows
+    @param out     Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::encodeBuffer(bool finish, String &out) {
+    TCharset dest_charset;
+    char *chunk, *buf;
+    long length, buf_length;
+    int dest_type;
+    char en;
+
+    // "" means the same character set as input
+    dest_charset = (*this).destHandle;
+    dest_type = (*this).destType;
+    if (dest_type == CS_NONE) {
+        dest_charset = (*this).srcHandle;
+        dest_type = (*this).srcType;
+        if (dest_type == CS_AUTO) {
+            dest_charset = CHARSET_UTF8;
+            dest_type = CS_UTF8;
+        }
+    }
+
+    if (finish) {
+        length = (*this).nUtf8Len;
+    } else {
+        // stateful output waits for a point where its encoder is reset,
+        // so that the result does not depend on how the text is sliced
+        length = utf8_complete_length((*this).pUtf8Buf, (*this).nUtf8Len);
+        length = encoder_reset_length(dest_type, (*this).pUtf8Buf, length);
+    }
+    if (length <= 0) {
+        return true;
+    }
+
+    chunk = new char [length + 1];
+    memcpy(chunk, (*this).pUtf8Buf, length);
+    chunk[length] = '\0';
+    buffer_consume((*this).pUtf8Buf, &((*this).nUtf8Len), length);
+
+    buf = NULL;
+    if (dest_type == CS_UTF16 || dest_type == CS_UTF32) {
+        en = (*this).destEndian;
+        if ((*this).destBOM && !(*this).outputStarted) {
+            en = (en == 'l')?'L':'B';
+        }
+        if (dest_type == CS_UTF16) {
+            buf = utf8_to_utf16(chunk, length, &buf_length, en);
+        } else {
+            buf = utf8_to_utf32(chunk, length, &buf_length, en);
+        }
+        if (buf != NULL) {
+            out.addBinary(buf, buf_length);
+        }
+    } else {
+        if (dest_type == CS_UTF8) {
+            if ((*this).destBOM && !(*this).outputStarted) {
+                out.addBinary("\xEF\xBB\xBF", 3);
+            }
+            dest_charset = CHARSET_UTF8;
+        }
+        buf = charset_convert(chunk, length, CHARSET_UTF8, dest_charset, &buf_length, (*this).threads);
+        if (buf != NULL) {
+            out.addBinary(buf, buf_length);
+        }
+    }
+    (*this).outputStarted = true;
+
+    if (buf != NULL) {
+        delete [] buf;
+    }
+    delete [] chunk;
+
+    return true;
+}
+
+
+/*! Decode input bytes to UTF-8
+    @param data      Input bytes (any slice of input)
+    @param length    Size of data
+    @param utf8_out  UTF-8 text is appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::decode(const char *data, long length, String &utf8_out) {
+    if (data == NULL || length < 0) {
+        return false;
+    }
+    buffer_append(&((*this).pSrcBuf), &((*this).nSrcLen), &((*this).nSrcCapacity), data, length);
+    return (*this).decodeBuffer(false, utf8_out);
+}
+
+
+/*! Decode all of the pending input to UTF-8
+    @param utf8_out  UTF-8 text is appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::decodeFlush(String &utf8_out) {
+    return (*this).decodeBuffer(true, utf8_out);
+}
+
+
+/*! Encode UTF-8 text to the output character set
+    @param utf8    UTF-8 text (any slice of text)
+    @param length  Size of utf8
+    @param out     Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::encode(const char *utf8, long length, String &out) {
+    if (utf8 == NULL || length < 0) {
+        return false;
+    }
+    buffer_append(&((*this).pUtf8Buf), &((*this).nUtf8Len), &((*this).nUtf8Capacity), utf8, length);
+    return (*this).encodeBuffer(false, out);
+}
+
+
+/*! Encode all of the pending UTF-8 text
+    @param out  Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::encodeFlush(String &out) {
+    return (*this).encodeBuffer(true, out);
+}
+
+
+/*! Convert complete characters of pending input to the output character set
+    @param finish  true if no more input follows
+    @param out     Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::convertBuffer(bool finish, String &out) {
+    const char *charset;
+    TCharset src_charset, dest_charset;
+    char *chunk, *buf;
+    long length, chunk_length, buf_length;
+    bool through_utf8;
+
+    charset = (*this).detect(finish);
+    if (charset == NULL) {
+        return true;
+    }
+
+    // UTF-16/32 are always converted through UTF-8
+    through_utf8 = ((*this).srcType == CS_UTF16 || (*this).srcType == CS_UTF32 ||
+                    (*this).destType == CS_UTF16 || (*this).destType == CS_UTF32);
+#if __ICONV == 1
+    // so is any other pair with iconv: text which iconv cannot encode is then
+    // left as its UTF-8, as String::strconv() from UTF-8 leaves it
+    through_utf8 = (through_utf8 || (*this).srcHandle != (*this).destHandle);
+#endif
+    if (through_utf8) {
+        String utf8;
+        bool ret;
+        utf8.useAsBinary(0);
+        ret = (*this).decodeBuffer(finish, utf8);
+        if (ret && 0 < utf8.binaryLength()) {
+            ret = (*this).encode(utf8.c_str(), utf8.binaryLength(), out);
+        }
+        if (ret && finish) {
+            ret = (*this).encodeFlush(out);
+        }
+        return ret;
+    }
+
+    // stateful output is converted up to a point where its encoder is reset,
+    // so that the result does not depend on how the input is sliced
+    length = (*this).nSrcLen;
+    if (!finish) {
+        length = encoder_reset_length((*this).destType, (*this).pSrcBuf, length);
+    }
+
+    if ((*this).srcType == CS_AUTO) {
+        // 7bit text while detecting
+        if (length <= 0) {
+            return true;
+        }
+        chunk_length = length;
+        chunk = new char [chunk_length + 1];
+        memcpy(chunk, (*this).pSrcBuf, chunk_length);
+        chunk[chunk_length] = '\0';
+        buffer_consume((*this).pSrcBuf, &((*this).nSrcLen), chunk_length);
+    } else {
+        chunk = (*this).takeSrcChunk(finish, length, chunk_length);
+        if (chunk == NULL) {
+            return true;
+        }
+    }
+    (*this).inputStarted = true;
+
+    dest_charset = (*this).destHandle;
+    if ((*this).destType == CS_UTF8) {
+        if ((*this).destBOM && !(*this).outputStarted) {
+            out.addBinary("\xEF\xBB\xBF", 3);
+        }
+        dest_charset = CHARSET_UTF8;
+    }
+    src_charset = ((*this).srcType == CS_AUTO)?CHARSET_ASCII:(*this).srcHandle;
+    if (src_charset != CHARSET_UNKNOWN) {
+        buf = charset_convert(chunk, chunk_length, src_charset, dest_charset, &buf_length, (*this).threads);
+    } else {
+        // unregistered name is passed as it is (for iconv)
+        buf = charset_convert(chunk, chunk_length, charset, charsetName(dest_charset), &buf_length);
+    }
+    (*this).outputStarted = true;
+    delete [] chunk;
+
+    if (buf != NULL) {
+        out.addBinary(buf, buf_length);
+        delete [] buf;
+    }
+
+    return true;
+}
+
+
+/*! Convert input bytes to the output character set
+    @param data    Input bytes (any slice of input)
+    @param length  Size of data
+    @param out     Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::write(const char *data, long length, String &out) {
+    if (data == NULL || length < 0) {
+        return false;
+    }
+
+    // no conversion
+    if ((*this).destType == CS_NONE) {
+        if (0 < length) {
+            out.addBinary(data, length);
+        }
+        return true;
+    }
+
+    buffer_append(&((*this).pSrcBuf), &((*this).nSrcLen), &((*this).nSrcCapacity), data, length);
+
+    return (*this).convertBuffer(false, out);
+}
+
+
+/*! Convert all of the pending input to the output character set
+    @param out  Converted bytes are appended to this
+    @retval true  success
+    @retval false failure
+ */
+bool CharsetStream::flush(String &out) {
+    bool ret;
+
+    if ((*this).destType == CS_NONE) {
+        return true;
+    }
+
+    ret = (*this).convertBuffer(true, out);
+    if (ret) {
+        ret = (*this).encodeFlush(out);
+    }
+
+    return ret;
+}
+
+
+} // namespace apolloron
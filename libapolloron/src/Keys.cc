@@ -5,27 +5,243 @@
  ******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include "apolloron.h"
 
 namespace apolloron {
 
-// change 1 byte value to 6bit vale (0-63)
-#define b64(a) (((unsigned char)(a) & 0xfc) >> 2)
+#define KEYS_SLOT_MIN      16      // first size of hash table
+#define KEYS_NODE_MAX      64      // largest number of entries of a tree node
+#define KEYS_NODE_MIN      16      // a tree node with fewer entries joins its sibling
+#define KEYS_DEPTH_MAX     32      // deepest tree
+#define KEYS_POOL_MIN      256     // first size of key string chunk
+#define KEYS_POOL_MAX      65536   // largest size of key string chunk
+
+// Chunk of key strings (key strings follow the header)
+typedef struct KeyPoolChunk {
+    struct KeyPoolChunk *prev;
+    long size;
+} KeyPoolChunk;
+
+// Node of B+ tree of elements (a leaf, or the head of a KeyBranch)
+typedef struct KeyNode {
+    long n; // number of entries
+    bool leaf;
+    Element *element[KEYS_NODE_MAX + 1]; // leaf: elements, branch: first element under each child
+} KeyNode;
+
+// Branch node of B+ tree of elements
+typedef struct {
+    KeyNode node;
+    KeyNode *child[KEYS_NODE_MAX + 1];
+    long count[KEYS_NODE_MAX + 1]; // number of elements under children 0 to i
+} KeyBranch;
+
+
+/*! FNV-1a hash of a key
+    @param key     key string
+    @param maxLen  length limit of key (-1: up to NUL)
+    @param keyLen  length of key (output)
+    @return hash value
+ */
+static inline unsigned long keys_hash(const char *key, long maxLen, long *keyLen) {
+    unsigned long hash = 2166136261UL;
+    long i;
+
+    for (i = 0; (maxLen < 0 || i < maxLen) && key[i] != '\0'; i++) {
+        hash = ((hash ^ (unsigned char)key[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    *keyLen = i;
+
+    return hash;
+}
+
+
+/*! Store an element in a hash table (linear probing)
+    @param slots     hash table
+    @param capacity  size of slots (power of 2)
+    @param hash      hash of key
+    @param element   element of key
+    @return void
+ */
+static inline void keys_slot_insert(KeySlot *slots, long capacity, unsigned long hash, Element *element) {
+    long i;
+
+    i = (long)(hash & (unsigned long)(capacity - 1));
+    while (slots[i].element != NULL) {
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i].hash = hash;
+    slots[i].element = element;
+}
+
+
+/*! Allocate a tree node
+    @param leaf  true: leaf, false: branch
+    @return tree node
+ */
+static inline KeyNode *keys_node_new(bool leaf) {
+    KeyNode *node;
+
+    node = leaf?new KeyNode:(KeyNode *)new KeyBranch;
+    node->n = 0;
+    node->leaf = leaf;
+
+    return node;
+}
+
+
+/*! Free a tree node (not the nodes and elements under it)
+    @param node  tree node
+    @return void
+ */
+static inline void keys_node_delete(KeyNode *node) {
+    if (node->leaf) {
+        delete node;
+    } else {
+        delete (KeyBranch *)node;
+    }
+}
+
+
+/*! Free a tree with its elements
+    @param node  root of tree
+    @return void
+ */
+static void keys_tree_delete(KeyNode *node) {
+    long i;
+
+    for (i = 0; i < node->n; i++) {
+        if (node->leaf) {
+            delete node->element[i]->value;
+            delete node->element[i];
+        } else {
+            keys_tree_delete(((KeyBranch *)node)->child[i]);
+        }
+    }
+    keys_node_delete(node);
+}
+
+
+/*! Number of elements under a tree node
+    @param node  tree node
+    @return number of elements
+ */
+static inline long keys_node_count(const KeyNode *node) {
+    if (node->leaf) {
+        return node->n;
+    }
+
+    return (0 < node->n)?((const KeyBranch *)node)->count[node->n - 1]:0;
+}
+
+
+/*! Count the elements under each child of a branch again
+    @param node  branch node
+    @return void
+ */
+static inline void keys_node_recount(KeyNode *node) {
+    KeyBranch *branch = (KeyBranch *)node;
+    long count, i;
+
+    count = 0;
+    for (i = 0; i < node->n; i++) {
+        count += keys_node_count(branch->child[i]);
+        branch->count[i] = count;
+    }
+}
+
+
+/*! Move entries of tree nodes (children of branches too, not counts)
+    @param to       destination node
+    @param toPos    index of destination entry
+    @param from     source node (may be the same as to)
+    @param fromPos  index of source entry
+    @param num      number of entries
+    @return void
+ */
+static inline void keys_node_move(KeyNode *to, long toPos, KeyNode *from, long fromPos, long num) {
+    if (num <= 0) {
+        return;
+    }
+    memmove(&to->element[toPos], &from->element[fromPos], sizeof(Element*) * num);
+    if (!from->leaf) {
+        memmove(&((KeyBranch *)to)->child[toPos], &((KeyBranch *)from)->child[fromPos],
+                sizeof(KeyNode*) * num);
+    }
+}
+
+
+/*! Find the entry of a tree node for a key
+    @param node  tree node
+    @param key   key string
+    @return leaf: first entry whose key is not less than key,
+            branch: last child whose first key is not greater than key (0 at least)
+ */
+static inline long keys_node_find(const KeyNode *node, const char *key) {
+    long low, high, mid;
+
+    if (node->leaf) {
+        low = 0;
+        high = node->n;
+        while (low < high) {
+            mid = low + (high - low) / 2;
+            if (strcmp(node->element[mid]->key, key) < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    low = 1;
+    high = node->n;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (strcmp(node->element[mid]->key, key) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low - 1;
+}
+
+
+/*! Replace the first element of the ancestors whose first element was old
+    @param path     ancestors from the root
+    @param pos      index of child in each ancestor
+    @param depth    number of ancestors
+    @param old      replaced element
+    @param element  new first element
+    @return void
+ */
+static inline void keys_path_first(KeyNode **path, const long *pos, int depth, const Element *old, Element *element) {
+    int d;
+
+    for (d = depth - 1; 0 <= d && path[d]->element[pos[d]] == old; d--) {
+        path[d]->element[pos[d]] = element;
+    }
+}
+
 
 /*! Constructor of Keys.
     @param void
     @return void
  */
 Keys::Keys() {
-    int i;
-
-    (*this).pElement = new Element ** [64];
-    for (i = 0; i < 64; i++) {
-        (*this).nElementTotal[i] = 0;
-        (*this).pElement[i] = (Element **)NULL;
-    }
+    (*this).nElementTotal = 0;
+    (*this).pRoot = (KeyNode *)NULL;
+    (*this).nSlotCapacity = 0;
+    (*this).pSlot = (KeySlot *)NULL;
+    (*this).pKeyPool = (char *)NULL;
+    (*this).nKeyPoolLeft = 0;
+    (*this).nKeyPoolUsed = 0;
+    (*this).nKeyPoolDead = 0;
 
     (*this).tmpString = (String *)NULL;
     (*this).emptyString = new String;
@@ -38,13 +254,14 @@ Keys::Keys() {
     @return void
  */
 Keys::Keys(const Keys &keys) {
-    int i;
-
-    (*this).pElement = new Element ** [64];
-    for (i = 0; i < 64; i++) {
-        (*this).nElementTotal[i] = 0;
-        (*this).pElement[i] = (Element **)NULL;
-    }
+    (*this).nElementTotal = 0;
+    (*this).pRoot = (KeyNode *)NULL;
+    (*this).nSlotCapacity = 0;
+    (*this).pSlot = (KeySlot *)NULL;
+    (*this).pKeyPool = (char *)NULL;
+    (*this).nKeyPoolLeft = 0;
+    (*this).nKeyPoolUsed = 0;
+    (*this).nKeyPoolDead = 0;
 
     (*this).tmpString = (String *)NULL;
     (*this).emptyString = new String;
@@ -59,35 +276,7 @@ Keys::Keys(const Keys &keys) {
     @return void
  */
 Keys::~Keys() {
-    int i;
-    long l;
-
-    if ((*this).pElement != NULL) {
-        for (i = 0; i < 64; i++) {
-            if ((*this).pElement[i] != NULL) {
-                l = 0;
-                while (l < (*this).nElementTotal[i]) {
-                    if ((*this).pElement[i][l] != NULL) {
-                        if ((*this).pElement[i][l]->key != NULL) {
-                            delete [] (*this).pElement[i][l]->key;
-                        }
-                        delete (*this).pElement[i][l]->value;
-                        delete [] (*this).pElement[i][l];
-                    }
-                    l++;
-                }
-                delete [] (*this).pElement[i];
-                (*this).nElementTotal[i] = 0;
-            }
-        }
-        delete [] (*this).pElement;
-        (*this).pElement = NULL;
-    }
-
-    if ((*this).tmpString != (String *)NULL) {
-        delete (*this).tmpString;
-        (*this).tmpString = (String *)NULL;
-    }
+    (*this).clear();
 
     if ((*this).emptyString != (String *)NULL) {
         delete (*this).emptyString;
@@ -101,35 +290,28 @@ Keys::~Keys() {
     @retval false  failure
  */
 bool Keys::clear() {
-    int i;
-    long l;
-
-    if ((*this).pElement != NULL && *((*this).pElement) != NULL) {
-        for (i = 0; i < 64; i++) {
-            l = 0;
-            while (l < (*this).nElementTotal[i]) {
-                if ((*this).pElement[i][l] != NULL) {
-                    if ((*this).pElement[i][l]->key != NULL) {
-                        delete [] (*this).pElement[i][l]->key;
-                    }
-                    delete (*this).pElement[i][l]->value;
-                    delete [] (*this).pElement[i][l];
-                }
-                l++;
-            }
-            delete *((*this).pElement[i]);
-            (*this).nElementTotal[i] = 0;
-        }
-        delete [] *((*this).pElement);
-        (*this).pElement = NULL;
+    KeyPoolChunk *chunk;
+
+    if ((*this).pRoot != NULL) {
+        keys_tree_delete((*this).pRoot);
+        (*this).pRoot = (KeyNode *)NULL;
     }
+    (*this).nElementTotal = 0;
 
-    (*this).pElement = new Element ** [64];
-    for (i = 0; i < 64; i++) {
-        (*this).nElementTotal[i] = 0;
-        (*this).pElement[i] = (Element **)NULL;
-        (*this).nElementCapacity[i] = 0;
+    if ((*this).pSlot != NULL) {
+        delete [] (*this).pSlot;
+        (*this).pSlot = (KeySlot *)NULL;
     }
+    (*this).nSlotCapacity = 0;
+
+    while ((*this).pKeyPool != NULL) {
+        chunk = (KeyPoolChunk *)(*this).pKeyPool;
+        (*this).pKeyPool = (char *)chunk->prev;
+        delete [] (char *)chunk;
+    }
+    (*this).nKeyPoolLeft = 0;
+    (*this).nKeyPoolUsed = 0;
+    (*this).nKeyPoolDead = 0;
 
     if ((*this).tmpString != (String *)NULL) {
         delete (*this).tmpString;
@@ -140,6 +322,163 @@ bool Keys::clear() {
 }
 
 
+/*! Find the slot of a key.
+    @param key     key of object
+    @param keyLen  length of key
+    @param hash    hash of key
+    @return index of pSlot, -1 if not found
+ */
+long Keys::findSlot(const char *key, long keyLen, unsigned long hash) const {
+    const char *p;
+    long i;
+
+    if ((*this).nSlotCapacity <= 0) {
+        return -1;
+    }
+
+    i = (long)(hash & (unsigned long)((*this).nSlotCapacity - 1));
+    while ((*this).pSlot[i].element != NULL) {
+        if ((*this).pSlot[i].hash == hash) {
+            p = (*this).pSlot[i].element->key;
+            if (strncmp(p, key, keyLen) == 0 && p[keyLen] == '\0') {
+                return i;
+            }
+        }
+        i = (i + 1) & ((*this).nSlotCapacity - 1);
+    }
+
+    return -1;
+}
+
+
+/*! Add an element to the hash table (grows the table if needed).
+    @param hash     hash of key
+    @param element  element of key
+    @return void
+ */
+void Keys::addSlot(unsigned long hash, Element *element) {
+    KeySlot *slots;
+    long capacity, i;
+
+    // keep the table at most half full
+    if ((*this).nSlotCapacity < ((*this).nElementTotal + 1) * 2) {
+        capacity = ((*this).nSlotCapacity <= 0)?KEYS_SLOT_MIN:(*this).nSlotCapacity * 2;
+        while (capacity < ((*this).nElementTotal + 1) * 2) {
+            capacity *= 2;
+        }
+        slots = new KeySlot [capacity];
+        for (i = 0; i < capacity; i++) {
+            slots[i].element = (Element *)NULL;
+        }
+        for (i = 0; i < (*this).nSlotCapacity; i++) {
+            if ((*this).pSlot[i].element != NULL) {
+                keys_slot_insert(slots, capacity, (*this).pSlot[i].hash, (*this).pSlot[i].element);
+            }
+        }
+        if ((*this).pSlot != NULL) {
+            delete [] (*this).pSlot;
+        }
+        (*this).pSlot = slots;
+        (*this).nSlotCapacity = capacity;
+    }
+
+    keys_slot_insert((*this).pSlot, (*this).nSlotCapacity, hash, element);
+}
+
+
+/*! Remove a slot from the hash table (later slots of the cluster move back).
+    @param slot  index of pSlot
+    @return void
+ */
+void Keys::removeSlot(long slot) {
+    long mask = (*this).nSlotCapacity - 1;
+    long i, j, k;
+
+    i = slot;
+    (*this).pSlot[i].element = (Element *)NULL;
+    j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if ((*this).pSlot[j].element == NULL) {
+            break;
+        }
+        k = (long)((*this).pSlot[j].hash & (unsigned long)mask);
+        // the slot stays if its home is cyclically in (i, j]
+        if ((i <= j)?(i < k && k <= j):(i < k || k <= j)) {
+            continue;
+        }
+        (*this).pSlot[i] = (*this).pSlot[j];
+        (*this).pSlot[j].element = (Element *)NULL;
+        i = j;
+    }
+}
+
+
+/*! Copy a key string into the chunks of key strings.
+    @param key     key string
+    @param keyLen  length of key
+    @return copied key string
+ */
+char *Keys::poolKey(const char *key, long keyLen) {
+    KeyPoolChunk *chunk;
+    long size;
+    char *p;
+
+    if ((*this).nKeyPoolLeft < keyLen + 1) {
+        chunk = (KeyPoolChunk *)(*this).pKeyPool;
+        size = (chunk == NULL)?KEYS_POOL_MIN:chunk->size * 2;
+        if (KEYS_POOL_MAX < size) {
+            size = KEYS_POOL_MAX;
+        }
+        if (size < (long)sizeof(KeyPoolChunk) + keyLen + 1) {
+            size = (long)sizeof(KeyPoolChunk) + keyLen + 1;
+        }
+        chunk = (KeyPoolChunk *)new char [size];
+        chunk->prev = (KeyPoolChunk *)(*this).pKeyPool;
+        chunk->size = size;
+        (*this).pKeyPool = (char *)chunk;
+        (*this).nKeyPoolLeft = size - (long)sizeof(KeyPoolChunk);
+    }
+
+    chunk = (KeyPoolChunk *)(*this).pKeyPool;
+    p = (*this).pKeyPool + chunk->size - (*this).nKeyPoolLeft;
+    memcpy(p, key, keyLen);
+    p[keyLen] = '\0';
+    (*this).nKeyPoolLeft -= keyLen + 1;
+    (*this).nKeyPoolUsed += keyLen + 1;
+
+    return p;
+}
+
+
+/*! Copy the key strings of elements into new chunks to drop deleted ones.
+    @param void
+    @return void
+ */
+void Keys::compactKeyPool() {
+    KeyPoolChunk *chunk;
+    char *old;
+    long i;
+
+    old = (*this).pKeyPool;
+    (*this).pKeyPool = (char *)NULL;
+    (*this).nKeyPoolLeft = 0;
+    (*this).nKeyPoolUsed = 0;
+    (*this).nKeyPoolDead = 0;
+
+    for (i = 0; i < (*this).nElementTotal; i++) {
+        Element *element = (*this).array(i);
+        element->key = (*this).poolKey(element->key, strlen(element->key));
+    }
+
+    while (old != NULL) {
+        chunk = (KeyPoolChunk *)old;
+        old = (char *)chunk->prev;
+        delete [] (char *)chunk;
+    }
+}
+
+
 /*! Get an element that have match key.
     @param key  key of object
     @return String object
@@ -197,45 +536,21 @@ String& Keys::getValue(const String &key) const {
     @param key  key of object
     @return Keys object
  */
- String& Keys::getValue(const char *key) const {
-    if (key == NULL) {
-        if ((*this).emptyString->c_str()[0] != '\0') {
-            *(*this).emptyString = "";
-        }
-        return *(*this).emptyString;
-    }
-
-    int start = b64(key[0]);
-    if ((*this).nElementTotal[start] <= 0 || !(*this).pElement[start]) {
-        if ((*this).emptyString->c_str()[0] != '\0') {
-            *(*this).emptyString = "";
-        }
-        return *(*this).emptyString;
-    }
-
-    // Binary search to find target element
-    long left = 0;
-    long right = (*this).nElementTotal[start];
-    
-    while (left < right) {
-        long mid = (left + right) / 2;
-        if (!(*this).pElement[start][mid] || !(*this).pElement[start][mid]->key) {
-            break;
-        }
-        int cmp = strcmp(key, (*this).pElement[start][mid]->key);
-        if (cmp == 0) {
-            return *((*this).pElement[start][mid]->value);
-        }
-        if (cmp < 0) {
-            right = mid;
-        } else {
-            left = mid + 1;
+String& Keys::getValue(const char *key) const {
+    unsigned long hash;
+    long keyLen, slot;
+
+    if (key != NULL) {
+        hash = keys_hash(key, -1, &keyLen);
+        slot = (*this).findSlot(key, keyLen, hash);
+        if (0 <= slot) {
+            return *((*this).pSlot[slot].element->value);
         }
     }
 
     // Key not found
     if ((*this).emptyString->c_str()[0] != '\0') {
-        (*this).emptyString->operator=("");
+        *(*this).emptyString = "";
     }
     return *(*this).emptyString;
 }
@@ -254,48 +569,21 @@ const char* Keys::read(const String &key) const {
     @param key  key of object
     @return Keys object
  */
- const char* Keys::read(const char *key) const {
-    if (key == NULL) {
-        return NULL;
-    }
-
-    int start = b64(key[0]);
+const char* Keys::read(const char *key) const {
+    unsigned long hash;
+    long keyLen, slot;
 
-    if (!(*this).pElement[start]) {
+    if (key == NULL) {
         return NULL;
     }
 
-    long left = 0;
-    long right = (*this).nElementTotal[start];
-
-    if (right <= 0) {
+    hash = keys_hash(key, -1, &keyLen);
+    slot = (*this).findSlot(key, keyLen, hash);
+    if (slot < 0 || (*this).pSlot[slot].element->value == (const String *)NULL) {
         return NULL;
     }
 
-    while (left < right) {
-        long mid = (left + right) / 2;
-        if (!(*this).pElement[start][mid]) {
-            return NULL;
-        }
-        if (!(*this).pElement[start][mid]->key) {
-            return NULL;
-        }
-        int cmp = strcmp(key, (*this).pElement[start][mid]->key);
-        if (cmp == 0) {
-            if ((*this).pElement[start][mid]->value == (const String *)NULL) {
-                return NULL;
-            }
-            const char* value = (*((*this).pElement[start][mid]->value)).c_str();
-            return value;
-        }
-        if (cmp < 0) {
-            right = mid;
-        } else {
-            left = mid + 1;
-        }
-    }
-
-    return NULL;
+    return (*this).pSlot[slot].element->value->c_str();
 }
 
 
@@ -315,29 +603,16 @@ bool Keys::isKeyExist(const String &key) const {
     @retval false key not exist
  */
 bool Keys::isKeyExist(const char *key) const {
-    int start = b64(key[0]);
-    if (!(*this).pElement[start]) return false;
+    unsigned long hash;
+    long keyLen;
 
-    long left = 0;
-    long right = (*this).nElementTotal[start];
-
-    while (left < right) {
-        long mid = (left + right) / 2;
-        if (!(*this).pElement[start][mid] || !(*this).pElement[start][mid]->key) {
-            return false;
-        }
-        int cmp = strcmp(key, (*this).pElement[start][mid]->key);
-        if (cmp == 0) {
-            return true;
-        }
-        if (cmp < 0) {
-            right = mid;
-        } else {
-            left = mid + 1;
-        }
+    if (key == NULL) {
+        return false;
     }
 
-    return false;
+    hash = keys_hash(key, -1, &keyLen);
+
+    return (0 <= (*this).findSlot(key, keyLen, hash));
 }
 
 
@@ -346,16 +621,7 @@ bool Keys::isKeyExist(const char *key) const {
     @return number of keys
  */
 long Keys::max() const {
-    int i;
-    long total;
-
-    total = 0;
-
-    for (i = 0; i < 64; i++) {
-        total += (*this).nElementTotal[i];
-    }
-
-    return total;
+    return (*this).nElementTotal;
 }
 
 
@@ -378,6 +644,10 @@ const char *Keys::key(long index) const {
 bool Keys::set(const Keys & keys) {
     long i;
 
+    if (&keys == this) {
+        return true;
+    }
+
     (*this).clear();
 
     i = 0;
@@ -412,39 +682,37 @@ String& Keys::value(long index) const {
 }
 
 
-/*! Get element of array
+/*! Get element of array (in order of key)
     @param index index of Keys
     @return Element object
  */
 Element* Keys::array(long index) const {
-    Element *element;
+    const KeyNode *node;
+    const KeyBranch *branch;
+    const long *count;
+    long len, half, i;
 
-    element = (Element *)NULL;
-
-    if (0 <= index) {
-        int i;
-        int start;
-        long total;
+    if (index < 0 || (*this).nElementTotal <= index) {
+        return (Element *)NULL;
+    }
 
-        start = -1;
-        total = 0;
-        for (i = 0; i < 64; i++) {
-            total += (*this).nElementTotal[i];
-            if (index < total) {
-                start = i;
-                break;
-            }
+    // go down to the first child whose count is over index
+    node = (*this).pRoot;
+    while (!node->leaf) {
+        branch = (const KeyBranch *)node;
+        count = branch->count;
+        for (len = node->n; 1 < len; len -= half) {
+            half = len / 2;
+            count += (count[half - 1] <= index)?half:0;
         }
-
-        if (0 <= start) {
-            long internal_index = index - (total - (*this).nElementTotal[start]);
-            if (0 <= internal_index && internal_index <= (*this).nElementTotal[start]) {
-                element = (*this).pElement[start][internal_index];
-            }
+        i = count - branch->count;
+        if (0 < i) {
+            index -= branch->count[i - 1];
         }
+        node = branch->child[i];
     }
 
-    return element;
+    return node->element[index];
 }
 
 
@@ -505,98 +773,98 @@ bool Keys::addKey(const char *key, const char *value) {
     @retval true  success
     @retval false failure
  */
- bool Keys::addKey(const char *key, const char *value, long keyLen) {
+bool Keys::addKey(const char *key, const char *value, long keyLen) {
+    KeyNode *path[KEYS_DEPTH_MAX];
+    long pos[KEYS_DEPTH_MAX];
+    KeyNode *node, *sibling, *root;
+    KeyBranch *branch;
+    Element *element;
+    unsigned long hash;
+    long slot, i, j, half;
+    int depth;
+
     if (key == NULL || value == NULL) return false;
 
-    int start = b64(key[0]);
-
-    // Create new array if needed
-    if ((*this).nElementTotal[start] == 0) {
-        // Start with capacity of 128 elements
-        (*this).pElement[start] = new Element*[128];
-        (*this).nElementCapacity[start] = 128;
-        (*this).pElement[start][0] = new Element;
-        (*this).pElement[start][0]->key = new char[keyLen + 1];
-        strncpy((*this).pElement[start][0]->key, key, keyLen);
-        (*this).pElement[start][0]->key[keyLen] = '\0';
-        (*this).pElement[start][0]->value = new String;
-        *((*this).pElement[start][0]->value) = value;
-        (*this).nElementTotal[start] = 1;
+    hash = keys_hash(key, keyLen, &keyLen);
+    slot = (*this).findSlot(key, keyLen, hash);
+    if (0 <= slot) {
+        // Overwrite existing value
+        *((*this).pSlot[slot].element->value) = value;
         return true;
     }
 
-    if (!(*this).pElement[start]) return false;
-
-    // Find insertion point using binary search on sorted array
-    long left = 0;
-    long right = (*this).nElementTotal[start];
-    long insert_pos = 0;
+    element = new Element;
+    element->key = (*this).poolKey(key, keyLen);
+    element->value = new String;
+    *(element->value) = value;
 
-    while (left < right) {
-        long mid = (left + right) / 2;
-        if (!(*this).pElement[start][mid] || !(*this).pElement[start][mid]->key) {
-            break;
-        }
-        int cmp = strcmp(key, (*this).pElement[start][mid]->key);
-        if (cmp == 0) {
-            // Overwrite existing value
-            *((*this).pElement[start][mid]->value) = value;
-            return true;
+    // go down to the leaf of the key
+    if ((*this).pRoot == NULL) {
+        (*this).pRoot = keys_node_new(true);
+    }
+    node = (*this).pRoot;
+    depth = 0;
+    while (!node->leaf) {
+        branch = (KeyBranch *)node;
+        i = keys_node_find(node, element->key);
+        if (i == 0 && strcmp(element->key, node->element[0]->key) < 0) {
+            node->element[0] = element;
         }
-        if (cmp < 0) {
-            right = mid;
-        } else {
-            left = mid + 1;
+        for (j = i; j < node->n; j++) {
+            branch->count[j]++;
         }
+        path[depth] = node;
+        pos[depth] = i;
+        depth++;
+        node = branch->child[i];
     }
-    insert_pos = left;
-
-    // create new array with increased capacity if needed
-    if ((*this).nElementCapacity[start] <= (*this).nElementTotal[start]) {
-        // increase capacity by 128 elements
-        long new_capacity = (*this).nElementCapacity[start] + 128;
-        Element** new_array = new Element*[new_capacity];
-
-        // initialize all elements to NULL
-        //for (long i = 0; i < new_capacity; i++) {
-        //    new_array[i] = NULL;
-        //}
-
-        // copy existing elements
-        //for (long i = 0; i < (*this).nElementTotal[start]; i++) {
-        //    new_array[i] = (*this).pElement[start][i];
-        //}
-        memcpy(new_array, (*this).pElement[start], sizeof(Element*) * (*this).nElementTotal[start]);
-
-        // store old array temporarily
-        Element** old_array = (*this).pElement[start];
-        (*this).pElement[start] = new_array;
-        (*this).nElementCapacity[start] = new_capacity;
-
-        // delete old array
-        if (old_array != NULL) {
-            delete[] old_array;
+
+    i = keys_node_find(node, element->key);
+    keys_node_move(node, i + 1, node, i, node->n - i);
+    node->element[i] = element;
+    node->n++;
+
+    // split full nodes from the leaf up
+    while (KEYS_NODE_MAX < node->n) {
+        half = node->n / 2;
+        sibling = keys_node_new(node->leaf);
+        keys_node_move(sibling, 0, node, half, node->n - half);
+        sibling->n = node->n - half;
+        node->n = half;
+        if (!node->leaf) {
+            keys_node_recount(node);
+            keys_node_recount(sibling);
         }
+
+        if (depth == 0) {
+            root = keys_node_new(false);
+            branch = (KeyBranch *)root;
+            root->element[0] = node->element[0];
+            root->element[1] = sibling->element[0];
+            branch->child[0] = node;
+            branch->child[1] = sibling;
+            root->n = 2;
+            keys_node_recount(root);
+            (*this).pRoot = root;
+            break;
+        }
+
+        depth--;
+        i = pos[depth];
+        node = path[depth];
+        branch = (KeyBranch *)node;
+        keys_node_move(node, i + 2, node, i + 1, node->n - i - 1);
+        memmove(&branch->count[i + 2], &branch->count[i + 1], sizeof(long) * (node->n - i - 1));
+        node->element[i + 1] = sibling->element[0];
+        branch->child[i + 1] = sibling;
+        branch->count[i + 1] = branch->count[i];
+        branch->count[i] -= keys_node_count(sibling);
+        node->n++;
     }
 
-    // shift elements to make space for new element using memmove
-    //for (long i = (*this).nElementTotal[start]; i > insert_pos; i--) {
-    //    (*this).pElement[start][i] = (*this).pElement[start][i - 1];
-    //}
-    if (insert_pos < (*this).nElementTotal[start]) {
-        memmove(&(*this).pElement[start][insert_pos + 1],
-                &(*this).pElement[start][insert_pos],
-                sizeof(Element*) * ((*this).nElementTotal[start] - insert_pos));
-    }
-
-    // insert new element
-    (*this).pElement[start][insert_pos] = new Element;
-    (*this).pElement[start][insert_pos]->key = new char[keyLen + 1];
-    strncpy((*this).pElement[start][insert_pos]->key, key, keyLen);
-    (*this).pElement[start][insert_pos]->key[keyLen] = '\0';
-    (*this).pElement[start][insert_pos]->value = new String;
-    *((*this).pElement[start][insert_pos]->value) = value;
-    (*this).nElementTotal[start]++;
+    (*this).addSlot(hash, element);
+    (*this).nElementTotal++;
+
     return true;
 }
 
@@ -614,55 +882,110 @@ bool Keys::delKey(const String &key) {
     @retval true  success
     @retval false failure
  */
- bool Keys::delKey(const char *key) {
-    if (key == NULL) return false;
+bool Keys::delKey(const char *key) {
+    KeyNode *path[KEYS_DEPTH_MAX];
+    long pos[KEYS_DEPTH_MAX];
+    KeyNode *node, *left, *right, *root;
+    KeyBranch *branch;
+    Element *element;
+    unsigned long hash;
+    long keyLen, slot, i, j, half;
+    int depth;
 
-    int start = b64(key[0]);
+    if (key == NULL) return false;
 
-    if (!(*this).pElement[start]) return false;
+    hash = keys_hash(key, -1, &keyLen);
+    slot = (*this).findSlot(key, keyLen, hash);
+    if (slot < 0) return false;
+
+    element = (*this).pSlot[slot].element;
+    (*this).removeSlot(slot);
+
+    // go down to the leaf of the key
+    node = (*this).pRoot;
+    depth = 0;
+    while (!node->leaf) {
+        branch = (KeyBranch *)node;
+        i = keys_node_find(node, element->key);
+        for (j = i; j < node->n; j++) {
+            branch->count[j]--;
+        }
+        path[depth] = node;
+        pos[depth] = i;
+        depth++;
+        node = branch->child[i];
+    }
 
-    // Find deletion position using binary search
-    long left = 0;
-    long right = (*this).nElementTotal[start];
-    long deletePos = -1;
+    i = keys_node_find(node, element->key);
+    keys_node_move(node, i, node, i + 1, node->n - i - 1);
+    node->n--;
+    if (i == 0 && 0 < node->n) {
+        keys_path_first(path, pos, depth, element, node->element[0]);
+    }
 
-    while (left < right) {
-        long mid = (left + right) / 2;
-        if (!(*this).pElement[start][mid] || !(*this).pElement[start][mid]->key) {
+    // join or even out small nodes with their siblings from the leaf up
+    while (0 < depth && node->n < KEYS_NODE_MIN) {
+        depth--;
+        node = path[depth];
+        branch = (KeyBranch *)node;
+        if (node->n < 2) {
             break;
         }
-        int cmp = strcmp(key, (*this).pElement[start][mid]->key);
-        if (cmp == 0) {
-            deletePos = mid;
-            break;
-        }
-        if (cmp < 0) {
-            right = mid;
+        i = (0 < pos[depth])?pos[depth] - 1:0;
+        left = branch->child[i];
+        right = branch->child[i + 1];
+        if (left->n + right->n <= KEYS_NODE_MAX) {
+            keys_node_move(left, left->n, right, 0, right->n);
+            left->n += right->n;
+            keys_node_delete(right);
+            keys_node_move(node, i + 1, node, i + 2, node->n - i - 2);
+            memmove(&branch->count[i], &branch->count[i + 1], sizeof(long) * (node->n - i - 1));
+            node->n--;
+            if (!left->leaf) {
+                keys_node_recount(left);
+            }
         } else {
-            left = mid + 1;
+            half = (left->n + right->n) / 2;
+            if (left->n < half) {
+                keys_node_move(left, left->n, right, 0, half - left->n);
+                keys_node_move(right, 0, right, half - left->n, right->n - (half - left->n));
+                right->n -= half - left->n;
+                left->n = half;
+            } else {
+                keys_node_move(right, left->n - half, right, 0, right->n);
+                keys_node_move(right, 0, left, half, left->n - half);
+                right->n += left->n - half;
+                left->n = half;
+            }
+            node->element[i + 1] = right->element[0];
+            if (!left->leaf) {
+                keys_node_recount(left);
+                keys_node_recount(right);
+            }
+            branch->count[i] = branch->count[i + 1] - keys_node_count(right);
+        }
+        if (node->element[i] != left->element[0]) {
+            node->element[i] = left->element[0];
+            keys_path_first(path, pos, depth, element, left->element[0]);
         }
     }
 
-    if (deletePos == -1) return false;
-
-    // delete element
-    if ((*this).pElement[start][deletePos]->key != NULL) {
-        delete [] (*this).pElement[start][deletePos]->key;
+    // drop roots with a single child
+    while (!(*this).pRoot->leaf && (*this).pRoot->n == 1) {
+        root = (*this).pRoot;
+        (*this).pRoot = ((KeyBranch *)root)->child[0];
+        keys_node_delete(root);
     }
-    delete (*this).pElement[start][deletePos]->value;
-    delete [] (*this).pElement[start][deletePos];
 
-    // Shift elements to fill gap using memcpy
-    //for (long i = deletePos; i < (*this).nElementTotal[start] - 1; i++) {
-    //    (*this).pElement[start][i] = (*this).pElement[start][i + 1];
-    //}
-    if (deletePos < (*this).nElementTotal[start] - 1) {
-        memcpy(&(*this).pElement[start][deletePos],
-               &(*this).pElement[start][deletePos + 1],
-               sizeof(Element*) * ((*this).nElementTotal[start] - deletePos - 1));
+    // the key string stays in the chunks until most of them are deleted ones
+    (*this).nKeyPoolDead += keyLen + 1;
+    delete element->value;
+    delete element;
+    (*this).nElementTotal--;
+    if (KEYS_POOL_MIN < (*this).nKeyPoolDead && (*this).nKeyPoolUsed < (*this).nKeyPoolDead * 2) {
+        (*this).compactKeyPool();
     }
 
-    (*this).nElementTotal[start]--;
     return true;
 }
 
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "apolloron.h"
 
@@ -154,193 +156,698 @@ loop:
 }
 
 
-/* compare function for sort() */
-static int _sheet_cmp_asc(const void *ppkeys1, const void *ppkeys2, const char *key) {
-    apolloron::Keys *pkeys1, *pkeys2;
-    const char *value1, *value2;
-    int cmp_result;
+// Key of a row to sort
+typedef struct {
+    const char *value;
+    long num; // atol() of value (sortnum(), sortnumr())
+    long row;
+} TSheetSortKey;
+
+
+/* compare a key of rows by order ('s': string, 'S': string reverse,
+   'n': number, 'N': number reverse) */
+static int _sheet_cmp_key(const TSheetSortKey *pkey1, const TSheetSortKey *pkey2, char order) {
+    switch (order) {
+        case 'S':
+            return (-(strcmp(pkey1->value, pkey2->value)));
+        case 'n':
+            return (pkey2->num < pkey1->num)?1:((pkey1->num < pkey2->num)?-1:0);
+        case 'N':
+            return (pkey1->num < pkey2->num)?1:((pkey2->num < pkey1->num)?-1:0);
+        default:
+            return strcmp(pkey1->value, pkey2->value);
+    }
+}
 
-    pkeys1 = *((apolloron::Keys **)ppkeys1);
-    pkeys2 = *((apolloron::Keys **)ppkeys2);
 
-    value1 = (*pkeys1)[key].c_str();
-    value2 = (*pkeys2)[key].c_str();
+/* compare function for sortByCols() (a key of each column in orders) */
+static int _sheet_cmp_keys(const void *ppkey1, const void *ppkey2, const char *orders) {
+    const TSheetSortKey *pkey1, *pkey2;
+    int i, cmp;
 
-    cmp_result = strcmp(value1, value2);
+    pkey1 = *((const TSheetSortKey **)ppkey1);
+    pkey2 = *((const TSheetSortKey **)ppkey2);
+
+    for (i = 0; orders[i] != '\0'; i++) {
+        cmp = _sheet_cmp_key(&(pkey1[i]), &(pkey2[i]), orders[i]);
+        if (cmp != 0) {
+            return cmp;
+        }
+    }
 
-    return cmp_result;
+    // rows of the same keys keep their order
+    return (pkey1->row < pkey2->row)?-1:((pkey2->row < pkey1->row)?1:0);
 }
 
 
-/* compare function for sortr() */
-static int _sheet_cmp_desc(const void *ppkeys1, const void *ppkeys2, const char *key) {
-    apolloron::Keys *pkeys1, *pkeys2;
-    const char *value1, *value2;
-    int cmp_result;
+#define SHEET_SORT_PART_MIN  32768L  // least rows sorted on each thread
+
 
-    pkeys1 = *((apolloron::Keys **)ppkeys1);
-    pkeys2 = *((apolloron::Keys **)ppkeys2);
+// Rows sorted or merged on a thread of sortRowsByCols()
+typedef struct {
+    TSheetSortKey **src;
+    TSheetSortKey **dest; // (merge)
+    long from;
+    long middle; // first row of the second sorted part (merge)
+    long to;
+    const char *orders;
+} TSheetSortPart;
 
-    value1 = (*pkeys1)[key].c_str();
-    value2 = (*pkeys2)[key].c_str();
 
-    cmp_result = (-(strcmp(value1, value2)));
+/* Sort a part of rows (thread entry) */
+static void *_sortSheetPart(void *arg) {
+    TSheetSortPart *part = (TSheetSortPart *)arg;
 
-    return cmp_result;
+    qsort_with_key(part->src + part->from, part->to - part->from, sizeof(TSheetSortKey *),
+                   _sheet_cmp_keys, part->orders);
+
+    return NULL;
 }
 
 
-/* compare function for sortnum() */
-static int _sheet_cmp_num(const void *ppkeys1, const void *ppkeys2, const char *key) {
-    apolloron::Keys *pkeys1, *pkeys2;
-    const char *value1, *value2;
-    long num1, num2;
-    int cmp_result;
+/* Merge two sorted parts of rows into dest (thread entry) */
+static void *_mergeSheetParts(void *arg) {
+    TSheetSortPart *part = (TSheetSortPart *)arg;
+    long i, j, k;
 
-    pkeys1 = *((apolloron::Keys **)ppkeys1);
-    pkeys2 = *((apolloron::Keys **)ppkeys2);
+    i = part->from;
+    j = part->middle;
+    k = part->from;
+    while (i < part->middle && j < part->to) {
+        // the first part wins a tie (it never happens as rows differ)
+        if (_sheet_cmp_keys(&(part->src[j]), &(part->src[i]), part->orders) < 0) {
+            part->dest[k++] = part->src[j++];
+        } else {
+            part->dest[k++] = part->src[i++];
+        }
+    }
+    memcpy(part->dest + k, part->src + i, sizeof(TSheetSortKey *) * (part->middle - i));
+    k += part->middle - i;
+    memcpy(part->dest + k, part->src + j, sizeof(TSheetSortKey *) * (part->to - j));
 
-    value1 = (*pkeys1)[key].c_str();
-    value2 = (*pkeys2)[key].c_str();
+    return NULL;
+}
 
-    num1 = atol(value1);
-    num2 = atol(value2);
-    if (num2 < num1) {
-        cmp_result = 1;
-    } else if (num1 < num2) {
-        cmp_result = -1;
-    } else {
-        cmp_result = 0;
+
+/* Run a function for each part on threads (the first one on the calling thread) */
+static void _runSheetParts(void *(*func)(void *), TSheetSortPart *parts, long count) {
+    pthread_t *thread;
+    bool *started;
+    long i;
+
+    thread = new pthread_t [count];
+    started = new bool [count];
+    for (i = 1; i < count; i++) {
+        started[i] = (pthread_create(&thread[i], NULL, func, &parts[i]) == 0);
     }
+    func(&parts[0]);
+    for (i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(thread[i], NULL);
+        } else {
+            func(&parts[i]);
+        }
+    }
+    delete [] started;
+    delete [] thread;
+}
 
-    return cmp_result;
+
+/* Sort keys of rows: even parts are sorted on threads, and merged by pairs.
+   Keys of different rows never tie, so the order is the same as one qsort. */
+static void _sortSheetKeys(TSheetSortKey **pkeys, long rows, const char *orders, int threads) {
+    TSheetSortPart *parts;
+    TSheetSortKey **src, **dest, **tmp;
+    long count, n, i;
+
+    count = (rows / SHEET_SORT_PART_MIN < threads)?(rows / SHEET_SORT_PART_MIN):threads;
+    if (count <= 1) {
+        qsort_with_key(pkeys, rows, sizeof(TSheetSortKey *), _sheet_cmp_keys, orders);
+        return;
+    }
+
+    parts = new TSheetSortPart [count];
+    for (i = 0; i < count; i++) {
+        parts[i].src = pkeys;
+        parts[i].dest = (TSheetSortKey **)NULL;
+        parts[i].from = rows * i / count;
+        parts[i].middle = parts[i].from;
+        parts[i].to = rows * (i + 1) / count;
+        parts[i].orders = orders;
+    }
+    _runSheetParts(_sortSheetPart, parts, count);
+
+    tmp = new TSheetSortKey * [rows];
+    src = pkeys;
+    dest = tmp;
+    while (1 < count) {
+        // (the last part of odd count is copied as it is)
+        n = 0;
+        for (i = 0; i < count; i += 2) {
+            parts[n].src = src;
+            parts[n].dest = dest;
+            parts[n].from = parts[i].from;
+            parts[n].middle = parts[i].to;
+            parts[n].to = (i + 1 < count)?parts[i + 1].to:parts[i].to;
+            n++;
+        }
+        _runSheetParts(_mergeSheetParts, parts, n);
+        count = n;
+        src = dest;
+        dest = (dest == tmp)?pkeys:tmp;
+    }
+    if (src != pkeys) {
+        memcpy(pkeys, src, sizeof(TSheetSortKey *) * rows);
+    }
+
+    delete [] tmp;
+    delete [] parts;
 }
 
-/* compare function for sortnumr() */
-static int _sheet_cmp_numr(const void *ppkeys1, const void *ppkeys2, const char *key) {
-    apolloron::Keys *pkeys1, *pkeys2;
-    const char *value1, *value2;
-    long num1, num2;
-    int cmp_result;
 
-    pkeys1 = *((apolloron::Keys **)ppkeys1);
-    pkeys2 = *((apolloron::Keys **)ppkeys2);
+/* Initialize cells of a column (all rows empty) */
+static void _initSheetColumn(apolloron::SheetColumn *column, long rows_capacity) {
+    long i;
 
-    value1 = (*pkeys1)[key].c_str();
-    value2 = (*pkeys2)[key].c_str();
+    column->arena = (char *)NULL;
+    column->arenaLength = 0;
+    column->arenaCapacity = 0;
+    column->arenaUnused = 0;
+    column->offsets = (long *)NULL;
+    if (0 < rows_capacity) {
+        column->offsets = new long [rows_capacity];
+        for (i = 0; i < rows_capacity; i++) {
+            column->offsets[i] = -1;
+        }
+    }
+}
 
-    num1 = atol(value1);
-    num2 = atol(value2);
-    if (num1 < num2) {
-        cmp_result = 1;
-    } else if (num2 < num1) {
-        cmp_result = -1;
-    } else {
-        cmp_result = 0;
+
+/* Free cells of a column */
+static void _freeSheetColumn(apolloron::SheetColumn *column) {
+    if (column->arena != (char *)NULL) {
+        delete [] column->arena;
+        column->arena = (char *)NULL;
+    }
+    if (column->offsets != (long *)NULL) {
+        delete [] column->offsets;
+        column->offsets = (long *)NULL;
     }
+    column->arenaLength = 0;
+    column->arenaCapacity = 0;
+    column->arenaUnused = 0;
+}
+
 
-    return cmp_result;
+/* Check if a value of cell is written without quotes */
+static bool _isCSVPlain(const char *value) {
+    long length;
+
+    length = strlen(value);
+    if (length <= 0) {
+        return true;
+    }
+    if (isspace((unsigned char)value[0]) || isspace((unsigned char)value[length - 1])) {
+        return false;
+    }
+    if (value[0] == '+' || value[0] == '-' || (value[0] == '0' && isdigit((unsigned char)value[1]))) {
+        return false;
+    }
+
+    // as String::searchChar() <= 0, only the first one of each is checked
+    return ((strchr(value, ',') == NULL || value[0] == ',') &&
+            (strchr(value, '"') == NULL || value[0] == '"') &&
+            (strchr(value, '\r') == NULL || value[0] == '\r') &&
+            (strchr(value, '\n') == NULL || value[0] == '\n'));
 }
 
 
-/* Get line length of CSV string */
-long _searchCSVLineEnd(const apolloron::String &csv, long start_pos) {
-    bool quoted, comma;
-    long i, max, length;
+/* Check if CSV text in csv_charset can be converted from/to other_charset
+   at once instead of each cell */
+static bool _isCSVConvertibleAtOnce(const char *csv_charset, const char *other_charset) {
+    apolloron::TCharset csv, other;
 
-    quoted = false;
-    comma = true;
-    length = 0;
-    max = csv.len();
-    for (i = start_pos; i < max; i++) {
-        length++;
-        if (quoted == false) {
-            if (csv[i] == '\n') {
-                break;
-            } else if (csv[i] == '\r' && csv[i+1] == '\n') {
-                length++;
-                break;
-            } else if (csv[i] == '\r') {
-                break;
-            } else if (csv[i] == ',') {
-                comma = true;
-            } else if (comma == true && csv[i] == '"') {
-                quoted = true;
+    if (csv_charset == NULL || other_charset == NULL) {
+        return false;
+    }
+    csv = apolloron::charsetHandle(csv_charset);
+    other = apolloron::charsetHandle(other_charset);
+
+    // '"' and ',' must be single bytes of ASCII in csv_charset, and the text
+    // of other_charset must not depend on where the cells are cut
+    if (csv == apolloron::CHARSET_UNKNOWN || csv == apolloron::CHARSET_AUTODETECT ||
+            csv == apolloron::CHARSET_AUTODETECT_JP || csv == apolloron::CHARSET_UTF7 ||
+            csv == apolloron::CHARSET_UTF7_IMAP || csv == apolloron::CHARSET_JIS ||
+            (apolloron::CHARSET_UTF16 <= csv && csv <= apolloron::CHARSET_UTF32LE_BOM)) {
+        return false;
+    }
+    if (other == apolloron::CHARSET_UNKNOWN || other == apolloron::CHARSET_AUTODETECT ||
+            other == apolloron::CHARSET_AUTODETECT_JP || other == apolloron::CHARSET_UTF7 ||
+            other == apolloron::CHARSET_UTF7_IMAP ||
+            (apolloron::CHARSET_UTF16 <= other && other <= apolloron::CHARSET_UTF32LE_BOM)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Append a value of cell to CSV text (without conversion) */
+static void _addCSVCell(apolloron::String &csv, const char *value) {
+    const char *p;
+    long length;
+
+    if (_isCSVPlain(value)) {
+        csv.addBinary(value, strlen(value));
+        return;
+    }
+
+    csv.addBinary('"');
+    while (*value != '\0') {
+        p = strchr(value, '"');
+        length = (p != NULL)?(p - value + 1):(long)strlen(value);
+        csv.addBinary(value, length);
+        if (p != NULL) {
+            csv.addBinary('"');
+        }
+        value += length;
+    }
+    csv.addBinary('"');
+}
+
+
+/* Field of CSV text found by _nextCSVField() */
+typedef struct {
+    const char *value; // field in the CSV text (after the opening '"' if quoted)
+    long length;       // length of value up to ',' or a line break
+    bool quoted;       // field was quoted
+    bool lineEnd;      // field is the last one of its line
+} TCSVField;
+
+
+/* Find a field of CSV text (terminated by '\0') starting at pos, and return
+   its length with the following ',' or line break (0 at the end of the text) */
+static long _nextCSVField(const char *csv, long csv_len, long pos, TCSVField *field) {
+    const char *p, *end, *q;
+
+    field->lineEnd = true;
+    if (csv_len <= pos) {
+        field->value = csv + csv_len;
+        field->length = 0;
+        field->quoted = false;
+        return 0;
+    }
+
+    p = csv + pos;
+    end = csv + csv_len;
+    field->quoted = (*p == '"');
+    if (field->quoted) {
+        // skip to the closing '"' (",", "\r" and "\n" are data up to it)
+        p++;
+        field->value = p;
+        while (p < end) {
+            q = (const char *)memchr(p, '"', end - p);
+            if (q == NULL) {
+                p = end;
+            } else if (q[1] == '"') {
+                p = q + 2;
+                continue;
             } else {
-                comma = false;
-            }
-        } else {
-            if (csv[i] == '"' && csv[i+1] == '"') {
-                length++;
-                i++;
-            } else if (csv[i] == '"') {
-                quoted = false;
+                p = q + 1;
             }
-            comma = false;
+            break;
+        }
+    } else {
+        field->value = p;
+    }
+
+    q = p + strcspn(p, ",\r\n");
+    field->length = q - field->value;
+    if (q < end && *q == ',') {
+        field->lineEnd = false;
+        q++;
+    } else if (q < end) {
+        if (*q == '\r' && q[1] == '\n') {
+            q++;
         }
+        q++;
     }
-    return length;
+
+    return q - (csv + pos);
 }
 
 
-/* Get column length of CSV string */
-long _searchCSVColEnd(const apolloron::String &csv, long start_pos, apolloron::String &cell_data, const char *src_charset, const char *dest_charset, const char *return_code) {
+/* Get value of a CSV field. Quoted values are unescaped into buf (of
+   field->length + 1 bytes) unless they can be used as they are, and
+   converted from src_charset to dest_charset if they are not NULL. */
+static const char *_getCSVFieldValue(const TCSVField *field, const char *src_charset, const char *dest_charset,
+                                     apolloron::String &cell_data, char *buf, long *length) {
+    apolloron::String raw;
+    const char *value, *q;
     bool quoted;
-    long i, max, length, start, l;
+    long i, j;
 
-    quoted = false;
-    length = 0;
-    max = csv.len();
-    i = start_pos;
+    value = field->value;
+    *length = field->length;
+    if (field->quoted) {
+        q = (const char *)memchr(field->value, '"', field->length);
+        if (q != NULL && q == field->value + field->length - 1) {
+            // only the closing '"'
+            *length = field->length - 1;
+        } else if (q != NULL) {
+            // '""' is '"', and the text after the closing '"' is taken as it is
+            quoted = true;
+            j = 0;
+            for (i = 0; i < field->length; i++) {
+                if (quoted && field->value[i] == '"') {
+                    if (i + 1 < field->length && field->value[i + 1] == '"') {
+                        buf[j++] = '"';
+                        i++;
+                    } else {
+                        quoted = false;
+                    }
+                } else {
+                    buf[j++] = field->value[i];
+                }
+            }
+            value = buf;
+            *length = j;
+        }
+    }
 
-    cell_data = "";
-    if (max < i) {
-        return 0;
+    if (src_charset == NULL || dest_charset == NULL) {
+        return value;
     }
 
-    start = 0;
-    if (csv[i] == '"') {
-        start = 1;
-        length++;
-        quoted = true;
-        i++;
+    raw.set(value, *length);
+    cell_data = raw.strconv(src_charset, dest_charset).changeReturnCode("\n");
+    *length = cell_data.len();
+    return cell_data.c_str();
+}
+
+
+/* Get text of a CSV field in UTF-8 (line breaks in quoted values are "\n") */
+static const char *_getCSVFieldText(const TCSVField *field, apolloron::String &cell_data, char *buf, long *length) {
+    apolloron::String raw;
+    const char *value;
+
+    value = _getCSVFieldValue(field, NULL, NULL, cell_data, buf, length);
+    if (field->quoted && memchr(value, '\r', *length) != NULL) {
+        raw.set(value, *length);
+        cell_data = raw.changeReturnCode("\n");
+        *length = cell_data.len();
+        value = cell_data.c_str();
     }
-    l = 0;
-    for (; i < max; i++) {
-        length++;
-        if (quoted == false) {
-            if (csv[i] == '\n') {
-                break;
-            } else if (csv[i] == '\r' && csv[i+1] == '\n') {
-                length++;
-                break;
-            } else if (csv[i] == '\r') {
-                break;
-            } else if (csv[i] == ',') {
+
+    return value;
+}
+
+
+#define SHEET_READ_SIZE    (1024L * 1024L)  // bytes read from CSV file at once
+#define SHEET_WRITE_SIZE   (1024L * 1024L)  // bytes written to a file at once
+#define SHEET_RUN_BUF_MIN  (64L * 1024L)    // least buffer to read a run
+#define SHEET_MERGE_MAX    64               // runs merged at once
+
+/* Output of records of sortCSVFile() */
+typedef struct {
+    int fd; // run file (cells terminated by '\0'), or -1 for CSV output
+    FILE *fp; // CSV output
+    apolloron::CharsetStream *cs; // UTF-8 to the charset of CSV output
+    const char *returnStr;
+    apolloron::String *buf;
+    bool error;
+} TSheetWriter;
+
+
+/* Run of sorted records in a file, read back for merging */
+typedef struct {
+    int fd;
+    char *buf;
+    long length;
+    long capacity;
+    long next; // offset of the next record in buf
+    bool eof;
+    bool error; // failed to read
+    const char **cells; // cells of the current record
+    TSheetSortKey *keys; // keys of the current record
+    long run; // index of run (records of an earlier run go first on ties)
+} TSheetRun;
+
+
+/* Create a temporary file for a run (removed when it is closed) */
+static int _openSheetRunFile() {
+    const char *dir;
+    char path[1024];
+    int fd;
+
+    dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    snprintf(path, sizeof(path), "%s/apolloron-sheet-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (0 <= fd) {
+        unlink(path);
+    }
+
+    return fd;
+}
+
+
+/* Add a run file to the list of runs */
+static int _addSheetRun(int **runs, long *count, long *capacity) {
+    int *tmp;
+    int fd;
+
+    fd = _openSheetRunFile();
+    if (fd < 0) {
+        return -1;
+    }
+    if (*capacity <= *count) {
+        tmp = new int [*capacity * 2];
+        memcpy(tmp, *runs, sizeof(int) * (*count));
+        delete [] *runs;
+        *runs = tmp;
+        *capacity *= 2;
+    }
+    (*runs)[(*count)++] = fd;
+
+    return fd;
+}
+
+
+/* Write whole data to a file descriptor */
+static bool _writeSheetFile(int fd, const char *data, long length) {
+    long l;
+
+    while (0 < length) {
+        l = (long)write(fd, data, length);
+        if (l <= 0) {
+            return false;
+        }
+        data += l;
+        length -= l;
+    }
+
+    return true;
+}
+
+
+/* Write out buffered records */
+static void _flushSheetWriter(TSheetWriter *writer, bool finish) {
+    apolloron::String *buf = writer->buf;
+    apolloron::String out;
+
+    if (0 <= writer->fd) {
+        if (!_writeSheetFile(writer->fd, buf->c_str(), buf->binaryLength())) {
+            writer->error = true;
+        }
+    } else {
+        out.useAsBinary(0);
+        if (0 < buf->binaryLength()) {
+            const apolloron::String &text = buf->changeReturnCode(writer->returnStr);
+            writer->cs->encode(text.c_str(), text.len(), out);
+        }
+        if (finish) {
+            writer->cs->encodeFlush(out);
+        }
+        if (0 < out.binaryLength() &&
+                fwrite(out.c_str(), 1, out.binaryLength(), writer->fp) != (size_t)out.binaryLength()) {
+            writer->error = true;
+        }
+    }
+    buf->useAsBinary(0);
+}
+
+
+/* Write a record (to a run, or as a line of CSV in UTF-8 before conversion) */
+static void _writeSheetRecord(TSheetWriter *writer, const char * const *cells, long col_max) {
+    long col;
+
+    for (col = 0; col < col_max; col++) {
+        if (0 <= writer->fd) {
+            writer->buf->addBinary(cells[col], strlen(cells[col]) + 1);
+        } else {
+            if (0 < col) {
+                writer->buf->addBinary(',');
+            }
+            _addCSVCell(*(writer->buf), cells[col]);
+        }
+    }
+    if (writer->fd < 0) {
+        writer->buf->addBinary('\n');
+    }
+    if (SHEET_WRITE_SIZE <= writer->buf->binaryLength()) {
+        _flushSheetWriter(writer, false);
+    }
+}
+
+
+/* Read the next record of a run */
+static bool _readSheetRun(TSheetRun *run, long col_max, const long *key_cols, long keys) {
+    char *p, *end, *buf;
+    long col, l;
+
+    for (;;) {
+        p = run->buf + run->next;
+        end = run->buf + run->length;
+        for (col = 0; col < col_max && p < end; col++) {
+            run->cells[col] = p;
+            p = (char *)memchr(p, '\0', end - p);
+            if (p == NULL) {
                 break;
-            } else {
-                l++;
             }
+            p++;
+        }
+        if (col == col_max) {
+            run->next = p - run->buf;
+            for (col = 0; col < keys; col++) {
+                run->keys[col].value = run->cells[key_cols[col]];
+                run->keys[col].num = atol(run->keys[col].value);
+                run->keys[col].row = run->run;
+            }
+            return true;
+        }
+        if (run->eof) {
+            return false;
+        }
+
+        // keep the rest of the record and read more
+        l = run->length - run->next;
+        if (l == run->capacity) {
+            buf = new char [run->capacity * 2];
+            memcpy(buf, run->buf + run->next, l);
+            delete [] run->buf;
+            run->buf = buf;
+            run->capacity *= 2;
+        } else if (0 < l) {
+            memmove(run->buf, run->buf + run->next, l);
+        }
+        run->length = l;
+        run->next = 0;
+        l = (long)read(run->fd, run->buf + run->length, run->capacity - run->length);
+        if (l <= 0) {
+            run->eof = true;
+            run->error = (l < 0);
         } else {
-            if (csv[i] == '"' && csv[i+1] == '"') {
-                l += 2;
-                length++;
-                i++;
-            } else if (csv[i] == '"') {
-                quoted = false;
-            } else {
-                l++;
+            run->length += l;
+        }
+    }
+}
+
+
+/* Check if the current record of run1 goes before that of run2 */
+static bool _sheetRunBefore(const TSheetRun *run1, const TSheetRun *run2, const char *orders, long keys) {
+    long i;
+    int cmp;
+
+    for (i = 0; i < keys; i++) {
+        cmp = _sheet_cmp_key(&(run1->keys[i]), &(run2->keys[i]), orders[i]);
+        if (cmp != 0) {
+            return (cmp < 0);
+        }
+    }
+
+    return (run1->run < run2->run);
+}
+
+
+/* Merge runs (k-way with a heap) and write the records */
+static bool _mergeSheetRuns(const int *fds, long count, long col_max, const long *key_cols,
+                            const char *orders, long keys, long memory_limit, TSheetWriter *writer) {
+    TSheetRun *runs, **heap, *tmp;
+    long i, n, parent, child, buf_size;
+    bool error;
+
+    buf_size = memory_limit / (count + 1);
+    if (buf_size < SHEET_RUN_BUF_MIN) {
+        buf_size = SHEET_RUN_BUF_MIN;
+    }
+
+    runs = new TSheetRun [count];
+    heap = new TSheetRun * [count];
+    n = 0;
+    for (i = 0; i < count; i++) {
+        runs[i].fd = fds[i];
+        runs[i].buf = new char [buf_size];
+        runs[i].length = 0;
+        runs[i].capacity = buf_size;
+        runs[i].next = 0;
+        runs[i].eof = (lseek(fds[i], 0, SEEK_SET) != 0);
+        runs[i].error = runs[i].eof;
+        runs[i].cells = new const char * [col_max];
+        runs[i].keys = new TSheetSortKey [(0 < keys)?keys:1];
+        runs[i].run = i;
+        if (!_readSheetRun(&(runs[i]), col_max, key_cols, keys)) {
+            continue;
+        }
+        // push
+        child = n++;
+        while (0 < child) {
+            parent = (child - 1) / 2;
+            if (!_sheetRunBefore(&(runs[i]), heap[parent], orders, keys)) {
+                break;
             }
+            heap[child] = heap[parent];
+            child = parent;
         }
+        heap[child] = &(runs[i]);
     }
 
-    if (csv[start_pos] == '"') {
-        cell_data = csv.mid(start_pos + start, l).unescapeCSV(src_charset, dest_charset, return_code);
-    } else {
-        cell_data = csv.mid(start_pos + start, l).strconv(src_charset, dest_charset).changeReturnCode(return_code);
+    while (0 < n && !writer->error) {
+        _writeSheetRecord(writer, heap[0]->cells, col_max);
+        if (!_readSheetRun(heap[0], col_max, key_cols, keys)) {
+            heap[0] = heap[--n];
+        }
+        // sift down
+        tmp = heap[0];
+        parent = 0;
+        while ((child = parent * 2 + 1) < n) {
+            if (child + 1 < n && _sheetRunBefore(heap[child + 1], heap[child], orders, keys)) {
+                child++;
+            }
+            if (!_sheetRunBefore(heap[child], tmp, orders, keys)) {
+                break;
+            }
+            heap[parent] = heap[child];
+            parent = child;
+        }
+        if (0 < n) {
+            heap[parent] = tmp;
+        }
+    }
+
+    error = writer->error;
+    for (i = 0; i < count; i++) {
+        error = (error || runs[i].error);
+        delete [] runs[i].buf;
+        delete [] runs[i].cells;
+        delete [] runs[i].keys;
     }
+    delete [] heap;
+    delete [] runs;
 
-    return length;
+    return !error;
 }
 
 } // namespace
@@ -348,16 +855,26 @@ long _searchCSVColEnd(const apolloron::String &csv, long start_pos, apolloron::S
 
 namespace apolloron {
 
+#define SHEET_ROWS_MIN     128     // first number of rows allocated
+#define SHEET_COLS_MIN     8       // first number of columns allocated
+#define SHEET_ARENA_MIN    256     // first size of arena of a column
+
+#define SHEET_SORT_ASC     0
+#define SHEET_SORT_DESC    1
+#define SHEET_SORT_NUM     2
+#define SHEET_SORT_NUMR    3
+
 /*! Constructor of Sheet.
     @param void
     @return void
  */
 Sheet::Sheet() {
-    (*this).tmpString = (String *)NULL;
     (*this).tmpCSVString = (String *)NULL;
-    (*this).pRows = (Keys **)NULL;
+    (*this).pCols = (SheetColumn *)NULL;
+    (*this).colsCapacity = 0;
     (*this).rowsMax = 0;
     (*this).rowsCapacity = 0;
+    (*this).threads = 1;
     (*this).clear();
 }
 
@@ -367,11 +884,12 @@ Sheet::Sheet() {
     @return void
  */
 Sheet::Sheet(Sheet &sheet) {
-    (*this).tmpString = (String *)NULL;
     (*this).tmpCSVString = (String *)NULL;
-    (*this).pRows = (Keys **)NULL;
+    (*this).pCols = (SheetColumn *)NULL;
+    (*this).colsCapacity = 0;
     (*this).rowsMax = 0;
     (*this).rowsCapacity = 0;
+    (*this).threads = sheet.threads;
     (*this).clear();
     (*this).set(sheet);
 }
@@ -394,20 +912,17 @@ Sheet::~Sheet() {
 bool Sheet::clear() {
     long i;
 
-    (*this).columns.clear();
-    if ((*this).pRows != (Keys **)NULL) {
-        for (i = 0; i < (*this).rowsMax; i++) {
-            delete (*this).pRows[i];
+    if ((*this).pCols != (SheetColumn *)NULL) {
+        for (i = 0; i < (*this).columns.max(); i++) {
+            _freeSheetColumn(&((*this).pCols[i]));
         }
-        delete [] (*this).pRows;
+        delete [] (*this).pCols;
     }
-    (*this).pRows = (Keys **)NULL;
+    (*this).columns.clear();
+    (*this).pCols = (SheetColumn *)NULL;
+    (*this).colsCapacity = 0;
     (*this).rowsMax = 0;
     (*this).rowsCapacity = 0;
-    if ((*this).tmpString != (String *)NULL) {
-        delete (*this).tmpString;
-        (*this).tmpString = (String *)NULL;
-    }
     if ((*this).tmpCSVString != (String *)NULL) {
         delete (*this).tmpCSVString;
         (*this).tmpCSVString = (String *)NULL;
@@ -417,6 +932,136 @@ bool Sheet::clear() {
 }
 
 
+/*! Get value of cell (in the arena of the column).
+    @param col column index
+    @param row row index
+    @return value of cell ("" if empty)
+ */
+const char *Sheet::cell(long col, long row) const {
+    long offset = (*this).pCols[col].offsets[row];
+
+    return (offset < 0)?"":((*this).pCols[col].arena + offset);
+}
+
+
+/*! Store value of cell at the end of the arena of the column.
+    @param col column index
+    @param row row index
+    @param value value to store
+    @param length length of value
+    @return void
+ */
+void Sheet::storeCell(long col, long row, const char *value, long length) {
+    SheetColumn *column = &((*this).pCols[col]);
+    char *arena;
+    long capacity;
+
+    if (0 <= column->offsets[row]) {
+        column->arenaUnused += strlen(column->arena + column->offsets[row]) + 1;
+        column->offsets[row] = -1;
+    }
+    if (length <= 0) {
+        return;
+    }
+
+    if (column->arenaCapacity < column->arenaLength + length + 1) {
+        // drop overwritten values before growing
+        if (column->arenaLength < column->arenaUnused * 2) {
+            (*this).compactCol(col);
+        }
+        if (column->arenaCapacity < column->arenaLength + length + 1) {
+            capacity = (column->arenaCapacity <= 0)?SHEET_ARENA_MIN:column->arenaCapacity * 2;
+            while (capacity < column->arenaLength + length + 1) {
+                capacity *= 2;
+            }
+            arena = new char [capacity];
+            if (0 < column->arenaLength) {
+                memcpy(arena, column->arena, column->arenaLength);
+            }
+            if (column->arena != (char *)NULL) {
+                delete [] column->arena;
+            }
+            column->arena = arena;
+            column->arenaCapacity = capacity;
+        }
+    }
+
+    memcpy(column->arena + column->arenaLength, value, length);
+    column->arena[column->arenaLength + length] = '\0';
+    column->offsets[row] = column->arenaLength;
+    column->arenaLength += length + 1;
+}
+
+
+/*! Copy values of a column into a new arena in order of rows.
+    @param col column index
+    @return void
+ */
+void Sheet::compactCol(long col) {
+    SheetColumn *column = &((*this).pCols[col]);
+    char *arena;
+    long capacity, length, offset, row;
+
+    capacity = SHEET_ARENA_MIN;
+    while (capacity < column->arenaLength - column->arenaUnused) {
+        capacity *= 2;
+    }
+    arena = new char [capacity];
+    offset = 0;
+    for (row = 0; row < (*this).rowsMax; row++) {
+        if (0 <= column->offsets[row]) {
+            length = strlen(column->arena + column->offsets[row]) + 1;
+            memcpy(arena + offset, column->arena + column->offsets[row], length);
+            column->offsets[row] = offset;
+            offset += length;
+        }
+    }
+    if (column->arena != (char *)NULL) {
+        delete [] column->arena;
+    }
+    column->arena = arena;
+    column->arenaLength = offset;
+    column->arenaCapacity = capacity;
+    column->arenaUnused = 0;
+}
+
+
+/*! Make room for rows in every column.
+    @param rows number of rows
+    @retval true  success
+    @retval false failure
+ */
+bool Sheet::growRows(long rows) {
+    long *offsets;
+    long capacity, col, i;
+
+    if (rows <= (*this).rowsCapacity) {
+        return true;
+    }
+
+    capacity = ((*this).rowsCapacity <= 0)?SHEET_ROWS_MIN:(*this).rowsCapacity * 2;
+    while (capacity < rows) {
+        capacity *= 2;
+    }
+    for (col = 0; col < (*this).columns.max(); col++) {
+        offsets = new long [capacity];
+        if (0 < (*this).rowsMax) {
+            memcpy(offsets, (*this).pCols[col].offsets, sizeof(long) * (*this).rowsMax);
+        }
+        for (i = (*this).rowsMax; i < capacity; i++) {
+            offsets[i] = -1;
+        }
+        if ((*this).pCols[col].offsets != (long *)NULL) {
+            delete [] (*this).pCols[col].offsets;
+        }
+        (*this).pCols[col].offsets = offsets;
+    }
+    (*this).rowsCapacity = capacity;
+
+    return true;
+}
+
+
 /*! Get max number of columns.
     @param void
     @return max number of columns
@@ -441,21 +1086,39 @@ long Sheet::maxRow() const {
     @retval false failure
  */
 bool Sheet::set(Sheet &sheet) {
-    long col, row, col_max, row_max;
+    SheetColumn *column, *src;
+    long col, col_max;
+
+    if (&sheet == this) {
+        return true;
+    }
 
     (*this).clear();
 
     col_max = sheet.maxCol();
-    row_max = sheet.maxRow();
-
-    for (col = 0; col < col_max; col++) {
-        (*this).addCol(sheet.col(col));
+    (*this).columns.set(sheet.columns);
+    (*this).rowsMax = sheet.rowsMax;
+    (*this).rowsCapacity = (0 < sheet.rowsMax)?sheet.rowsMax:0;
+    if (0 < col_max) {
+        (*this).pCols = new SheetColumn [col_max];
+        (*this).colsCapacity = col_max;
     }
 
-    for (row = 0; row < row_max; row++) {
-        (*this).addRow();
-        for (col = 0; col < col_max; col++) {
-            (*(*this).pRows[row])[sheet.col(col)] = sheet.getValue(sheet.col(col), row);
+    // arenas are copied as they are
+    for (col = 0; col < col_max; col++) {
+        column = &((*this).pCols[col]);
+        src = &(sheet.pCols[col]);
+        _initSheetColumn(column, 0);
+        if (0 < (*this).rowsCapacity) {
+            column->offsets = new long [(*this).rowsCapacity];
+            memcpy(column->offsets, src->offsets, sizeof(long) * (*this).rowsMax);
+        }
+        if (0 < src->arenaLength) {
+            column->arena = new char [src->arenaLength];
+            memcpy(column->arena, src->arena, src->arenaLength);
+            column->arenaLength = src->arenaLength;
+            column->arenaCapacity = src->arenaLength;
+            column->arenaUnused = src->arenaUnused;
         }
     }
 
@@ -499,11 +1162,9 @@ int Sheet::operator == (Sheet &sheet) {
 
     for (row = 0; row < row_max; row++) {
         for (col = 0; col < col_max; col++) {
-            String colname = (*this).columns[col];
-            if ((*(*this).pRows[row])[colname] != sheet.getValue(colname, row)) {
+            if (strcmp((*this).cell(col, row), sheet.cell(col, row)) != 0) {
                 return 0;
             }
-            colname.clear();
         }
     }
 
@@ -517,35 +1178,7 @@ int Sheet::operator == (Sheet &sheet) {
     @retval 0  if not matched
  */
 int Sheet::operator != (Sheet &sheet) {
-    long col, row, col_max, row_max;
-
-    col_max = (*this).columns.max();
-    if (col_max != sheet.maxCol()) {
-        return 1;
-    }
-
-    row_max = (*this).rowsMax;
-    if (row_max != sheet.maxRow()) {
-        return 1;
-    }
-
-    for (col = 0; col < col_max; col++) {
-        if ((*this).columns[col] != sheet.col(col)) {
-            return 1;
-        }
-    }
-
-    for (row = 0; row < row_max; row++) {
-        for (col = 0; col < col_max; col++) {
-            String colname = (*this).columns[col];
-            if ((*(*this).pRows[row])[colname] != sheet.getValue(colname, row)) {
-                return 1;
-            }
-            colname.clear();
-        }
-    }
-
-    return 0;
+    return ((*this) == sheet)?0:1;
 }
 
 
@@ -555,7 +1188,35 @@ int Sheet::operator != (Sheet &sheet) {
     @retval false failure
  */
 bool Sheet::setCols(const List &list) {
-    (*this).columns.set(list);
+    SheetColumn *cols;
+    List names;
+    long col_max, old_max, col, old;
+
+    // cells stay with the column of the same name
+    names.set(list);
+    col_max = names.max();
+    old_max = (*this).columns.max();
+    cols = (0 < col_max)?new SheetColumn [col_max]:(SheetColumn *)NULL;
+    for (col = 0; col < col_max; col++) {
+        old = (*this).colIndex(names[col]);
+        if (0 <= old && (*this).pCols[old].offsets != (long *)NULL) {
+            cols[col] = (*this).pCols[old];
+            (*this).pCols[old].arena = (char *)NULL;
+            (*this).pCols[old].offsets = (long *)NULL;
+        } else {
+            _initSheetColumn(&(cols[col]), (*this).rowsCapacity);
+        }
+    }
+    for (old = 0; old < old_max; old++) {
+        _freeSheetColumn(&((*this).pCols[old]));
+    }
+    if ((*this).pCols != (SheetColumn *)NULL) {
+        delete [] (*this).pCols;
+    }
+    (*this).pCols = cols;
+    (*this).colsCapacity = col_max;
+
+    (*this).columns.set(names);
     return true;
 }
 
@@ -597,6 +1258,24 @@ long Sheet::colIndex(const String &colname) {
     @retval false failure
  */
 bool Sheet::addCol(const String &colname) {
+    SheetColumn *cols;
+    long col_max, capacity;
+
+    col_max = (*this).columns.max();
+    if ((*this).colsCapacity <= col_max) {
+        capacity = ((*this).colsCapacity <= 0)?SHEET_COLS_MIN:(*this).colsCapacity * 2;
+        cols = new SheetColumn [capacity];
+        if (0 < col_max) {
+            memcpy(cols, (*this).pCols, sizeof(SheetColumn) * col_max);
+        }
+        if ((*this).pCols != (SheetColumn *)NULL) {
+            delete [] (*this).pCols;
+        }
+        (*this).pCols = cols;
+        (*this).colsCapacity = capacity;
+    }
+    _initSheetColumn(&((*this).pCols[col_max]), (*this).rowsCapacity);
+
     return (*this).columns.add(colname);
 }
 
@@ -613,6 +1292,12 @@ bool Sheet::delCol(const String &colname) {
         return true;
     }
 
+    _freeSheetColumn(&((*this).pCols[col_index]));
+    if (col_index < (*this).columns.max() - 1) {
+        memmove(&((*this).pCols[col_index]), &((*this).pCols[col_index + 1]),
+                sizeof(SheetColumn) * ((*this).columns.max() - col_index - 1));
+    }
+
     return (*this).columns.remove(col_index);
 }
 
@@ -641,31 +1326,13 @@ bool Sheet::renameCol(const String &old_colname, const String &new_colname) {
     @retval false failure
  */
 bool Sheet::addRow() {
-    long i;
+    long col;
 
-    if ((*this).rowsMax == 0 && (*this).rowsCapacity == 0) {
-        (*this).pRows = new Keys * [128];
-        (*this).pRows[0] = new Keys;
-        (*this).rowsMax = 1;
-        (*this).rowsCapacity = 128;
-    } else {
-        if ((*this).rowsCapacity <= (*this).rowsMax + 1) {
-            Keys **p = new Keys * [(*this).rowsMax + 128];
-            (*this).rowsCapacity = (*this).rowsMax + 128;
-            Keys **pp = (*this).pRows;
-            for (i = 0; i < (*this).rowsMax; i++) {
-               p[i] = (*this).pRows[i];
-               pp[i] = (Keys *)NULL;
-            }
-            (*this).pRows = p;
-            delete [] pp;
-            (*this).pRows[(*this).rowsMax] = new Keys;
-            (*this).rowsMax++;
-	    } else {
-                (*this).pRows[(*this).rowsMax] = new Keys;
-                (*this).rowsMax++;
-    	}
+    (*this).growRows((*this).rowsMax + 1);
+    for (col = 0; col < (*this).columns.max(); col++) {
+        (*this).pCols[col].offsets[(*this).rowsMax] = -1;
     }
+    (*this).rowsMax++;
 
     return true;
 }
@@ -677,50 +1344,19 @@ bool Sheet::addRow() {
     @retval false failure
  */
 bool Sheet::insertRow(long row) {
-    long i;
+    long col;
 
     if (row < 0 || (*this).rowsMax <= row) {
         return false;
     }
 
-    if ((*this).rowsMax == 0 && (*this).rowsCapacity == 0) {
-        (*this).pRows = new Keys * [128];
-        (*this).pRows[0] = new Keys;
-        (*this).rowsMax = 1;
-        (*this).rowsCapacity = 128;
-    } else {
-        if ((*this).rowsCapacity <= (*this).rowsMax + 1) {
-            // expand capacity if insufficient
-            Keys **p = new Keys * [(*this).rowsMax + 128];
-            (*this).rowsCapacity = (*this).rowsMax + 128;
-
-            // copy data before insertion point
-            for (i = 0; i < row; i++) {
-                p[i] = (*this).pRows[i];
-            }
-
-            // insert new row
-            p[row] = new Keys;
-
-            // move data after insertion point
-            for (i = row; i < (*this).rowsMax; i++) {
-                p[i + 1] = (*this).pRows[i];
-            }
-
-            // delete old array and replace with new array
-            delete [] (*this).pRows;
-            (*this).pRows = p;
-        } else {
-            // if capacity is sufficient
-            // shift data from back to front to make space for insertion
-            for (i = (*this).rowsMax; i > row; i--) {
-                (*this).pRows[i] = (*this).pRows[i - 1];
-            }
-            // insert new row
-            (*this).pRows[row] = new Keys;
-        }
-        (*this).rowsMax++;
+    (*this).growRows((*this).rowsMax + 1);
+    for (col = 0; col < (*this).columns.max(); col++) {
+        memmove(&((*this).pCols[col].offsets[row + 1]), &((*this).pCols[col].offsets[row]),
+                sizeof(long) * ((*this).rowsMax - row));
+        (*this).pCols[col].offsets[row] = -1;
     }
+    (*this).rowsMax++;
 
     return true;
 }
@@ -732,30 +1368,27 @@ bool Sheet::insertRow(long row) {
     @retval false failure
  */
 bool Sheet::delRow(long row) {
-    long i;
+    SheetColumn *column;
+    long col;
 
     if (row < 0 || (*this).rowsMax <= row) {
         return false;
     }
 
-    if ((*this).rowsMax == 1) {
-        if ((*this).pRows != (Keys **)NULL) {
-            for (i = 0; i < (*this).rowsMax; i++) {
-                delete (*this).pRows[i];
-            }
-            delete [] (*this).pRows;
-        }
-        (*this).pRows = (Keys **)NULL;
-        (*this).rowsMax = 0;
-        (*this).rowsCapacity = 0;
-    } else {
-        delete (*this).pRows[row];
-        for (i = row; i < (*this).rowsMax - 1; i++) {
-            (*this).pRows[i] = (*this).pRows[i + 1];
+    for (col = 0; col < (*this).columns.max(); col++) {
+        column = &((*this).pCols[col]);
+        if ((*this).rowsMax == 1) {
+            // the arena is reused from the beginning
+            column->arenaLength = 0;
+            column->arenaUnused = 0;
+        } else if (0 <= column->offsets[row]) {
+            column->arenaUnused += strlen(column->arena + column->offsets[row]) + 1;
         }
-        (*this).pRows[(*this).rowsMax - 1] = (Keys *)NULL;
-        (*this).rowsMax--;
+        memmove(&(column->offsets[row]), &(column->offsets[row + 1]),
+                sizeof(long) * ((*this).rowsMax - row - 1));
+        column->offsets[(*this).rowsMax - 1] = -1;
     }
+    (*this).rowsMax--;
 
     return true;
 }
@@ -764,37 +1397,25 @@ bool Sheet::delRow(long row) {
 /*! Get value of cell.
     @param colname column name
     @param row row index
-    @return string value of cell
+    @return copy of value of cell (use setValue() to change the cell)
  */
-String& Sheet::getValue(const String &colname, long row) {
-    if (row < 0 || (*this).rowsMax <= row) {
-        if ((*this).tmpString == (String *)NULL) {
-            (*this).tmpString = new String;
-        }
-        *((*this).tmpString) = "";
-        return *((*this).tmpString);
-    }
-
-    return (*(*this).pRows[row])[colname];
+const String Sheet::getValue(const String &colname, long row) {
+    return (*this).getValue((*this).colIndex(colname), row);
 }
 
 
 /*! Get value of cell.
     @param col column index
     @param row row index
-    @return string value of cell
+    @return copy of value of cell (use setValue() to change the cell)
  */
-String& Sheet::getValue(long col, long row) {
+const String Sheet::getValue(long col, long row) {
     if (col < 0 || (*this).columns.max() <= col ||
             row < 0 || (*this).rowsMax <= row) {
-        if ((*this).tmpString == (String *)NULL) {
-            (*this).tmpString = new String;
-        }
-        *((*this).tmpString) = "";
-        return *((*this).tmpString);
+        return String("");
     }
 
-    return (*(*this).pRows[row])[(*this).columns[col]];
+    return String((*this).cell(col, row));
 }
 
 
@@ -806,13 +1427,7 @@ String& Sheet::getValue(long col, long row) {
     @retval false failure
  */
 bool Sheet::setValue(const String &colname, long row, const String &value) {
-    if (row < 0 || (*this).rowsMax <= row) {
-        return false;
-    }
-
-    (*(*this).pRows[row])[colname] = value;
-
-    return true;
+    return (*this).setValue((*this).colIndex(colname), row, value);
 }
 
 
@@ -829,7 +1444,7 @@ bool Sheet::setValue(long col, long row, const String &value) {
         return false;
     }
 
-    (*(*this).pRows[row])[(*this).columns[col]] = value;
+    (*this).storeCell(col, row, value.c_str(), value.len());
 
     return true;
 }
@@ -841,10 +1456,15 @@ bool Sheet::setValue(long col, long row, const String &value) {
     @return row index (-1 if not found)
  */
 long Sheet::searchRow(const String &colname, const String &value) {
-    long i;
+    long col, i;
+
+    col = (*this).colIndex(colname);
+    if (col < 0) {
+        return (value == "" && 0 < (*this).rowsMax)?0:-1;
+    }
 
     for (i = 0; i < (*this).rowsMax; i++) {
-        if ((*(*this).pRows[i])[colname] == value) {
+        if (strcmp((*this).cell(col, i), value.c_str()) == 0) {
             return i;
         }
     }
@@ -853,79 +1473,247 @@ long Sheet::searchRow(const String &colname, const String &value) {
 }
 
 
-/*! Sort rows (ascending order).
+/*! Sort rows by keys taken from a column once (rows of the same key keep their order).
     @param colname column name
+    @param order SHEET_SORT_ASC, SHEET_SORT_DESC, SHEET_SORT_NUM or SHEET_SORT_NUMR
     @retval true  success
     @retval false failure
  */
-bool Sheet::sort(const String &colname) {
-    long col_index = (*this).colIndex(colname);
-    if (col_index < 0) {
+bool Sheet::sortRows(const String &colname, int order) {
+    long col;
+    char orders[2];
+
+    col = (*this).colIndex(colname);
+    if (col < 0) {
         // specified column name is invalid
         return false;
     }
 
-    if (0 < (*this).rowsMax) {
-        qsort_with_key((*this).pRows, (*this).rowsMax, sizeof(Keys *), _sheet_cmp_asc, colname.c_str());
+    switch (order) {
+        case SHEET_SORT_DESC:
+            orders[0] = 'S';
+            break;
+        case SHEET_SORT_NUM:
+            orders[0] = 'n';
+            break;
+        case SHEET_SORT_NUMR:
+            orders[0] = 'N';
+            break;
+        default:
+            orders[0] = 's';
+            break;
     }
-    return true;
+    orders[1] = '\0';
+
+    return (*this).sortRowsByCols(&col, orders, 1);
 }
 
 
-/*! Sort rows (descending order).
-    @param colname column name
+/*! Get columns of sort keys.
+    @param colnames column names of keys
+    @param orders order of each key ('s': string, 'S': string reverse,
+                  'n': number, 'N': number reverse; 's' if omitted)
+    @param cols column index of each key (colnames.max() elements)
+    @param key_orders order of each key (colnames.max() + 1 bytes)
+    @return number of keys (unknown column names are skipped)
+ */
+long Sheet::keyCols(const List &colnames, const char *orders, long *cols, char *key_orders) {
+    List names;
+    long i, keys, col;
+    char order;
+
+    names.set(colnames);
+    keys = 0;
+    for (i = 0; i < names.max(); i++) {
+        order = 's';
+        if (orders != NULL && *orders != '\0') {
+            if (*orders == 'S' || *orders == 'n' || *orders == 'N') {
+                order = *orders;
+            }
+            orders++;
+        }
+        col = (*this).colIndex(names[i]);
+        if (col < 0) {
+            continue;
+        }
+        cols[keys] = col;
+        key_orders[keys] = order;
+        keys++;
+    }
+    key_orders[keys] = '\0';
+
+    return keys;
+}
+
+
+/*! Sort rows by keys of columns (rows of the same keys keep their order).
+    @param cols column index of each key
+    @param orders order of each key ('s', 'S', 'n' or 'N')
+    @param keys number of keys
     @retval true  success
     @retval false failure
  */
-bool Sheet::sortr(const String &colname) {
-    long col_index = (*this).colIndex(colname);
-    if (col_index < 0) {
-        // specified column name is invalid
-        return false;
+bool Sheet::sortRowsByCols(const long *cols, const char *orders, long keys) {
+    TSheetSortKey *sort_keys, **pkeys;
+    long *offsets;
+    long col, row, i;
+
+    if (keys <= 0 || (*this).rowsMax <= 1) {
+        return true;
     }
 
-    if (0 < (*this).rowsMax) {
-        qsort_with_key((*this).pRows, (*this).rowsMax, sizeof(Keys *), _sheet_cmp_desc, colname.c_str());
+    sort_keys = new TSheetSortKey [(*this).rowsMax * keys];
+    pkeys = new TSheetSortKey * [(*this).rowsMax];
+    for (row = 0; row < (*this).rowsMax; row++) {
+        for (i = 0; i < keys; i++) {
+            sort_keys[row * keys + i].value = (*this).cell(cols[i], row);
+            sort_keys[row * keys + i].num = (orders[i] == 'n' || orders[i] == 'N')?atol(sort_keys[row * keys + i].value):0;
+            sort_keys[row * keys + i].row = row;
+        }
+        pkeys[row] = &(sort_keys[row * keys]);
+    }
+
+    _sortSheetKeys(pkeys, (*this).rowsMax, orders, (*this).threads);
+
+    // the rows of every column follow the order (values stay in the arenas)
+    offsets = new long [(*this).rowsMax];
+    for (col = 0; col < (*this).columns.max(); col++) {
+        for (row = 0; row < (*this).rowsMax; row++) {
+            offsets[row] = (*this).pCols[col].offsets[pkeys[row]->row];
+        }
+        memcpy((*this).pCols[col].offsets, offsets, sizeof(long) * (*this).rowsMax);
     }
+
+    delete [] offsets;
+    delete [] pkeys;
+    delete [] sort_keys;
+
     return true;
 }
 
 
-/*! Sort rows as number (ascending order).
-    @param colname column name
+/*! Write sorted rows to a run file of sortCSVFile(), and empty the rows.
+    @param fd file descriptor of the run
+    @param cols column index of each key
+    @param orders order of each key ('s', 'S', 'n' or 'N')
+    @param keys number of keys
     @retval true  success
     @retval false failure
  */
-bool Sheet::sortnum(const String &colname) {
-    long col_index = (*this).colIndex(colname);
-    if (col_index < 0) {
-        // specified column name is invalid
-        return false;
+bool Sheet::writeRun(int fd, const long *cols, const char *orders, long keys) {
+    TSheetWriter writer;
+    String buf;
+    const char **cells;
+    long col, col_max, row;
+
+    (*this).sortRowsByCols(cols, orders, keys);
+
+    col_max = (*this).columns.max();
+    cells = new const char * [(0 < col_max)?col_max:1];
+    buf.useAsBinary(0);
+    writer.fd = fd;
+    writer.fp = (FILE *)NULL;
+    writer.cs = (CharsetStream *)NULL;
+    writer.returnStr = NULL;
+    writer.buf = &buf;
+    writer.error = false;
+    for (row = 0; row < (*this).rowsMax; row++) {
+        for (col = 0; col < col_max; col++) {
+            cells[col] = (*this).cell(col, row);
+        }
+        _writeSheetRecord(&writer, cells, col_max);
     }
+    _flushSheetWriter(&writer, true);
+    delete [] cells;
+    buf.clear();
+
+    // the arenas are reused for the next rows
+    for (col = 0; col < col_max; col++) {
+        (*this).pCols[col].arenaLength = 0;
+        (*this).pCols[col].arenaUnused = 0;
+    }
+    (*this).rowsMax = 0;
+
+    return !writer.error;
+}
+
 
-    if (0 < (*this).rowsMax) {
-        qsort_with_key((*this).pRows, (*this).rowsMax, sizeof(Keys *), _sheet_cmp_num, colname.c_str());
+/*! Set number of threads which sort rows
+    @param threads  Number of threads (large sheets are cut into parts, which are
+                    sorted at once and merged)
+    @retval true  success
+    @retval false failure
+ */
+bool Sheet::setThreads(int threads) {
+    if (threads <= 0) {
+        return false;
     }
+    (*this).threads = threads;
     return true;
 }
 
 
+/*! Sort rows (ascending order).
+    @param colname column name
+    @retval true  success
+    @retval false failure
+ */
+bool Sheet::sort(const String &colname) {
+    return (*this).sortRows(colname, SHEET_SORT_ASC);
+}
+
+
+/*! Sort rows (descending order).
+    @param colname column name
+    @retval true  success
+    @retval false failure
+ */
+bool Sheet::sortr(const String &colname) {
+    return (*this).sortRows(colname, SHEET_SORT_DESC);
+}
+
+
+/*! Sort rows as number (ascending order).
+    @param colname column name
+    @retval true  success
+    @retval false failure
+ */
+bool Sheet::sortnum(const String &colname) {
+    return (*this).sortRows(colname, SHEET_SORT_NUM);
+}
+
+
 /*! Sort rows as number (descending order).
     @param colname column name
     @retval true  success
     @retval false failure
  */
 bool Sheet::sortnumr(const String &colname) {
-    long col_index = (*this).colIndex(colname);
-    if (col_index < 0) {
-        // specified column name is invalid
-        return false;
-    }
+    return (*this).sortRows(colname, SHEET_SORT_NUMR);
+}
 
-    if (0 < (*this).rowsMax) {
-        qsort_with_key((*this).pRows, (*this).rowsMax, sizeof(Keys *), _sheet_cmp_numr, colname.c_str());
-    }
-    return true;
+
+/*! Sort rows by several columns (rows of the same keys keep their order).
+    @param colnames column names of keys (the first one is compared first)
+    @param orders order of each key ('s': string, 'S': string reverse,
+                  'n': number, 'N': number reverse; ex. "sN")
+    @retval true  success
+    @retval false failure (rows are sorted by the known columns)
+ */
+bool Sheet::sortByCols(const List &colnames, const char *orders) {
+    long *cols;
+    char *key_orders;
+    long keys;
+    bool ret;
+
+    cols = new long [colnames.max() + 1];
+    key_orders = new char [colnames.max() + 1];
+    keys = (*this).keyCols(colnames, orders, cols, key_orders);
+    ret = (*this).sortRowsByCols(cols, key_orders, keys);
+    delete [] key_orders;
+    delete [] cols;
+
+    return (ret && keys == colnames.max());
 }
 
 
@@ -949,6 +1737,30 @@ String& Sheet::getCSV(const char *src_charset, const char *dest_charset, const c
         return *((*this).tmpCSVString);
     }
 
+    if (_isCSVConvertibleAtOnce(src_charset, dest_charset)) {
+        // rows are written from the arenas and converted at once
+        str.useAsBinary(0);
+        for (i = 0; i < col_max; i++) {
+            if (0 < i) {
+                str.addBinary(',');
+            }
+            _addCSVCell(str, (*this).columns[i].c_str());
+        }
+        str.addBinary('\n');
+        for (i = 0; i < (*this).rowsMax; i++) {
+            for (j = 0; j < col_max; j++) {
+                if (0 < j) {
+                    str.addBinary(',');
+                }
+                _addCSVCell(str, (*this).cell(j, i));
+            }
+            str.addBinary('\n');
+        }
+        *((*this).tmpCSVString) = str.strconv(src_charset, dest_charset).changeReturnCode(return_str);
+        str.clear();
+        return *((*this).tmpCSVString);
+    }
+
     for (i = 0; i < col_max; i++) {
         if (0 < i) {
             *((*this).tmpCSVString) += ",";
@@ -973,7 +1785,7 @@ String& Sheet::getCSV(const char *src_charset, const char *dest_charset, const c
             if (0 < j) {
                 *((*this).tmpCSVString) += ",";
             }
-            str = (*(*this).pRows[i])[(*this).columns[j]];
+            str = (*this).cell(j, i);
             trimstr = str.trim();
             if (str == trimstr && str[0] != '+' && str[0] != '-' &&
                     (str[0] != '0' || (str[0] == '0' && !isdigit(str[1]))) &&
@@ -1002,9 +1814,14 @@ String& Sheet::getCSV(const char *src_charset, const char *dest_charset, const c
     @retval false failure
  */
 bool Sheet::setCSV(const String &csv, const char *src_charset, const char *dest_charset) {
-    long pos1, pos2, length1, length2, col_max, col, row;
-    String csv_line;
+    TCSVField field;
+    String text;
+    String colname;
     String cell_data;
+    const char *csv_text, *value;
+    const char *field_src_charset, *field_dest_charset;
+    char *buf;
+    long csv_len, buf_size, pos, length, value_len, col_max, col, row;
 
     (*this).clear();
 
@@ -1014,44 +1831,68 @@ bool Sheet::setCSV(const String &csv, const char *src_charset, const char *dest_
         src_charset = csv.detectCharSetJP();
     }
 
-    // Set column names
-    pos1 = 0;
-    length1 = _searchCSVLineEnd(csv, pos1);
-    if (length1 <= 0) {
-        return true;
+    // convert the whole text once if cells can be cut after the conversion,
+    // otherwise cut it in UTF-8 and convert each cell
+    if (_isCSVConvertibleAtOnce(dest_charset, src_charset)) {
+        text = csv.strconv(src_charset, dest_charset).changeReturnCode("\n");
+        field_src_charset = NULL;
+        field_dest_charset = NULL;
+    } else {
+        text = csv.strconv(src_charset, "UTF-8").changeReturnCode("\n");
+        field_src_charset = "UTF-8";
+        field_dest_charset = dest_charset;
     }
-    csv_line = csv.mid(pos1, length1);
-    pos2 = 0;
+    csv_text = text.c_str();
+    csv_len = text.len();
+    buf_size = 256;
+    buf = new char [buf_size];
+
+    // Set column names
+    pos = 0;
     col_max = 0;
-    while (1) {
-        length2 = _searchCSVColEnd(csv_line, pos2, cell_data, src_charset, dest_charset, "\n");
-        if (cell_data == "" && length2 <= 0) {
-            break;
+    while (0 < (length = _nextCSVField(csv_text, csv_len, pos, &field))) {
+        if (buf_size <= field.length) {
+            delete [] buf;
+            buf_size = field.length + 1;
+            buf = new char [buf_size];
         }
-        (*this).addCol(cell_data);
-        pos2 += length2;
+        value = _getCSVFieldValue(&field, field_src_charset, field_dest_charset, cell_data, buf, &value_len);
+        colname.set(value, value_len);
+        (*this).addCol(colname);
         col_max++;
+        pos += length;
+        if (field.lineEnd) {
+            break;
+        }
     }
-    pos1 += length1;
 
     row = 0;
-    while (0 < (length1 = _searchCSVLineEnd(csv, pos1))) {
+    while (pos < csv_len) {
         (*this).addRow();
-        csv_line = csv.mid(pos1, length1);
-        pos2 = 0;
-        for (col = 0; col < col_max; col++) {
-            length2 = _searchCSVColEnd(csv_line, pos2, cell_data, src_charset, dest_charset, "\n");
-            (*(*this).pRows[row])[(*this).columns[col]] = cell_data;
-            if (cell_data == "" && length2 <= 0) {
+        col = 0;
+        while (0 < (length = _nextCSVField(csv_text, csv_len, pos, &field))) {
+            // fields over the columns are skipped
+            if (col < col_max) {
+                if (buf_size <= field.length) {
+                    delete [] buf;
+                    buf_size = field.length + 1;
+                    buf = new char [buf_size];
+                }
+                value = _getCSVFieldValue(&field, field_src_charset, field_dest_charset, cell_data, buf, &value_len);
+                (*this).storeCell(col, row, value, value_len);
+            }
+            col++;
+            pos += length;
+            if (field.lineEnd) {
                 break;
             }
-            pos2 += length2;
         }
         row++;
-        pos1 += length1;
     }
 
-    csv_line.clear();
+    delete [] buf;
+    text.clear();
+    colname.clear();
     cell_data.clear();
 
     return true;
@@ -1085,4 +1926,254 @@ bool Sheet::saveCSV(const String &filename, const char *src_charset, const char
     return true;
 }
 
+
+/*! Sort CSV file which may be larger than memory (as setCSV(), sortByCols()
+    and getCSV() would do). Sorted runs of rows are written to temporary files
+    (in $TMPDIR), and merged into the output.
+    @param src_filename CSV file to sort
+    @param dest_filename file name of the output
+    @param colnames column names of keys (the first one is compared first)
+    @param orders order of each key ('s': string, 'S': string reverse,
+                  'n': number, 'N': number reverse; ex. "sN")
+    @param src_charset character set of input ("AUTODETECT" to guess)
+    @param dest_charset character set of output (same as input if NULL or "")
+    @param return_str return code of output
+    @param memory_limit bytes of memory used for rows at once
+    @return number of columns in colnames found in the header, which are sorted by
+            (-1 if failed to read or write; the output file is removed)
+ */
+long Sheet::sortCSVFile(const String &src_filename, const String &dest_filename,
+                        const List &colnames, const char *orders,
+                        const char *src_charset, const char *dest_charset,
+                        const char *return_str, long memory_limit) {
+    CharsetStream cs_in, cs_out;
+    TSheetWriter writer, run_writer;
+    TCSVField field;
+    String pending, rest, cell_data, colname, buf_str, run_buf;
+    FILE *fpin, *fpout;
+    const char *text, *value, **cells;
+    char *block, *buf, *key_orders;
+    long *key_cols;
+    int *runs, fd;
+    long text_len, pos, rec_end, length, value_len, buf_size;
+    long col, col_max, row, keys, run_bytes, run_count, run_capacity, i;
+    bool header, finished, error;
+
+    (*this).clear();
+    if (memory_limit < SHEET_RUN_BUF_MIN * 2) {
+        memory_limit = SHEET_RUN_BUF_MIN * 2;
+    }
+
+    fpin = fopen(src_filename.c_str(), "rb");
+    if (fpin == (FILE *)NULL) {
+        return -1;
+    }
+    if (src_charset == NULL || src_charset[0] == '\0') {
+        src_charset = "AUTODETECT";
+    }
+    cs_in.open(src_charset, "UTF-8");
+
+    block = new char [SHEET_READ_SIZE];
+    buf_size = 256;
+    buf = new char [buf_size];
+    key_cols = new long [colnames.max() + 1];
+    key_orders = new char [colnames.max() + 1];
+    keys = 0;
+    cells = (const char **)NULL;
+    run_capacity = 16;
+    runs = new int [run_capacity];
+    run_count = 0;
+    run_bytes = 0;
+    col_max = 0;
+    header = true;
+    finished = false;
+    error = false;
+    writer.fd = -1;
+    writer.fp = (FILE *)NULL;
+    writer.cs = &cs_out;
+    writer.returnStr = return_str;
+    writer.buf = &buf_str;
+    writer.error = false;
+    buf_str.useAsBinary(0);
+    pending.useAsBinary(0);
+
+    // rows are read into the sheet, and written to a sorted run when it is full
+    while (!finished && !error) {
+        length = (long)fread(block, 1, SHEET_READ_SIZE, fpin);
+        if (0 < length) {
+            cs_in.decode(block, length, pending);
+        } else {
+            cs_in.decodeFlush(pending);
+            finished = true;
+            error = (ferror(fpin) != 0);
+        }
+
+        text = pending.c_str();
+        text_len = pending.binaryLength();
+        pos = 0;
+        while (pos < text_len) {
+            // a record reaching the end of the text waits for the rest
+            rec_end = pos;
+            do {
+                length = _nextCSVField(text, text_len, rec_end, &field);
+                rec_end += length;
+            } while (0 < length && !field.lineEnd);
+            if (text_len <= rec_end && !finished) {
+                break;
+            }
+
+            if (header) {
+                // BOM of UTF-8 is not a part of the first column name
+                if (pos == 0 && 3 <= rec_end && !memcmp(text, "\xEF\xBB\xBF", 3)) {
+                    pos = 3;
+                }
+                while (pos < rec_end) {
+                    pos += _nextCSVField(text, text_len, pos, &field);
+                    if (buf_size <= field.length) {
+                        delete [] buf;
+                        buf_size = field.length + 1;
+                        buf = new char [buf_size];
+                    }
+                    value = _getCSVFieldText(&field, cell_data, buf, &value_len);
+                    colname.set(value, value_len);
+                    (*this).addCol(colname);
+                    col_max++;
+                }
+                keys = (*this).keyCols(colnames, orders, key_cols, key_orders);
+                cells = new const char * [col_max];
+                header = false;
+                continue;
+            }
+
+            (*this).addRow();
+            row = (*this).rowsMax - 1;
+            run_bytes += rec_end - pos + (long)sizeof(long) * (col_max + keys * 3 + 1);
+            for (col = 0; pos < rec_end; col++) {
+                pos += _nextCSVField(text, text_len, pos, &field);
+                // fields over the columns are skipped
+                if (col_max <= col) {
+                    continue;
+                }
+                if (buf_size <= field.length) {
+                    delete [] buf;
+                    buf_size = field.length + 1;
+                    buf = new char [buf_size];
+                }
+                value = _getCSVFieldText(&field, cell_data, buf, &value_len);
+                (*this).storeCell(col, row, value, value_len);
+            }
+
+            if (memory_limit / 2 <= run_bytes) {
+                fd = _addSheetRun(&runs, &run_count, &run_capacity);
+                if (fd < 0 || !(*this).writeRun(fd, key_cols, key_orders, keys)) {
+                    error = true;
+                    break;
+                }
+                run_bytes = 0;
+            }
+        }
+        rest.setBinary(text + pos, text_len - pos);
+        pending.setBinary(rest.c_str(), rest.binaryLength());
+    }
+    fclose(fpin);
+
+    // the last rows go to a run too if the others are in runs
+    if (!error && 0 < run_count && 0 < (*this).rowsMax) {
+        fd = _addSheetRun(&runs, &run_count, &run_capacity);
+        if (fd < 0 || !(*this).writeRun(fd, key_cols, key_orders, keys)) {
+            error = true;
+        }
+    }
+
+    if (!error) {
+        fpout = fopen(dest_filename.c_str(), "wb");
+        if (fpout == (FILE *)NULL) {
+            error = true;
+        } else if (!header) {
+            if (dest_charset == NULL || dest_charset[0] == '\0') {
+                dest_charset = cs_in.srcCharSet();
+            }
+            cs_out.open("UTF-8", dest_charset);
+            writer.fp = fpout;
+            for (col = 0; col < col_max; col++) {
+                cells[col] = (*this).columns[col].c_str();
+            }
+            _writeSheetRecord(&writer, cells, col_max);
+
+            if (run_count <= 0) {
+                // all rows are in memory
+                (*this).sortRowsByCols(key_cols, key_orders, keys);
+                for (row = 0; row < (*this).rowsMax; row++) {
+                    for (col = 0; col < col_max; col++) {
+                        cells[col] = (*this).cell(col, row);
+                    }
+                    _writeSheetRecord(&writer, cells, col_max);
+                }
+            } else {
+                (*this).clear();
+
+                // too many runs are merged into one in advance (keeping their order)
+                run_writer.fp = (FILE *)NULL;
+                run_writer.cs = (CharsetStream *)NULL;
+                run_writer.returnStr = NULL;
+                run_writer.buf = &run_buf;
+                run_writer.error = false;
+                run_buf.useAsBinary(0);
+                while (!error && SHEET_MERGE_MAX < run_count) {
+                    run_writer.fd = _openSheetRunFile();
+                    if (run_writer.fd < 0 ||
+                            !_mergeSheetRuns(runs, SHEET_MERGE_MAX, col_max, key_cols, key_orders, keys,
+                                             memory_limit, &run_writer)) {
+                        error = true;
+                        break;
+                    }
+                    _flushSheetWriter(&run_writer, true);
+                    error = run_writer.error;
+                    fd = run_writer.fd;
+                    for (i = 0; i < SHEET_MERGE_MAX; i++) {
+                        close(runs[i]);
+                    }
+                    runs[0] = fd;
+                    memmove(&(runs[1]), &(runs[SHEET_MERGE_MAX]), sizeof(int) * (run_count - SHEET_MERGE_MAX));
+                    run_count -= SHEET_MERGE_MAX - 1;
+                }
+                if (!error) {
+                    error = !_mergeSheetRuns(runs, run_count, col_max, key_cols, key_orders, keys,
+                                             memory_limit, &writer);
+                }
+            }
+            _flushSheetWriter(&writer, true);
+            error = (error || writer.error);
+        }
+        if (fpout != (FILE *)NULL) {
+            if (fclose(fpout) != 0) {
+                error = true;
+            }
+            // partial output is not left as if it were sorted
+            if (error) {
+                unlink(dest_filename.c_str());
+            }
+        }
+    }
+
+    for (i = 0; i < run_count; i++) {
+        close(runs[i]);
+    }
+    delete [] runs;
+    if (cells != (const char **)NULL) {
+        delete [] cells;
+    }
+    delete [] key_orders;
+    delete [] key_cols;
+    delete [] buf;
+    delete [] block;
+    pending.clear();
+    rest.clear();
+    buf_str.clear();
+    run_buf.clear();
+    (*this).clear();
+
+    return error?-1:keys;
+}
+
 } // namespace apolloron
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <unistd.h>
 
@@ -39,6 +40,7 @@ String::String() {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -57,6 +59,7 @@ String::String(const String &value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -77,6 +80,7 @@ String::String(const char *value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -97,6 +101,7 @@ String::String(long value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -117,6 +122,7 @@ String::String(int value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -137,6 +143,7 @@ String::String(char value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -157,6 +164,7 @@ String::String(double value) {
     *((*this).pTmp) = NULL;
     (*this).pTmpLen = new long;
     *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
     (*this).nLength = 0;
     (*this).nCapacity = 0;
     (*this).nFixedLength = 0;
@@ -167,6 +175,32 @@ String::String(double value) {
 }
 
 
+#if __cplusplus >= 201103L
+/*! Move constructor of String
+    @param value  String to move (released if it is a temporary String)
+    @return void
+ */
+String::String(String &&value) {
+    (*this).pText = NULL;
+    (*this).pTmp = new (String **);
+    *((*this).pTmp) = NULL;
+    (*this).pTmpLen = new long;
+    *((*this).pTmpLen) = 0;
+    (*this).pTmpOwner = NULL;
+    (*this).nLength = 0;
+    (*this).nCapacity = 0;
+    (*this).nFixedLength = 0;
+    (*this).nBinaryLength = -1;
+    (*this).nLengthRenewRecommended = false;
+
+    (*this).take(value);
+    if (value.pTmpOwner != NULL) {
+        (*(value.pTmpOwner)).releaseTmpStr(&value);
+    }
+}
+#endif
+
+
 /*! Destructor of String
     @param void
     @return void
@@ -189,20 +223,26 @@ String::~String() {
     @return Pointer of a temporary String.
  */
 String* String::tmpStr() const {
+    String *tmp;
+    long n;
+
+    n = *((*this).pTmpLen);
     if (*((*this).pTmp) == NULL) {
         *((*this).pTmp) = new String * [1];
-        **((*this).pTmp) = new String;
-        *((*this).pTmpLen) = 1L;
-    } else {
+    } else if (0 < n && (n & (n - 1)) == 0) {
+        // the array is full at a power of two; double it
         String **ptmptmp;
-        ptmptmp = new String * [(*((*this).pTmpLen)) + 1];
-        memcpy(ptmptmp, *((*this).pTmp), sizeof(String *) * (*((*this).pTmpLen)));
+        ptmptmp = new String * [n * 2];
+        memcpy(ptmptmp, *((*this).pTmp), sizeof(String *) * n);
         delete [] *((*this).pTmp);
         *((*this).pTmp) = ptmptmp;
-        (*((*this).pTmp))[*((*this).pTmpLen)] = new String;
-        (*((*this).pTmpLen))++;
     }
-    return (*((*this).pTmp))[*((*this).pTmpLen) - 1];
+    tmp = new String;
+    (*tmp).pTmpOwner = this;
+    (*((*this).pTmp))[n] = tmp;
+    *((*this).pTmpLen) = n + 1;
+
+    return tmp;
 }
 
 
@@ -234,6 +274,83 @@ bool String::clearTmpStr() const {
 }
 
 
+/*! Take memory of a String
+    @param value  String to take memory from (gets the old memory of this String)
+    @retval true  success
+    @retval false failure
+ */
+bool String::take(String &value) {
+    char *text;
+    long length, capacity, fixed_length, binary_length;
+
+    length = value.len();
+    text = (*this).pText;
+    capacity = (*this).nCapacity;
+    fixed_length = (*this).nFixedLength;
+    binary_length = (*this).nBinaryLength;
+
+    (*this).pText = value.pText;
+    (*this).nLength = length;
+    (*this).nLengthRenewRecommended = false;
+    (*this).nCapacity = value.nCapacity;
+    (*this).nFixedLength = value.nFixedLength;
+    (*this).nBinaryLength = value.nBinaryLength;
+
+    value.pText = text;
+    value.nLength = 0;
+    value.nLengthRenewRecommended = true;
+    value.nCapacity = capacity;
+    value.nFixedLength = fixed_length;
+    value.nBinaryLength = binary_length;
+
+    return true;
+}
+
+
+/*! Delete a temporary String before gc()
+    @param tmp  temporary String of this String
+    @retval true  success
+    @retval false tmp is not a temporary String of this String
+ */
+bool String::releaseTmpStr(const String *tmp) const {
+    long i, n;
+
+    n = *((*this).pTmpLen);
+    for (i = n - 1; 0 <= i; i--) {
+        if ((*((*this).pTmp))[i] == tmp) {
+            delete (*((*this).pTmp))[i];
+            memmove(*((*this).pTmp) + i, *((*this).pTmp) + i + 1, sizeof(String *) * (n - i - 1));
+            (*((*this).pTmp))[n - 1] = NULL;
+            if (n == 1) {
+                delete [] *((*this).pTmp);
+                *((*this).pTmp) = NULL;
+            }
+            *((*this).pTmpLen) = n - 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*! Check if a String is deleted with the temporary Strings of this String
+    @param tmp  String to check
+    @retval true  tmp is a temporary String of this String (or of its temporary String)
+    @retval false otherwise
+ */
+bool String::ownsTmpStr(const String *tmp) const {
+    while (tmp != NULL) {
+        if ((*tmp).pTmpOwner == this) {
+            return true;
+        }
+        tmp = (*tmp).pTmpOwner;
+    }
+
+    return false;
+}
+
+
 /*! Check if String is empty (text mode)
     @param void
     @retval true  empty
@@ -484,6 +601,9 @@ long String::width(const char * src_charset) const {
         } else {
             src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'B');
         }
+    } else if (CHARSET_INFO[charsetHandle(src_charset)].family == CHARSET_UTF8) {
+        // invalid bytes are counted as they are
+        return utf8_width((*this).pText, (long)strlen((*this).pText));
     } else {
         src_utf8 = charset_convert((*this).pText, src_charset, STR_UTF8);
     }
@@ -640,9 +760,11 @@ double String::toDouble() const {
 
 
 char& String::operator [] (long index) {
-    static  char  tmp = 0;
+    static __thread char tmp = 0;
 
     if (index < 0 || ((*this).nFixedLength <= index && (*this).nLength <= index)) {
+        // a dummy per thread, so that writes through it do not race
+        tmp = 0;
         return tmp;
     }
 
@@ -653,9 +775,10 @@ char& String::operator [] (long index) {
 
 
 char& String::operator [] (int index) {
-    static  char  tmp = 0;
+    static __thread char tmp = 0;
 
     if (index < 0 || ((*this).nFixedLength <= index && (*this).nLength <= index)) {
+        tmp = 0;
         return tmp;
     }
 
@@ -668,6 +791,13 @@ char& String::operator [] (int index) {
 bool String::set(const String &value) {
     long length, fsize, max;
 
+    if ((*this).ownsTmpStr(&value) && value.pText != NULL) {
+        // value is deleted with the temporary Strings, so take its memory
+        (*this).take((String &)value);
+        (*this).clearTmpStr();
+        return true;
+    }
+
     length = value.len();
     fsize = value.fixedLength();
     max = (fsize < length)?length:fsize;
@@ -1111,6 +1241,27 @@ const String& String::operator = (const String &value) {
 }
 
 
+#if __cplusplus >= 201103L
+const String& String::operator = (String &&value) {
+    const String *owner;
+
+    if (&value == this) {
+        return *this;
+    }
+
+    // a temporary String of another String is released at once
+    owner = (*this).ownsTmpStr(&value)?NULL:value.pTmpOwner;
+    (*this).take(value);
+    (*this).clearTmpStr();
+    if (owner != NULL) {
+        (*owner).releaseTmpStr(&value);
+    }
+
+    return *this;
+}
+#endif
+
+
 const String& String::operator = (const char *value) {
     set(value);
 
@@ -7255,6 +7406,76 @@ String& String::evalText(const Keys replace_keys) const {
 }
 
 
+/*! Handle of character set of input ("" or NULL means AUTODETECT)
+    @param charset  Name of character set
+    @return Handle
+ */
+static TCharset src_handle(const char *charset) {
+    if (charset == NULL || charset[0] == '\0') {
+        return CHARSET_AUTODETECT;
+    }
+    return charsetHandle(charset);
+}
+
+
+/*! Convert text to UTF-8 (including UTF-16 and UTF-32)
+    @param str            Source text.
+    @param length         Byte size of str.
+    @param src_charset    Character set of input.
+    @param src_name       Name of src_charset given by the caller (can be NULL)
+    @param result_length  Byte size of converted text. (can be NULL)
+    @return Converted text
+ */
+static char* decode_to_utf8(const char *str, long length, TCharset src_charset, const char *src_name,
+                            long *result_length) {
+    long l;
+
+    switch (CHARSET_INFO[src_charset].family) {
+    case CHARSET_UTF16:
+        return utf16_to_utf8(str, length, CHARSET_INFO[src_charset].endian, (result_length != NULL)?result_length:&l);
+    case CHARSET_UTF32:
+        return utf32_to_utf8(str, length, CHARSET_INFO[src_charset].endian, (result_length != NULL)?result_length:&l);
+    case CHARSET_UNKNOWN:
+        if (src_name != NULL) {
+            // iconv may know the name
+            return charset_convert(str, length, src_name, STR_UTF8, result_length);
+        }
+        break;
+    default:
+        break;
+    }
+
+    return charset_convert(str, length, src_charset, CHARSET_UTF8, result_length);
+}
+
+
+/*! Convert UTF-8 text to a character set (including UTF-16 and UTF-32)
+    @param utf8           Source text. (utf8[length] must be '\0')
+    @param length         Byte size of utf8.
+    @param dest_charset   Character set of output.
+    @param result_length  Byte size of converted text.
+    @return Converted text
+ */
+static char* encode_from_utf8(const char *utf8, long length, TCharset dest_charset, long *result_length) {
+    char en;
+
+    en = CHARSET_INFO[dest_charset].endian;
+    if (CHARSET_INFO[dest_charset].bom) {
+        en = (en == 'l')?'L':'B';
+    }
+    switch (CHARSET_INFO[dest_charset].family) {
+    case CHARSET_UTF16:
+        return utf8_to_utf16(utf8, length, result_length, en);
+    case CHARSET_UTF32:
+        return utf8_to_utf32(utf8, length, result_length, en);
+    default:
+        break;
+    }
+
+    return charset_convert(utf8, length, CHARSET_UTF8, dest_charset, result_length);
+}
+
+
 /*! Convert HTML to plain text
     @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
     @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
@@ -7277,25 +7498,14 @@ String& String::convertHTMLToPlain(const char *src_charset, const char *dest_cha
     } tag = TAG_UNKNOWN;
     bool instyle, inscript;
     long i, j, length;
+    TCharset src, dest;
 
-    if (!strncasecmp(src_charset, "UTF-16", 6) || !strncasecmp(src_charset, "UTF16", 5)) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
-    } else if (!strncasecmp(src_charset, "UTF-32", 6) || !strncasecmp(src_charset, "UTF32", 5)) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
+    src = src_handle(src_charset);
+    if (CHARSET_INFO[src].family == CHARSET_UTF16 || CHARSET_INFO[src].family == CHARSET_UTF32) {
+        src_utf8 = decode_to_utf8((*this).pText, (*this).binaryLength(), src, NULL, NULL);
     } else {
-        src_utf8 = charset_convert((*this).pText, src_charset, STR_UTF8);
+        src_utf8 = decode_to_utf8((*this).pText, ((*this).pText != NULL)?(long)strlen((*this).pText):0L,
+                                  src, src_charset, NULL);
     }
     if (src_utf8) {
         String html;
@@ -7439,40 +7649,16 @@ String& String::convertHTMLToPlain(const char *src_charset, const char *dest_cha
         }
         buf[j] = '\0';
 
-        if (!strncasecmp(dest_charset, "UTF-16", 6) || !strncasecmp(dest_charset, "UTF16", 5)) {
-            int bom = strcasestr(dest_charset, "BOM")?1:0;
-            if (strcasestr(dest_charset, "LE") != NULL) {
-                buf1 = utf8_to_utf16(buf, &j, bom?'L':'l');
-            } else if (strcasestr(dest_charset, "BE") != NULL) {
-                buf1 = utf8_to_utf16(buf, &j, bom?'B':'b');
-            } else {
-                buf1 = utf8_to_utf16(buf, &j, 'B');
-            }
-            if (buf1 != NULL) {
-                delete [] buf;
-                buf = buf1;
-                (*tmp).pTextReplace((char *)buf, -1, j, j);
-                (*tmp).useAsBinary(j);
-            }
-        } else if (!strncasecmp(dest_charset, "UTF-32", 6) || !strncasecmp(dest_charset, "UTF32", 5)) {
-            int bom = strcasestr(dest_charset, "BOM")?1:0;
-            if (strcasestr(dest_charset, "LE") != NULL) {
-                buf1 = utf8_to_utf32(buf, &j, bom?'L':'l');
-            } else if (strcasestr(dest_charset, "BE") != NULL) {
-                buf1 = utf8_to_utf32(buf, &j, bom?'B':'b');
-            } else {
-                buf1 = utf8_to_utf32(buf, &j, 'B');
-            }
-            if (buf1 != NULL) {
-                delete [] buf;
-                buf = buf1;
-                (*tmp).pTextReplace((char *)buf, -1, j, j);
-                (*tmp).useAsBinary(j);
-            }
+        dest = charsetHandle(dest_charset);
+        buf1 = encode_from_utf8(buf, (long)strlen(buf), dest, &j);
+        delete [] buf;
+        if (buf1 == NULL) {
+            (*tmp).useAsText();
+            *tmp = "";
+        } else if (CHARSET_INFO[dest].family == CHARSET_UTF16 || CHARSET_INFO[dest].family == CHARSET_UTF32) {
+            (*tmp).pTextReplace(buf1, -1, j, j);
+            (*tmp).useAsBinary(j);
         } else {
-            buf1 = charset_convert(buf, STR_UTF8, dest_charset);
-            delete [] buf;
-
             (*tmp).useAsText();
             (*tmp).pTextReplace(buf1, -1, -1, -1);
         }
@@ -7770,76 +7956,97 @@ String& String::convertPlainToHTML(const char *src_charset, const char *dest_cha
     @return Temporary string object
  */
 String& String::strconv(const char *src_charset, const char *dest_charset) const {
-    String *tmp = (*this).tmpStr();
-    char *buf, *buf2, *utf8buf;
-    const char *dest_ch;
-    long length;
+    return (*this).strconv(src_charset, dest_charset, 1);
+}
+
+
+/*! Convert character set of string, on threads for large text
+    @param src_charset  Character set of input. (ex. "UTF-8", "EUC-JP", etc..)
+    @param dest_charset Character set of output. (ex. "UTF-8", "EUC-JP", etc..)
+    @param threads      Number of threads. Text of stateless character sets is cut
+                        at line ends and converted on the threads at once.
+    @return Temporary string object
+ */
+String& String::strconv(const char *src_charset, const char *dest_charset, int threads) const {
+    TCharset src;
 
     if (dest_charset == NULL) {
-        return *tmp;
+        return *((*this).tmpStr());
     }
 
-    utf8buf = NULL;
-    if (src_charset != NULL && (!strncasecmp(src_charset, "UTF-16", 6) || !strncasecmp(src_charset, "UTF16", 5))) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            utf8buf = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            utf8buf = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            utf8buf = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
-    } else if (src_charset != NULL && (!strncasecmp(src_charset, "UTF-32", 6) || !strncasecmp(src_charset, "UTF32", 5))) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            utf8buf = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            utf8buf = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            utf8buf = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
+    src = src_handle(src_charset);
+#if __ICONV == 1
+    if (src == CHARSET_UNKNOWN) {
+        // iconv may know the name
+        String *tmp = (*this).tmpStr();
+        char *buf;
+        long length;
+
+        buf = decode_to_utf8((*this).pText, (*this).isBinary()?(*this).binaryLength():(*this).len(),
+                             src, src_charset, &length);
+        (*tmp).useAsText();
+        (*tmp).pTextReplace(buf, length, -1, length + 1);
+        *tmp = (*tmp).strconv(CHARSET_UTF8, charsetHandle(dest_charset), threads);
+        return *tmp;
     }
+#endif
 
-    if (!strncasecmp(dest_charset, "UTF-16", 6) || !strncasecmp(dest_charset, "UTF16", 5) ||
-            !strncasecmp(dest_charset, "UTF-32", 6) || !strncasecmp(dest_charset, "UTF32", 5)) {
-        dest_ch = STR_UTF8;
-    } else {
-        dest_ch = dest_charset;
+    return (*this).strconv(src, charsetHandle(dest_charset), threads);
+}
+
+
+/*! Convert character set of string
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8, CHARSET_AUTODETECT, etc..)
+    @param dest_charset Character set of output. (ex. CHARSET_UTF8, CHARSET_JIS, etc..)
+    @return Temporary string object
+ */
+String& String::strconv(TCharset src_charset, TCharset dest_charset) const {
+    return (*this).strconv(src_charset, dest_charset, 1);
+}
+
+
+/*! Convert character set of string, on threads for large text
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8, CHARSET_EUCJP, etc..)
+    @param dest_charset Character set of output. (ex. CHARSET_UTF8, CHARSET_EUCJP, etc..)
+    @param threads      Number of threads. ISO-2022-JP and UTF-7 are converted on one thread.
+    @return Temporary string object
+ */
+String& String::strconv(TCharset src_charset, TCharset dest_charset, int threads) const {
+    String *tmp = (*this).tmpStr();
+    char *buf, *buf2, *utf8buf;
+    TCharset src_family, dest_family, dest_ch;
+    long length, src_length, utf8_length;
+
+    if (src_charset < CHARSET_UNKNOWN || CHARSET_MAX <= src_charset) {
+        src_charset = CHARSET_UNKNOWN;
+    }
+    if (dest_charset < CHARSET_UNKNOWN || CHARSET_MAX <= dest_charset) {
+        dest_charset = CHARSET_UNKNOWN;
     }
+    src_family = CHARSET_INFO[src_charset].family;
+    dest_family = CHARSET_INFO[dest_charset].family;
 
+    src_length = (*this).isBinary()?(*this).binaryLength():(*this).len();
+
+    // UTF-16 and UTF-32 go through UTF-8
+    dest_ch = (dest_family == CHARSET_UTF16 || dest_family == CHARSET_UTF32)?CHARSET_UTF8:dest_charset;
+    utf8buf = NULL;
+    if (src_family == CHARSET_UTF16 || src_family == CHARSET_UTF32) {
+        utf8buf = decode_to_utf8((*this).pText, src_length, src_charset, NULL, &utf8_length);
+    }
     if (utf8buf != NULL) {
-        buf = charset_convert(utf8buf, STR_UTF8, dest_ch);
+        buf = charset_convert(utf8buf, utf8_length, CHARSET_UTF8, dest_ch, &length, threads);
         delete [] utf8buf;
     } else {
-        buf = charset_convert((*this).pText, src_charset, dest_ch);
+        buf = charset_convert((*this).pText, src_length, src_charset, dest_ch, &length, threads);
     }
 
-    if (!strncasecmp(dest_charset, "UTF-16", 6) || !strncasecmp(dest_charset, "UTF16", 5)) {
-        int bom = strcasestr(dest_charset, "BOM")?1:0;
-        if (strcasestr(dest_charset, "LE") != NULL) {
-            buf2 = utf8_to_utf16(buf, &length, bom?'L':'l');
-        } else if (strcasestr(dest_charset, "BE") != NULL) {
-            buf2 = utf8_to_utf16(buf, &length, bom?'B':'b');
-        } else {
-            buf2 = utf8_to_utf16(buf, &length, 'B');
-        }
-        delete [] buf;
-        buf = buf2;
+    if (dest_family == CHARSET_UTF16 || dest_family == CHARSET_UTF32) {
         if (buf != NULL) {
-            (*tmp).useAsBinary(length);
-            (*tmp).pTextReplace((char *)buf, 0, length, length);
-        } else {
-            *tmp = "";
-        }
-    } else if (!strncasecmp(dest_charset, "UTF-32", 6) || !strncasecmp(dest_charset, "UTF32", 5)) {
-        int bom = strcasestr(dest_charset, "BOM")?1:0;
-        if (strcasestr(dest_charset, "LE") != NULL) {
-            buf2 = utf8_to_utf32(buf, &length, bom?'L':'l');
-        } else if (strcasestr(dest_charset, "BE") != NULL) {
-            buf2 = utf8_to_utf32(buf, &length, bom?'B':'b');
-        } else {
-            buf2 = utf8_to_utf32(buf, &length, 'B');
+            buf2 = encode_from_utf8(buf, length, dest_charset, &length);
+            delete [] buf;
+            buf = buf2;
         }
-        delete [] buf;
-        buf = buf2;
         if (buf != NULL) {
             (*tmp).useAsBinary(length);
             (*tmp).pTextReplace((char *)buf, 0, length, length);
@@ -7848,10 +8055,8 @@ String& String::strconv(const char *src_charset, const char *dest_charset) const
         }
     } else {
         if (buf != NULL) {
-            long len;
-            len = strlen(buf);
             (*tmp).useAsText();
-            (*tmp).pTextReplace((char *)buf, len, -1, len + 1);
+            (*tmp).pTextReplace((char *)buf, length, -1, length + 1);
         } else {
             *tmp = "";
         }
@@ -7861,6 +8066,46 @@ String& String::strconv(const char *src_charset, const char *dest_charset) const
 }
 
 
+/*! Convert character set of string into a caller supplied buffer
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8, CHARSET_EUCJP, etc..)
+    @param dest_charset Character set of output. (ex. CHARSET_UTF8, CHARSET_EUCJP, etc..)
+    @param buf          Output buffer. (can be NULL when size is 0)
+    @param size         Byte size of buf.
+    @return Byte size of converted text (may exceed size, as snprintf),
+            or -1 on error. buf is '\0' terminated when the result fits.
+ */
+long String::strconv(TCharset src_charset, TCharset dest_charset, char *buf, long size) const {
+    String tmp;
+    TCharset src_family, dest_family;
+    long length;
+
+    if (src_charset < CHARSET_UNKNOWN || CHARSET_MAX <= src_charset) {
+        src_charset = CHARSET_UNKNOWN;
+    }
+    if (dest_charset < CHARSET_UNKNOWN || CHARSET_MAX <= dest_charset) {
+        dest_charset = CHARSET_UNKNOWN;
+    }
+    src_family = CHARSET_INFO[src_charset].family;
+    dest_family = CHARSET_INFO[dest_charset].family;
+
+    // UTF-16 and UTF-32 are converted aside and copied
+    if (src_family == CHARSET_UTF16 || src_family == CHARSET_UTF32 ||
+            dest_family == CHARSET_UTF16 || dest_family == CHARSET_UTF32) {
+        tmp = (*this).strconv(src_charset, dest_charset);
+        length = tmp.isBinary()?tmp.binaryLength():tmp.len();
+        if (buf != NULL && 0 < size) {
+            memcpy(buf, tmp.c_str(), (length < size)?length:size);
+            if (length < size) {
+                buf[length] = '\0';
+            }
+        }
+        return length;
+    }
+
+    length = (*this).isBinary()?(*this).binaryLength():(*this).len();
+    return charset_convert((*this).pText, length, src_charset, dest_charset, buf, size);
+}
+
 const char* String::detectCharSet() const {
     const char *str;
     str = (*this).pText;
@@ -7927,39 +8172,113 @@ const char* String::detectCharSetJP() const {
 }
 
 
+/*! Character set from BOM of UTF-16 or UTF-32
+    @param str     text
+    @param length  byte size of str
+    @return Character set, or NULL if str has no BOM of UTF-16 or UTF-32
+ */
+static const char* detect_bom(const char *str, long length) {
+    if (length < 4) {
+        return NULL;
+    }
+    if ((const unsigned char)str[0] == (const unsigned char)'\xFF' &&
+            (const unsigned char)str[1] == (const unsigned char)'\xFE') {
+        if ((const unsigned char)str[2] == (const unsigned char)'\x00' &&
+                (const unsigned char)str[3] == (const unsigned char)'\x00') {
+            return STR_UTF32LE;
+        }
+        return STR_UTF16LE;
+    } else if ((const unsigned char)str[0] == (const unsigned char)'\xFE' &&
+            (const unsigned char)str[1] == (const unsigned char)'\xFF') {
+        return STR_UTF16BE;
+    } else if ((const unsigned char)str[0] == (const unsigned char)'\x00' &&
+            (const unsigned char)str[1] == (const unsigned char)'\x00' &&
+            (const unsigned char)str[2] == (const unsigned char)'\xFE' &&
+            (const unsigned char)str[3] == (const unsigned char)'\xFF') {
+        return STR_UTF32BE;
+    }
+
+    return NULL;
+}
+
+
+/*! Detect character set from a prefix of the string
+    @param limit       maximum bytes to judge (0: judge the whole text)
+    @param confidence  CHARSET_CONFIDENCE_HIGH, CHARSET_CONFIDENCE_MEDIUM or
+                       CHARSET_CONFIDENCE_LOW (can be NULL)
+    @return Character set
+ */
+const char* String::detectCharSet(long limit, int *confidence) const {
+    const char *charset;
+    long length;
+
+    length = (*this).isBinary()?(*this).binaryLength():(*this).len();
+    charset = detect_bom((*this).pText, length);
+    if (charset != NULL) {
+        if (confidence != NULL) *confidence = CHARSET_CONFIDENCE_HIGH;
+        return charset;
+    }
+
+    return auto_detect((*this).pText, length, limit, confidence);
+}
+
+
+/*! Detect japanese character set from a prefix of the string
+    @param limit       maximum bytes to judge (0: judge the whole text)
+    @param confidence  confidence of the result (can be NULL)
+    @return Character set
+ */
+const char* String::detectCharSetJP(long limit, int *confidence) const {
+    const char *charset;
+    long length;
+
+    length = (*this).isBinary()?(*this).binaryLength():(*this).len();
+    charset = detect_bom((*this).pText, length);
+    if (charset != NULL) {
+        if (confidence != NULL) *confidence = CHARSET_CONFIDENCE_HIGH;
+        return charset;
+    }
+
+    return jis_auto_detect((*this).pText, length, limit, confidence);
+}
+
+
 /*! Change return code
     @param return_str  String of return code (ex. "\r\n")
     @return Temporary string object
  */
 String& String::changeReturnCode(const char * return_str) const {
     String *tmp = (*this).tmpStr();
-    char *buf, ch;
-    long i, j, ret_len, length;
+    char *buf;
+    long i, j, k, ret_len, length, size;
 
     (*tmp).useAsText();
 
     if (return_str != NULL) {
         length = (*this).len();
         ret_len = strlen(return_str);
-        buf = new char[(length * ret_len) + 1];
+        size = length * ((1 < ret_len)?ret_len:1) + 1;
+        buf = new char[size];
+        i = 0;
         j = 0;
-        for (i = 0; i < length; i++) {
-            ch = (*this).pText[i];
-            if (ch == '\r' && (*this).pText[i+1] == '\n') {
-                strcpy(buf + j, return_str);
-                j += ret_len;
+        while (i < length) {
+            // copy the run up to the next line break at once
+            k = strcspn((*this).pText + i, "\r\n");
+            memcpy(buf + j, (*this).pText + i, k);
+            i += k;
+            j += k;
+            if (length <= i) {
+                break;
+            }
+            if ((*this).pText[i] == '\r' && (*this).pText[i+1] == '\n') {
                 i++;
-            } else if (ch == '\r' || ch == '\n') {
-                strcpy(buf + j, return_str);
-                j += ret_len;
-            } else {
-                buf[j] = ch;
-                j++;
             }
+            memcpy(buf + j, return_str, ret_len);
+            j += ret_len;
+            i++;
         }
         buf[j] = '\0';
-        *tmp = buf;
-        delete [] buf;
+        (*tmp).pTextReplace(buf, j, -1, size);
     } else {
         *tmp = (*this).pText;
     }
@@ -7987,63 +8306,28 @@ String& String::changeWidth(const char *option, const char *src_charset, const c
     char *buf, *buf1;
     char *src_utf8;
     long j;
+    TCharset src, dest;
 
-    if (!strncasecmp(src_charset, "UTF-16", 6) || !strncasecmp(src_charset, "UTF16", 5)) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            src_utf8 = utf16_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
-    } else if (!strncasecmp(src_charset, "UTF-32", 6) || !strncasecmp(src_charset, "UTF32", 5)) {
-        if (strcasestr(src_charset, "BE") != NULL) {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'b');
-        } else if (strcasestr(src_charset, "LE") != NULL) {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'l');
-        } else {
-            src_utf8 = utf32_to_utf8((*this).pText, (*this).binaryLength(), 'B');
-        }
+    src = src_handle(src_charset);
+    if (CHARSET_INFO[src].family == CHARSET_UTF16 || CHARSET_INFO[src].family == CHARSET_UTF32) {
+        src_utf8 = decode_to_utf8((*this).pText, (*this).binaryLength(), src, NULL, NULL);
     } else {
-        src_utf8 = charset_convert((*this).pText, src_charset, STR_UTF8);
+        src_utf8 = decode_to_utf8((*this).pText, ((*this).pText != NULL)?(long)strlen((*this).pText):0L,
+                                  src, src_charset, NULL);
     }
     if (src_utf8) {
         buf = utf8_change_width(src_utf8, option);
 
-        if (!strncasecmp(dest_charset, "UTF-16", 6) || !strncasecmp(dest_charset, "UTF16", 5)) {
-            int bom = strcasestr(dest_charset, "BOM")?1:0;
-            if (strcasestr(dest_charset, "LE") != NULL) {
-                buf1 = utf8_to_utf16(buf, &j, bom?'L':'l');
-            } else if (strcasestr(dest_charset, "BE") != NULL) {
-                buf1 = utf8_to_utf16(buf, &j, bom?'B':'b');
-            } else {
-                buf1 = utf8_to_utf16(buf, &j, 'B');
-            }
-            if (buf1 != NULL) {
-                delete [] buf;
-                buf = buf1;
-                (*tmp).pTextReplace((char *)buf, -1, j, j);
-                (*tmp).useAsBinary(j);
-            }
-        } else if (!strncasecmp(dest_charset, "UTF-32", 6) || !strncasecmp(dest_charset, "UTF32", 5)) {
-            int bom = strcasestr(dest_charset, "BOM")?1:0;
-            if (strcasestr(dest_charset, "LE") != NULL) {
-                buf1 = utf8_to_utf32(buf, &j, bom?'L':'l');
-            } else if (strcasestr(dest_charset, "BE") != NULL) {
-                buf1 = utf8_to_utf32(buf, &j, bom?'B':'b');
-            } else {
-                buf1 = utf8_to_utf32(buf, &j, 'B');
-            }
-            if (buf1 != NULL) {
-                delete [] buf;
-                buf = buf1;
-                (*tmp).pTextReplace((char *)buf, -1, j, j);
-                (*tmp).useAsBinary(j);
-            }
+        dest = charsetHandle(dest_charset);
+        buf1 = encode_from_utf8(buf, (long)strlen(buf), dest, &j);
+        delete [] buf;
+        if (buf1 == NULL) {
+            (*tmp).useAsText();
+            *tmp = "";
+        } else if (CHARSET_INFO[dest].family == CHARSET_UTF16 || CHARSET_INFO[dest].family == CHARSET_UTF32) {
+            (*tmp).pTextReplace(buf1, -1, j, j);
+            (*tmp).useAsBinary(j);
         } else {
-            buf1 = charset_convert(buf, STR_UTF8, dest_charset);
-            delete [] buf;
-
             (*tmp).useAsText();
             (*tmp).pTextReplace(buf1, -1, -1, -1);
         }
@@ -8390,55 +8674,120 @@ bool String::isWcMatchAll(const char *wildcard) const {
 }
 
 
+// Slot of hash table of uniq() (a line of text)
+typedef struct {
+    unsigned long hash;
+    long start; // offset of the line (-1: empty slot)
+    long length; // length of the line without '\n'
+} TUniqLine;
+
+
+/*! FNV-1a hash of a line
+    @param line    line
+    @param length  length of line
+    @return hash value
+ */
+static inline unsigned long uniq_hash(const char *line, long length) {
+    unsigned long hash = 2166136261UL;
+    long i;
+
+    for (i = 0; i < length; i++) {
+        hash = ((hash ^ (unsigned char)line[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
+
+    return hash;
+}
+
+
 /*! Transform each lines of (*this).pText to unique.
-    @param void
+    The first one of the same lines is left (in one pass with a hash table of lines).
+    @param adjacent  true: only the same lines in a row are removed (as uniq command)
     @return Temporary string object (uniqed text)
  */
-String& String::uniq() const {
+String& String::uniq(bool adjacent) const {
     String *tmp = (*this).tmpStr();
     long length;
 
     length = (*this).len();
 
     if (0 < length) {
+        const char *text, *p;
         char *buf;
-        long i, j, k;
-        long token_start, token_len;
+        TUniqLine *slots;
+        unsigned long hash;
+        long capacity, lines, pos, end, next, line_len, prev_start, prev_len, i, k;
+        bool found;
+
+        text = (*this).pText;
+        slots = (TUniqLine *)NULL;
+        capacity = 0;
+        if (!adjacent) {
+            // table is kept less than half full
+            lines = 1;
+            for (p = text; (p = (const char *)memchr(p, '\n', length - (p - text))) != NULL; p++) {
+                lines++;
+            }
+            capacity = 16;
+            while (capacity < lines * 2) {
+                capacity *= 2;
+            }
+            slots = new TUniqLine [capacity];
+            for (i = 0; i < capacity; i++) {
+                slots[i].start = -1;
+            }
+        }
 
         // Memory allocation
         buf = new char[length + 1];
-        strcpy(buf, (*this).pText);
 
         // Conversion
-        i = 0;
-        token_start = 0;
-        while (buf[i] != '\0') {
-            if (buf[i] == '\n') {
-                token_len = i - token_start;
-
-                // Delete all same lines
-                j = i;
-                while (buf[j] != '\0') {
-                    if (buf[j] == '\n' && !strncmp(&(buf[j + 1]), &(buf[token_start]), token_len) && (buf[j + token_len + 1] == '\n' || buf[j + token_len + 1] == '\0')) {
-                        k = j + 1;
-                        while (buf[k + token_len + 1] != '\0') {
-                            buf[k] = buf[k + token_len + 1];
-                            k++;
-                        }
-                        buf[k] = '\0';
-                    } else {
-                        j++;
+        k = 0;
+        pos = 0;
+        prev_start = -1;
+        prev_len = 0;
+        while (pos < length) {
+            p = (const char *)memchr(text + pos, '\n', length - pos);
+            end = (p != NULL)?(long)(p - text):length;
+            next = (p != NULL)?end + 1:length;
+            line_len = end - pos;
+            found = false;
+            if (adjacent) {
+                found = (0 <= prev_start && prev_len == line_len &&
+                         !memcmp(text + prev_start, text + pos, line_len));
+                prev_start = pos;
+                prev_len = line_len;
+            } else {
+                hash = uniq_hash(text + pos, line_len);
+                i = (long)(hash & (unsigned long)(capacity - 1));
+                while (0 <= slots[i].start) {
+                    if (slots[i].hash == hash && slots[i].length == line_len &&
+                            !memcmp(text + slots[i].start, text + pos, line_len)) {
+                        found = true;
+                        break;
                     }
+                    i = (i + 1) & (capacity - 1);
+                }
+                if (!found) {
+                    slots[i].hash = hash;
+                    slots[i].start = pos;
+                    slots[i].length = line_len;
                 }
-
-                token_start = i + 1;
             }
-            i++;
+            // the line is copied with its '\n'
+            if (!found) {
+                memcpy(buf + k, text + pos, next - pos);
+                k += next - pos;
+            }
+            pos = next;
+        }
+        buf[k] = '\0';
+
+        if (slots != (TUniqLine *)NULL) {
+            delete [] slots;
         }
-        buf[i] = '\0';
 
         (*tmp).useAsText();
-        (*tmp).pTextReplace(buf, i, -1, length + 1);
+        (*tmp).pTextReplace(buf, k, -1, length + 1);
     } else {
         *tmp = "";
     }
@@ -8462,6 +8811,7 @@ long String::loadFile(const String& filename) {
  */
 long String::loadFile(const char *filename) {
     FILE *fp;
+    struct stat st;
     char *buf;
     long l, length;
     int retry;
@@ -8524,6 +8874,16 @@ long String::loadFile(const char *filename) {
             usleep(1000);
         }
 
+        // A regular file is read into memory allocated once
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && 0 < st.st_size) {
+            (*this).useAsBinary((long)st.st_size);
+            while (length < (long)st.st_size &&
+                    0 < (l = fread((*this).pText + length, 1, (long)st.st_size - length, fp))) {
+                length += l;
+            }
+            (*this).useAsBinary(length);
+        }
+
         // Memory allocation
         buf = new char[4096 + 1];
 
@@ -8,12 +8,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <pthread.h>
+
 #if __ICONV == 1
 #include <errno.h>
 #include <sys/errno.h>
 #include <iconv.h>
 #endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define __CHARSET_SIMD_X86 1
+#else
+#define __CHARSET_SIMD_X86 0
+#endif
+
 #include "apolloron.h"
 #include "charset/table_unicode_sjis.h"
 #include "charset/table_sjis_unicode.h"
@@ -190,893 +199,2360 @@ const char *STR_GBK        = "GB18030";
 const char *STR_AUTO       = "AUTODETECT";
 
 
-/*! Multi-character set converter
-    @param str          Source text.
-    @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
-    @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
-    @return Converted text
+// Descriptors of character set handles (in the order of TCharset)
+const TCharsetInfo CHARSET_INFO[CHARSET_MAX] = {
+    {"",              CHARSET_UNKNOWN,       0,   'B', false},
+    {"AUTODETECT",    CHARSET_AUTODETECT,    0,   'B', false},
+    {"AUTODETECT_JP", CHARSET_AUTODETECT_JP, 0,   'B', false},
+    {"US-ASCII",      CHARSET_ASCII,         0,   'B', false},
+    {"UTF-8",         CHARSET_UTF8,          0,   'B', false},
+    {"UTF-8_BOM",     CHARSET_UTF8,          0,   'B', true},
+    {"UTF-7",         CHARSET_UTF7,          0,   'B', false},
+    {"UTF-7-IMAP",    CHARSET_UTF7_IMAP,     0,   'B', false},
+    {"UTF-16",        CHARSET_UTF16,         0,   'B', true},
+    {"UTF-16BE",      CHARSET_UTF16,         0,   'b', false},
+    {"UTF-16LE",      CHARSET_UTF16,         0,   'l', false},
+    {"UTF-16BE_BOM",  CHARSET_UTF16,         0,   'b', true},
+    {"UTF-16LE_BOM",  CHARSET_UTF16,         0,   'l', true},
+    {"UTF-32",        CHARSET_UTF32,         0,   'B', true},
+    {"UTF-32BE",      CHARSET_UTF32,         0,   'b', false},
+    {"UTF-32LE",      CHARSET_UTF32,         0,   'l', false},
+    {"UTF-32BE_BOM",  CHARSET_UTF32,         0,   'b', true},
+    {"UTF-32LE_BOM",  CHARSET_UTF32,         0,   'l', true},
+    {"CP932",         CHARSET_SJIS,          0,   'B', false},
+    {"EUC-JP",        CHARSET_EUCJP,         0,   'B', false},
+    {"EUCJP-MS",      CHARSET_EUCJPMS,       0,   'B', false},
+    {"ISO-2022-JP",   CHARSET_JIS,           0,   'B', false},
+    {"CP949",         CHARSET_EUCKR,         0,   'B', false},
+    {"GB18030",       CHARSET_GBK,           0,   'B', false},
+    {"CP950",         CHARSET_BIG5,          0,   'B', false},
+    {"ISO-8859-1",    CHARSET_ISO8859_1,     1,   'B', false},
+    {"ISO-8859-2",    CHARSET_ISO8859_2,     2,   'B', false},
+    {"ISO-8859-3",    CHARSET_ISO8859_3,     3,   'B', false},
+    {"ISO-8859-4",    CHARSET_ISO8859_4,     4,   'B', false},
+    {"ISO-8859-5",    CHARSET_ISO8859_5,     5,   'B', false},
+    {"ISO-8859-6",    CHARSET_ISO8859_6,     6,   'B', false},
+    {"ISO-8859-7",    CHARSET_ISO8859_7,     7,   'B', false},
+    {"ISO-8859-8",    CHARSET_ISO8859_8,     8,   'B', false},
+    {"ISO-8859-9",    CHARSET_ISO8859_9,     9,   'B', false},
+    {"ISO-8859-10",   CHARSET_ISO8859_10,    10,  'B', false},
+    {"ISO-8859-11",   CHARSET_ISO8859_11,    11,  'B', false},
+    {"ISO-8859-13",   CHARSET_ISO8859_13,    13,  'B', false},
+    {"ISO-8859-14",   CHARSET_ISO8859_14,    14,  'B', false},
+    {"ISO-8859-15",   CHARSET_ISO8859_15,    15,  'B', false},
+    {"ISO-8859-16",   CHARSET_ISO8859_16,    16,  'B', false},
+    {"KOI8-R",        CHARSET_KOI8_R,        'R', 'B', false},
+    {"KOI8-U",        CHARSET_KOI8_U,        'U', 'B', false},
+    {"CP1251",        CHARSET_CP1251,        '1', 'B', false},
+    {"CP1252",        CHARSET_CP1252,        '2', 'B', false},
+    {"CP1258",        CHARSET_CP1258,        '8', 'B', false}
+};
+
+// Registered names (upper case)
+static const struct {
+    const char *alias;
+    TCharset charset;
+} charset_alias[] = {
+    {"ASCII", CHARSET_ASCII},
+    {"US-ASCII", CHARSET_ASCII},
+    {"EUC-JP-MS", CHARSET_EUCJPMS},
+    {"EUCJP-MS", CHARSET_EUCJPMS},
+    {"EUC-JP", CHARSET_EUCJP},
+    {"X-EUC-JP", CHARSET_EUCJP},
+    {"EUCJP", CHARSET_EUCJP},
+    {"CP51932", CHARSET_EUCJP},
+    {"EUC-JIS", CHARSET_EUCJP},
+    {"SHIFT_JIS", CHARSET_SJIS},
+    {"SHIFT-JIS", CHARSET_SJIS},
+    {"CP932", CHARSET_SJIS},
+    {"WINDOWS-932", CHARSET_SJIS},
+    {"WINDOWS-31J", CHARSET_SJIS},
+    {"MS932", CHARSET_SJIS},
+    {"X-SJIS", CHARSET_SJIS},
+    {"ISO-2022-JP", CHARSET_JIS},
+    {"X-WINDOWS-ISO2022JP", CHARSET_JIS},
+    {"UTF-8", CHARSET_UTF8},
+    {"UTF8", CHARSET_UTF8},
+    {"UTF-8_BOM", CHARSET_UTF8_BOM},
+    {"UTF-8-BOM", CHARSET_UTF8_BOM},
+    {"UTF8_BOM", CHARSET_UTF8_BOM},
+    {"UTF8-BOM", CHARSET_UTF8_BOM},
+    {"UTF-7-IMAP", CHARSET_UTF7_IMAP},
+    {"UTF7-IMAP", CHARSET_UTF7_IMAP},
+    {"UTF-7", CHARSET_UTF7},
+    {"UTF7", CHARSET_UTF7},
+    {"UTF-16", CHARSET_UTF16},
+    {"UTF16", CHARSET_UTF16},
+    {"UTF-16BE", CHARSET_UTF16BE},
+    {"UTF16BE", CHARSET_UTF16BE},
+    {"UTF-16LE", CHARSET_UTF16LE},
+    {"UTF16LE", CHARSET_UTF16LE},
+    {"UTF-16BE_BOM", CHARSET_UTF16BE_BOM},
+    {"UTF-16BE-BOM", CHARSET_UTF16BE_BOM},
+    {"UTF-16LE_BOM", CHARSET_UTF16LE_BOM},
+    {"UTF-16LE-BOM", CHARSET_UTF16LE_BOM},
+    {"UTF-32", CHARSET_UTF32},
+    {"UTF32", CHARSET_UTF32},
+    {"UTF-32BE", CHARSET_UTF32BE},
+    {"UTF32BE", CHARSET_UTF32BE},
+    {"UTF-32LE", CHARSET_UTF32LE},
+    {"UTF32LE", CHARSET_UTF32LE},
+    {"UTF-32BE_BOM", CHARSET_UTF32BE_BOM},
+    {"UTF-32BE-BOM", CHARSET_UTF32BE_BOM},
+    {"UTF-32LE_BOM", CHARSET_UTF32LE_BOM},
+    {"UTF-32LE-BOM", CHARSET_UTF32LE_BOM},
+    {"AUTODETECT_JP", CHARSET_AUTODETECT_JP},
+    {"AUTODETECT", CHARSET_AUTODETECT},
+    {"EUC-KR", CHARSET_EUCKR},
+    {"EUCKR", CHARSET_EUCKR},
+    {"CP949", CHARSET_EUCKR},
+    {"WINDOWS-949", CHARSET_EUCKR},
+    {"MS949", CHARSET_EUCKR},
+    {"X-EUC-KR", CHARSET_EUCKR},
+    {"KS_C_5601-1987", CHARSET_EUCKR},
+    {"GB2312", CHARSET_GBK},
+    {"GBK", CHARSET_GBK},
+    {"GB18030", CHARSET_GBK},
+    {"EUC-CN", CHARSET_GBK},
+    {"EUCCN", CHARSET_GBK},
+    {"CP936", CHARSET_GBK},
+    {"WINDOWS-936", CHARSET_GBK},
+    {"MS936", CHARSET_GBK},
+    {"X-EUC-CN", CHARSET_GBK},
+    {"BIG5", CHARSET_BIG5},
+    {"EUC-TW", CHARSET_BIG5},
+    {"EUCTW", CHARSET_BIG5},
+    {"CP950", CHARSET_BIG5},
+    {"WINDOWS-950", CHARSET_BIG5},
+    {"MS950", CHARSET_BIG5},
+    {"CP1251", CHARSET_CP1251},
+    {"WINDOWS-1251", CHARSET_CP1251},
+    {"MS1251", CHARSET_CP1251},
+    {"CP1252", CHARSET_CP1252},
+    {"CP-1252", CHARSET_CP1252},
+    {"WINDOWS-1252", CHARSET_CP1252},
+    {"MS1252", CHARSET_CP1252},
+    {"LATIN-1", CHARSET_CP1252},
+    {"LATIN1", CHARSET_CP1252},
+    {"CP1258", CHARSET_CP1258},
+    {"CP-1258", CHARSET_CP1258},
+    {"WINDOWS-1258", CHARSET_CP1258},
+    {"MS1258", CHARSET_CP1258},
+    {"ISO-8859-1", CHARSET_ISO8859_1},
+    {"ISO-8859-2", CHARSET_ISO8859_2},
+    {"LATIN-2", CHARSET_ISO8859_2},
+    {"LATIN2", CHARSET_ISO8859_2},
+    {"CP28592", CHARSET_ISO8859_2},
+    {"CP-28592", CHARSET_ISO8859_2},
+    {"WINDOWS-28592", CHARSET_ISO8859_2},
+    {"ISO-8859-3", CHARSET_ISO8859_3},
+    {"LATIN-3", CHARSET_ISO8859_3},
+    {"LATIN3", CHARSET_ISO8859_3},
+    {"CP28593", CHARSET_ISO8859_3},
+    {"CP-28593", CHARSET_ISO8859_3},
+    {"WINDOWS-28593", CHARSET_ISO8859_3},
+    {"ISO-8859-4", CHARSET_ISO8859_4},
+    {"LATIN-4", CHARSET_ISO8859_4},
+    {"LATIN4", CHARSET_ISO8859_4},
+    {"CP28594", CHARSET_ISO8859_4},
+    {"CP-28594", CHARSET_ISO8859_4},
+    {"WINDOWS-28594", CHARSET_ISO8859_4},
+    {"ISO-8859-5", CHARSET_ISO8859_5},
+    {"CP28595", CHARSET_ISO8859_5},
+    {"CP-28595", CHARSET_ISO8859_5},
+    {"WINDOWS-28595", CHARSET_ISO8859_5},
+    {"ISO-8859-6", CHARSET_ISO8859_6},
+    {"CP28596", CHARSET_ISO8859_6},
+    {"CP-28596", CHARSET_ISO8859_6},
+    {"WINDOWS-28596", CHARSET_ISO8859_6},
+    {"ISO-IR-127", CHARSET_ISO8859_6},
+    {"ECMA-114", CHARSET_ISO8859_6},
+    {"ASMO-708", CHARSET_ISO8859_6},
+    {"ARABIC", CHARSET_ISO8859_6},
+    {"CSISOLATINARABIC", CHARSET_ISO8859_6},
+    {"ISO-8859-7", CHARSET_ISO8859_7},
+    {"CP28597", CHARSET_ISO8859_7},
+    {"CP-28597", CHARSET_ISO8859_7},
+    {"WINDOWS-28597", CHARSET_ISO8859_7},
+    {"ISO-IR-126", CHARSET_ISO8859_7},
+    {"ELOT_928", CHARSET_ISO8859_7},
+    {"ECMA-118", CHARSET_ISO8859_7},
+    {"GREEK", CHARSET_ISO8859_7},
+    {"CSISOLATINGREEK", CHARSET_ISO8859_7},
+    {"ISO-8859-8", CHARSET_ISO8859_8},
+    {"CP28598", CHARSET_ISO8859_8},
+    {"CP-28598", CHARSET_ISO8859_8},
+    {"WINDOWS-28598", CHARSET_ISO8859_8},
+    {"ISO-8859-9", CHARSET_ISO8859_9},
+    {"LATIN-5", CHARSET_ISO8859_9},
+    {"LATIN5", CHARSET_ISO8859_9},
+    {"CP28599", CHARSET_ISO8859_9},
+    {"CP-28599", CHARSET_ISO8859_9},
+    {"WINDOWS-28599", CHARSET_ISO8859_9},
+    {"ISO-8859-10", CHARSET_ISO8859_10},
+    {"LATIN-6", CHARSET_ISO8859_10},
+    {"LATIN6", CHARSET_ISO8859_10},
+    {"ISO-8859-11", CHARSET_ISO8859_11},
+    {"CP874", CHARSET_ISO8859_11},
+    {"CP-874", CHARSET_ISO8859_11},
+    {"WINDOWS-874", CHARSET_ISO8859_11},
+    {"TIS-620", CHARSET_ISO8859_11},
+    {"ISO-8859-13", CHARSET_ISO8859_13},
+    {"LATIN-7", CHARSET_ISO8859_13},
+    {"LATIN7", CHARSET_ISO8859_13},
+    {"ISO-8859-14", CHARSET_ISO8859_14},
+    {"LATIN-8", CHARSET_ISO8859_14},
+    {"LATIN8", CHARSET_ISO8859_14},
+    {"ISO-8859-15", CHARSET_ISO8859_15},
+    {"LATIN-9", CHARSET_ISO8859_15},
+    {"LATIN9", CHARSET_ISO8859_15},
+    {"CP28605", CHARSET_ISO8859_15},
+    {"CP-28605", CHARSET_ISO8859_15},
+    {"WINDOWS-28605", CHARSET_ISO8859_15},
+    {"ISO-8859-16", CHARSET_ISO8859_16},
+    {"LATIN-10", CHARSET_ISO8859_16},
+    {"LATIN10", CHARSET_ISO8859_16},
+    {"KOI8-U", CHARSET_KOI8_U},
+    {"CP21866", CHARSET_KOI8_U},
+    {"WINDOWS-21866", CHARSET_KOI8_U},
+    {"MS21866", CHARSET_KOI8_U},
+    {"KOI8-R", CHARSET_KOI8_R},
+    {"KOI8", CHARSET_KOI8_R},
+    {"CP20866", CHARSET_KOI8_R},
+    {"WINDOWS-20866", CHARSET_KOI8_R},
+    {"MS20866", CHARSET_KOI8_R},
+};
+
+// Perfect hash of charset_alias[]: the seed of the bucket places every alias
+// in its own slot (regenerate both tables when an alias is added)
+#define CHARSET_ALIAS_BUCKETS 64
+#define CHARSET_ALIAS_SLOTS   256
+static const unsigned short charset_alias_seed[CHARSET_ALIAS_BUCKETS] = {
+    7, 2, 2, 2, 1, 1, 4, 2, 0, 1, 1, 1, 11, 1, 4, 1,
+    1, 1, 1, 6, 1, 1, 6, 5, 6, 9, 2, 9, 6, 7, 0, 19,
+    1, 3, 0, 2, 5, 6, 3, 4, 5, 8, 0, 5, 0, 10, 4, 3,
+    7, 9, 14, 13, 7, 8, 7, 0, 24, 3, 1, 1, 7, 2, 0, 3,
+};
+
+static const short charset_alias_slot[CHARSET_ALIAS_SLOTS] = {
+    -1, -1, 145, -1, -1, -1, 128, 38, 130, 148, 13, 62, 49, 85, -1, 123,
+    78, -1, 112, 3, 100, -1, 136, -1, -1, -1, 90, 64, -1, -1, 162, -1,
+    74, 16, 105, 19, 114, 75, 76, -1, 40, 165, 22, 86, 98, -1, 23, -1,
+    154, 152, -1, -1, 46, -1, 71, -1, 115, -1, 29, -1, 146, 118, 42, -1,
+    26, 143, -1, 43, 111, 2, -1, 5, -1, 159, 84, -1, 1, -1, 11, 37,
+    110, 63, 164, -1, 163, 94, 39, 31, 53, -1, 20, 133, 122, 124, 14, -1,
+    153, -1, -1, -1, -1, 82, -1, -1, 87, -1, 125, 10, 156, 131, 135, 99,
+    161, -1, 61, 59, 97, -1, -1, 108, -1, 44, -1, -1, 116, -1, -1, -1,
+    138, -1, 52, -1, 24, 80, 129, 51, 32, 151, 149, 35, -1, -1, 30, 109,
+    -1, 121, 67, 8, -1, 50, 92, 155, -1, 141, 27, 126, -1, 12, 140, 91,
+    127, 139, 120, 25, -1, 66, -1, 167, -1, -1, 79, -1, -1, 96, -1, 45,
+    60, -1, -1, 106, 70, 73, 93, 21, 102, -1, 83, 41, 34, -1, 132, 160,
+    55, 104, 6, 28, 103, 147, 134, 137, 144, -1, 56, 54, 88, -1, -1, -1,
+    -1, 150, -1, 58, -1, -1, -1, 101, 4, 36, 15, 47, 119, 18, -1, -1,
+    157, 117, 95, 48, -1, 9, 68, -1, -1, -1, 33, 69, 17, 57, -1, 158,
+    -1, 113, 7, -1, -1, 142, 166, 0, -1, 72, 89, 107, 77, 65, 81, -1,
+};
+
+
+// Prefixes of other names, in the order of precedence
+static const struct {
+    const char *prefix;
+    TCharset charset;
+} charset_prefix[] = {
+    {"ASCII", CHARSET_ASCII}, {"US-ASCII", CHARSET_ASCII},
+    {"EUC-JP-MS", CHARSET_EUCJPMS}, {"EUCJP-MS", CHARSET_EUCJPMS},
+    {"EUC-JP", CHARSET_EUCJP}, {"X-EUC-JP", CHARSET_EUCJP}, {"EUCJP", CHARSET_EUCJP},
+    {"EUC-JIS", CHARSET_EUCJP},
+    {"SHIFT_JIS", CHARSET_SJIS}, {"SHIFT-JIS", CHARSET_SJIS}, {"X-SJIS", CHARSET_SJIS},
+    {"ISO-2022-JP", CHARSET_JIS}, {"X-WINDOWS-ISO2022JP", CHARSET_JIS},
+    {"UTF-16", CHARSET_UTF16}, {"UTF16", CHARSET_UTF16},
+    {"UTF-32", CHARSET_UTF32}, {"UTF32", CHARSET_UTF32},
+    {"UTF-8", CHARSET_UTF8}, {"UTF8", CHARSET_UTF8},
+    {"UTF-7-IMAP", CHARSET_UTF7_IMAP}, {"UTF7-IMAP", CHARSET_UTF7_IMAP},
+    {"UTF-7", CHARSET_UTF7}, {"UTF7", CHARSET_UTF7},
+    {"AUTODETECT_JP", CHARSET_AUTODETECT_JP}, {"AUTODETECT", CHARSET_AUTODETECT},
+    {"EUC-KR", CHARSET_EUCKR}, {"EUCKR", CHARSET_EUCKR}, {"X-EUC-KR", CHARSET_EUCKR},
+    {"GB", CHARSET_GBK}, {"EUC-CN", CHARSET_GBK}, {"EUCCN", CHARSET_GBK}, {"X-EUC-CN", CHARSET_GBK},
+    {"EUC-TW", CHARSET_BIG5}, {"EUCTW", CHARSET_BIG5},
+    {"GREEK", CHARSET_ISO8859_7}, {"ISO-8859-8", CHARSET_ISO8859_8},
+    {"KOI8-U", CHARSET_KOI8_U}, {"KOI8", CHARSET_KOI8_R}
+};
+
+
+/*! Hash of a character set name (FNV-1a)
+    @param name  Name in upper case
+    @param seed  Seed
+    @return Hash value
  */
-char* charset_convert(const char* str, const char *src_charset, const char *dest_charset) {
+static unsigned int charset_hash(const char *name, unsigned int seed) {
+    unsigned int h;
+
+    h = 2166136261U ^ seed;
+    while (*name != '\0') {
+        h ^= (unsigned char)*name;
+        h *= 16777619U;
+        name++;
+    }
+
+    return h;
+}
+
+
+/*! Resolve a character set name to its handle
+    @param charset  Name of character set (ex. "UTF-8", "Shift_JIS", "UTF-16LE_BOM", etc..)
+    @return Handle (CHARSET_UNKNOWN if the name is not registered)
+ */
+TCharset charsetHandle(const char *charset) {
+    char name[32];
+    unsigned int i, seed;
+    int slot;
+    TCharset handle;
+
+    if (charset == NULL) {
+        return CHARSET_UNKNOWN;
+    }
+
+    for (i = 0; charset[i] != '\0' && i < sizeof(name) - 1; i++) {
+        name[i] = ('a' <= charset[i] && charset[i] <= 'z')?(charset[i] - 'a' + 'A'):charset[i];
+    }
+    name[i] = '\0';
+    if (charset[i] == '\0') {
+        // a registered name is found by one probe
+        seed = charset_alias_seed[charset_hash(name, 0) % CHARSET_ALIAS_BUCKETS];
+        slot = charset_alias_slot[charset_hash(name, seed) % CHARSET_ALIAS_SLOTS];
+        if (0 <= slot && !strcmp(charset_alias[slot].alias, name)) {
+            return charset_alias[slot].charset;
+        }
+    }
+
+    handle = CHARSET_UNKNOWN;
+    for (i = 0; i < sizeof(charset_prefix) / sizeof(charset_prefix[0]); i++) {
+        if (!strncasecmp(charset, charset_prefix[i].prefix, strlen(charset_prefix[i].prefix))) {
+            handle = charset_prefix[i].charset;
+            break;
+        }
+    }
+
+    // ISO-8859-x followed by anything (ex. "ISO-8859-1:1987") is ISO-8859-x
+    if (handle == CHARSET_UNKNOWN && !strncasecmp(charset, "ISO-8859-", 9)) {
+        int num;
+        num = atoi(charset + 9);
+        for (i = CHARSET_ISO8859_1; i <= CHARSET_ISO8859_16; i++) {
+            if (CHARSET_INFO[i].param == num) {
+                handle = (TCharset)i;
+                break;
+            }
+        }
+    }
+
+    // variants follow in the order BE, LE, BE_BOM, LE_BOM
+    if (handle == CHARSET_UTF16 || handle == CHARSET_UTF32) {
+        if (strcasestr(charset, "BE") != NULL) {
+            handle = (TCharset)(handle + ((strcasestr(charset, "BOM") != NULL)?3:1));
+        } else if (strcasestr(charset, "LE") != NULL) {
+            handle = (TCharset)(handle + ((strcasestr(charset, "BOM") != NULL)?4:2));
+        }
+    } else if (handle == CHARSET_UTF8 && strcasestr(charset, "BOM") != NULL) {
+        handle = CHARSET_UTF8_BOM;
+    }
+
+    return handle;
+}
+
+
+/*! Canonical name of a character set handle
+    @param charset  Handle
+    @return Name ("" for CHARSET_UNKNOWN)
+ */
+const char* charsetName(TCharset charset) {
+    if (charset <= CHARSET_UNKNOWN || CHARSET_MAX <= charset) {
+        return "";
+    }
+    return CHARSET_INFO[charset].name;
+}
+
+
+/*! Length of leading 7bit text without ESC (portable version)
+    @param str     text
+    @param length  byte size of str
+    @return Byte size of the run
+ */
+static long ascii_span_scalar(const char *str, long length) {
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long highs = 0x8080808080808080ULL;
+    unsigned long long w, e;
+    long i;
+
+    i = 0;
+    while (i + 8 <= length) {
+        memcpy(&w, str + i, 8);
+        e = w ^ (ones * 0x1B);
+        if (((w | ((e - ones) & ~e)) & highs) != 0) {
+            break;
+        }
+        i += 8;
+    }
+    while (i < length && ((unsigned char)str[i] & 0x80) == 0 && str[i] != '\x1B') {
+        i++;
+    }
+
+    return i;
+}
+
+
+#if __CHARSET_SIMD_X86 == 1
+/*! Length of leading 7bit text without ESC (SSE2 version)
+    @param str     text
+    @param length  byte size of str
+    @return Byte size of the run
+ */
+__attribute__((target("sse2")))
+static long ascii_span_sse2(const char *str, long length) {
+    const __m128i esc = _mm_set1_epi8(0x1B);
+    __m128i v;
+    int mask;
+    long i;
+
+    i = 0;
+    while (i + 16 <= length) {
+        v = _mm_loadu_si128((const __m128i *)(str + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, esc)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+
+    return i + ascii_span_scalar(str + i, length - i);
+}
+
+
+/*! Length of leading 7bit text without ESC (AVX2 version)
+    @param str     text
+    @param length  byte size of str
+    @return Byte size of the run
+ */
+__attribute__((target("avx2")))
+static long ascii_span_avx2(const char *str, long length) {
+    const __m256i esc = _mm256_set1_epi8(0x1B);
+    __m256i v;
+    unsigned int mask;
+    long i;
+
+    i = 0;
+    while (i + 32 <= length) {
+        v = _mm256_loadu_si256((const __m256i *)(str + i));
+        mask = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(v, _mm256_cmpeq_epi8(v, esc)));
+        if (mask != 0) {
+            _mm256_zeroupper();
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    // leave AVX state clean for the SSE code that follows
+    _mm256_zeroupper();
+
+    return i + ascii_span_sse2(str + i, length - i);
+}
+#endif
+
+
+/*! Select the ascii_span() implementation for this CPU
+    @param  void
+    @return Implementation
+ */
+static long (*ascii_span_select())(const char *, long) {
+#if __CHARSET_SIMD_X86 == 1
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return ascii_span_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return ascii_span_sse2;
+    }
+#endif
+    return ascii_span_scalar;
+}
+
+
+/*! Length of leading 7bit text without ESC
+    @param str     text
+    @param length  byte size of str
+    @return Byte size of the run (0 if str starts with 8bit byte or ESC)
+ */
+long ascii_span(const char *str, long length) {
+    static long (* const span)(const char *, long) = ascii_span_select();
+
+    return span(str, length);
+}
+
+
+/*! Length of leading 7bit text without ESC, if it is long enough to copy at once
+    @param str     text
+    @param length  byte size of str
+    @return Byte size of the run (0 if the run is shorter than 8 bytes)
+ */
+static inline long ascii_run(const char *str, long length) {
+    unsigned long long w;
+
+    // short runs between CJK characters are cheaper to convert byte by byte
+    if (length < 8) {
+        return 0;
+    }
+    memcpy(&w, str, 8);
+    if ((w & 0x8080808080808080ULL) != 0) {
+        return 0;
+    }
+
+    return ascii_span(str, length);
+}
+
+
+#if defined(__GNUC__)
+#define CHARSET_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#define CHARSET_NOINLINE __attribute__((noinline))
+#else
+#define CHARSET_UNLIKELY(x) (x)
+#define CHARSET_NOINLINE
+#endif
+
+/*! Whether a 7bit character is the start of 7bit text long enough to copy at once
+    @param str     text
+    @param i       position of the 7bit character
+    @param length  byte size of str
+    @return true: the previous byte and the 8 bytes from i are 7bit, and str[i] is not ESC
+ */
+static inline bool ascii_after_ascii(const char *str, long i, long length) {
+    unsigned long long w;
+
+    // a 7bit character between CJK characters is converted byte by byte
+    // without reading ahead, so dense CJK text does not pay for the check
+    if (i == 0 || ((unsigned char)str[i - 1] & 0x80) != 0) {
+        return false;
+    }
+    // short runs are cheaper to convert byte by byte
+    if (length - i < 8 || str[i] == '\x1B') {
+        return false;
+    }
+    memcpy(&w, str + i, 8);
+
+    return (w & 0x8080808080808080ULL) == 0;
+}
+
+
+/*! Whether ISO-2022-JP text starts with a roman run long enough to copy at once
+    @param str     text
+    @param length  byte size of str
+    @return true: first 8 bytes are 7bit and none of them is NUL, SO, SI or ESC
+ */
+static inline bool jis_roman_head(const char *str, long length) {
+    unsigned long long w;
+
+    // short runs between kanji are cheaper to convert byte by byte
+    if (length < 8) {
+        return false;
+    }
+    memcpy(&w, str, 8);
+
+    // no 8bit byte, and no byte below 0x1C (a borrow sets the top bit)
+    return ((w | (w - 0x1C1C1C1C1C1C1C1CULL)) & 0x8080808080808080ULL) == 0;
+}
+
+
+/*! Copy leading 7bit text without ESC
+    @param dest    destination buffer
+    @param str     text starting where ascii_after_ascii() is true
+    @param length  byte size of str
+    @return Byte size of the copied run
+ */
+// Out of line: a call in the converter loop, even if not taken, makes the compiler
+// keep its values in callee-saved registers and spill the rest on every 8bit character.
+CHARSET_NOINLINE
+static long ascii_copy(char *dest, const char *str, long length) {
+    long span;
+
+    span = ascii_span(str, length);
+    memcpy(dest, str, span);
+
+    return span;
+}
+
+
+#if __ICONV == 0
+/*! Convert text of a character set to UTF-8
+    @param str            Source text. (str[length] must be '\0')
+    @param length         Byte size of str.
+    @param src_charset    Character set of input.
+    @param result_length  Byte size of converted text.
+    @return Converted text (NULL if src_charset has no converter)
+ */
+static char* charset_to_utf8(const char* str, long length, TCharset src_charset, long *result_length) {
+    char *buf;
+
+    switch (src_charset) {
+    case CHARSET_UTF8:
+        buf = new char [length + 1];
+        memcpy(buf, str, length);
+        buf[length] = '\0';
+        *result_length = length;
+        utf8_clean(buf, result_length);
+        return buf;
+    case CHARSET_EUCJPMS:
+        return eucjpms_to_utf8(str, length, result_length);
+    case CHARSET_EUCJP:
+        return eucjpwin_to_utf8(str, length, result_length);
+    case CHARSET_SJIS:
+        return sjis_to_utf8(str, length, result_length);
+    case CHARSET_JIS:
+        return jis_to_utf8(str, length, result_length);
+    case CHARSET_EUCKR:
+        return euckr_to_utf8(str, length, result_length);
+    case CHARSET_UTF7:
+        return utf7_to_utf8(str, length, result_length);
+    case CHARSET_UTF7_IMAP:
+        return modutf7_to_utf8(str, length, result_length);
+    case CHARSET_GBK:
+        return gbk_to_utf8(str, length, result_length);
+    case CHARSET_BIG5:
+        return big5_to_utf8(str, length, result_length);
+    case CHARSET_KOI8_R:
+    case CHARSET_KOI8_U:
+    case CHARSET_CP1251:
+    case CHARSET_CP1252:
+    case CHARSET_CP1258:
+        return europe_to_utf8(str, length, (char)CHARSET_INFO[src_charset].param, result_length);
+    default:
+        if (CHARSET_ISO8859_1 <= src_charset && src_charset <= CHARSET_ISO8859_16) {
+            return iso8859_to_utf8(str, length, CHARSET_INFO[src_charset].param, result_length);
+        }
+        break;
+    }
+
+    return NULL;
+}
+
+
+static char* utf8_to_iso8859_into(const char* str, long length, int iso8859_num, char *dest, long *result_length);
+static char* utf8_to_europe_into(const char* str, long length, char ch, char *dest, long *result_length);
+static char* sjis_to_eucjpms_into(const char *str, long length, char *dest, long *result_length);
+static char* sjis_to_eucjpwin_into(const char *str, long length, char *dest, long *result_length);
+static char* utf8_to_sjis_into(const char *str, long length, char *dest, long *result_length);
+static char* sjis_to_jis_into(const char *str, long length, char *dest, long *result_length);
+static char* utf8_to_euckr_into(const char* str, long length, char *dest, long *result_length);
+static char* utf8_to_gbk_into(const char* str, long length, char *dest, long *result_length);
+static char* utf8_to_big5_into(const char* str, long length, char *dest, long *result_length);
+
+
+/*! Convert UTF-8 text to a character set
+    @param str            Source text. (str[length] must be '\0')
+    @param length         Byte size of str.
+    @param dest_charset   Character set of output.
+    @param dst            Buffer the last stage writes into when its worst case fits (can be NULL)
+    @param capacity       Byte size of dst.
+    @param result_length  Byte size of converted text.
+    @return Converted text: dst, a new buffer, or NULL if dest_charset has no converter
+ */
+static char* utf8_to_charset(const char* str, long length, TCharset dest_charset,
+                             char *dst, long capacity, long *result_length) {
+    char *sjis_str, *buf;
+    long sjis_length;
+
+    switch (dest_charset) {
+    case CHARSET_EUCJPMS:
+    case CHARSET_EUCJP:
+    case CHARSET_JIS:
+        // via Shift_JIS, and only the last step can use dst
+        sjis_length = 0;
+        sjis_str = utf8_to_sjis(str, length, &sjis_length);
+        if (sjis_str == NULL) {
+            return NULL;
+        }
+        if (dest_charset == CHARSET_JIS) {
+            buf = sjis_to_jis_into(sjis_str, sjis_length,
+                                   (sjis_length*7 + 100 <= capacity)?dst:(char *)NULL, result_length);
+        } else if (dest_charset == CHARSET_EUCJP) {
+            buf = sjis_to_eucjpwin_into(sjis_str, sjis_length,
+                                        (sjis_length*3 + 1 <= capacity)?dst:(char *)NULL, result_length);
+        } else {
+            buf = sjis_to_eucjpms_into(sjis_str, sjis_length,
+                                       (sjis_length*3 + 1 <= capacity)?dst:(char *)NULL, result_length);
+        }
+        delete [] sjis_str;
+        return buf;
+    case CHARSET_SJIS:
+        return utf8_to_sjis_into(str, length, (length*2 + 1 <= capacity)?dst:(char *)NULL, result_length);
+    case CHARSET_EUCKR:
+        return utf8_to_euckr_into(str, length, (length*2 + 1 <= capacity)?dst:(char *)NULL, result_length);
+    case CHARSET_UTF7:
+        return utf8_to_utf7(str, length, result_length);
+    case CHARSET_UTF7_IMAP:
+        return utf8_to_modutf7(str, length, result_length);
+    case CHARSET_GBK:
+        return utf8_to_gbk_into(str, length, (length*3 + 1 <= capacity)?dst:(char *)NULL, result_length);
+    case CHARSET_BIG5:
+        return utf8_to_big5_into(str, length, (length*2 + 1 <= capacity)?dst:(char *)NULL, result_length);
+    case CHARSET_KOI8_R:
+    case CHARSET_KOI8_U:
+    case CHARSET_CP1251:
+    case CHARSET_CP1252:
+    case CHARSET_CP1258:
+        return utf8_to_europe_into(str, length, (char)CHARSET_INFO[dest_charset].param,
+                                   (length*3 + 1 <= capacity)?dst:(char *)NULL, result_length);
+    default:
+        if (CHARSET_ISO8859_1 <= dest_charset && dest_charset <= CHARSET_ISO8859_16) {
+            return utf8_to_iso8859_into(str, length, CHARSET_INFO[dest_charset].param,
+                                        (length*3 + 1 <= capacity)?dst:(char *)NULL, result_length);
+        }
+        break;
+    }
+
+    return NULL;
+}
+
+
+/*! Convert between japanese character sets without UTF-8
+    @param str            Source text. (str[length] must be '\0')
+    @param length         Byte size of str.
+    @param src_charset    Character set of input.
+    @param dest_charset   Character set of output.
+    @param result_length  Byte size of converted text.
+    @return Converted text (NULL if the pair has no direct converter)
+ */
+static char* jp_to_jp(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                      long *result_length) {
+    switch (src_charset) {
+    case CHARSET_EUCJPMS:
+        if (dest_charset == CHARSET_EUCJP) return eucjpms_to_eucjpwin(str, length, result_length);
+        if (dest_charset == CHARSET_SJIS) return eucjpms_to_sjis(str, length, result_length);
+        if (dest_charset == CHARSET_JIS) return eucjpms_to_jis(str, length, result_length);
+        break;
+    case CHARSET_EUCJP:
+        if (dest_charset == CHARSET_EUCJPMS) return eucjpwin_to_eucjpms(str, length, result_length);
+        if (dest_charset == CHARSET_SJIS) return eucjpwin_to_sjis(str, length, result_length);
+        if (dest_charset == CHARSET_JIS) return eucjpwin_to_jis(str, length, result_length);
+        break;
+    case CHARSET_SJIS:
+        if (dest_charset == CHARSET_EUCJPMS) return sjis_to_eucjpms(str, length, result_length);
+        if (dest_charset == CHARSET_EUCJP) return sjis_to_eucjpwin(str, length, result_length);
+        if (dest_charset == CHARSET_JIS) return sjis_to_jis(str, length, result_length);
+        break;
+    case CHARSET_JIS:
+        if (dest_charset == CHARSET_EUCJPMS) return jis_to_eucjpms(str, length, result_length);
+        if (dest_charset == CHARSET_EUCJP) return jis_to_eucjpwin(str, length, result_length);
+        if (dest_charset == CHARSET_SJIS) return jis_to_sjis(str, length, result_length);
+        break;
+    default:
+        break;
+    }
+
+    return NULL;
+}
+#endif
+
+
+#if __ICONV == 1
+#define ICONV_CACHE_SIZE 8
+
+// Opened descriptor of iconv
+typedef struct {
+    char src[32];
+    char dest[32];
+    iconv_t cd;
+} TIconvCache;
+
+// Descriptors opened by a thread (closed when the thread exits)
+typedef struct {
+    TIconvCache entry[ICONV_CACHE_SIZE];
+    int count;
+    int next;
+} TIconvCacheList;
+
+static pthread_key_t iconv_cache_key;
+static pthread_once_t iconv_cache_once = PTHREAD_ONCE_INIT;
+
+
+/*! Close the descriptors of a thread
+    @param list  TIconvCacheList of the thread
+    @return void
+ */
+static void iconv_cache_free(void *list) {
+    TIconvCacheList *cache;
+    int i;
+
+    cache = (TIconvCacheList *)list;
+    for (i = 0; i < cache->count; i++) {
+        iconv_close(cache->entry[i].cd);
+    }
+    delete cache;
+}
+
+
+/*! Create the key of the per-thread descriptors
+    @param void
+    @return void
+ */
+static void iconv_cache_init() {
+    pthread_key_create(&iconv_cache_key, iconv_cache_free);
+}
+
+
+/*! Get a descriptor from src_ch to dest_ch (opened on the first use)
+    @param dest_ch  Name of output character set
+    @param src_ch   Name of input character set
+    @return Descriptor in the initial state, or (iconv_t)-1
+ */
+static iconv_t iconv_cache_open(const char *dest_ch, const char *src_ch) {
+    TIconvCacheList *cache;
+    TIconvCache *entry;
+    iconv_t cd;
+    int i;
+
+    pthread_once(&iconv_cache_once, iconv_cache_init);
+    cache = (TIconvCacheList *)pthread_getspecific(iconv_cache_key);
+    if (cache == NULL) {
+        cache = new TIconvCacheList;
+        cache->count = 0;
+        cache->next = 0;
+        pthread_setspecific(iconv_cache_key, cache);
+    }
+
+    for (i = 0; i < cache->count; i++) {
+        entry = &(cache->entry[i]);
+        if (!strcmp(entry->src, src_ch) && !strcmp(entry->dest, dest_ch)) {
+            iconv(entry->cd, NULL, NULL, NULL, NULL);
+            return entry->cd;
+        }
+    }
+
+    if (31 < strlen(src_ch) || 31 < strlen(dest_ch)) {
+        return (iconv_t)-1;
+    }
+    cd = iconv_open(dest_ch, src_ch);
+    if (cd == (iconv_t)-1) {
+        return cd;
+    }
+
+    // replace the oldest one when full
+    if (cache->count < ICONV_CACHE_SIZE) {
+        entry = &(cache->entry[cache->count]);
+        cache->count++;
+    } else {
+        entry = &(cache->entry[cache->next]);
+        iconv_close(entry->cd);
+        cache->next = (cache->next + 1) % ICONV_CACHE_SIZE;
+    }
+    strcpy(entry->src, src_ch);
+    strcpy(entry->dest, dest_ch);
+    entry->cd = cd;
+
+    return cd;
+}
+#endif
+
+
+/*! Whether conversion to a character set family is left to the caller
+    @param family  Character set family of output
+    @return true: UTF-16, UTF-32 or not known (text is passed as UTF-8), false: converted
+ */
+static bool charset_no_dest(TCharset family) {
+    return (family == CHARSET_UNKNOWN || family == CHARSET_AUTODETECT ||
+            family == CHARSET_AUTODETECT_JP ||
+            family == CHARSET_UTF16 || family == CHARSET_UTF32);
+}
+
+
+/*! Convert text on resolved handles without falling back
+    @param str           Source text. (str[length] must be '\0')
+    @param length        Byte size of str.
+    @param src_charset   Character set of input. (AUTODETECT is resolved)
+    @param dest_charset  Character set of output.
+    @param src_name      Name of src_charset given by the caller (can be NULL)
+    @param dst           Buffer the last encoder may write into (can be NULL)
+    @param capacity      Byte size of dst.
+    @param result_length Byte size of converted text.
+    @return Converted text (dst or a new buffer), or NULL if it cannot be converted
+ */
+static char* convert_resolved(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                              const char *src_name, char *dst, long capacity, long *result_length) {
     char *buf;
     int converted;
-    const char *src_ch, *dest_ch;
-    long length;
+    TCharset src_family, dest_family;
+    bool no_dest;
+    long buf_length;
 #if __ICONV == 0
-    char *buf1, *utf8_str;
-    buf1 = NULL;
-    utf8_str = NULL;
+    char *utf8_str;
+    long utf8_length;
 #else
+    const char *src_ch, *dest_ch;
     iconv_t cd;
 #endif
 
-    if (str == (const char *)NULL) {
-        return NULL;
-    }
-
-    length = strlen(str);
-
     buf = NULL;
+    buf_length = 0;
     converted = 0;
 
-    if (src_charset == NULL || src_charset[0] == '\0') {
-        src_ch = STR_AUTO;
-    } else if (!strncasecmp(src_charset, "ASCII", 5) || !strncasecmp(src_charset, "US-ASCII", 8)) {
-        src_ch = STR_ASCII;
-    } else if (!strncasecmp(src_charset, "EUC-JP-MS", 9) || !strncasecmp(src_charset, "EUCJP-MS", 8)) {
-        src_ch = STR_EUCJPMS;
-    } else if (!strncasecmp(src_charset, "EUC-JP", 6) || !strncasecmp(src_charset, "X-EUC-JP", 8) ||
-               !strncasecmp(src_charset, "EUCJP", 5) || !strcasecmp(src_charset, "CP51932") ||
-               !strncasecmp(src_charset, "EUC-JIS", 7)) {
-        src_ch = STR_EUCJP;
-    } else if (!strncasecmp(src_charset, "SHIFT_JIS", 9) || !strncasecmp(src_charset, "SHIFT-JIS", 9) ||
-               !strcasecmp(src_charset, "CP932") || !strcasecmp(src_charset, "WINDOWS-932") ||
-               !strcasecmp(src_charset, "WINDOWS-31J") || !strcasecmp(src_charset, "MS932") ||
-               !strncasecmp(src_charset, "X-SJIS", 6)) {
-        src_ch = STR_SJIS;
-    } else if (!strncasecmp(src_charset, "ISO-2022-JP", 11) || !strncasecmp(src_charset, "X-WINDOWS-ISO2022JP", 19)) {
-        src_ch = STR_JIS;
-    } else if (!strncasecmp(src_charset, "UTF-8", 5) || !strncasecmp(src_charset, "UTF8", 4)) {
-        src_ch = STR_UTF8;
-    } else if (!strncasecmp(src_charset, "UTF-7-IMAP", 10) || !strncasecmp(src_charset, "UTF7-IMAP", 9)) {
-        src_ch = STR_UTF7_IMAP;
-    } else if (!strncasecmp(src_charset, "UTF-7", 5) || !strncasecmp(src_charset, "UTF7", 4)) {
-        src_ch = STR_UTF7;
-    } else if (!strncasecmp(src_charset, "AUTODETECT_JP", 13)) {
-        src_ch = jis_auto_detect(str);
-        if (src_ch == (const char *)NULL) {
-            src_ch = src_charset;
-        }
-    } else if (!strncasecmp(src_charset, "AUTODETECT", 10)) {
-        src_ch = auto_detect(str);
-        if (src_ch == (const char *)NULL) {
-            src_ch = src_charset;
-        }
-    } else if (!strncasecmp(src_charset, "EUC-KR", 6) || !strncasecmp(src_charset, "EUCKR", 5) ||
-               !strcasecmp(src_charset, "CP949") || !strcasecmp(src_charset, "WINDOWS-949") ||
-               !strcasecmp(src_charset, "MS949") || !strncasecmp(src_charset, "X-EUC-KR", 8) ||
-               !strcasecmp(src_charset, "KS_C_5601-1987")) {
-        src_ch = STR_EUCKR;
-    } else if (!strncasecmp(src_charset, "GB", 2) ||
-               !strncasecmp(src_charset, "EUC-CN", 6) || !strncasecmp(src_charset, "EUCCN", 5) ||
-               !strcasecmp(src_charset, "CP936") || !strcasecmp(src_charset, "WINDOWS-936") ||
-               !strcasecmp(src_charset, "MS936") || !strncasecmp(src_charset, "X-EUC-CN", 8)) {
-        src_ch = STR_GBK;
-    } else if (!strcasecmp(src_charset, "BIG5") || !strncasecmp(src_charset, "EUC-TW", 6) ||
-               !strncasecmp(src_charset, "EUCTW", 5) || !strcasecmp(src_charset, "CP950") ||
-               !strcasecmp(src_charset, "WINDOWS-950") || !strcasecmp(src_charset, "MS950")) {
-        src_ch = STR_BIG5;
-    } else if (!strcasecmp(src_charset, "CP1251") || !strcasecmp(src_charset, "WINDOWS-1251") ||
-               !strcasecmp(src_charset, "MS1251")) {
-        src_ch = STR_CP1251;
-    } else if (!strcasecmp(src_charset, "CP1252") || !strcasecmp(src_charset, "CP-1252") ||
-               !strcasecmp(src_charset, "WINDOWS-1252") || !strcasecmp(src_charset, "MS1252") ||
-               !strcasecmp(src_charset, "LATIN-1") || !strcasecmp(src_charset, "LATIN1")) {
-        src_ch = STR_CP1252;
-    } else if (!strcasecmp(src_charset, "CP1258") || !strcasecmp(src_charset, "CP-1258") ||
-               !strcasecmp(src_charset, "WINDOWS-1258") || !strcasecmp(src_charset, "MS1258")) {
-        src_ch = STR_CP1258;
-    } else if (!strcasecmp(src_charset, "ISO-8859-1")) {
-        src_ch = STR_ISO8859_1;
-    } else if (!strcasecmp(src_charset, "ISO-8859-2") || !strcasecmp(src_charset, "LATIN-2") ||
-               !strcasecmp(src_charset, "LATIN2") || !strcasecmp(src_charset, "CP28592") ||
-               !strcasecmp(src_charset, "CP-28592") || !strcasecmp(src_charset, "WINDOWS-28592")) {
-        src_ch = STR_ISO8859_2;
-    } else if (!strcasecmp(src_charset, "ISO-8859-3") || !strcasecmp(src_charset, "LATIN-3") ||
-               !strcasecmp(src_charset, "LATIN3") || !strcasecmp(src_charset, "CP28593") ||
-               !strcasecmp(src_charset, "CP-28593") || !strcasecmp(src_charset, "WINDOWS-28593")) {
-        src_ch = STR_ISO8859_3;
-    } else if (!strcasecmp(src_charset, "ISO-8859-4") || !strcasecmp(src_charset, "LATIN-4") ||
-               !strcasecmp(src_charset, "LATIN4") || !strcasecmp(src_charset, "CP28594") ||
-               !strcasecmp(src_charset, "CP-28594") || !strcasecmp(src_charset, "WINDOWS-28594")) {
-        src_ch = STR_ISO8859_4;
-    } else if (!strcasecmp(src_charset, "ISO-8859-5") || !strcasecmp(src_charset, "CP28595") ||
-               !strcasecmp(src_charset, "CP-28595") || !strcasecmp(src_charset, "WINDOWS-28595")) {
-        src_ch = STR_ISO8859_5;
-    } else if (!strcasecmp(src_charset, "ISO-8859-6") || !strcasecmp(src_charset, "iso-ir-127") ||
-               !strcasecmp(src_charset, "ECMA-114") || !strcasecmp(src_charset, "ASMO-708") ||
-               !strcasecmp(src_charset, "Arabic") || !strcasecmp(src_charset, "csISOLatinArabic") ||
-               !strcasecmp(src_charset, "CP28596") || !strcasecmp(src_charset, "CP-28596") ||
-               !strcasecmp(src_charset, "WINDOWS-28596")) {
-        src_ch = STR_ISO8859_6;
-    } else if (!strcasecmp(src_charset, "ISO-8859-7") || !strcasecmp(src_charset, "iso-ir-126") ||
-               !strcasecmp(src_charset, "ELOT_928") || !strcasecmp(src_charset, "ECMA-118") ||
-               !strncasecmp(src_charset, "greek", 5) || !strcasecmp(src_charset, "csISOLatinGreek") ||
-               !strcasecmp(src_charset, "CP28597") || !strcasecmp(src_charset, "CP-28597") ||
-               !strcasecmp(src_charset, "WINDOWS-28597")) {
-        src_ch = STR_ISO8859_7;
-    } else if (!strncasecmp(src_charset, "ISO-8859-8", 10) || !strcasecmp(src_charset, "CP28598") ||
-               !strcasecmp(src_charset, "CP-28598") || !strcasecmp(src_charset, "WINDOWS-28598")) {
-        src_ch = STR_ISO8859_8;
-    } else if (!strcasecmp(src_charset, "ISO-8859-9") || !strcasecmp(src_charset, "LATIN-5") ||
-               !strcasecmp(src_charset, "LATIN5") || !strcasecmp(src_charset, "CP28599") ||
-               !strcasecmp(src_charset, "CP-28599") || !strcasecmp(src_charset, "WINDOWS-28599")) {
-        src_ch = STR_ISO8859_9;
-    } else if (!strcasecmp(src_charset, "ISO-8859-10") || !strcasecmp(src_charset, "LATIN-6") ||
-               !strcasecmp(src_charset, "LATIN6")) {
-        src_ch = STR_ISO8859_10;
-    } else if (!strcasecmp(src_charset, "ISO-8859-11") || !strcasecmp(src_charset, "CP874") ||
-               !strcasecmp(src_charset, "CP-874") || !strcasecmp(src_charset, "WINDOWS-874") ||
-               !strcasecmp(src_charset, "TIS-620")) {
-        src_ch = STR_ISO8859_11;
-    } else if (!strcasecmp(src_charset, "ISO-8859-13") || !strcasecmp(src_charset, "LATIN-7") ||
-               !strcasecmp(src_charset, "LATIN7")) {
-        src_ch = STR_ISO8859_13;
-    } else if (!strcasecmp(src_charset, "ISO-8859-14") || !strcasecmp(src_charset, "LATIN-8") ||
-               !strcasecmp(src_charset, "LATIN8")) {
-        src_ch = STR_ISO8859_14;
-    } else if (!strcasecmp(src_charset, "ISO-8859-15") || !strcasecmp(src_charset, "LATIN-9") ||
-               !strcasecmp(src_charset, "LATIN9") || !strcasecmp(src_charset, "CP28605") ||
-               !strcasecmp(src_charset, "CP-28605") || !strcasecmp(src_charset, "WINDOWS-28605")) {
-        src_ch = STR_ISO8859_15;
-    } else if (!strcasecmp(src_charset, "ISO-8859-16") || !strcasecmp(src_charset, "LATIN-10") ||
-               !strcasecmp(src_charset, "LATIN10")) {
-        src_ch = STR_ISO8859_16;
-    } else if (!strncasecmp(src_charset, "KOI8-U", 6) ||
-               !strcasecmp(src_charset, "CP21866") || !strcasecmp(src_charset, "WINDOWS-21866") ||
-               !strcasecmp(src_charset, "MS21866")) {
-        src_ch = STR_KOI8_U;
-    } else if (!strncasecmp(src_charset, "KOI8", 4) ||
-               !strcasecmp(src_charset, "CP20866") || !strcasecmp(src_charset, "WINDOWS-20866") ||
-               !strcasecmp(src_charset, "MS20866")) {
-        src_ch = STR_KOI8_R;
-    } else {
-        src_ch = src_charset;
-    }
-
-    if (dest_charset == NULL) {
-        dest_ch = "";
-    } else if (!strncasecmp(dest_charset, "ASCII", 5) || !strncasecmp(dest_charset, "US-ASCII", 8)) {
-        dest_ch = STR_ASCII;
-    } else if (!strncasecmp(dest_charset, "EUC-JP-MS", 9) || !strncasecmp(dest_charset, "EUCJP-MS", 8)) {
-        dest_ch = STR_EUCJPMS;
-    } else if (!strncasecmp(dest_charset, "EUC-JP", 6) || !strncasecmp(dest_charset, "X-EUC-JP", 8) ||
-               !strncasecmp(dest_charset, "EUCJP", 5) || !strcasecmp(dest_charset, "CP51932") ||
-               !strncasecmp(dest_charset, "EUC-JIS", 7)) {
-        dest_ch = STR_EUCJP;
-    } else if (!strncasecmp(dest_charset, "SHIFT_JIS", 9) || !strncasecmp(dest_charset, "SHIFT-JIS", 9) ||
-               !strcasecmp(dest_charset, "CP932") || !strcasecmp(dest_charset, "WINDOWS-932") ||
-               !strcasecmp(dest_charset, "WINDOWS-31J") || !strcasecmp(dest_charset, "MS932") ||
-               !strncasecmp(dest_charset, "X-SJIS", 6)) {
-        dest_ch = STR_SJIS;
-    } else if (!strncasecmp(dest_charset, "ISO-2022-JP", 11) || !strncasecmp(dest_charset, "X-WINDOWS-ISO2022JP", 19)) {
-        dest_ch = STR_JIS;
-    } else if (!strncasecmp(dest_charset, "UTF-8", 5) || !strncasecmp(dest_charset, "UTF8", 4)) {
-        dest_ch = STR_UTF8;
-    } else if (!strncasecmp(dest_charset, "UTF-7-IMAP", 10) || !strncasecmp(dest_charset, "UTF7-IMAP", 9)) {
-        dest_ch = STR_UTF7_IMAP;
-    } else if (!strncasecmp(dest_charset, "UTF-7", 5) || !strncasecmp(dest_charset, "UTF7", 4)) {
-        dest_ch = STR_UTF7;
-    } else if (!strncasecmp(dest_charset, "EUC-KR", 6) || !strncasecmp(dest_charset, "EUCKR", 5) ||
-               !strcasecmp(dest_charset, "CP949") || !strcasecmp(dest_charset, "WINDOWS-949") ||
-               !strcasecmp(dest_charset, "MS949") || !strncasecmp(dest_charset, "X-EUC-KR", 8) ||
-               !strcasecmp(dest_charset, "KS_C_5601-1987")) {
-        dest_ch = STR_EUCKR;
-    } else if (!strncasecmp(dest_charset, "GB", 2) ||
-               !strncasecmp(dest_charset, "EUC-CN", 6) || !strncasecmp(src_charset, "EUCCN", 5) ||
-               !strcasecmp(dest_charset, "CP936") || !strcasecmp(dest_charset, "WINDOWS-936") ||
-               !strcasecmp(dest_charset, "MS936") || !strncasecmp(dest_charset, "X-EUC-CN", 8)) {
-        dest_ch = STR_GBK;
-    } else if (!strcasecmp(dest_charset, "BIG5") || !strncasecmp(dest_charset, "EUC-TW", 6) ||
-               !strncasecmp(dest_charset, "EUCTW", 5) || !strcasecmp(dest_charset, "CP950") ||
-               !strcasecmp(dest_charset, "WINDOWS-950") || !strcasecmp(dest_charset, "MS950")) {
-        dest_ch = STR_BIG5;
-    } else if (!strcasecmp(dest_charset, "CP1251") || !strcasecmp(dest_charset, "WINDOWS-1251") ||
-               !strcasecmp(dest_charset, "MS1251")) {
-        dest_ch = STR_CP1251;
-    } else if (!strcasecmp(dest_charset, "CP1252") || !strcasecmp(dest_charset, "CP-1252") ||
-               !strcasecmp(dest_charset, "WINDOWS-1252") || !strcasecmp(dest_charset, "MS1252") ||
-               !strcasecmp(dest_charset, "LATIN-1") || !strcasecmp(dest_charset, "LATIN1")) {
-        dest_ch = STR_CP1252;
-    } else if (!strcasecmp(dest_charset, "CP1258") || !strcasecmp(dest_charset, "CP-1258") ||
-               !strcasecmp(dest_charset, "WINDOWS-1258") || !strcasecmp(dest_charset, "MS1258")) {
-        dest_ch = STR_CP1258;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-1")) {
-        dest_ch = STR_ISO8859_1;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-2") || !strcasecmp(dest_charset, "LATIN-2") ||
-               !strcasecmp(dest_charset, "LATIN2") || !strcasecmp(dest_charset, "CP28592") ||
-               !strcasecmp(dest_charset, "CP-28592") || !strcasecmp(dest_charset, "WINDOWS-28592")) {
-        dest_ch = STR_ISO8859_2;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-3") || !strcasecmp(dest_charset, "LATIN-3") ||
-               !strcasecmp(dest_charset, "LATIN3") || !strcasecmp(dest_charset, "CP28593") ||
-               !strcasecmp(dest_charset, "CP-28593") || !strcasecmp(dest_charset, "WINDOWS-28593")) {
-        dest_ch = STR_ISO8859_3;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-4") || !strcasecmp(dest_charset, "LATIN-4") ||
-               !strcasecmp(dest_charset, "LATIN4") || !strcasecmp(dest_charset, "CP28594") ||
-               !strcasecmp(dest_charset, "CP-28594") || !strcasecmp(dest_charset, "WINDOWS-28594")) {
-        dest_ch = STR_ISO8859_4;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-5") || !strcasecmp(dest_charset, "CP28595") ||
-               !strcasecmp(dest_charset, "CP-28595") || !strcasecmp(dest_charset, "WINDOWS-28595")) {
-        dest_ch = STR_ISO8859_5;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-6") || !strcasecmp(dest_charset, "iso-ir-127") ||
-               !strcasecmp(dest_charset, "ECMA-114") || !strcasecmp(dest_charset, "ASMO-708") ||
-               !strcasecmp(dest_charset, "Arabic") || !strcasecmp(dest_charset, "csISOLatinArabic") ||
-               !strcasecmp(dest_charset, "CP28596") || !strcasecmp(dest_charset, "CP-28596") ||
-               !strcasecmp(dest_charset, "WINDOWS-28596")) {
-        dest_ch = STR_ISO8859_6;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-7") || !strcasecmp(dest_charset, "iso-ir-126") ||
-               !strcasecmp(dest_charset, "ELOT_928") || !strcasecmp(dest_charset, "ECMA-118") ||
-               !strncasecmp(dest_charset, "greek", 5) || !strcasecmp(dest_charset, "csISOLatinGreek") ||
-               !strcasecmp(dest_charset, "CP28597") || !strcasecmp(dest_charset, "CP-28597") ||
-               !strcasecmp(dest_charset, "WINDOWS-28597")) {
-        dest_ch = STR_ISO8859_7;
-    } else if (!strncasecmp(dest_charset, "ISO-8859-8", 10) || !strcasecmp(dest_charset, "CP28598") ||
-               !strcasecmp(dest_charset, "CP-28598") || !strcasecmp(dest_charset, "WINDOWS-28598")) {
-        dest_ch = STR_ISO8859_8;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-9") || !strcasecmp(dest_charset, "LATIN-5") ||
-               !strcasecmp(dest_charset, "LATIN5") || !strcasecmp(dest_charset, "CP28599") ||
-               !strcasecmp(dest_charset, "CP-28599") || !strcasecmp(dest_charset, "WINDOWS-28599")) {
-        dest_ch = STR_ISO8859_9;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-10") || !strcasecmp(dest_charset, "LATIN-6") ||
-               !strcasecmp(dest_charset, "LATIN6")) {
-        dest_ch = STR_ISO8859_10;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-11") || !strcasecmp(dest_charset, "CP874") ||
-               !strcasecmp(dest_charset, "CP-874") || !strcasecmp(dest_charset, "WINDOWS-874") ||
-               !strcasecmp(dest_charset, "TIS-620")) {
-        dest_ch = STR_ISO8859_11;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-13") || !strcasecmp(dest_charset, "LATIN-7") ||
-               !strcasecmp(dest_charset, "LATIN7")) {
-        dest_ch = STR_ISO8859_13;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-14") || !strcasecmp(dest_charset, "LATIN-8") ||
-               !strcasecmp(dest_charset, "LATIN8")) {
-        dest_ch = STR_ISO8859_14;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-15") || !strcasecmp(dest_charset, "LATIN-9") ||
-               !strcasecmp(dest_charset, "LATIN9")) {
-        dest_ch = STR_ISO8859_15;
-    } else if (!strcasecmp(dest_charset, "ISO-8859-16") || !strcasecmp(dest_charset, "LATIN-10") ||
-               !strcasecmp(dest_charset, "LATIN10")) {
-        dest_ch = STR_ISO8859_16;
-    } else if (!strncasecmp(dest_charset, "KOI8-U", 6) ||
-               !strcasecmp(dest_charset, "CP21866") || !strcasecmp(dest_charset, "WINDOWS-21866") ||
-               !strcasecmp(dest_charset, "MS21866")) {
-        dest_ch = STR_KOI8_U;
-    } else if (!strncasecmp(dest_charset, "KOI8", 4) ||
-               !strcasecmp(dest_charset, "CP20866") || !strcasecmp(dest_charset, "WINDOWS-20866") ||
-               !strcasecmp(dest_charset, "MS20866")) {
-        dest_ch = STR_KOI8_R;
+    src_family = CHARSET_INFO[src_charset].family;
+    dest_family = CHARSET_INFO[dest_charset].family;
+
+    // UTF-16 and UTF-32 are left to the caller
+    no_dest = charset_no_dest(dest_family);
+
+#if __ICONV == 1
+    // a name not registered is given to iconv as it is
+    if (src_charset == CHARSET_UNKNOWN && src_name != NULL) {
+        src_ch = src_name;
     } else {
-        dest_ch = "";
+        src_ch = (src_family == CHARSET_UTF8)?STR_UTF8:CHARSET_INFO[src_charset].name;
     }
+    dest_ch = no_dest?"":CHARSET_INFO[dest_family].name;
 
-#if __ICONV == 1
     // get characterset converter from src_ch to dest_ch
-    cd = iconv_open(dest_ch, src_ch);
+    cd = iconv_cache_open(dest_ch, src_ch);
 
     if (cd != (iconv_t)-1) {
 #if __ICONV_CONST == 1
-        const char *src;
-        const char *ibuf, *ip;
+        const char *ip;
 #else
-        char *src;
-        char *ibuf, *ip;
+        char *ip;
 #endif
-        char *obuf, *op;
+        char *obuf, *obuf_orig, *op;
         size_t ileft, oleft;
         size_t olen, osize;
-        int r;
+        int r, err;
 
 #if __ICONV_CONST == 1
-        src = (const char *)str;
+        ip = (const char *)str;
 #else
-        src = (char *)str;
+        ip = (char *)str;
 #endif
-
-        osize = 1024 + 1;
-        obuf = new char [osize];
-        olen = 0;
-        obuf[olen] = '\0';
-
-        ibuf = src;
         ileft = (size_t)length;
-        ip = ibuf;
-        do {
-            char *obuf_orig;
-
-            oleft = 1024;
-            osize = olen + oleft + 1;
-
-            obuf_orig = obuf;
-            obuf = new char [osize];
-            memcpy(obuf, obuf_orig, olen + 1);
-            delete [] obuf_orig;
 
+        // sized for the usual expansion, and doubled when it is not enough
+        osize = (size_t)length + (size_t)length / 2 + 16;
+        obuf = new char [osize + 1];
+        olen = 0;
+        for (;;) {
             op = obuf + olen;
-
+            oleft = osize - olen;
             r = iconv(cd, &ip, &ileft, &op, &oleft);
-
-            if (r < 0 && errno == EILSEQ) {
-                /* error */
-                if (0 < oleft) {
-                    *op = '?';
-                    op++;
-                    oleft--;
-                    ip++;
-                    ileft--;
-                } else {
-                    break;
-                }
+            err = (r < 0)?errno:0;
+            olen = osize - oleft;
+            if (err != E2BIG) {
+                break;
             }
-            olen += (1024 - oleft);
-        } while (r < 0 && errno == E2BIG);
-        obuf[olen] = '\0';
 
-        iconv_close(cd);
+            obuf_orig = obuf;
+            osize *= 2;
+            obuf = new char [osize + 1];
+            memcpy(obuf, obuf_orig, olen);
+            delete [] obuf_orig;
+        }
+        obuf[olen] = '\0';
 
-        if (!(r < 0 && errno == EILSEQ)) {
+        if (err != EILSEQ) {
             buf = obuf;
+            buf_length = olen;
             converted = 1;
         } else {
             delete [] obuf;
         }
     }
 
-#else
-    if (!strcasecmp(src_ch, STR_AUTOJP)) {
-        src_ch = jis_auto_detect(str);
-    } else if (!strcasecmp(src_ch, STR_AUTO)) {
-        src_ch = auto_detect(str);
-    }
 
-    if (dest_ch[0] == '\0' || !strcasecmp(src_ch, dest_ch)) {
+#else
+    if (no_dest || src_family == dest_family) {
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        buf_length = length;
         converted = 1;
-    } else if (!strcasecmp(src_ch, STR_EUCJPMS)) {
-        if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = eucjpms_to_eucjpwin(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = eucjpms_to_sjis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = eucjpms_to_jis(str);
+    } else if ((buf = jp_to_jp(str, length, src_family, dest_family, &buf_length)) != NULL) {
+        converted = 1;
+    } else {
+        utf8_length = 0;
+        utf8_str = charset_to_utf8(str, length, src_family, &utf8_length);
+        if (utf8_str != NULL && dest_family == CHARSET_UTF8) {
+            buf = utf8_str;
+            buf_length = utf8_length;
             converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = eucjpms_to_utf8(str);
+        } else if (utf8_str != NULL) {
+            buf = utf8_to_charset(utf8_str, utf8_length, dest_family, dst, capacity, &buf_length);
             converted = 1;
-        } else {
-            utf8_str = eucjpms_to_utf8(str);
+            delete [] utf8_str;
         }
-    } else if (!strcasecmp(src_ch, STR_EUCJP)) {
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = eucjpwin_to_eucjpms(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = eucjpwin_to_sjis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = eucjpwin_to_jis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = eucjpwin_to_utf8(str);
-            converted = 1;
-        } else {
-            utf8_str = eucjpwin_to_utf8(str);
-        }
-    } else if (!strcasecmp(src_ch, STR_SJIS)) {
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = sjis_to_eucjpms(str);
-            converted = 1;
-        } if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = sjis_to_eucjpwin(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = sjis_to_jis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = sjis_to_utf8(str);
-            converted = 1;
-        } else {
-            utf8_str = sjis_to_utf8(str);
-        }
-    } else if (!strcasecmp(src_ch, STR_JIS)) {
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = jis_to_eucjpms(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = jis_to_eucjpwin(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = jis_to_sjis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = jis_to_utf8(str);
-            converted = 1;
-        } else {
-            utf8_str = eucjpwin_to_utf8(str);
-        }
-    } else if (!strcasecmp(src_ch, STR_UTF8)) {
-        utf8_str = new char [length + 1];
-        memcpy(utf8_str, str, length);
-        utf8_str[length] = '\0';
-        utf8_clean(utf8_str);
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = utf8_to_eucjpms(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = utf8_to_eucjpwin(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = utf8_to_sjis(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = utf8_to_jis(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCKR)) {
-            buf = utf8_to_euckr(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF7)) {
-            buf = utf8_to_utf7(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF7_IMAP)) {
-            buf = utf8_to_modutf7(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_GBK)) {
-            buf = utf8_to_gbk(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_BIG5)) {
-            buf = utf8_to_big5(utf8_str);
-            converted = 1;
-        } else if (!strncasecmp(dest_ch, "ISO-8859-", 9)) {
-            int num;
-            num = atoi(dest_ch + 9);
-            buf = utf8_to_iso8859(utf8_str, num);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_KOI8_U)) {
-            buf = utf8_to_europe(utf8_str, 'U');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_KOI8_R)) {
-            buf = utf8_to_europe(utf8_str, 'R');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1251)) {
-            buf = utf8_to_europe(utf8_str, '1');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1252)) {
-            buf = utf8_to_europe(utf8_str, '2');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1258)) {
-            buf = utf8_to_europe(utf8_str, '8');
-            converted = 1;
+    }
+#endif
+
+    if (converted == 0 || buf == NULL) {
+        if (buf != NULL && buf != dst) {
+            delete [] buf;
         }
-        delete [] utf8_str;
-        utf8_str = NULL;
-    } else if (!strcasecmp(src_ch, STR_AUTOJP) || !strcasecmp(src_ch, STR_AUTO)) {
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = autojp_to_eucjpms(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = autojp_to_eucjpwin(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = autojp_to_sjis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = autojp_to_jis(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = autojp_to_utf8(str);
-            utf8_clean(buf);
-            converted = 1;
+        return NULL;
+    }
+
+    if (src_family == CHARSET_UTF8 && (dest_family == CHARSET_UTF8 || no_dest)) {
+        utf8_clean(buf, &buf_length);
+    }
+
+    *result_length = buf_length;
+    return buf;
+}
+
+
+#define CHARSET_PIECE_MIN (1024L * 1024L) // smallest piece converted on a thread of its own
+
+// Piece of text converted on a thread
+typedef struct {
+    const char *str;
+    long length;
+    TCharset src_charset;
+    TCharset dest_charset;
+    char *buf;
+    long buf_length;
+} TConvertPiece;
+
+
+/*! Whether text of a character set family can be cut at any line end
+    @param family  Character set family
+    @return true: no state is carried over line ends, false: stateful or not known
+ */
+static bool charset_splittable(TCharset family) {
+    switch (family) {
+        case CHARSET_UNKNOWN:
+        case CHARSET_AUTODETECT:
+        case CHARSET_AUTODETECT_JP:
+        case CHARSET_UTF7:
+        case CHARSET_UTF7_IMAP:
+        case CHARSET_JIS:
+        case CHARSET_UTF16:
+        case CHARSET_UTF32:
+            return false;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+
+/*! Convert a piece of text (thread entry)
+    @param arg  TConvertPiece
+    @return NULL
+ */
+static void *convert_piece(void *arg) {
+    TConvertPiece *piece = (TConvertPiece *)arg;
+    char *str;
+
+    // converters need a terminated text
+    str = new char [piece->length + 1];
+    memcpy(str, piece->str, piece->length);
+    str[piece->length] = '\0';
+    piece->buf_length = 0;
+    piece->buf = convert_resolved(str, piece->length, piece->src_charset, piece->dest_charset,
+                                  NULL, NULL, 0L, &(piece->buf_length));
+    delete [] str;
+
+    return NULL;
+}
+
+
+static int utf8_trail_required(const char *str, long pos);
+
+
+/*! Convert text cut at line ends on threads, and join the results
+    @param str           Source text. (str[length] must be '\0')
+    @param length        Byte size of str.
+    @param src_charset   Character set of input. (AUTODETECT is resolved)
+    @param dest_charset  Character set of output.
+    @param threads       Number of threads
+    @param result_length Byte size of converted text.
+    @return Converted text, or NULL if it cannot be converted
+ */
+static char* convert_pieces(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                            int threads, long *result_length) {
+    TConvertPiece *pieces;
+    pthread_t *thread;
+    bool *started;
+    const char *p;
+    char *buf;
+    long from, to, total;
+    int count, n, i;
+    bool failed;
+
+    count = (int)((length / CHARSET_PIECE_MIN < threads)?(length / CHARSET_PIECE_MIN):threads);
+    pieces = new TConvertPiece [count];
+    n = 0;
+    from = 0;
+    while (from < length && n < count) {
+        // cut just after the first line end from the even share
+        to = (n == count - 1)?length:(from + (length - from) / (count - n));
+        while (to < length) {
+            p = (const char *)memchr(str + to, '\n', length - to);
+            to = (p != NULL)?(long)(p - str) + 1:length;
+            // broken UTF-8 may take the line end as its trailing byte
+            if (p == NULL || CHARSET_INFO[src_charset].family != CHARSET_UTF8 ||
+                    !utf8_trail_required(str, p - str)) {
+                break;
+            }
         }
-    } else if (!strcasecmp(src_ch, STR_EUCKR)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = euckr_to_utf8(str);
-            converted = 1;
+        pieces[n].str = str + from;
+        pieces[n].length = to - from;
+        pieces[n].src_charset = src_charset;
+        pieces[n].dest_charset = dest_charset;
+        pieces[n].buf = NULL;
+        pieces[n].buf_length = 0;
+        n++;
+        from = to;
+    }
+    if (n <= 1) {
+        delete [] pieces;
+        return convert_resolved(str, length, src_charset, dest_charset, NULL, NULL, 0L, result_length);
+    }
+
+    // the first piece is converted on the calling thread
+    thread = new pthread_t [n];
+    started = new bool [n];
+    for (i = 1; i < n; i++) {
+        started[i] = (pthread_create(&thread[i], NULL, convert_piece, &pieces[i]) == 0);
+    }
+    convert_piece(&pieces[0]);
+    for (i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(thread[i], NULL);
         } else {
-            utf8_str = euckr_to_utf8(str);
+            convert_piece(&pieces[i]);
         }
-    } else if (!strcasecmp(src_ch, STR_UTF7)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = utf7_to_utf8(str);
-            converted = 1;
+    }
+
+    failed = false;
+    total = 0;
+    for (i = 0; i < n; i++) {
+        if (pieces[i].buf == NULL) {
+            failed = true;
         } else {
-            utf8_str = utf7_to_utf8(str);
+            total += pieces[i].buf_length;
         }
-    } else if (!strcasecmp(src_ch, STR_UTF7_IMAP)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = modutf7_to_utf8(str);
-            converted = 1;
-        } else {
-            utf8_str = modutf7_to_utf8(str);
+    }
+    buf = NULL;
+    if (!failed) {
+        buf = new char [total + 1];
+        total = 0;
+        for (i = 0; i < n; i++) {
+            memcpy(buf + total, pieces[i].buf, pieces[i].buf_length);
+            total += pieces[i].buf_length;
         }
-    } else if (!strcasecmp(src_ch, STR_GBK)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = gbk_to_utf8(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_BIG5)) {
-            buf1 = gbk_to_utf8(str);
-            buf = utf8_to_big5(buf1);
-            if (buf1 != NULL) {
-                delete [] buf1;
-            }
-            converted = 1;
-        } else {
-            utf8_str = gbk_to_utf8(str);
+        buf[total] = '\0';
+        *result_length = total;
+    }
+    for (i = 0; i < n; i++) {
+        if (pieces[i].buf != NULL) {
+            delete [] pieces[i].buf;
         }
-    } else if (!strcasecmp(src_ch, STR_BIG5)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = big5_to_utf8(str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_GBK)) {
-            buf1 = big5_to_utf8(str);
-            buf = utf8_to_gbk(buf1);
-            if (buf1 != NULL) {
-                delete [] buf1;
-            }
-            converted = 1;
-        } else {
-            utf8_str = big5_to_utf8(str);
+    }
+    delete [] started;
+    delete [] thread;
+    delete [] pieces;
+
+    return buf;
+}
+
+
+/*! Multi-character set converter on resolved handles
+    @param str           Source text. (str[length] must be '\0')
+    @param length        Byte size of str.
+    @param src_charset   Character set of input.
+    @param dest_charset  Character set of output.
+    @param src_name      Name of src_charset given by the caller (can be NULL)
+    @param threads       Number of threads for large stateless text
+    @param dst           Buffer the last encoder may write into (can be NULL)
+    @param capacity      Byte size of dst.
+    @param result_length Byte size of converted text. (can be NULL)
+    @return Converted text (dst or a new buffer)
+ */
+static char* convert_charset(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                             const char *src_name, int threads, char *dst, long capacity,
+                             long *result_length) {
+    char *buf;
+    TCharset src_family, dest_family;
+    long buf_length;
+
+    if (result_length != NULL) *result_length = 0;
+    if (str == (const char *)NULL) {
+        return NULL;
+    }
+
+    if (src_charset == CHARSET_AUTODETECT_JP) {
+        src_charset = charsetHandle(jis_auto_detect(str, length));
+    } else if (src_charset == CHARSET_AUTODETECT) {
+        src_charset = charsetHandle(auto_detect(str, length));
+    }
+    src_family = CHARSET_INFO[src_charset].family;
+    dest_family = CHARSET_INFO[dest_charset].family;
+
+    buf_length = 0;
+    if (1 < threads && 2 * CHARSET_PIECE_MIN <= length &&
+            charset_splittable(src_family) && charset_splittable(dest_family)) {
+        buf = convert_pieces(str, length, src_charset, dest_charset, threads, &buf_length);
+    } else {
+        buf = convert_resolved(str, length, src_charset, dest_charset, src_name, dst, capacity, &buf_length);
+    }
+
+    if (buf == NULL) {
+        buf = new char [length + 1];
+        memcpy(buf, str, length);
+        buf[length] = '\0';
+        buf_length = length;
+        if (src_family == CHARSET_UTF8 && (dest_family == CHARSET_UTF8 || charset_no_dest(dest_family))) {
+            utf8_clean(buf, &buf_length);
         }
-    } else if (!strncasecmp(src_ch, "ISO-8859-", 9)) {
-        int num;
-        num = atoi(src_ch + 9);
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = iso8859_to_utf8(str, num);
-            converted = 1;
-        } else {
-            utf8_str = iso8859_to_utf8(str, num);
+    }
+
+    if (buf && CHARSET_INFO[dest_charset].bom && dest_family == CHARSET_UTF8) {
+        char *bom_buf;
+        bom_buf = new char [buf_length + 4];
+        bom_buf[0] = '\xEF';
+        bom_buf[1] = '\xBB';
+        bom_buf[2] = '\xBF';
+        memcpy(bom_buf + 3, buf, buf_length);
+        bom_buf[buf_length + 3] = '\0';
+        delete [] buf;
+        buf = bom_buf;
+        buf_length += 3;
+    }
+
+    if (result_length != NULL) *result_length = buf_length;
+    return buf;
+}
+
+
+/*! Multi-character set converter
+    @param str          Source text. (str[length] must be '\0')
+    @param length       Byte size of str.
+    @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @param result_length Byte size of converted text. (can be NULL)
+    @return Converted text
+ */
+char* charset_convert(const char* str, long length, const char *src_charset, const char *dest_charset,
+                      long *result_length) {
+    return convert_charset(str, length,
+                           (src_charset == NULL || src_charset[0] == '\0')?CHARSET_AUTODETECT:charsetHandle(src_charset),
+                           charsetHandle(dest_charset), src_charset, 1, NULL, 0L, result_length);
+}
+
+
+/*! Multi-character set converter on handles
+    @param str          Source text. (str[length] must be '\0')
+    @param length       Byte size of str.
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8)
+    @param dest_charset Character set of output. (ex. CHARSET_JIS)
+    @param result_length Byte size of converted text. (can be NULL)
+    @return Converted text
+ */
+char* charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                      long *result_length) {
+    if (src_charset < CHARSET_UNKNOWN || CHARSET_MAX <= src_charset) {
+        src_charset = CHARSET_UNKNOWN;
+    }
+    if (dest_charset < CHARSET_UNKNOWN || CHARSET_MAX <= dest_charset) {
+        dest_charset = CHARSET_UNKNOWN;
+    }
+    return convert_charset(str, length, src_charset, dest_charset, NULL, 1, NULL, 0L, result_length);
+}
+
+
+/*! Multi-character set converter on handles, on threads for large text
+    @param str          Source text. (str[length] must be '\0')
+    @param length       Byte size of str.
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8)
+    @param dest_charset Character set of output. (ex. CHARSET_EUCJP)
+    @param result_length Byte size of converted text. (can be NULL)
+    @param threads      Number of threads. Text of stateless character sets is cut
+                        at line ends and the pieces are converted at once.
+                        ISO-2022-JP, UTF-7, UTF-16 and UTF-32 are converted on one thread.
+    @return Converted text
+ */
+char* charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                      long *result_length, int threads) {
+    if (src_charset < CHARSET_UNKNOWN || CHARSET_MAX <= src_charset) {
+        src_charset = CHARSET_UNKNOWN;
+    }
+    if (dest_charset < CHARSET_UNKNOWN || CHARSET_MAX <= dest_charset) {
+        dest_charset = CHARSET_UNKNOWN;
+    }
+    return convert_charset(str, length, src_charset, dest_charset, NULL, threads, NULL, 0L, result_length);
+}
+
+
+/*! Multi-character set converter
+    @param str          Source text.
+    @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @return Converted text
+ */
+char* charset_convert(const char* str, const char *src_charset, const char *dest_charset) {
+    return charset_convert(str, (str != NULL)?(long)strlen(str):0L, src_charset, dest_charset, (long *)NULL);
+}
+
+
+/*! Convert text into a caller supplied buffer
+    @param str          Source text. (str[length] must be '\0')
+    @param length       Byte size of str.
+    @param src_charset  Character set of input.
+    @param dest_charset Character set of output.
+    @param src_name     Name of src_charset given by the caller (can be NULL)
+    @param dst          Output buffer. (can be NULL when capacity is 0)
+    @param capacity     Byte size of dst.
+    @return Byte size of converted text (may exceed capacity, as snprintf)
+ */
+static long convert_charset_into(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                                 const char *src_name, char *dst, long capacity) {
+    char *buf;
+    long buf_length;
+
+    if (dst == NULL) {
+        capacity = 0;
+    }
+
+    // the last encoder writes into dst when its worst case fits, otherwise it is copied
+    buf_length = 0;
+    buf = convert_charset(str, length, src_charset, dest_charset, src_name, 1, dst, capacity, &buf_length);
+    if (buf == NULL) {
+        return -1L;
+    }
+    if (buf == dst) {
+        return buf_length;
+    }
+
+    if (0 < capacity) {
+        memcpy(dst, buf, (buf_length < capacity)?buf_length:capacity);
+        if (buf_length < capacity) {
+            dst[buf_length] = '\0';
         }
-    } else if (!strcasecmp(src_ch, STR_KOI8_U)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = europe_to_utf8(str, 'U');
-            converted = 1;
-        } else {
-            utf8_str = europe_to_utf8(str, 'U');
+    }
+    delete [] buf;
+
+    return buf_length;
+}
+
+
+/*! Multi-character set converter into a caller supplied buffer
+    @param src          Source text. (need not be terminated)
+    @param length       Byte size of src.
+    @param dst          Output buffer. (can be NULL when capacity is 0)
+    @param capacity     Byte size of dst.
+    @param src_charset  Character set of input. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @param dest_charset Character set of output. (ex. "UTF-8", "ISO-2022-JP", etc..)
+    @return Byte size of converted text (may exceed capacity, as snprintf),
+            or -1 on error. dst is '\0' terminated when the result fits.
+ */
+long charset_convert(const char* src, long length, char *dst, long capacity,
+                     const char *src_charset, const char *dest_charset) {
+    char *tmp;
+    long buf_length;
+
+    if (src == NULL || length < 0) {
+        return -1L;
+    }
+
+    tmp = new char [length + 1];
+    memcpy(tmp, src, length);
+    tmp[length] = '\0';
+    buf_length = convert_charset_into(tmp, length,
+                                      (src_charset == NULL || src_charset[0] == '\0')?CHARSET_AUTODETECT:charsetHandle(src_charset),
+                                      charsetHandle(dest_charset), src_charset, dst, capacity);
+    delete [] tmp;
+
+    return buf_length;
+}
+
+
+/*! Multi-character set converter on handles into a caller supplied buffer
+    @param str          Source text. (str[length] must be '\0')
+    @param length       Byte size of str.
+    @param src_charset  Character set of input. (ex. CHARSET_UTF8)
+    @param dest_charset Character set of output. (ex. CHARSET_JIS)
+    @param dst          Output buffer. (can be NULL when capacity is 0)
+    @param capacity     Byte size of dst.
+    @return Byte size of converted text (may exceed capacity, as snprintf),
+            or -1 on error. dst is '\0' terminated when the result fits.
+ */
+long charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                     char *dst, long capacity) {
+    if (str == NULL || length < 0) {
+        return -1L;
+    }
+    if (src_charset < CHARSET_UNKNOWN || CHARSET_MAX <= src_charset) {
+        src_charset = CHARSET_UNKNOWN;
+    }
+    if (dest_charset < CHARSET_UNKNOWN || CHARSET_MAX <= dest_charset) {
+        dest_charset = CHARSET_UNKNOWN;
+    }
+    return convert_charset_into(str, length, src_charset, dest_charset, NULL, dst, capacity);
+}
+
+
+/*! Length of leading 7bit text without stop1, stop2 and stop3 (portable version)
+    @param str     text
+    @param length  byte size of str
+    @param stop1   7bit character to stop at (8bit value: none)
+    @param stop2   7bit character to stop at (8bit value: none)
+    @param stop3   7bit character to stop at (8bit value: none)
+    @return Byte size of the run
+ */
+static long detect_span_scalar(const char *str, long length, char stop1, char stop2, char stop3) {
+    long i;
+
+    i = 0;
+    while (i < length && ((unsigned char)str[i] & 0x80) == 0 &&
+            str[i] != stop1 && str[i] != stop2 && str[i] != stop3) {
+        i++;
+    }
+
+    return i;
+}
+
+
+/*! Whether a byte has to be a UTF-8 trailing byte (portable version)
+    @param str  text
+    @param pos  position in str
+    @return 1: one of the 5 bytes before is a leading byte covering pos, 0: not
+ */
+static int utf8_trail_required(const char *str, long pos) {
+    long k;
+
+    for (k = 1; k <= 5 && k <= pos; k++) {
+        if (k < utf8_len((unsigned char)str[pos - k])) {
+            return 1;
         }
-    } else if (!strcasecmp(src_ch, STR_KOI8_R)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = europe_to_utf8(str, 'R');
-            converted = 1;
-        } else {
-            utf8_str = europe_to_utf8(str, 'R');
+    }
+
+    return 0;
+}
+
+
+/*! Find a UTF-8 leading byte without enough trailing bytes (portable version)
+    @param str     text (str[length] must be '\0')
+    @param length  byte size of str
+    @param from    first position to check
+    @param to      end of positions to check (length + 1 at most)
+    @return 1: found, 0: not found
+ */
+static int utf8_broken_scalar(const char *str, long length, long from, long to) {
+    long pos;
+
+    for (pos = from; pos < to; pos++) {
+        if (((unsigned char)str[pos] & 0xC0) != 0x80 && utf8_trail_required(str, pos)) {
+            return 1;
         }
-    } else if (!strcasecmp(src_ch, STR_CP1251)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = europe_to_utf8(str, '1');
-            converted = 1;
-        } else {
-            utf8_str = europe_to_utf8(str, '1');
+    }
+
+    return 0;
+}
+
+
+#if __CHARSET_SIMD_X86 == 1
+/*! Length of leading 7bit text without stop1, stop2 and stop3 (SSE2 version)
+    @param str     text
+    @param length  byte size of str
+    @param stop1   7bit character to stop at (8bit value: none)
+    @param stop2   7bit character to stop at (8bit value: none)
+    @param stop3   7bit character to stop at (8bit value: none)
+    @return Byte size of the run
+ */
+__attribute__((target("sse2")))
+static long detect_span_sse2(const char *str, long length, char stop1, char stop2, char stop3) {
+    const __m128i s1 = _mm_set1_epi8(stop1);
+    const __m128i s2 = _mm_set1_epi8(stop2);
+    const __m128i s3 = _mm_set1_epi8(stop3);
+    __m128i v;
+    int mask;
+    long i;
+
+    i = 0;
+    while (i + 16 <= length) {
+        v = _mm_loadu_si128((const __m128i *)(str + i));
+        v = _mm_or_si128(_mm_or_si128(v, _mm_cmpeq_epi8(v, s1)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+        mask = _mm_movemask_epi8(v);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
         }
-    } else if (!strcasecmp(src_ch, STR_CP1252)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = europe_to_utf8(str, '2');
-            converted = 1;
-        } else {
-            utf8_str = europe_to_utf8(str, '2');
+        i += 16;
+    }
+
+    return i + detect_span_scalar(str + i, length - i, stop1, stop2, stop3);
+}
+
+
+/*! Find a UTF-8 leading byte without enough trailing bytes (SSE2 version)
+    @param str     text (str[length] must be '\0')
+    @param length  byte size of str
+    @param from    first position to check
+    @param to      end of positions to check (length + 1 at most)
+    @return 1: found, 0: not found
+ */
+__attribute__((target("sse2")))
+static int utf8_broken_sse2(const char *str, long length, long from, long to) {
+    // leading bytes by the number of trailing bytes they need at least
+    const __m128i need1 = _mm_set1_epi8((char)0xC2);
+    const __m128i need2 = _mm_set1_epi8((char)0xE0);
+    const __m128i need3 = _mm_set1_epi8((char)0xF0);
+    const __m128i need4 = _mm_set1_epi8((char)0xF8);
+    const __m128i need5 = _mm_set1_epi8((char)0xFC);
+    const __m128i last = _mm_set1_epi8((char)0xFD);
+    const __m128i top2 = _mm_set1_epi8((char)0xC0);
+    const __m128i trail = _mm_set1_epi8((char)0x80);
+    __m128i v, p, required;
+    long pos;
+
+    pos = from;
+    while (pos < to && pos < 5) {
+        if (utf8_broken_scalar(str, length, pos, pos + 1)) {
+            return 1;
         }
-    } else if (!strcasecmp(src_ch, STR_CP1258)) {
-        if (!strcasecmp(dest_ch, STR_UTF8)) {
-            buf = europe_to_utf8(str, '8');
-            converted = 1;
-        } else {
-            utf8_str = europe_to_utf8(str, '8');
+        pos++;
+    }
+    // the 16 bytes at pos and the 5 bytes before are in str
+    while (pos + 16 <= to && pos + 16 <= length) {
+        v = _mm_loadu_si128((const __m128i *)(str + pos));
+        p = _mm_loadu_si128((const __m128i *)(str + pos - 1));
+        required = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(p, need1), p),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(p, last), p));
+        p = _mm_loadu_si128((const __m128i *)(str + pos - 2));
+        required = _mm_or_si128(required, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(p, need2), p),
+                                                        _mm_cmpeq_epi8(_mm_min_epu8(p, last), p)));
+        p = _mm_loadu_si128((const __m128i *)(str + pos - 3));
+        required = _mm_or_si128(required, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(p, need3), p),
+                                                        _mm_cmpeq_epi8(_mm_min_epu8(p, last), p)));
+        p = _mm_loadu_si128((const __m128i *)(str + pos - 4));
+        required = _mm_or_si128(required, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(p, need4), p),
+                                                        _mm_cmpeq_epi8(_mm_min_epu8(p, last), p)));
+        p = _mm_loadu_si128((const __m128i *)(str + pos - 5));
+        required = _mm_or_si128(required, _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(p, need5), p),
+                                                        _mm_cmpeq_epi8(_mm_min_epu8(p, last), p)));
+        if (_mm_movemask_epi8(_mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(v, top2), trail),
+                                               required)) != 0) {
+            return 1;
         }
+        pos += 16;
     }
+
+    return utf8_broken_scalar(str, length, pos, to);
+}
 #endif
 
-#if __ICONV == 0
-    if (converted == 0 && utf8_str != NULL) {
-        if (!strcasecmp(dest_ch, STR_EUCJPMS)) {
-            buf = utf8_to_eucjpms(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCJP)) {
-            buf = utf8_to_eucjpwin(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_SJIS)) {
-            buf = utf8_to_sjis(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_JIS)) {
-            buf = utf8_to_jis(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_EUCKR)) {
-            buf = utf8_to_euckr(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF7)) {
-            buf = utf8_to_utf7(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_UTF7_IMAP)) {
-            buf = utf8_to_modutf7(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_GBK)) {
-            buf = utf8_to_gbk(utf8_str);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_BIG5)) {
-            buf = utf8_to_big5(utf8_str);
-            converted = 1;
-        } else if (!strncasecmp(dest_ch, "ISO-8859-", 9)) {
-            int num;
-            num = atoi(dest_ch + 9);
-            buf = utf8_to_iso8859(utf8_str, num);
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_KOI8_U)) {
-            buf = utf8_to_europe(utf8_str, 'U');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_KOI8_R)) {
-            buf = utf8_to_europe(utf8_str, 'R');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1251)) {
-            buf = utf8_to_europe(utf8_str, '1');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1252)) {
-            buf = utf8_to_europe(utf8_str, '2');
-            converted = 1;
-        } else if (!strcasecmp(dest_ch, STR_CP1258)) {
-            buf = utf8_to_europe(utf8_str, '8');
-            converted = 1;
-        }
-    }
 
-    if (utf8_str) {
-        delete [] utf8_str;
+/*! Select the detect_span() implementation for this CPU
+    @param  void
+    @return Implementation
+ */
+static long (*detect_span_select())(const char *, long, char, char, char) {
+#if __CHARSET_SIMD_X86 == 1
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        return detect_span_sse2;
     }
 #endif
+    return detect_span_scalar;
+}
 
-    if (converted == 0 || buf == NULL) {
-        long length;
-        length = strlen(str);
-        buf = new char [length + 1];
-        memcpy(buf, str, length);
-        buf[length] = '\0';
-        converted = 1;
-    }
 
-    if (!strcasecmp(src_ch, STR_UTF8) &&
-            (!strcasecmp(dest_ch, STR_UTF8) || dest_ch[0] == '\0')) {
-        utf8_clean(buf);
+/*! Select the utf8_broken() implementation for this CPU
+    @param  void
+    @return Implementation
+ */
+static int (*utf8_broken_select())(const char *, long, long, long) {
+#if __CHARSET_SIMD_X86 == 1
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        return utf8_broken_sse2;
     }
+#endif
+    return utf8_broken_scalar;
+}
 
-    if (buf && dest_charset && !strcasecmp(dest_ch, STR_UTF8) && strcasestr(dest_charset, "BOM")) {
-        long length;
-        length = strlen(buf);
-        utf8_str = new char [length + 4];
-        utf8_str[0] = '\xEF';
-        utf8_str[1] = '\xBB';
-        utf8_str[2] = '\xBF';
-        memcpy(utf8_str + 3, buf, length);
-        utf8_str[length + 3] = '\0';
-        delete [] buf;
-        buf = utf8_str;
-    }
 
-    return buf;
+/*! Length of leading 7bit text without stop1, stop2 and stop3
+    @param str     text
+    @param length  byte size of str
+    @param stop1   7bit character to stop at (8bit value: none)
+    @param stop2   7bit character to stop at (8bit value: none)
+    @param stop3   7bit character to stop at (8bit value: none)
+    @return Byte size of the run
+ */
+static long detect_span(const char *str, long length, char stop1, char stop2, char stop3) {
+    static long (* const span)(const char *, long, char, char, char) = detect_span_select();
+
+    return span(str, length, stop1, stop2, stop3);
 }
 
 
-/*! Auto detect character set
-    @param str  text for character set auto detection
-    @return Character set
+/*! Find a UTF-8 leading byte without enough trailing bytes
+    @param str     text (str[length] must be '\0')
+    @param length  byte size of str
+    @param from    first position to check
+    @param to      end of positions to check (length + 1 at most)
+    @return 1: found, 0: not found
  */
-const char* auto_detect(const char *str) {
-    const char *charcode;
-    long i, length, cp1252Pattern, badEUCKR;
-    unsigned char c0, c1, c2, c3;
+static int utf8_broken(const char *str, long length, long from, long to) {
+    static int (* const broken)(const char *, long, long, long) = utf8_broken_select();
 
-    if (str == NULL || str[0] == '\0') {
-        charcode = STR_ASCII;
-        return charcode;
+    return broken(str, length, from, to);
+}
+
+
+// Bytes of text each detector reads before the next detector follows
+#define DETECT_BLOCK_SIZE 32768L
+
+// 7bit bytes in a row after which a judgment skips the run by detect_span()
+#define DETECT_RUN_SIZE 16
+
+/* Judgments of auto_detect() and jis_auto_detect().
+   Each judgment keeps the position of its own loop, so that all of them
+   can read the text together, one block at a time. */
+struct charset_detector {
+    const char *str;
+    long length;
+
+    // Judgment of EUC-JP
+    long eucjp_i, eucjp_max, badEUCJP, isEUCJPMS;
+    int eucjp_done;
+
+    // Judgment of CP932 and ISO-2022-JP
+    long sjis_i, sjis_max, badSJIS, badJIS, isJIS;
+    int sjis_done;
+
+    // Judgment of UTF-8 (jis_auto_detect)
+    long utf8_i, badUTF8;
+    int utf8_done;
+
+    // Judgment of CP1252
+    long cp1252_i, cp1252Pattern;
+    int cp1252_done;
+
+    // Judgment of EUC-KR
+    long euckr_i, badEUCKR;
+    int euckr_done;
+
+    // Judgment of UTF-8 (auto_detect)
+    long strict_pos, badStrictUTF8;
+    int strict_done;
+
+    // Judgment of GB18030 (after UTF-8 has failed)
+    long gbk_i, badGBK;
+    int gb18030_4byte, gb_char, kana, gbk_started, gbk_done;
+
+    // Judgment of CP950 (after UTF-8 has failed)
+    long big5_i, badBIG5;
+    int big5_char, big5_done;
+
+    // Judged bytes and the way judgments stopped
+    long judged;
+    int decided, settled;
+};
+
+
+/*! Judgment of EUC-JP up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_eucjp(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long i, run, badEUCJP, isEUCJPMS;
+    int skip;
+
+    badEUCJP = det->badEUCJP;
+    isEUCJPMS = det->isEUCJPMS;
+    run = 0;
+    skip = 0;
+    for (i = det->eucjp_i; i < end; i++) {
+        if (((unsigned char)str[i] & 0x80) == 0 && str[i] != 0x1B && str[i] != '$' && str[i] != '%') {
+            // 7bit text which does not change the score
+            if (DETECT_RUN_SIZE <= ++run) {
+                skip = 1;
+                break;
+            }
+            continue;
+        }
+        run = 0;
+        if (((unsigned char)str[i] == 0x8E) && (++i < length)) {
+            if (ishankana((unsigned char)str[i])) {
+                badEUCJP++;
+            } else {
+                badEUCJP += 10;
+                i--;
+            }
+        } else if (((unsigned char)str[i] == 0x8F) && (++i < length - 1)) {
+            if (iseuc((unsigned char)str[i]) && iseuc((unsigned char)str[i + 1])) {
+                // 3byte EUC-JP
+                isEUCJPMS++;
+                i++;
+            } else {
+                badEUCJP += 10;
+                i--;
+            }
+        } else if (iseuc((unsigned char)str[i]) && (++i < length)) {
+            if (!iseuc((unsigned char)str[i])) {
+                badEUCJP += 10;
+                i--;
+            } else if (0x50 <= str[i-1]) {
+                badEUCJP++;
+            }
+        } else if ((str[i] == 0x1B) && (++i < length)) {
+            if ((str[i] == '$') || (str[i] == '(')) {
+                badEUCJP += 20;
+            } else {
+                i--;
+            }
+        } else if ((str[i] == '$') || (str[i] == '%')) {
+            badEUCJP++;
+        } else if (0x80 <= (unsigned char)str[i]) {
+            badEUCJP++;
+        }
+        if (1000 < badEUCJP) {
+            det->eucjp_max = i;
+            det->eucjp_done = 1;
+            break;
+        }
     }
+    if (length <= i) {
+        det->eucjp_done = 1;
+    }
+    det->eucjp_i = i;
+    det->badEUCJP = badEUCJP;
+    det->isEUCJPMS = isEUCJPMS;
+
+    return skip;
+}
 
-    length = strlen(str);
 
-    if (20 < length) {
-        cp1252Pattern = 0;
-        for (i = 1; i < length-3; i++) {
-            c0 = str[i-1];
-            c1 = str[i];
-            c2 = str[i+1];
-            c3 = str[i+2];
-            if (0x20 <= c0 && c0 <= 0x7E && (unsigned char)0x80 <= c1 &&
-                    'a' <= c2 && c2 <= 'z' && 'a' <= c3 && c3 <= 'z') {
-                cp1252Pattern++;
-            } else if ((unsigned char)0x80 <= c0 && (unsigned char)0x80 <= c1) {
-                cp1252Pattern = 0;
+/*! Judgment of CP932 and ISO-2022-JP up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_sjis(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long max = det->eucjp_max;
+    long i, run, badSJIS, badJIS, isJIS;
+    int skip;
+
+    badSJIS = det->badSJIS;
+    badJIS = det->badJIS;
+    isJIS = det->isJIS;
+    run = 0;
+    skip = 0;
+    for (i = det->sjis_i; i < max && i < end; i++) {
+        unsigned char c, d;
+        c = (unsigned char)str[i];
+        if ((c & 0x80) == 0 && c != 0x1B) {
+            // 7bit text which does not change the score
+            if (DETECT_RUN_SIZE <= ++run) {
+                skip = 1;
                 break;
             }
+            continue;
         }
-        if (0 < cp1252Pattern && cp1252Pattern <= length/60+1) {
-            charcode = STR_CP1252;
-            return charcode;
+        run = 0;
+        if (c == 0x1B && ((unsigned char)str[i+1] == '$' || (unsigned char)str[i+1] == '(')) {
+            // ISO-2022-JP also adds 200 to badUTF8 and badEUCJP
+            badSJIS += 160;
+            isJIS++;
+            i++;
+        } else if (issjis1(c) && (i + 1 < length)) {
+            d = (unsigned char)str[i+1];
+            if (issjis2(d)) {
+                badJIS += 50;
+                i++;
+            } else if (0 < i && 0x989F <= (((unsigned int)str[i-1] << 8) | (unsigned int)str[i])) {
+                badSJIS++;
+                badJIS++;
+            }
+        } else if (0x80 <= (unsigned char)str[i]) {
+            badJIS += 10;
+            if (ishankana((unsigned char)str[i])) {
+                badSJIS++;
+            } else {
+                badSJIS += 10;
+            }
+        }
+        if (1000 < badSJIS) {
+            det->sjis_max = i;
+            det->sjis_done = 1;
+            break;
         }
     }
+    if (length <= i || (det->eucjp_done && max <= i)) {
+        det->sjis_done = 1;
+    }
+    det->sjis_i = i;
+    det->badSJIS = badSJIS;
+    det->badJIS = badJIS;
+    det->isJIS = isJIS;
 
-    charcode = jis_auto_detect(str);
+    return skip;
+}
 
-    if (!strcmp(charcode, STR_EUCJP)) {
-        // Judgment of EUC-KR
-        badEUCKR = 0;
-        for (i = 0; i < length; i++) {
-            c0 = str[i];
-            c1 = str[i + 1];
-            if (c1 == (unsigned char)'\0') {
-                if ((unsigned char)0x80 <= c0) {
-                    badEUCKR++;
-                    break;
+
+/*! Judgment of UTF-8 (jis_auto_detect) up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_utf8(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long max = (0 <= det->sjis_max)?det->sjis_max:det->eucjp_max;
+    long i, run, badUTF8;
+    int skip;
+
+    badUTF8 = det->badUTF8;
+    run = 0;
+    skip = 0;
+    for (i = det->utf8_i; i < max && i < end; i++) {
+        if (((unsigned char)str[i] & 0x80) == 0 && str[i] != 0x1B && str[i] != '$' && str[i] != '%' &&
+                badUTF8 <= 1000) {
+            // 7bit text which does not change the score
+            if (DETECT_RUN_SIZE <= ++run) {
+                skip = 1;
+                break;
+            }
+            continue;
+        }
+        run = 0;
+        if ((str[i] == 0x1B) && (i+1 < length)) {
+            if ((str[i+1] == '$') || (str[i+1] == '(')) {
+                badUTF8 += 20;
+            }
+        } else if ((str[i] == '$') || (str[i] == '%')) {
+            badUTF8++;
+        }
+        if (isutf8_1((unsigned char)str[i]) && (++i < length)) {
+            if (isutf8_2((unsigned char)str[i]) && (++i < length)) {
+                if (3 <= utf8_len((unsigned char)str[i-2])) {
+                    if (!isutf8_3((unsigned char)str[i])) {
+                        badUTF8 += 10;
+                        i -= 2;
+                    }
+                } else {
+                    i--;
                 }
-            } else if (((unsigned char)0xB0 <= c0 && c0 <= (unsigned char)0xC8) &&
-                       ((unsigned char)0xA1 <= c1 && c1 <= (unsigned char)0xFE)) {
-                i++;
-            } else if ((unsigned char)0x80 <= c0) {
-                badEUCKR++;
+            } else {
+                badUTF8 += 5;
+                i--;
+            }
+        } else if (iseuc((unsigned char)str[i])) {
+            badUTF8 += 10;
+        }
+        if (1000 < badUTF8) {
+            det->utf8_done = 1;
+            break;
+        }
+    }
+    if (length <= i || (det->sjis_done && max <= i)) {
+        det->utf8_done = 1;
+    }
+    det->utf8_i = i;
+    det->badUTF8 = badUTF8;
+
+    return skip;
+}
+
+
+/*! Judgment of CP1252 up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_cp1252(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long i, run, cp1252Pattern;
+    int skip;
+    unsigned char c0, c1, c2, c3;
+
+    cp1252Pattern = det->cp1252Pattern;
+    run = 0;
+    skip = 0;
+    for (i = det->cp1252_i; i < length-3 && i < end; i++) {
+        if (((unsigned char)str[i] & 0x80) == 0) {
+            // a pattern needs 8bit str[i]
+            if (DETECT_RUN_SIZE <= ++run) {
+                skip = 1;
                 break;
             }
+            continue;
         }
-        if (badEUCKR == 0) {
-            charcode = STR_EUCKR;
+        run = 0;
+        c0 = str[i-1];
+        c1 = str[i];
+        c2 = str[i+1];
+        c3 = str[i+2];
+        if (0x20 <= c0 && c0 <= 0x7E && (unsigned char)0x80 <= c1 &&
+                'a' <= c2 && c2 <= 'z' && 'a' <= c3 && c3 <= 'z') {
+            cp1252Pattern++;
+        } else if ((unsigned char)0x80 <= c0 && (unsigned char)0x80 <= c1) {
+            cp1252Pattern = 0;
+            det->cp1252_done = 1;
+            break;
         }
     }
-    if (!strcmp(charcode, STR_EUCJP) || !strcmp(charcode, STR_SJIS)|| !strcmp(charcode, STR_UTF8)) {
-        // Judgment of UTF-8, GB18030, CP950
-        int u8len, gb18030_4byte, gb_char, kana, big5_char;
-        long badGBK, badUTF8, badBIG5;
-        unsigned char c2, c3;
-
-        badUTF8 = 0;
-        for (i = 0; i < length; i++) {
-            u8len = utf8_len(str[i]);
-            c0 = str[i];
-            c1 = str[i + 1];
-            if (u8len == 1) {
-                continue;
-            } else if (u8len == 2) {
-                if (0xC2 <= c0 && c0 <= 0xDF && 0x80 <= c1 && c1 <= 0xBF) {
-                    i++;
-                    continue;
-                }
-                badUTF8++;
+    if (length-3 <= i) {
+        det->cp1252_done = 1;
+    }
+    det->cp1252_i = i;
+    det->cp1252Pattern = cp1252Pattern;
+
+    return skip;
+}
+
+
+/*! Judgment of EUC-KR up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_euckr(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long i, run, badEUCKR;
+    int skip;
+    unsigned char c0, c1;
+
+    badEUCKR = det->badEUCKR;
+    run = 0;
+    skip = 0;
+    for (i = det->euckr_i; i < end; i++) {
+        if (((unsigned char)str[i] & 0x80) == 0) {
+            // 7bit text is valid
+            if (DETECT_RUN_SIZE <= ++run) {
+                skip = 1;
                 break;
-            } else if (u8len == 3) {
-                if (0xE0 <= c0 && c0 <= 0xEF && 0x80 <= c1 && c1 <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+2] && (unsigned char)str[i+2] <= 0xBF) {
-                    i += 2;
-                    continue;
-                }
-                badUTF8++;
+            }
+            continue;
+        }
+        run = 0;
+        c0 = str[i];
+        c1 = str[i + 1];
+        if (c1 == (unsigned char)'\0') {
+            if ((unsigned char)0x80 <= c0) {
+                badEUCKR++;
                 break;
-            } else if (u8len == 4) {
-                if (0xF0 <= c0 && c0 <= 0xF7 && 0x80 <= c1 && c1 <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+2] && (unsigned char)str[i+2] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+3] && (unsigned char)str[i+3] <= 0xBF) {
-                    i += 3;
-                    continue;
-                }
-                badUTF8++;
+            }
+        } else if (((unsigned char)0xB0 <= c0 && c0 <= (unsigned char)0xC8) &&
+                   ((unsigned char)0xA1 <= c1 && c1 <= (unsigned char)0xFE)) {
+            i++;
+        } else if ((unsigned char)0x80 <= c0) {
+            badEUCKR++;
+            break;
+        }
+    }
+    if (length <= i || 0 < badEUCKR) {
+        det->euckr_done = 1;
+    }
+    det->euckr_i = i;
+    det->badEUCKR = badEUCKR;
+
+    return skip;
+}
+
+
+/*! Judgment of UTF-8 (auto_detect) up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return void
+ */
+static void detect_strict_utf8(struct charset_detector *det, long end) {
+    long to;
+
+    // a leading byte at the end needs str[length] ('\0') to be a trailing byte
+    to = (end < det->length)?end:(det->length + 1);
+    if (utf8_broken(det->str, det->length, det->strict_pos, to)) {
+        det->badStrictUTF8++;
+        det->strict_done = 1;
+    } else if (det->length < to) {
+        det->strict_done = 1;
+    }
+    det->strict_pos = to;
+}
+
+
+/*! Judgment of GB18030 up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_gbk(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long i, run, badGBK;
+    int skip, gb18030_4byte, gb_char, kana;
+    unsigned char c0, c1, c2, c3;
+
+    badGBK = det->badGBK;
+    gb18030_4byte = det->gb18030_4byte;
+    gb_char = det->gb_char;
+    kana = det->kana;
+    run = 0;
+    skip = 0;
+    for (i = det->gbk_i; i < end; i++) {
+        c0 = str[i];
+        c1 = str[i + 1];
+        if (c0 < (unsigned char)0x80) {
+            if (DETECT_RUN_SIZE <= ++run) {
+                // hand the rest of the 7bit run to detect_span()
+                skip = 1;
                 break;
-            } else if (u8len == 5) {
-                if (0xF8 <= c0 && c0 <= 0xFB && 0x80 <= c1 && c1 <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+2] && (unsigned char)str[i+2] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+3] && (unsigned char)str[i+3] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+4] && (unsigned char)str[i+4] <= 0xBF) {
-                    i += 4;
-                    continue;
-                }
-                badUTF8++;
+            }
+            continue;
+        }
+        run = 0;
+        if (c1 == (unsigned char)'\0') {
+            if ((unsigned char)0x80 <= c0) {
+                badGBK++;
                 break;
-            } else if (u8len == 6) {
-                if (0xFC <= c0 && c0 <= 0xFD && 0x80 <= c1 && c1 <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+2] && (unsigned char)str[i+2] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+3] && (unsigned char)str[i+3] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+4] && (unsigned char)str[i+4] <= 0xBF &&
-                        0x80 <= (unsigned char)str[i+5] && (unsigned char)str[i+5] <= 0xBF) {
-                    i += 5;
-                    continue;
-                }
-                badUTF8++;
+            }
+        } else if (((unsigned char)0x81 <= c0 && c0 <= (unsigned char)0xFE) &&
+                ((unsigned char)0x40 <= c1 && c1 <= (unsigned char)0xFE &&
+                c1 != (unsigned char)0x7F)) {
+            if (gb_char == 0 && (
+                    (c0 == (unsigned char)0xCE && c1 == (unsigned char)0xD2) ||
+                    (c0 == (unsigned char)0xBB && c1 == (unsigned char)0xF2) ||
+                    (c0 == (unsigned char)0xB5 && c1 == (unsigned char)0xC4) ||
+                    (c0 == (unsigned char)0xB2 && c1 == (unsigned char)0xFA) ||
+                    (c0 == (unsigned char)0xD6 && c1 == (unsigned char)0xB7) ||
+                    (c0 == (unsigned char)0xCE && c1 == (unsigned char)0xF1) ||
+                    (c0 == (unsigned char)0xA3 && c1 == (unsigned char)0xAC) ||
+                    (c0 == (unsigned char)0xA3 && c1 == (unsigned char)0xBB))) {
+                gb_char = 1;
+            }
+            if ((unsigned char)0xA4 <= c0 && c0 <= (unsigned char)0xA5 &&
+                    (unsigned char)0xA1 <= c1 && c1 <= (unsigned char)0xF6) {
+                kana = 1;
+            }
+            i++;
+        } else if (((unsigned char)0x81 <= c0 && c0 <= (unsigned char)0xFE) &&
+                   ((unsigned char)0x30 <= c1 && c1 <= (unsigned char)0x39)) {
+            c2 = str[i + 2];
+            if (c2 == (unsigned char)'\0') {
+                badGBK++;
                 break;
+            }
+            c3 = str[i + 3];
+            if (c3 == (unsigned char)'\0') {
+                badGBK++;
+                break;
+            }
+            if (((unsigned char)0x81 <= c2 && c2 <= (unsigned char)0xFE) &&
+                    ((unsigned char)0x30 <= c3 && c3 <= (unsigned char)0x39)) {
+                gb18030_4byte = 1;
+                i += 3;
             } else {
-                badUTF8++;
+                badGBK++;
                 break;
             }
+        } else {
+            badGBK++;
+            break;
         }
+    }
+    if (length <= i || 0 < badGBK) {
+        det->gbk_done = 1;
+    }
+    det->gbk_i = i;
+    det->badGBK = badGBK;
+    det->gb18030_4byte = gb18030_4byte;
+    det->gb_char = gb_char;
+    det->kana = kana;
+
+    return skip;
+}
+
+
+/*! Judgment of CP950 up to a position
+    @param det  detector
+    @param end  position to stop at (not beyond the text)
+    @return 1: stopped at a long 7bit run, 0: reached end or judged
+ */
+static int detect_big5(struct charset_detector *det, long end) {
+    const char *str = det->str;
+    long length = det->length;
+    long i, run, badBIG5;
+    int skip, big5_char;
+    unsigned char c0, c1;
+
+    badBIG5 = det->badBIG5;
+    big5_char = det->big5_char;
+    run = 0;
+    skip = 0;
+    for (i = det->big5_i; i < end; i++) {
+        c0 = str[i];
+        c1 = str[i + 1];
+        if (c0 < 0x7F) {
+            if (DETECT_RUN_SIZE <= ++run) {
+                // hand the rest of the 7bit run to detect_span()
+                skip = 1;
+                break;
+            }
+            continue;
+        }
+        run = 0;
+        if (( /* (0x88 <= c0 && c0 <= 0xA0) ||  is Big5-HKSCS */
+                (0xA1 <= c0 && c0 <= 0xC6) || (0xC9 <= c0 && c0 <= 0xF9)) ||
+                ((0x40 <= c1 && c1 <= 0x7E) || (0xA1 <= c1 && c1 <= 0xFE))) {
+            if (0x40 <= c1 && c1 <= 0x7E) big5_char = 1;
+            i++;
+            continue;
+        } else {
+            badBIG5++;
+            break;
+        }
+    }
+    if (length <= i || 0 < badBIG5) {
+        det->big5_done = 1;
+    }
+    det->big5_i = i;
+    det->badBIG5 = badBIG5;
+    det->big5_char = big5_char;
+
+    return skip;
+}
+
+
+static const char *detect_charset(const struct charset_detector *det, long length, int jis_only);
+
+
+/*! Run judgments over the text
+    @param det       detector
+    @param str       text for character set auto detection (str[length] must be '\0')
+    @param length    byte size of str
+    @param jis_only  1: judgments of jis_auto_detect() only, 0: all judgments
+    @param settle    1: stop when the result is the same at two checkpoints, 0: judge the whole text
+    @return void
+ */
+static void detect_run(struct charset_detector *det, const char *str, long length, int jis_only, int settle) {
+    long start, end, checkpoint;
+    const char *charcode, *last_charcode;
+
+    memset(det, 0, sizeof(struct charset_detector));
+    det->str = str;
+    det->length = length;
+    det->judged = length;
+    det->eucjp_max = length;
+    det->sjis_max = -1;
+    det->cp1252_i = 1;
+    det->cp1252_done = (jis_only || length <= 20);
+    det->euckr_done = jis_only;
+    det->strict_done = jis_only;
+    det->gbk_done = 1;
+    det->big5_done = 1;
+
+    // Every judgment reads a block before the next block is read
+    checkpoint = DETECT_BLOCK_SIZE;
+    last_charcode = NULL;
+    for (start = 0; start < length; start = end) {
+        end = (DETECT_BLOCK_SIZE < length - start)?(start + DETECT_BLOCK_SIZE):length;
+        while (!det->eucjp_done && detect_eucjp(det, end)) {
+            // 7bit text does not change the scores but for ESC, '$' and '%'
+            det->eucjp_i += detect_span(str + det->eucjp_i, end - det->eucjp_i, '\x1B', '$', '%');
+        }
+        while (!det->sjis_done && detect_sjis(det, end)) {
+            det->sjis_i += detect_span(str + det->sjis_i, end - det->sjis_i, '\x1B', '\x1B', '\x1B');
+        }
+        while (!det->utf8_done && det->isJIS == 0 && detect_utf8(det, end)) {
+            det->utf8_i += detect_span(str + det->utf8_i, end - det->utf8_i, '\x1B', '$', '%');
+        }
+        while (!det->cp1252_done && detect_cp1252(det, end)) {
+            // a pattern needs 8bit str[i]
+            det->cp1252_i += detect_span(str + det->cp1252_i, end - det->cp1252_i, '\x80', '\x80', '\x80');
+        }
+        while (!det->euckr_done && detect_euckr(det, end)) {
+            det->euckr_i += detect_span(str + det->euckr_i, end - det->euckr_i, '\x80', '\x80', '\x80');
+        }
+        if (!det->strict_done) detect_strict_utf8(det, end);
+        if (0 < det->badStrictUTF8 && !det->gbk_started) {
+            // GB18030 and CP950 are judged only if UTF-8 has failed
+            det->gbk_started = 1;
+            det->gbk_done = 0;
+            det->big5_done = 0;
+        }
+        while (!det->gbk_done && detect_gbk(det, end)) {
+            det->gbk_i += detect_span(str + det->gbk_i, end - det->gbk_i, '\x80', '\x80', '\x80');
+        }
+        while (!det->big5_done && detect_big5(det, end)) {
+            det->big5_i += detect_span(str + det->big5_i, end - det->big5_i, 0x7F, 0x7F, 0x7F);
+        }
+        if (det->eucjp_done && det->sjis_done && (det->utf8_done || 0 < det->isJIS) && det->cp1252_done &&
+                det->euckr_done && det->strict_done && det->gbk_done && det->big5_done) {
+            // the rest of the text cannot change the result
+            det->decided = (end < length);
+            break;
+        }
+        if (settle && end == checkpoint && end < length) {
+            // checkpoints at 32K, 64K, 128K, ... bytes
+            checkpoint *= 2;
+            charcode = detect_charset(det, end, jis_only);
+            if (charcode == last_charcode && charcode != STR_ASCII) {
+                det->judged = end;
+                det->settled = 1;
+                break;
+            }
+            last_charcode = charcode;
+        }
+    }
+}
+
+
+/*! Result of judgments of jis_auto_detect()
+    @param det     detector after detect_run()
+    @param length  judged byte size of the text
+    @return Character set ("CP932", "ISO-2022-JP", "EUC-JP", or "UTF-8").
+ */
+static const char *detect_jis_charset(const struct charset_detector *det, long length) {
+    const char *str = det->str;
+    long badEUCJP, badSJIS, badJIS, badUTF8;
+    const char *charcode;
+
+    badEUCJP = det->badEUCJP + 200 * det->isJIS;
+    badSJIS = det->badSJIS;
+    badJIS = det->badJIS;
+    badUTF8 = det->badUTF8;
+
+    if (3 <= length && (unsigned char)str[0] == 0xEF &&
+            (unsigned char)str[1] == 0xBB && (unsigned char)str[2] == 0xBF) {
+        badEUCJP += 10;
+        badSJIS += 10;
+        badJIS += 10;
+    }
+
+    if (badSJIS < badEUCJP && badSJIS <= badUTF8) {
+        // ISO-2022-JP or CP932
+        if (badSJIS < badJIS) {
+            charcode = STR_SJIS;
+        } else if (0 < det->isJIS) {
+            charcode = STR_JIS;
+        } else {
+            charcode = STR_ASCII;
+        }
+    } else if (2 <= length && badUTF8 < badEUCJP && badUTF8 < badSJIS) {
+        // UTF-8
+        charcode = STR_UTF8;
+    } else if (!(badEUCJP == 0 && badSJIS == 0 && badUTF8 == 0)) {
+        // EUC-JP
+        if (0 < det->isEUCJPMS) {
+            charcode = STR_EUCJPMS;
+        } else {
+            charcode = STR_EUCJP;
+        }
+    } else {
+        // ASCII
+        charcode = STR_ASCII;
+    }
+
+    return charcode;
+}
+
+
+/*! Result of judgments
+    @param det       detector after detect_run()
+    @param length    judged byte size of the text
+    @param jis_only  1: result of jis_auto_detect(), 0: result of auto_detect()
+    @return Character set
+ */
+static const char *detect_charset(const struct charset_detector *det, long length, int jis_only) {
+    struct charset_detector utf8_det;
+    const char *charcode;
 
-        if (badUTF8 == 0) {
+    if (!jis_only && 20 < length) {
+        if (0 < det->cp1252Pattern && det->cp1252Pattern <= length/60+1) {
+            charcode = STR_CP1252;
             return charcode;
         }
+    }
 
-        gb18030_4byte = 0;
-        gb_char = 0;
-        kana = 0;
-        badGBK = 0;
-        for (i = 0; i < length; i++) {
-            c0 = str[i];
-            c1 = str[i + 1];
-            if (c0 < (unsigned char)0x80) {
-                continue;
-            } else if (c1 == (unsigned char)'\0') {
-                if ((unsigned char)0x80 <= c0) {
-                    badGBK++;
-                    break;
-                }
-            } else if (((unsigned char)0x81 <= c0 && c0 <= (unsigned char)0xFE) &&
-                    ((unsigned char)0x40 <= c1 && c1 <= (unsigned char)0xFE &&
-                    c1 != (unsigned char)0x7F)) {
-                if (gb_char == 0 && (
-                        (c0 == (unsigned char)0xCE && c1 == (unsigned char)0xD2) ||
-                        (c0 == (unsigned char)0xBB && c1 == (unsigned char)0xF2) ||
-                        (c0 == (unsigned char)0xB5 && c1 == (unsigned char)0xC4) ||
-                        (c0 == (unsigned char)0xB2 && c1 == (unsigned char)0xFA) ||
-                        (c0 == (unsigned char)0xD6 && c1 == (unsigned char)0xB7) ||
-                        (c0 == (unsigned char)0xCE && c1 == (unsigned char)0xF1) ||
-                        (c0 == (unsigned char)0xA3 && c1 == (unsigned char)0xAC) ||
-                        (c0 == (unsigned char)0xA3 && c1 == (unsigned char)0xBB))) {
-                    gb_char = 1;
-                }
-                if ((unsigned char)0xA4 <= c0 && c0 <= (unsigned char)0xA5 &&
-                        (unsigned char)0xA1 <= c1 && c1 <= (unsigned char)0xF6) {
-                    kana = 1;
-                }
-                i++;
-            } else if (((unsigned char)0x81 <= c0 && c0 <= (unsigned char)0xFE) &&
-                       ((unsigned char)0x30 <= c1 && c1 <= (unsigned char)0x39)) {
-                c2 = str[i + 2];
-                if (c2 == (unsigned char)'\0') {
-                    badGBK++;
-                    break;
-                }
-                c3 = str[i + 3];
-                if (c3 == (unsigned char)'\0') {
-                    badGBK++;
-                    break;
-                }
-                if (((unsigned char)0x81 <= c2 && c2 <= (unsigned char)0xFE) &&
-                        ((unsigned char)0x30 <= c3 && c3 <= (unsigned char)0x39)) {
-                    gb18030_4byte = 1;
-                    i += 3;
-                } else {
-                    badGBK++;
-                    break;
-                }
-            } else {
-                badGBK++;
-                break;
-            }
+    if (0 < det->isJIS) {
+        // ISO-2022-JP adds its score before the judgment of UTF-8 starts
+        utf8_det = *det;
+        utf8_det.utf8_i = 0;
+        utf8_det.badUTF8 = 200 * det->isJIS;
+        utf8_det.utf8_done = 0;
+        while (detect_utf8(&utf8_det, length)) {
+            utf8_det.utf8_i += detect_span(det->str + utf8_det.utf8_i, length - utf8_det.utf8_i, '\x1B', '$', '%');
+        }
+        charcode = detect_jis_charset(&utf8_det, length);
+    } else {
+        charcode = detect_jis_charset(det, length);
+    }
+    if (jis_only) {
+        return charcode;
+    }
+
+    if (!strcmp(charcode, STR_EUCJP)) {
+        // Judgment of EUC-KR
+        if (det->badEUCKR == 0) {
+            charcode = STR_EUCKR;
+        }
+    }
+    if (!strcmp(charcode, STR_EUCJP) || !strcmp(charcode, STR_SJIS)|| !strcmp(charcode, STR_UTF8)) {
+        // Judgment of UTF-8, GB18030, CP950
+        if (det->badStrictUTF8 == 0) {
+            return charcode;
         }
-        if (badGBK == 0 && (gb18030_4byte == 1 || gb_char == 1) && kana == 0) {
+
+        if (det->badGBK == 0 && (det->gb18030_4byte == 1 || det->gb_char == 1) && det->kana == 0) {
             charcode = STR_GBK;
-        } else if (badGBK == 0 && kana == 1) {
+        } else if (det->badGBK == 0 && det->kana == 1) {
             charcode = STR_EUCJP;
         }
 
-        big5_char = 0;
-        badBIG5 = 0;
-        for (i = 0; i < length; i++) {
-            c0 = str[i];
-            c1 = str[i + 1];
-            if (c0 < 0x7F) {
-                continue;
-            } else if (( /* (0x88 <= c0 && c0 <= 0xA0) ||  is Big5-HKSCS */
-                    (0xA1 <= c0 && c0 <= 0xC6) || (0xC9 <= c0 && c0 <= 0xF9)) ||
-                    ((0x40 <= c1 && c1 <= 0x7E) || (0xA1 <= c1 && c1 <= 0xFE))) {
-                if (0x40 <= c1 && c1 <= 0x7E) big5_char = 1;
-                i++;
-                continue;
-            } else {
-                badBIG5++;
-                break;
-            }
+        if (strcmp(charcode, STR_SJIS) != 0 && det->badBIG5 == 0 && det->big5_char == 1) {
+            charcode = STR_BIG5;
         }
+    }
 
-        if (strcmp(charcode, STR_SJIS) != 0 && badBIG5 == 0 && big5_char == 1) {
-            charcode = STR_BIG5;
+    return charcode;
+}
+
+
+/*! Judge a prefix of the text
+    @param str         text for character set auto detection (str[length] must be '\0')
+    @param length      byte size of str
+    @param limit       maximum bytes to judge (0: judge the whole text)
+    @param confidence  confidence of the result (can be NULL)
+    @param jis_only    1: jis_auto_detect(), 0: auto_detect()
+    @return Character set
+ */
+static const char *detect_prefix(const char *str, long length, long limit, int *confidence, int jis_only) {
+    struct charset_detector det;
+    const char *charcode;
+    long judged;
+
+    if (str == NULL || length <= 0) {
+        if (confidence != NULL) *confidence = CHARSET_CONFIDENCE_HIGH;
+        return STR_ASCII;
+    }
+
+    judged = length;
+    if (0 < limit && limit < length) {
+        // a character cut at the limit would look broken, so cut after a line
+        for (judged = limit; 0 < judged && str[judged - 1] != '\n'; judged--);
+        if (judged == 0) judged = limit;
+    }
+
+    detect_run(&det, str, judged, jis_only, (0 < limit));
+    charcode = detect_charset(&det, det.judged, jis_only);
+
+    if (confidence != NULL) {
+        if (det.settled) {
+            *confidence = CHARSET_CONFIDENCE_MEDIUM;
+        } else if (judged == length || det.decided) {
+            *confidence = CHARSET_CONFIDENCE_HIGH;
+        } else {
+            *confidence = CHARSET_CONFIDENCE_LOW;
         }
     }
 
@@ -1084,169 +2560,68 @@ const char* auto_detect(const char *str) {
 }
 
 
-/*! Auto detect japanese character set
-    @param str  text for character set auto detection
-    @return Character set ("CP932", "ISO-2022-JP", "EUC-JP", or "UTF-8").
+/*! Auto detect character set
+    @param str     text for character set auto detection
+    @param length  byte size of str
+    @return Character set
  */
-const char* jis_auto_detect(const char *str) {
-    long length;
+const char* auto_detect(const char *str, long length) {
+    struct charset_detector det;
     const char *charcode;
 
-    if (str != NULL && str[0] != '\0') {
-        length = strlen(str);
-    } else {
-        length = 0;
+    if (str == NULL || length <= 0) {
+        charcode = STR_ASCII;
+        return charcode;
     }
 
-    if (0 < length) {
-        long i, badEUCJP, badSJIS, badJIS, badUTF8, max, isJIS, isEUCJPMS;
+    // All judgments read the text once
+    detect_run(&det, str, length, 0, 0);
+    charcode = detect_charset(&det, length, 0);
 
-        badEUCJP = 0;
-        badSJIS = 0;
-        badJIS = 0;
-        badUTF8 = 0;
+    return charcode;
+}
 
-        max = length; // Processing will be omitted if comparison is fully possible
 
-        isJIS = 0;
-        isEUCJPMS = 0;
+/*! Auto detect character set
+    @param str  text for character set auto detection
+    @return Character set
+ */
+const char* auto_detect(const char *str) {
+    return auto_detect(str, (str != NULL)?(long)strlen(str):0L);
+}
 
-        // Judgment of EUC-JP
-        for (i = 0; i < length; i++) {
-            if (((unsigned char)str[i] == 0x8E) && (++i < length)) {
-                if (ishankana((unsigned char)str[i])) {
-                    badEUCJP++;
-                } else {
-                    badEUCJP += 10;
-                    i--;
-                }
-            } else if (((unsigned char)str[i] == 0x8F) && (++i < length - 1)) {
-                if (iseuc((unsigned char)str[i]) && iseuc((unsigned char)str[i + 1])) {
-                    // 3byte EUC-JP
-                    isEUCJPMS++;
-                    i++;
-                } else {
-                    badEUCJP += 10;
-                    i--;
-                }
-            } else if (iseuc((unsigned char)str[i]) && (++i < length)) {
-                if (!iseuc((unsigned char)str[i])) {
-                    badEUCJP += 10;
-                    i--;
-                } else if (0x50 <= str[i-1]) {
-                    badEUCJP++;
-                }
-            } else if ((str[i] == 0x1B) && (++i < length)) {
-                if ((str[i] == '$') || (str[i] == '(')) {
-                    badEUCJP += 20;
-                } else {
-                    i--;
-                }
-            } else if ((str[i] == '$') || (str[i] == '%')) {
-                badEUCJP++;
-            } else if (0x80 <= (unsigned char)str[i]) {
-                badEUCJP++;
-            }
-            if (1000 < badEUCJP) {
-                max = i;
-                break;
-            }
-        }
 
-        // Judgment of CP932 and ISO-2022-JP
-        for (i = 0; i < length && i < max; i++) {
-            unsigned char c, d;
-            c = (unsigned char)str[i];
-            if (c == 0x1B && ((unsigned char)str[i+1] == '$' || (unsigned char)str[i+1] == '(')) {
-                badSJIS += 160;
-                badUTF8 += 200;
-                badEUCJP += 200;
-                isJIS++;
-                i++;
-            } else if (issjis1(c) && (i + 1 < length)) {
-                d = (unsigned char)str[i+1];
-                if (issjis2(d)) {
-                    badJIS += 50;
-                    i++;
-                } else if (0 < i && 0x989F <= (((unsigned int)str[i-1] << 8) | (unsigned int)str[i])) {
-                    badSJIS++;
-                    badJIS++;
-                }
-            } else if (0x80 <= (unsigned char)str[i]) {
-                badJIS += 10;
-                if (ishankana((unsigned char)str[i])) {
-                    badSJIS++;
-                } else {
-                    badSJIS += 10;
-                }
-            }
-            if (1000 < badSJIS) {
-                max = i;
-                break;
-            }
-        }
+/*! Auto detect character set from a prefix of the text
+    Judgments stop when the result is the same at two checkpoints
+    (32K, 64K, 128K, ... bytes) or when limit bytes are judged.
+    @param str         text for character set auto detection
+    @param length      byte size of str
+    @param limit       maximum bytes to judge (0: judge the whole text)
+    @param confidence  CHARSET_CONFIDENCE_HIGH, CHARSET_CONFIDENCE_MEDIUM or
+                       CHARSET_CONFIDENCE_LOW (can be NULL)
+    @return Character set
+ */
+const char* auto_detect(const char *str, long length, long limit, int *confidence) {
+    return detect_prefix(str, length, limit, confidence, 0);
+}
 
-        // Judgment of UTF-8
-        if (3 <= length && (unsigned char)str[0] == 0xEF &&
-                (unsigned char)str[1] == 0xBB && (unsigned char)str[2] == 0xBF) {
-            badEUCJP += 10;
-            badSJIS += 10;
-            badJIS += 10;
-        }
-        for (i = 0; i < length && i < max; i++) {
-            if ((str[i] == 0x1B) && (i+1 < length)) {
-                if ((str[i+1] == '$') || (str[i+1] == '(')) {
-                    badUTF8 += 20;
-                }
-            } else if ((str[i] == '$') || (str[i] == '%')) {
-                badUTF8++;
-            }
-            if (isutf8_1((unsigned char)str[i]) && (++i < length)) {
-                if (isutf8_2((unsigned char)str[i]) && (++i < length)) {
-                    if (3 <= utf8_len((unsigned char)str[i-2])) {
-                        if (!isutf8_3((unsigned char)str[i])) {
-                            badUTF8 += 10;
-                            i -= 2;
-                        }
-                    } else {
-                        i--;
-                    }
-                } else {
-                    badUTF8 += 5;
-                    i--;
-                }
-            } else if (iseuc((unsigned char)str[i])) {
-                badUTF8 += 10;
-            }
-            if (1000 < badUTF8) {
-                max = i;
-                break;
-            }
-        }
 
-        if (badSJIS < badEUCJP && badSJIS <= badUTF8) {
-            // ISO-2022-JP or CP932
-            if (badSJIS < badJIS) {
-                charcode = STR_SJIS;
-            } else if (0 < isJIS) {
-                charcode = STR_JIS;
-            } else {
-                charcode = STR_ASCII;
-            }
-        } else if (2 <= length && badUTF8 < badEUCJP && badUTF8 < badSJIS) {
-            // UTF-8
-            charcode = STR_UTF8;
-        } else if (!(badEUCJP == 0 && badSJIS == 0 && badUTF8 == 0)) {
-            // EUC-JP
-            if (0 < isEUCJPMS) {
-                charcode = STR_EUCJPMS;
-            } else {
-                charcode = STR_EUCJP;
-            }
-        } else {
-            // ASCII
-            charcode = STR_ASCII;
-        }
+/*! Auto detect japanese character set
+    @param str     text for character set auto detection
+    @param length  byte size of str
+    @return Character set ("CP932", "ISO-2022-JP", "EUC-JP", or "UTF-8").
+ */
+const char* jis_auto_detect(const char *str, long length) {
+    struct charset_detector det;
+    const char *charcode;
+
+    if (str == NULL) {
+        length = 0;
+    }
+
+    if (0 < length) {
+        detect_run(&det, str, length, 1, 0);
+        charcode = detect_charset(&det, length, 1);
     } else {
         // NULL
         charcode = STR_ASCII;
@@ -1256,15 +2631,38 @@ const char* jis_auto_detect(const char *str) {
 }
 
 
+/*! Auto detect japanese character set
+    @param str  text for character set auto detection
+    @return Character set ("CP932", "ISO-2022-JP", "EUC-JP", or "UTF-8").
+ */
+const char* jis_auto_detect(const char *str) {
+    return jis_auto_detect(str, (str != NULL)?(long)strlen(str):0L);
+}
+
+
+/*! Auto detect japanese character set from a prefix of the text
+    @param str         text for character set auto detection
+    @param length      byte size of str
+    @param limit       maximum bytes to judge (0: judge the whole text)
+    @param confidence  confidence of the result (can be NULL)
+    @return Character set ("CP932", "ISO-2022-JP", "EUC-JP", or "UTF-8").
+ */
+const char* jis_auto_detect(const char *str, long length, long limit, int *confidence) {
+    return detect_prefix(str, length, limit, confidence, 1);
+}
+
+
 #if __ICONV == 0
 /*! Convert character set from ISO-8859-x to UTF-8
     @param str          ISO-8859-x text
+    @param length  byte size of str
     @param iso8859_num  x of ISO-8859-x.
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text  (UTF-8 text)
  */
-char* iso8859_to_utf8(const char* str, int iso8859_num) {
+char* iso8859_to_utf8(const char* str, long length, int iso8859_num, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1;
     const unsigned char (*iso8859_map)[ISO8859_UNICODE_TABLE_MAX][2];
 
@@ -1324,10 +2722,10 @@ char* iso8859_to_utf8(const char* str, int iso8859_num) {
     }
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         length2 = length*3;
         buf = new char[length2 + 1];
 
@@ -1335,6 +2733,13 @@ char* iso8859_to_utf8(const char* str, int iso8859_num) {
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             if ((unsigned char)0x80 <= (unsigned char)str[i]) {
                 a0 = (*iso8859_map)[(unsigned char)str[i] - (unsigned char)0x80][0];
                 a1 = (*iso8859_map)[(unsigned char)str[i] - (unsigned char)0x80][1];
@@ -1356,18 +2761,32 @@ char* iso8859_to_utf8(const char* str, int iso8859_num) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from ISO-8859-x to UTF-8
+    @param str          ISO-8859-x text
+    @param iso8859_num  x of ISO-8859-x.
+    @return Converted text  (UTF-8 text)
+ */
+char* iso8859_to_utf8(const char* str, int iso8859_num) {
+    return iso8859_to_utf8(str, (str != NULL)?(long)strlen(str):0L, iso8859_num, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to ISO-8859-x
     @param str          UTF-8 text
+    @param length  byte size of str
     @param iso8859_num  x of ISO-8859-x
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-8859-x text)
  */
-char* utf8_to_iso8859(const char* str, int iso8859_num) {
+static char* utf8_to_iso8859_into(const char* str, long length, int iso8859_num, char *dest, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1, a2;
     const unsigned char (*iso8859_map)[ISO8859_UNICODE_TABLE_MAX][2];
 
@@ -1427,17 +2846,24 @@ char* utf8_to_iso8859(const char* str, int iso8859_num) {
     }
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         length2 = length*3;
-        buf = new char[length2 + 1];
+        buf = (dest != NULL)?dest:new char[length2 + 1];
 
         // UTF-8 to ISO-8859-x
         i = 0;
         j = 0;
         while (i < length && j <= length2) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             if (isutf8_1(a0) && i+utf8_len(a0)-1 < length) {
                 unsigned short len1, n;
@@ -1492,18 +2918,43 @@ char* utf8_to_iso8859(const char* str, int iso8859_num) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to ISO-8859-x
+    @param str          UTF-8 text
+    @param length  byte size of str
+    @param iso8859_num  x of ISO-8859-x
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (ISO-8859-x text)
+ */
+char* utf8_to_iso8859(const char* str, long length, int iso8859_num, long *result_length) {
+    return utf8_to_iso8859_into(str, length, iso8859_num, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to ISO-8859-x
+    @param str          UTF-8 text
+    @param iso8859_num  x of ISO-8859-x
+    @return Converted text (ISO-8859-x text)
+ */
+char* utf8_to_iso8859(const char* str, int iso8859_num) {
+    return utf8_to_iso8859(str, (str != NULL)?(long)strlen(str):0L, iso8859_num, (long *)NULL);
+}
+
+
 /*! Convert character set from KOI8-x/CP1251/CP1252/CP1258 to UTF-8
     @param str          KOI-8-x text
+    @param length  byte size of str
     @param ch           x of KOI8-x. '1' for CP1251, '2' for CP1252, '8' for CP1258
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text  (UTF-8 text)
  */
-char* europe_to_utf8(const char* str, char ch) {
+char* europe_to_utf8(const char* str, long length, char ch, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1;
     const unsigned char (*eur_map)[EUROPE_UNICODE_TABLE_MAX][2];
 
@@ -1522,10 +2973,10 @@ char* europe_to_utf8(const char* str, char ch) {
     }
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         length2 = length*3;
         buf = new char[length2 + 1];
 
@@ -1533,6 +2984,13 @@ char* europe_to_utf8(const char* str, char ch) {
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             if ((unsigned char)0x80 <= (unsigned char)str[i]) {
                 a0 = (*eur_map)[(unsigned char)str[i] - (unsigned char)0x80][0];
                 a1 = (*eur_map)[(unsigned char)str[i] - (unsigned char)0x80][1];
@@ -1554,18 +3012,32 @@ char* europe_to_utf8(const char* str, char ch) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from KOI8-x/CP1251/CP1252/CP1258 to UTF-8
+    @param str          KOI-8-x text
+    @param ch           x of KOI8-x. '1' for CP1251, '2' for CP1252, '8' for CP1258
+    @return Converted text  (UTF-8 text)
+ */
+char* europe_to_utf8(const char* str, char ch) {
+    return europe_to_utf8(str, (str != NULL)?(long)strlen(str):0L, ch, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to KOI8-x/CP1251/CP1252/CP1258
     @param str          UTF-8 text
+    @param length  byte size of str
     @param ch           x of KOI8-x. '1' for CP1251, '2' for CP1252, '8' for CP1258
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (KOI8-x/CP1251/CP1252/CP1258 text)
  */
-char* utf8_to_europe(const char* str, char ch) {
+static char* utf8_to_europe_into(const char* str, long length, char ch, char *dest, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1, a2;
     const unsigned char (*eur_map)[EUROPE_UNICODE_TABLE_MAX][2];
 
@@ -1584,17 +3056,24 @@ char* utf8_to_europe(const char* str, char ch) {
     }
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         length2 = length*3;
-        buf = new char[length2 + 1];
+        buf = (dest != NULL)?dest:new char[length2 + 1];
 
         // UTF-8 to KOI8-x/CP1251/CP1252/CP1258
         i = 0;
         j = 0;
         while (i < length && j <= length2) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             if (isutf8_1(a0) && i+utf8_len(a0)-1 < length) {
                 unsigned short len1, n;
@@ -1649,17 +3128,45 @@ char* utf8_to_europe(const char* str, char ch) {
         }
         buf[j] = '\0';
     }
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to KOI8-x/CP1251/CP1252/CP1258
+    @param str          UTF-8 text
+    @param length  byte size of str
+    @param ch           x of KOI8-x. '1' for CP1251, '2' for CP1252, '8' for CP1258
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (KOI8-x/CP1251/CP1252/CP1258 text)
+ */
+char* utf8_to_europe(const char* str, long length, char ch, long *result_length) {
+    return utf8_to_europe_into(str, length, ch, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to KOI8-x/CP1251/CP1252/CP1258
+    @param str          UTF-8 text
+    @param ch           x of KOI8-x. '1' for CP1251, '2' for CP1252, '8' for CP1258
+    @return Converted text (KOI8-x/CP1251/CP1252/CP1258 text)
+ */
+char* utf8_to_europe(const char* str, char ch) {
+    return utf8_to_europe(str, (str != NULL)?(long)strlen(str):0L, ch, (long *)NULL);
+}
+
+
+#endif
+
+
+// UTF-16 and UTF-32 are converted here also when iconv is used
 /*! Convert character set from UTF-8 to UTF-16
-    @param str    UTF-8 text
-    @param length byte size of UTF-16 binary text
-    @param en     'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
+    @param str           UTF-8 text
+    @param length        byte size of str
+    @param result_length byte size of UTF-16 binary text
+    @param en            'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
     @return Converted text (UTF-16 binary text)
  */
-char* utf8_to_utf16(const char *str, long *length, char en) {
+char* utf8_to_utf16(const char *str, long length, long *result_length, char en) {
     char *buf;
     unsigned long ucs4, n, n1, n2;
     const unsigned char *p;
@@ -1667,11 +3174,11 @@ char* utf8_to_utf16(const char *str, long *length, char en) {
     long i, j, l;
     int bom;
 
-    if (length != NULL) *length = 0;
-    if (str == NULL || length == NULL) return NULL;
+    if (result_length != NULL) *result_length = 0;
+    if (str == NULL || result_length == NULL) return NULL;
 
     // Memory allocation
-    l = strlen(str);
+    l = length;
     buf = new char[l * 4 + 4];
     buf[0] = '\0';
     buf[1] = '\0';
@@ -1797,23 +3304,36 @@ char* utf8_to_utf16(const char *str, long *length, char en) {
             }
         }
     }
-    *length = j;
+    *result_length = j;
 
     return buf;
 }
 
 
-/*! Convert character set from UTF-16 to UTF-8
-    @param str    UTF-16 binary text
+/*! Convert character set from UTF-8 to UTF-16
+    @param str    UTF-8 text
     @param length byte size of UTF-16 binary text
-    @param en     'b' for big endian, 'l' for little endian
+    @param en     'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
+    @return Converted text (UTF-16 binary text)
+ */
+char* utf8_to_utf16(const char *str, long *length, char en) {
+    return utf8_to_utf16(str, (str != NULL)?(long)strlen(str):0L, length, en);
+}
+
+
+/*! Convert character set from UTF-16 to UTF-8
+    @param str           UTF-16 binary text
+    @param length        byte size of UTF-16 binary text
+    @param en            'b' for big endian, 'l' for little endian
+    @param result_length byte size of UTF-8 text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* utf16_to_utf8(const char *str, long length, char en) {
+char* utf16_to_utf8(const char *str, long length, char en, long *result_length) {
     char *buf;
     long i, j;
     unsigned long ucs4, n1, n2;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) return NULL;
 
     // Memory allocation
@@ -1898,18 +3418,31 @@ char* utf16_to_utf8(const char *str, long length, char en) {
         }
     }
     buf[j] = '\0';
+    if (result_length != NULL) *result_length = j;
 
     return buf;
 }
 
 
+/*! Convert character set from UTF-16 to UTF-8
+    @param str    UTF-16 binary text
+    @param length byte size of UTF-16 binary text
+    @param en     'b' for big endian, 'l' for little endian
+    @return Converted text (UTF-8 text)
+ */
+char* utf16_to_utf8(const char *str, long length, char en) {
+    return utf16_to_utf8(str, length, en, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to UTF-32
-    @param str    UTF-8 text
-    @param length byte size of UTF-32 binary text
-    @param en     'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
+    @param str           UTF-8 text
+    @param length        byte size of str
+    @param result_length byte size of UTF-32 binary text
+    @param en            'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
     @return Converted text (UTF-32 binary text)
  */
-char* utf8_to_utf32(const char *str, long *length, char en) {
+char* utf8_to_utf32(const char *str, long length, long *result_length, char en) {
     char *buf;
     unsigned long ucs4;
     const unsigned char *p;
@@ -1917,11 +3450,11 @@ char* utf8_to_utf32(const char *str, long *length, char en) {
     long i, j, l;
     int bom;
 
-    if (length != NULL) *length = 0;
-    if (str == NULL || length == NULL) return NULL;
+    if (result_length != NULL) *result_length = 0;
+    if (str == NULL || result_length == NULL) return NULL;
 
     // Memory allocation
-    l = strlen(str);
+    l = length;
     buf = new char[l * 4 + 8];
     buf[0] = '\0';
     buf[1] = '\0';
@@ -2031,23 +3564,36 @@ char* utf8_to_utf32(const char *str, long *length, char en) {
             buf[j++] = ucs4 & 0xFF;
         }
     }
-    *length = j;
+    *result_length = j;
 
     return buf;
 }
 
 
-/*! Convert character set from UTF-32 to UTF-8
-    @param str    UTF-32 binary text
+/*! Convert character set from UTF-8 to UTF-32
+    @param str    UTF-8 text
     @param length byte size of UTF-32 binary text
-    @param en     'b' for big endian, 'l' for little endian
+    @param en     'b' for big endian, 'l' for little endian, 'B' or 'L' for adding BOM
+    @return Converted text (UTF-32 binary text)
+ */
+char* utf8_to_utf32(const char *str, long *length, char en) {
+    return utf8_to_utf32(str, (str != NULL)?(long)strlen(str):0L, length, en);
+}
+
+
+/*! Convert character set from UTF-32 to UTF-8
+    @param str           UTF-32 binary text
+    @param length        byte size of UTF-32 binary text
+    @param en            'b' for big endian, 'l' for little endian
+    @param result_length byte size of UTF-8 text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* utf32_to_utf8(const char *str, long length, char en) {
+char* utf32_to_utf8(const char *str, long length, char en, long *result_length) {
     char *buf;
     long i, j;
     unsigned long ucs4;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) return NULL;
 
     // Memory allocation
@@ -2109,20 +3655,36 @@ char* utf32_to_utf8(const char *str, long length, char en) {
         }
     }
     buf[j] = '\0';
+    if (result_length != NULL) *result_length = j;
 
     return buf;
 }
 
 
+/*! Convert character set from UTF-32 to UTF-8
+    @param str    UTF-32 binary text
+    @param length byte size of UTF-32 binary text
+    @param en     'b' for big endian, 'l' for little endian
+    @return Converted text (UTF-8 text)
+ */
+char* utf32_to_utf8(const char *str, long length, char en) {
+    return utf32_to_utf8(str, length, en, (long *)NULL);
+}
+
+
+#if __ICONV == 0
 /*! Convert character set from UTF-8 to EUCJP-MS
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* utf8_to_eucjpms(const char *str) {
+char* utf8_to_eucjpms(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = utf8_to_sjis(str);
-    buf2 = sjis_to_eucjpms(buf1);
+    buf1 = utf8_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpms(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2131,15 +3693,27 @@ char* utf8_to_eucjpms(const char *str) {
 }
 
 
+/*! Convert character set from UTF-8 to EUCJP-MS
+    @param str  UTF-8 text
+    @return Converted text (EUC-JP text)
+ */
+char* utf8_to_eucjpms(const char *str) {
+    return utf8_to_eucjpms(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to EUCJP-WIN
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* utf8_to_eucjpwin(const char *str) {
+char* utf8_to_eucjpwin(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = utf8_to_sjis(str);
-    buf2 = sjis_to_eucjpwin(buf1);
+    buf1 = utf8_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpwin(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2148,28 +3722,47 @@ char* utf8_to_eucjpwin(const char *str) {
 }
 
 
+/*! Convert character set from UTF-8 to EUCJP-WIN
+    @param str  UTF-8 text
+    @return Converted text (EUC-JP text)
+ */
+char* utf8_to_eucjpwin(const char *str) {
+    return utf8_to_eucjpwin(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from CP932 to EUCJP-MS
     @param str  CP932 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* sjis_to_eucjpms(const char *str) {
+static char* sjis_to_eucjpms_into(const char *str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, hankana, length;
+    long i, j, hankana, span;
     unsigned char c, d;
     const char *p;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
-        buf = new char[length*3 + 1];
+        buf = (dest != NULL)?dest:new char[length*3 + 1];
 
         // CP932 to EUC-JP
         hankana = 0;
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             c = str[i];
             d = c?(str[i+1]):0;
             if (c == 0xFA && 0x40 <= d && d <= 0xFF) {
@@ -2255,31 +3848,62 @@ char* sjis_to_eucjpms(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from CP932 to EUCJP-MS
+    @param str  CP932 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (EUC-JP text)
+ */
+char* sjis_to_eucjpms(const char *str, long length, long *result_length) {
+    return sjis_to_eucjpms_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from CP932 to EUCJP-MS
+    @param str  CP932 text
+    @return Converted text (EUC-JP text)
+ */
+char* sjis_to_eucjpms(const char *str) {
+    return sjis_to_eucjpms(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from CP932 to EUCJP-WIN
     @param str  CP932 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* sjis_to_eucjpwin(const char *str) {
+static char* sjis_to_eucjpwin_into(const char *str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, hankana, length;
+    long i, j, hankana, span;
     unsigned char c, d;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
-        buf = new char[length*3 + 1];
+        buf = (dest != NULL)?dest:new char[length*3 + 1];
 
         // CP932 to EUC-JP
         hankana = 0;
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             c = str[i];
             d = c?(str[i+1]):0;
             if (issjis1(c) && issjis2(d)) {
@@ -2375,19 +3999,43 @@ char* sjis_to_eucjpwin(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from CP932 to EUCJP-WIN
+    @param str  CP932 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (EUC-JP text)
+ */
+char* sjis_to_eucjpwin(const char *str, long length, long *result_length) {
+    return sjis_to_eucjpwin_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from CP932 to EUCJP-WIN
+    @param str  CP932 text
+    @return Converted text (EUC-JP text)
+ */
+char* sjis_to_eucjpwin(const char *str) {
+    return sjis_to_eucjpwin(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from ISO-2022-JP to EUCJP-MS
     @param str  ISO-2022-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* jis_to_eucjpms(const char *str) {
+char* jis_to_eucjpms(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = jis_to_sjis(str);
-    buf2 = sjis_to_eucjpms(buf1);
+    buf1 = jis_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpms(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2396,15 +4044,27 @@ char* jis_to_eucjpms(const char *str) {
 }
 
 
+/*! Convert character set from ISO-2022-JP to EUCJP-MS
+    @param str  ISO-2022-JP text
+    @return Converted text (EUC-JP text)
+ */
+char* jis_to_eucjpms(const char *str) {
+    return jis_to_eucjpms(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from ISO-2022-JP to EUCJP-WIN
     @param str  ISO-2022-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* jis_to_eucjpwin(const char *str) {
+char* jis_to_eucjpwin(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = jis_to_sjis(str);
-    buf2 = sjis_to_eucjpwin(buf1);
+    buf1 = jis_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpwin(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2509,27 +4169,45 @@ char* jis_to_eucjpwin(const char *str) {
 }
 
 
+/*! Convert character set from ISO-2022-JP to EUCJP-WIN
+    @param str  ISO-2022-JP text
+    @return Converted text (EUC-JP text)
+ */
+char* jis_to_eucjpwin(const char *str) {
+    return jis_to_eucjpwin(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-MS to CP932
     @param str  EUC-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP932 text)
  */
-char* eucjpms_to_sjis(const char *str) {
+char* eucjpms_to_sjis(const char *str, long length, long *result_length) {
     char *buf;
-    long i, j, k, length;
+    long i, j, k, span;
     unsigned char a0, a1, *e;
     int found;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         buf = new char[length + 1];
 
         // EUC-JP to CP932
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             a1 = str[i+1];
             if (a0 == 0x8E && ishankana(a1)) {
@@ -2623,31 +4301,50 @@ char* eucjpms_to_sjis(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from EUCJP-MS to CP932
+    @param str  EUC-JP text
+    @return Converted text (CP932 text)
+ */
+char* eucjpms_to_sjis(const char *str) {
+    return eucjpms_to_sjis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-WIN to CP932
     @param str  EUC-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP932 text)
  */
-char* eucjpwin_to_sjis(const char *str) {
+char* eucjpwin_to_sjis(const char *str, long length, long *result_length) {
     char *buf;
-    long i, j, k, length;
+    long i, j, k, span;
     unsigned char a0, a1, *e;
     int found;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         buf = new char[length + 1];
 
         // EUC-JP to CP932
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             a1 = str[i+1];
             if (a0 == 0x8E && ishankana(a1)) {
@@ -2791,19 +4488,32 @@ char* eucjpwin_to_sjis(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from EUCJP-WIN to CP932
+    @param str  EUC-JP text
+    @return Converted text (CP932 text)
+ */
+char* eucjpwin_to_sjis(const char *str) {
+    return eucjpwin_to_sjis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-MS to ISO-2022-JP
     @param str  EUC-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-2022-JP text)
  */
-char* eucjpms_to_jis(const char *str) {
+char* eucjpms_to_jis(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpms_to_sjis(str);
-    buf2 = sjis_to_jis(buf1);
+    buf1 = eucjpms_to_sjis(str, length, &length1);
+    buf2 = sjis_to_jis(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2812,15 +4522,27 @@ char* eucjpms_to_jis(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-MS to ISO-2022-JP
+    @param str  EUC-JP text
+    @return Converted text (ISO-2022-JP text)
+ */
+char* eucjpms_to_jis(const char *str) {
+    return eucjpms_to_jis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-WIN to ISO-2022-JP
     @param str  EUC-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-2022-JP text)
  */
-char* eucjpwin_to_jis(const char *str) {
+char* eucjpwin_to_jis(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpwin_to_sjis(str);
-    buf2 = sjis_to_jis(buf1);
+    buf1 = eucjpwin_to_sjis(str, length, &length1);
+    buf2 = sjis_to_jis(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2899,15 +4621,27 @@ char* eucjpwin_to_jis(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-WIN to ISO-2022-JP
+    @param str  EUC-JP text
+    @return Converted text (ISO-2022-JP text)
+ */
+char* eucjpwin_to_jis(const char *str) {
+    return eucjpwin_to_jis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-MS to UTF-8
     @param str  EUC-JP text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* eucjpms_to_utf8(const char *str) {
+char* eucjpms_to_utf8(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpms_to_sjis(str);
-    buf2 = sjis_to_utf8(buf1);
+    buf1 = eucjpms_to_sjis(str, length, &length1);
+    buf2 = sjis_to_utf8(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2916,15 +4650,27 @@ char* eucjpms_to_utf8(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-MS to UTF-8
+    @param str  EUC-JP text.
+    @return Converted text (UTF-8 text)
+ */
+char* eucjpms_to_utf8(const char *str) {
+    return eucjpms_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-WIN to UTF-8
     @param str  EUC-JP text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* eucjpwin_to_utf8(const char *str) {
+char* eucjpwin_to_utf8(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpwin_to_sjis(str);
-    buf2 = sjis_to_utf8(buf1);
+    buf1 = eucjpwin_to_sjis(str, length, &length1);
+    buf2 = sjis_to_utf8(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2933,15 +4679,27 @@ char* eucjpwin_to_utf8(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-WIN to UTF-8
+    @param str  EUC-JP text.
+    @return Converted text (UTF-8 text)
+ */
+char* eucjpwin_to_utf8(const char *str) {
+    return eucjpwin_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-MS to EUCJP-WIN
     @param str  EUCJP-MS text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUCJP-WIN text)
  */
-char* eucjpms_to_eucjpwin(const char *str) {
+char* eucjpms_to_eucjpwin(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpms_to_sjis(str);
-    buf2 = sjis_to_eucjpwin(buf1);
+    buf1 = eucjpms_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpwin(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2950,15 +4708,27 @@ char* eucjpms_to_eucjpwin(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-MS to EUCJP-WIN
+    @param str  EUCJP-MS text.
+    @return Converted text (EUCJP-WIN text)
+ */
+char* eucjpms_to_eucjpwin(const char *str) {
+    return eucjpms_to_eucjpwin(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from EUCJP-WIN to EUCJP-MS
     @param str  EUCJP-WIN text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUCJP-MS text)
  */
-char* eucjpwin_to_eucjpms(const char *str) {
+char* eucjpwin_to_eucjpms(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = eucjpwin_to_sjis(str);
-    buf2 = sjis_to_eucjpms(buf1);
+    buf1 = eucjpwin_to_sjis(str, length, &length1);
+    buf2 = sjis_to_eucjpms(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -2967,30 +4737,158 @@ char* eucjpwin_to_eucjpms(const char *str) {
 }
 
 
+/*! Convert character set from EUCJP-WIN to EUCJP-MS
+    @param str  EUCJP-WIN text.
+    @return Converted text (EUCJP-MS text)
+ */
+char* eucjpwin_to_eucjpms(const char *str) {
+    return eucjpwin_to_eucjpms(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
+/*! Build a two-level direct-index table from a high byte indexed table
+    @param index      first row of each high byte (-1: no row)
+    @param table      rows of {low byte, value high, value low}
+    @param table_max  number of rows
+    @return 256 pages (per high byte) of 256 16bit values (0: unmapped)
+ */
+static const unsigned short* const* dbcs_pages_new(const short int *index,
+        const unsigned char (*table)[3], long table_max) {
+    static const unsigned short unmapped_page[256] = {0};
+    const unsigned short **pages;
+    unsigned short *page;
+    long min, max, pos;
+    int c, s;
+
+    pages = new const unsigned short* [256];
+    for (c = 0; c < 256; c++) {
+        pages[c] = unmapped_page;
+        min = index[c];
+        if (min < 0 || table_max <= min) {
+            continue;
+        }
+        max = table_max - 1;
+        for (s = c + 1; s < 256; s++) {
+            if (0 <= index[s]) {
+                max = index[s] - 1;
+                break;
+            }
+        }
+        if (min + 255 < max) {
+            max = min + 255;
+        }
+        if (table_max - 1 < max) {
+            max = table_max - 1;
+        }
+        page = new unsigned short [256];
+        memset(page, 0, sizeof(unsigned short) * 256);
+        for (pos = min; pos <= max; pos++) {
+            page[table[pos][0]] = ((unsigned short)table[pos][1] << 8) | table[pos][2];
+        }
+        pages[c] = page;
+    }
+
+    return pages;
+}
+
+
+/*! CP932 decode table (built on first use, never freed)
+    @return 256 pages (per lead byte) of 256 UCS-2 codes (0: unmapped)
+ */
+static const unsigned short* const* sjis_decode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_sjis_unicode, sjis_unicode, SJIS_UNICODE_TABLE_MAX);
+    return pages;
+}
+
+
+/*! CP949 decode table (built on first use, never freed)
+    @return 256 pages (per lead byte) of 256 UCS-2 codes (0: unmapped)
+ */
+static const unsigned short* const* euckr_decode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_euckr_unicode, euckr_unicode, EUCKR_UNICODE_TABLE_MAX);
+    return pages;
+}
+
+
+/*! CP950 decode table (built on first use, never freed)
+    @return 256 pages (per lead byte) of 256 UCS-2 codes (0: unmapped)
+ */
+static const unsigned short* const* big5_decode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_big5_unicode, big5_unicode, BIG5_UNICODE_TABLE_MAX);
+    return pages;
+}
+
+
+/*! UCS-2 to CP932 table (built on first use, never freed)
+    @return 256 pages (per UCS-2 high byte) of 256 CP932 codes (0: unmapped)
+ */
+static const unsigned short* const* sjis_encode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_unicode_sjis, unicode_sjis, UNICODE_SJIS_TABLE_MAX);
+    return pages;
+}
+
+
+/*! UCS-2 to CP949 table (built on first use, never freed)
+    @return 256 pages (per UCS-2 high byte) of 256 CP949 codes (0: unmapped)
+ */
+static const unsigned short* const* euckr_encode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_unicode_euckr, unicode_euckr, UNICODE_EUCKR_TABLE_MAX);
+    return pages;
+}
+
+
+/*! UCS-2 to CP950 table (built on first use, never freed)
+    @return 256 pages (per UCS-2 high byte) of 256 CP950 codes (0: unmapped)
+ */
+static const unsigned short* const* big5_encode_pages() {
+    static const unsigned short* const* pages =
+        dbcs_pages_new(index_unicode_big5, unicode_big5, UNICODE_BIG5_TABLE_MAX);
+    return pages;
+}
+
+
 /*! Convert character set from UTF-8 to CP932
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP932 text)
  */
-char* utf8_to_sjis(const char *str) {
+static char* utf8_to_sjis_into(const char *str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1, a2;
+    unsigned short code;
+    const unsigned short * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = sjis_encode_pages();
+
         // Memory allocation
-        length = strlen(str);
         length2 = length*2;
-        buf = new char[length2 + 1];
+        buf = (dest != NULL)?dest:new char[length2 + 1];
 
         // UTF-8 to CP932
         i = 0;
         j = 0;
         while (i < length && j <= length2) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             if (isutf8_1(a0) && i+utf8_len(a0)-1 < length) {
-                int pos, old_pos, min, max, s;
                 unsigned short len1;
 
                 a1 = str[i+1];
@@ -3058,44 +4956,12 @@ char* utf8_to_sjis(const char *str) {
                     continue;
                 }
 
-                min = index_unicode_sjis[a0];
-                if (min < 0) {
-                    max = min;
-                } else if (a0 != 255) {
-                    max = min + 255;
-                    for (s = a0+1; s <= 255; s++) {
-                        if (0 <= index_unicode_sjis[s]) {
-                            max = index_unicode_sjis[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_SJIS_TABLE_MAX-1 < max) {
-                        max = UNICODE_SJIS_TABLE_MAX-1;
-                    }
+                code = pages[a0][a1];
+                if (code != 0) {
+                    buf[j++] = code >> 8;
+                    buf[j++] = code & 0xFF;
+                    i += (len1 - 1);
                 } else {
-                    max = UNICODE_SJIS_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (unicode_sjis[pos][0] == a1) {
-                            buf[j++] = unicode_sjis[pos][1];
-                            buf[j++] = unicode_sjis[pos][2];
-                            i += (utf8_len(str[i])-1);
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (unicode_sjis[old_pos][0] < a1) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (min < 0 || unicode_sjis[pos][0] != a1) {
                     buf[j++] = '?';
                     i += (len1 - 1);
                 }
@@ -3107,19 +4973,43 @@ char* utf8_to_sjis(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to CP932
+    @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (CP932 text)
+ */
+char* utf8_to_sjis(const char *str, long length, long *result_length) {
+    return utf8_to_sjis_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to CP932
+    @param str  UTF-8 text
+    @return Converted text (CP932 text)
+ */
+char* utf8_to_sjis(const char *str) {
+    return utf8_to_sjis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to ISO-2022-JP
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-2022-JP text)
  */
-char* utf8_to_jis(const char *str) {
+char* utf8_to_jis(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = utf8_to_sjis(str);
-    buf2 = sjis_to_jis(buf1);
+    buf1 = utf8_to_sjis(str, length, &length1);
+    buf2 = sjis_to_jis(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -3128,14 +5018,27 @@ char* utf8_to_jis(const char *str) {
 }
 
 
+/*! Convert character set from UTF-8 to ISO-2022-JP
+    @param str  UTF-8 text
+    @return Converted text (ISO-2022-JP text)
+ */
+char* utf8_to_jis(const char *str) {
+    return utf8_to_jis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from CP932 to UTF-8
     @param str  CP932 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* sjis_to_utf8(const char *str) {
+char* sjis_to_utf8(const char *str, long length, long *result_length) {
     char *buf;
-    long i, j, l, length;
+    long i, j, l, span;
     unsigned char c, d, a0, a1;
+    unsigned short ucs2;
+    const unsigned short * const *pages;
 
     /* SJIS A0-DF */
     const char *hankaku_kana[64] = {
@@ -3160,16 +5063,25 @@ char* sjis_to_utf8(const char *str) {
     };
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = sjis_decode_pages();
+
         // Memory allocation
-        length = strlen(str);
         buf = new char[length*3 + 1];
 
         // CP932 to UTF-8
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             c = str[i];
             if ((unsigned char)0xA0 <= c && c <= (unsigned char)0xDF) {
                 l = (c == (unsigned char)0xA0)?1:3;
@@ -3180,8 +5092,6 @@ char* sjis_to_utf8(const char *str) {
             }
             d = c?(str[i+1]):0;
             if (issjis1(c) && issjis2(d)) {
-                int pos, old_pos, min, max, s;
-
                 if (c == 0x82) {
                     if ((unsigned char)0x9F <= d && d <= (unsigned char)0xDD) {
                         // hiragana 1
@@ -3223,43 +5133,10 @@ char* sjis_to_utf8(const char *str) {
                     }
                 }
 
-                min = index_sjis_unicode[c];
-                if (min < 0) {
-                    max = min;
-                } else if (c != 255) {
-                    max = min + 255;
-                    for (s = c+1; s <= 255; s++) {
-                        if (0 <= index_sjis_unicode[s]) {
-                            max = index_sjis_unicode[s]-1;
-                            break;
-                        }
-                    }
-                    if (SJIS_UNICODE_TABLE_MAX-1 < max) {
-                        max = SJIS_UNICODE_TABLE_MAX-1;
-                    }
-                } else {
-                    max = SJIS_UNICODE_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (sjis_unicode[pos][0] == d) {
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (sjis_unicode[old_pos][0] < d) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (0 <= min && pos != old_pos && min <= max) {
-                    a0 = sjis_unicode[pos][1];
-                    a1 = sjis_unicode[pos][2];
+                ucs2 = pages[c][d];
+                if (ucs2 != 0) {
+                    a0 = ucs2 >> 8;
+                    a1 = ucs2 & 0xFF;
                     if (a0 == (unsigned char)0x00 && (a1 & (unsigned char)0x80) == (unsigned char)0x00) {
                         buf[j++] = a1;
                     } else if (a0 <= (unsigned char)0x07) {
@@ -3282,19 +5159,32 @@ char* sjis_to_utf8(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from CP932 to UTF-8
+    @param str  CP932 text
+    @return Converted text (UTF-8 text)
+ */
+char* sjis_to_utf8(const char *str) {
+    return sjis_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from ISO-2022-JP to UTF-8
     @param str  ISO-2022-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* jis_to_utf8(const char *str) {
+char* jis_to_utf8(const char *str, long length, long *result_length) {
     char *buf1, *buf2;
+    long length1;
 
-    buf1 = jis_to_sjis(str);
-    buf2 = sjis_to_utf8(buf1);
+    buf1 = jis_to_sjis(str, length, &length1);
+    buf2 = sjis_to_utf8(buf1, length1, result_length);
 
     if (buf1 != NULL) {
         delete [] buf1;
@@ -3303,21 +5193,33 @@ char* jis_to_utf8(const char *str) {
 }
 
 
+/*! Convert character set from ISO-2022-JP to UTF-8
+    @param str  ISO-2022-JP text
+    @return Converted text (UTF-8 text)
+ */
+char* jis_to_utf8(const char *str) {
+    return jis_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from CP932 to ISO-2022-JP
     @param str  CP932 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-2022-JP text)
  */
-char* sjis_to_jis(const char *str) {
+static char* sjis_to_jis_into(const char *str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, jiskanji, length;
+    long i, j, jiskanji;
     unsigned char a0, a1;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
-        buf = new char[length*7 + 100];
+        buf = (dest != NULL)?dest:new char[length*7 + 100];
 
         // CP932 to ISO-2022-JP
         jiskanji = 0;
@@ -3437,27 +5339,50 @@ char* sjis_to_jis(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from CP932 to ISO-2022-JP
+    @param str  CP932 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (ISO-2022-JP text)
+ */
+char* sjis_to_jis(const char *str, long length, long *result_length) {
+    return sjis_to_jis_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from CP932 to ISO-2022-JP
+    @param str  CP932 text
+    @return Converted text (ISO-2022-JP text)
+ */
+char* sjis_to_jis(const char *str) {
+    return sjis_to_jis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from ISO-2022-JP to CP932
     @param str  ISO-2022-JP text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP932 text)
  */
-char *jis_to_sjis(const char *str) {
+char* jis_to_sjis(const char *str, long length, long *result_length) {
     char *buf;
-    long i, j, length;
-    const char *from;
+    long i, j, span;
+    const char *from, *p;
     enum {IS_ROMAN, IS_KANJI, IS_KANA} shifted;
     int c, normal_flg;
     int hi, lo;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         buf = new char[length * 3 + 2048];
 
         // ISO-2022-JP to CP932
@@ -3577,6 +5502,20 @@ char *jis_to_sjis(const char *str) {
                         break;
                     case IS_ROMAN:
                     default:
+                        // copy 7bit text up to the next shift at once
+                        if (CHARSET_UNLIKELY(jis_roman_head(from + i, length - i))) {
+                            span = detect_span(from + i, length - i, '\x1B', '\x0E', '\x0F');
+                            p = (const char *)memchr(from + i, '\0', span);
+                            if (p != NULL) {
+                                span = p - (from + i);
+                            }
+                            if (1 < span) {
+                                memcpy(buf + j, from + i, span);
+                                i += span;
+                                j += span;
+                                break;
+                            }
+                        }
                         buf[j++] = from[i];
                         i++;
                         break;
@@ -3586,246 +5525,289 @@ char *jis_to_sjis(const char *str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from ISO-2022-JP to CP932
+    @param str  ISO-2022-JP text
+    @return Converted text (CP932 text)
+ */
+char *jis_to_sjis(const char *str) {
+    return jis_to_sjis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Auto detect japanese character set, and convert text to EUCJP-MS
     @param str  text for convertion)
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* autojp_to_eucjpms(const char *str) {
+char* autojp_to_eucjpms(const char *str, long length, long *result_length) {
     char *buf;
     const char *charset;
-    long length;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
 
-    charset = jis_auto_detect(str);
+    charset = jis_auto_detect(str, length);
     if (charset == (const char *)NULL) {
         charset = "";
     }
     if (!strcasecmp(charset, STR_SJIS)) {
-        buf = sjis_to_eucjpms(str);
+        buf = sjis_to_eucjpms(str, length, result_length);
     } else if (!strcasecmp(charset, STR_JIS)) {
-        buf = jis_to_eucjpms(str);
+        buf = jis_to_eucjpms(str, length, result_length);
     } else if (!strcasecmp(charset, STR_UTF8)) {
-        buf = utf8_to_eucjpms(str);
+        buf = utf8_to_eucjpms(str, length, result_length);
     } else {
-        length = strlen(str);
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        if (result_length != NULL) *result_length = length;
     }
 
     return buf;
 }
 
 
+/*! Auto detect japanese character set, and convert text to EUCJP-MS
+    @param str  text for convertion)
+    @return Converted text (EUC-JP text)
+ */
+char* autojp_to_eucjpms(const char *str) {
+    return autojp_to_eucjpms(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Auto detect japanese character set, and convert text to EUCJP-WIN
     @param str  text for convertion)
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (EUC-JP text)
  */
-char* autojp_to_eucjpwin(const char *str) {
+char* autojp_to_eucjpwin(const char *str, long length, long *result_length) {
     char *buf;
     const char *charset;
-    long length;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
 
-    charset = jis_auto_detect(str);
+    charset = jis_auto_detect(str, length);
     if (charset == (const char *)NULL) {
         charset = "";
     }
     if (!strcasecmp(charset, STR_SJIS)) {
-        buf = sjis_to_eucjpwin(str);
+        buf = sjis_to_eucjpwin(str, length, result_length);
     } else if (!strcasecmp(charset, STR_JIS)) {
-        buf = jis_to_eucjpwin(str);
+        buf = jis_to_eucjpwin(str, length, result_length);
     } else if (!strcasecmp(charset, STR_UTF8)) {
-        buf = utf8_to_eucjpwin(str);
+        buf = utf8_to_eucjpwin(str, length, result_length);
     } else {
-        length = strlen(str);
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        if (result_length != NULL) *result_length = length;
     }
 
     return buf;
 }
 
 
+/*! Auto detect japanese character set, and convert text to EUCJP-WIN
+    @param str  text for convertion)
+    @return Converted text (EUC-JP text)
+ */
+char* autojp_to_eucjpwin(const char *str) {
+    return autojp_to_eucjpwin(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Auto detect japanese character set, and convert text to CP932.
     @param str  text for convertion
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP932 text)
  */
-char* autojp_to_sjis(const char *str) {
+char* autojp_to_sjis(const char *str, long length, long *result_length) {
     char *buf;
     const char *charset;
-    long length;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
 
-    charset = jis_auto_detect(str);
+    charset = jis_auto_detect(str, length);
     if (charset == (const char *)NULL) {
         charset = "";
     }
     if (!strcasecmp(charset, STR_EUCJPMS)) {
-        buf = eucjpms_to_sjis(str);
+        buf = eucjpms_to_sjis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_EUCJP)) {
-        buf = eucjpwin_to_sjis(str);
+        buf = eucjpwin_to_sjis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_JIS)) {
-        buf = jis_to_sjis(str);
+        buf = jis_to_sjis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_UTF8)) {
-        buf = utf8_to_sjis(str);
+        buf = utf8_to_sjis(str, length, result_length);
     } else {
-        length = strlen(str);
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        if (result_length != NULL) *result_length = length;
     }
 
     return buf;
 }
 
 
+/*! Auto detect japanese character set, and convert text to CP932.
+    @param str  text for convertion
+    @return Converted text (CP932 text)
+ */
+char* autojp_to_sjis(const char *str) {
+    return autojp_to_sjis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Auto detect japanese character set, and convert text to ISO-2022-JP
     @param str  text for convertion
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (ISO-2022-JP text)
  */
-char* autojp_to_jis(const char *str) {
+char* autojp_to_jis(const char *str, long length, long *result_length) {
     char *buf;
     const char *charset;
-    long length;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
 
-    charset = jis_auto_detect(str);
+    charset = jis_auto_detect(str, length);
     if (charset == (const char *)NULL) {
         charset = "";
     }
     if (!strcasecmp(charset, STR_EUCJPMS)) {
-        buf = eucjpms_to_jis(str);
+        buf = eucjpms_to_jis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_EUCJP)) {
-        buf = eucjpwin_to_jis(str);
+        buf = eucjpwin_to_jis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_SJIS)) {
-        buf = sjis_to_jis(str);
+        buf = sjis_to_jis(str, length, result_length);
     } else if (!strcasecmp(charset, STR_UTF8)) {
-        buf = utf8_to_jis(str);
+        buf = utf8_to_jis(str, length, result_length);
     } else {
-        length = strlen(str);
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        if (result_length != NULL) *result_length = length;
     }
 
     return buf;
 }
 
 
+/*! Auto detect japanese character set, and convert text to ISO-2022-JP
+    @param str  text for convertion
+    @return Converted text (ISO-2022-JP text)
+ */
+char* autojp_to_jis(const char *str) {
+    return autojp_to_jis(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Auto detect japanese character set, and convert text to UTF-8
     @param str  text for convertion
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text: UTF-8 text.
  */
-char* autojp_to_utf8(const char *str) {
+char* autojp_to_utf8(const char *str, long length, long *result_length) {
     char *buf;
     const char *charset;
-    long length;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
 
-    charset = jis_auto_detect(str);
+    charset = jis_auto_detect(str, length);
     if (charset == (const char *)NULL) {
         charset = "";
     }
     if (!strcasecmp(charset, STR_EUCJP)) {
-        buf = eucjpwin_to_utf8(str);
+        buf = eucjpwin_to_utf8(str, length, result_length);
     } else if (!strcasecmp(charset, STR_SJIS)) {
-        buf = sjis_to_utf8(str);
+        buf = sjis_to_utf8(str, length, result_length);
     } else if (!strcasecmp(charset, STR_JIS)) {
-        buf = jis_to_utf8(str);
+        buf = jis_to_utf8(str, length, result_length);
     } else {
-        length = strlen(str);
         buf = new char [length + 1];
         memcpy(buf, str, length);
         buf[length] = '\0';
+        if (result_length != NULL) *result_length = length;
     }
 
     return buf;
 }
 
 
+/*! Auto detect japanese character set, and convert text to UTF-8
+    @param str  text for convertion
+    @return Converted text: UTF-8 text.
+ */
+char* autojp_to_utf8(const char *str) {
+    return autojp_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from CP949 to UTF-8
     @param str  CP949 text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* euckr_to_utf8(const char* str) {
+char* euckr_to_utf8(const char* str, long length, long *result_length) {
     char *buf;
-    long i, j, length;
+    long i, j, span;
     unsigned char c, d, a0, a1;
+    unsigned short ucs2;
+    const unsigned short * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = euckr_decode_pages();
+
         // Memory allocation
-        length = strlen(str);
         buf = new char[length*3 + 1];
 
         // CP949 to UTF-8
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             c = str[i];
             d = str[i+1];
             if ((unsigned char)0x80 <= c) {
-                int pos, old_pos, min, max, s;
-
-                min = index_euckr_unicode[c];
-                if (min < 0) {
-                    max = min;
-                } else if (c != 255) {
-                    max = min + 255;
-                    for (s = c+1; s <= 255; s++) {
-                        if (0 <= index_euckr_unicode[s]) {
-                            max = index_euckr_unicode[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_EUCKR_TABLE_MAX-1 < max) {
-                        max = EUCKR_UNICODE_TABLE_MAX-1;
-                    }
-                } else {
-                    max = EUCKR_UNICODE_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (euckr_unicode[pos][0] == d) {
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (euckr_unicode[old_pos][0] < d) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (0 <= min && pos != old_pos && min <= max) {
-                    a0 = euckr_unicode[pos][1];
-                    a1 = euckr_unicode[pos][2];
+                ucs2 = pages[c][d];
+                if (ucs2 != 0) {
+                    a0 = ucs2 >> 8;
+                    a1 = ucs2 & 0xFF;
                     if (a0 == (unsigned char)0x00 && (a1 & (unsigned char)0x80) == (unsigned char)0x00) {
                         buf[j++] = a1;
                     } else if (a0 <= (unsigned char)0x07) {
@@ -3848,34 +5830,57 @@ char* euckr_to_utf8(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from CP949 to UTF-8
+    @param str  CP949 text.
+    @return Converted text (UTF-8 text)
+ */
+char* euckr_to_utf8(const char* str) {
+    return euckr_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to CP949
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (CP949 text)
  */
-char* utf8_to_euckr(const char* str) {
+static char* utf8_to_euckr_into(const char* str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1, a2;
+    unsigned short code;
+    const unsigned short * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = euckr_encode_pages();
+
         // Memory allocation
-        length = strlen(str);
         length2 = length*2;
-        buf = new char[length2 + 1];
+        buf = (dest != NULL)?dest:new char[length2 + 1];
 
         // UTF-8 to CP949
         i = 0;
         j = 0;
         while (i < length && j <= length2) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             if (isutf8_1(a0) && i+utf8_len(a0)-1 < length) {
-                int pos, old_pos, min, max, s;
                 unsigned short len1;
 
                 a1 = str[i+1];
@@ -3904,44 +5909,12 @@ char* utf8_to_euckr(const char* str) {
                     continue;
                 }
 
-                min = index_unicode_euckr[a0];
-                if (min < 0) {
-                    max = min;
-                } else if (a0 != 255) {
-                    max = min + 255;
-                    for (s = a0+1; s <= 255; s++) {
-                        if (0 <= index_unicode_euckr[s]) {
-                            max = index_unicode_euckr[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_EUCKR_TABLE_MAX-1 < max) {
-                        max = UNICODE_EUCKR_TABLE_MAX-1;
-                    }
+                code = pages[a0][a1];
+                if (code != 0) {
+                    buf[j++] = code >> 8;
+                    buf[j++] = code & 0xFF;
+                    i += (len1 - 1);
                 } else {
-                    max = UNICODE_EUCKR_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (unicode_euckr[pos][0] == a1) {
-                            buf[j++] = unicode_euckr[pos][1];
-                            buf[j++] = unicode_euckr[pos][2];
-                            i += (utf8_len(str[i])-1);
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (unicode_euckr[old_pos][0] < a1) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (min < 0 || unicode_euckr[pos][0] != a1) {
                     buf[j++] = '?';
                     i += (len1 - 1);
                 }
@@ -3953,10 +5926,31 @@ char* utf8_to_euckr(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to CP949
+    @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (CP949 text)
+ */
+char* utf8_to_euckr(const char* str, long length, long *result_length) {
+    return utf8_to_euckr_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to CP949
+    @param str  UTF-8 text
+    @return Converted text (CP949 text)
+ */
+char* utf8_to_euckr(const char* str) {
+    return utf8_to_euckr(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 static inline char *_utf8_char_to_gb18030(const char *utf8_char, char *gb18030_buf) {
     int x, length, count;
     int xx, xy, o;
@@ -4163,6 +6157,62 @@ static inline char *_utf8_char_to_gb18030(const char *utf8_char, char *gb18030_b
 }
 
 
+/*! Build a UCS-2 to GB18030 four-byte code table
+    @param  void
+    @return 256 pages (per UCS-2 high byte) of 256 four-byte codes (0: not four-byte)
+ */
+static const unsigned long* const* gb18030_pages_new() {
+    static const unsigned long unmapped_page[256] = {0};
+    const unsigned long **pages;
+    unsigned long *page;
+    char utf8[4], gb18030[10];
+    long code;
+    int c, k;
+
+    pages = new const unsigned long* [256];
+    for (c = 0; c < 256; c++) {
+        page = NULL;
+        for (k = 0; k < 256; k++) {
+            code = (c << 8) | k;
+            if (code < 0x80) {
+                continue;
+            } else if (code < 0x800) {
+                utf8[0] = 0xC0 | (code >> 6);
+                utf8[1] = 0x80 | (code & 0x3F);
+                utf8[2] = '\0';
+            } else {
+                utf8[0] = 0xE0 | (code >> 12);
+                utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+                utf8[2] = 0x80 | (code & 0x3F);
+                utf8[3] = '\0';
+            }
+            if (_utf8_char_to_gb18030(utf8, gb18030) != NULL) {
+                if (page == NULL) {
+                    page = new unsigned long [256];
+                    memset(page, 0, sizeof(unsigned long) * 256);
+                }
+                page[k] = ((unsigned long)(unsigned char)gb18030[0] << 24) |
+                          ((unsigned long)(unsigned char)gb18030[1] << 16) |
+                          ((unsigned long)(unsigned char)gb18030[2] << 8) |
+                          (unsigned long)(unsigned char)gb18030[3];
+            }
+        }
+        pages[c] = (page != NULL)?page:unmapped_page;
+    }
+
+    return pages;
+}
+
+
+/*! UCS-2 to GB18030 four-byte code table (built on first use, never freed)
+    @return 256 pages (per UCS-2 high byte) of 256 four-byte codes (0: not four-byte)
+ */
+static const unsigned long* const* gb18030_encode_pages() {
+    static const unsigned long* const* pages = gb18030_pages_new();
+    return pages;
+}
+
+
 static inline char *_gb18030_char_to_utf8(const char *gb18030_char, char *utf8_buf) {
     int x, count;
     int xx, xy, o;
@@ -4309,26 +6359,35 @@ static inline char *_gb18030_char_to_utf8(const char *gb18030_char, char *utf8_b
 
 /*! Convert character set from GBK to UTF-8
     @param str  GBK text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* gbk_to_utf8(const char* str) {
+char* gbk_to_utf8(const char* str, long length, long *result_length) {
     char *buf;
     char buf2[10], *p;
-    long i, j, k, length;
+    long i, j, k, span;
     unsigned char c, d, a0, a1;
     int pos;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
         // Memory allocation
-        length = strlen(str);
         buf = new char[length*3 + 1];
 
         // gbk to UTF-8
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             // 4byte GB18030
             if (0x81 <= (const unsigned char)str[i] &&
                     (const unsigned char)str[i] <= 0xFE &&
@@ -4386,32 +6445,57 @@ char* gbk_to_utf8(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from GBK to UTF-8
+    @param str  GBK text
+    @return Converted text (UTF-8 text)
+ */
+char* gbk_to_utf8(const char* str) {
+    return gbk_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to GBK
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (GBK text)
  */
-char* utf8_to_gbk(const char* str) {
+static char* utf8_to_gbk_into(const char* str, long length, char *dest, long *result_length) {
     char *buf, buf2[10];
-    long i, j, length, length3;
+    long i, j, length3, span;
     unsigned char c, d, a0, a1, a2;
     int a0len, pos;
+    long code;
+    unsigned long gb18030;
+    const unsigned long * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = gb18030_encode_pages();
+
         // Memory allocation
-        length = strlen(str);
         length3 = length*3;
-        buf = new char[length3 + 1];
+        buf = (dest != NULL)?dest:new char[length3 + 1];
 
         // UTF-8 to gbk
         i = 0;
         j = 0;
         while (i < length && j <= length3) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             a0len = utf8_len(a0);
             if (a0len == 1) {
@@ -4419,7 +6503,26 @@ char* utf8_to_gbk(const char* str) {
                 i++;
                 continue;
             }
-            if (_utf8_char_to_gb18030(str+i, buf2) != NULL) {
+            code = -1;
+            if (a0len == 2 && i+1 < length && ((unsigned char)str[i+1] & 0xC0) == 0x80) {
+                code = ((a0 & 0x1F) << 6) | (str[i+1] & 0x3F);
+            } else if (a0len == 3 && i+2 < length && ((unsigned char)str[i+1] & 0xC0) == 0x80 &&
+                    ((unsigned char)str[i+2] & 0xC0) == 0x80 &&
+                    (a0 != 0xE0 || (unsigned char)0xA0 <= (unsigned char)str[i+1])) {
+                code = ((a0 & 0x0F) << 12) | ((str[i+1] & 0x3F) << 6) | (str[i+2] & 0x3F);
+            }
+            if (0 <= code) {
+                // well-formed BMP character
+                gb18030 = pages[code >> 8][code & 0xFF];
+                if (gb18030 != 0) {
+                    buf[j++] = gb18030 >> 24;
+                    buf[j++] = (gb18030 >> 16) & 0xFF;
+                    buf[j++] = (gb18030 >> 8) & 0xFF;
+                    buf[j++] = gb18030 & 0xFF;
+                    i += a0len;
+                    continue;
+                }
+            } else if (_utf8_char_to_gb18030(str+i, buf2) != NULL) {
                 strncpy(buf+j, buf2, 4);
                 j += 4;
                 i += a0len;
@@ -4468,72 +6571,71 @@ char* utf8_to_gbk(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to GBK
+    @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (GBK text)
+ */
+char* utf8_to_gbk(const char* str, long length, long *result_length) {
+    return utf8_to_gbk_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to GBK
+    @param str  UTF-8 text
+    @return Converted text (GBK text)
+ */
+char* utf8_to_gbk(const char* str) {
+    return utf8_to_gbk(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from BIG5 to UTF-8
     @param str  BIG5 text.
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* big5_to_utf8(const char* str) {
+char* big5_to_utf8(const char* str, long length, long *result_length) {
     char *buf;
-    long i, j, length;
+    long i, j, span;
     unsigned char c, d, a0, a1;
+    unsigned short ucs2;
+    const unsigned short * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = big5_decode_pages();
+
         // Memory allocation
-        length = strlen(str);
         buf = new char[length*3 + 1];
 
         // BIG5 to UTF-8
         i = 0;
         j = 0;
         while (i < length) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             c = str[i];
             d = str[i+1];
             if ((unsigned char)0x80 <= c) {
-                int pos, old_pos, min, max, s;
-
-                min = index_big5_unicode[c];
-                if (min < 0) {
-                    max = min;
-                } else if (c != 255) {
-                    max = min + 255;
-                    for (s = c+1; s <= 255; s++) {
-                        if (0 <= index_big5_unicode[s]) {
-                            max = index_big5_unicode[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_BIG5_TABLE_MAX-1 < max) {
-                        max = BIG5_UNICODE_TABLE_MAX-1;
-                    }
-                } else {
-                    max = BIG5_UNICODE_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (big5_unicode[pos][0] == d) {
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (big5_unicode[old_pos][0] < d) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (0 <= min && pos != old_pos && min <= max) {
-                    a0 = big5_unicode[pos][1];
-                    a1 = big5_unicode[pos][2];
+                ucs2 = pages[c][d];
+                if (ucs2 != 0) {
+                    a0 = ucs2 >> 8;
+                    a1 = ucs2 & 0xFF;
                     if (a0 == (unsigned char)0x00 && (a1 & (unsigned char)0x80) == (unsigned char)0x00) {
                         buf[j++] = a1;
                     } else if (a0 <= (unsigned char)0x07) {
@@ -4556,34 +6658,57 @@ char* big5_to_utf8(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from BIG5 to UTF-8
+    @param str  BIG5 text.
+    @return Converted text (UTF-8 text)
+ */
+char* big5_to_utf8(const char* str) {
+    return big5_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to BIG5
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param dest  buffer for the converted text, of the size allocated here (NULL: allocate)
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (BIG5 text)
  */
-char* utf8_to_big5(const char* str) {
+static char* utf8_to_big5_into(const char* str, long length, char *dest, long *result_length) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length2, span;
     unsigned char a0, a1, a2;
+    unsigned short code;
+    const unsigned short * const *pages;
 
     buf = NULL;
+    if (result_length != NULL) *result_length = 0;
 
     if (str != NULL) {
+        pages = big5_encode_pages();
+
         // Memory allocation
-        length = strlen(str);
         length2 = length*2;
-        buf = new char[length2 + 1];
+        buf = (dest != NULL)?dest:new char[length2 + 1];
 
         // UTF-8 to BIG5
         i = 0;
         j = 0;
         while (i < length && j <= length2) {
+            if (CHARSET_UNLIKELY(((unsigned char)str[i] & 0x80) == 0 && ascii_after_ascii(str, i, length))) {
+                // copy 7bit run at once
+                span = ascii_copy(buf + j, str + i, length - i);
+                i += span;
+                j += span;
+                continue;
+            }
             a0 = str[i];
             if (isutf8_1(a0) && i+utf8_len(a0)-1 < length) {
-                int pos, old_pos, min, max, s;
                 unsigned short len1;
 
                 a1 = str[i+1];
@@ -4612,44 +6737,12 @@ char* utf8_to_big5(const char* str) {
                     continue;
                 }
 
-                min = index_unicode_big5[a0];
-                if (min < 0) {
-                    max = min;
-                } else if (a0 != 255) {
-                    max = min + 255;
-                    for (s = a0+1; s <= 255; s++) {
-                        if (0 <= index_unicode_big5[s]) {
-                            max = index_unicode_big5[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_BIG5_TABLE_MAX-1 < max) {
-                        max = UNICODE_BIG5_TABLE_MAX-1;
-                    }
+                code = pages[a0][a1];
+                if (code != 0) {
+                    buf[j++] = code >> 8;
+                    buf[j++] = code & 0xFF;
+                    i += (len1 - 1);
                 } else {
-                    max = UNICODE_BIG5_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (unicode_big5[pos][0] == a1) {
-                            buf[j++] = unicode_big5[pos][1];
-                            buf[j++] = unicode_big5[pos][2];
-                            i += (utf8_len(str[i])-1);
-                            break;
-                        }
-
-                        old_pos = pos;
-                        if (unicode_big5[old_pos][0] < a1) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-
-                if (min < 0 || unicode_big5[pos][0] != a1) {
                     buf[j++] = '?';
                     i += (len1 - 1);
                 }
@@ -4661,15 +6754,38 @@ char* utf8_to_big5(const char* str) {
         buf[j] = '\0';
     }
 
+    if (result_length != NULL && buf != NULL) *result_length = j;
     return buf;
 }
 
 
+/*! Convert character set from UTF-8 to BIG5
+    @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
+    @return Converted text (BIG5 text)
+ */
+char* utf8_to_big5(const char* str, long length, long *result_length) {
+    return utf8_to_big5_into(str, length, (char *)NULL, result_length);
+}
+
+
+/*! Convert character set from UTF-8 to BIG5
+    @param str  UTF-8 text
+    @return Converted text (BIG5 text)
+ */
+char* utf8_to_big5(const char* str) {
+    return utf8_to_big5(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-7 to UTF-8
     @param str  UTF-7 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* utf7_to_utf8(const char* str) {
+char* utf7_to_utf8(const char* str, long length, long *result_length) {
     unsigned char c, i, bitcount;
     unsigned long ucs4, utf16, bitbuf;
     unsigned char base64[256] = {
@@ -4700,30 +6816,32 @@ char* utf7_to_utf8(const char* str) {
     const unsigned long UTF16HIGHEND   = 0xDBFFUL;
     const unsigned long UTF16LOSTART   = 0xDC00UL;
     const unsigned long UTF16LOEND   = 0xDFFFUL;
-    const int malloc_base_size = 4096;
-    int str_malloced_size;
+    long str_malloced_size;
     char *utf8_str;
-    int col;
+    long col;
+    const char *str_end;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
+    str_end = str + length;
 
-    str_malloced_size = malloc_base_size;
+    str_malloced_size = length * 3 + 1;
     utf8_str = new char [str_malloced_size];
     col = 0;
     utf8_str[col] = '\0';
 
     // loop until end of string
-    while (*str != '\0') {
+    while (str < str_end) {
         c = *str++;
         // deal with literal characters and &-, +-
-        if (c != '+' || *str == '-') {
+        if (c != '+' || (str < str_end && *str == '-')) {
             if (c < ' ' || c > '~') {
                 // hex encode if necessary
                 if (str_malloced_size - col - 1 < 3) {
                     char *tmp_utf8_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf8_str = new char [str_malloced_size];
                     memcpy(tmp_utf8_str, utf8_str, col);
                     delete [] utf8_str;
@@ -4742,7 +6860,7 @@ char* utf7_to_utf8(const char* str) {
                 // encode literally
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_utf8_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf8_str = new char [str_malloced_size];
                     memcpy(tmp_utf8_str, utf8_str, col);
                     delete [] utf8_str;
@@ -4756,7 +6874,7 @@ char* utf7_to_utf8(const char* str) {
             bitbuf = 0;
             bitcount = 0;
             ucs4 = 0;
-            while ((c = base64[(unsigned char) *str]) != undefined_num) {
+            while (str < str_end && (c = base64[(unsigned char) *str]) != undefined_num) {
                 str++;
                 bitbuf = (bitbuf << 6) | c;
                 bitcount += 6;
@@ -4800,7 +6918,7 @@ char* utf7_to_utf8(const char* str) {
                     for (c = 0; c < i; c++) {
                         if (str_malloced_size - col - 1 < 1) {
                             char *tmp_utf8_str;
-                            str_malloced_size += malloc_base_size;
+                            str_malloced_size *= 2;
                             tmp_utf8_str = new char [str_malloced_size];
                             memcpy(tmp_utf8_str, utf8_str, col);
                             delete [] utf8_str;
@@ -4812,20 +6930,32 @@ char* utf7_to_utf8(const char* str) {
                 }
             }
             // skip over trailing '-' in modified UTF-7 encoding
-            if (*str == '-') str++;
+            if (str < str_end && *str == '-') str++;
         }
     }
 
     utf8_str[col] = '\0';
+    if (result_length != NULL) *result_length = col;
     return utf8_str;
 }
 
 
+/*! Convert character set from UTF-7 to UTF-8
+    @param str  UTF-7 text
+    @return Converted text (UTF-8 text)
+ */
+char* utf7_to_utf8(const char* str) {
+    return utf7_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to UTF-7
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-7 text)
  */
-char* utf8_to_utf7(const char* str) {
+char* utf8_to_utf7(const char* str, long length, long *result_length) {
     unsigned int utf8pos, utf8total, c, utf7mode, bitstogo, utf16flag;
     unsigned long ucs4, bitbuf;
     const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"; // base64
@@ -4835,19 +6965,22 @@ char* utf8_to_utf7(const char* str) {
     const unsigned long UTF16HIGHSTART = 0xD800UL;
     const unsigned long UTF16LOSTART   = 0xDC00UL;
     const int malloc_base_size = 4096;
-    int str_malloced_size;
+    long str_malloced_size;
     char *utf7_str;
-    int col;
+    long col;
+    const char *str_end;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
+    str_end = str + length;
 
     utf8pos = 0;
     ucs4 = 0;
     bitbuf = 0;
 
-    str_malloced_size = malloc_base_size;
+    str_malloced_size = length * 2 + malloc_base_size;
     utf7_str = new char [str_malloced_size];
     col = 0;
     utf7_str[col] = '\0';
@@ -4855,7 +6988,8 @@ char* utf8_to_utf7(const char* str) {
     utf7mode = 0;
     utf8total = 0;
     bitstogo = 0;
-    while ((c = (unsigned char)*str) != '\0') {
+    while (str < str_end) {
+        c = (unsigned char)*str;
         str++;
         // normal character?
         if (isalnum(c) || isspace(c) || c == '(' || c == ')' || c == '/' || c == ',') {
@@ -4864,7 +6998,7 @@ char* utf8_to_utf7(const char* str) {
                 if (bitstogo) {
                     if (str_malloced_size - col - 1 < 1) {
                         char *tmp_utf7_str;
-                        str_malloced_size += malloc_base_size;
+                        str_malloced_size *= 2;
                         tmp_utf7_str = new char [str_malloced_size];
                         memcpy(tmp_utf7_str, utf7_str, col);
                         delete [] utf7_str;
@@ -4875,7 +7009,7 @@ char* utf8_to_utf7(const char* str) {
                 }
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_utf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf7_str = new char [str_malloced_size];
                     memcpy(tmp_utf7_str, utf7_str, col);
                     delete [] utf7_str;
@@ -4887,7 +7021,7 @@ char* utf8_to_utf7(const char* str) {
             }
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_utf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_utf7_str = new char [str_malloced_size];
                 memcpy(tmp_utf7_str, utf7_str, col);
                 delete [] utf7_str;
@@ -4899,7 +7033,7 @@ char* utf8_to_utf7(const char* str) {
             if (c == '+') {
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_utf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf7_str = new char [str_malloced_size];
                     memcpy(tmp_utf7_str, utf7_str, col);
                     delete [] utf7_str;
@@ -4914,7 +7048,7 @@ char* utf8_to_utf7(const char* str) {
         if (!utf7mode) {
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_utf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_utf7_str = new char [str_malloced_size];
                 memcpy(tmp_utf7_str, utf7_str, col);
                 delete [] utf7_str;
@@ -4969,7 +7103,7 @@ char* utf8_to_utf7(const char* str) {
                 bitstogo -= 6;
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_utf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf7_str = new char [str_malloced_size];
                     memcpy(tmp_utf7_str, utf7_str, col);
                     delete [] utf7_str;
@@ -4986,7 +7120,7 @@ char* utf8_to_utf7(const char* str) {
         if (bitstogo) {
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_utf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_utf7_str = new char [str_malloced_size];
                 memcpy(tmp_utf7_str, utf7_str, col);
                 delete [] utf7_str;
@@ -4997,7 +7131,7 @@ char* utf8_to_utf7(const char* str) {
         }
         if (str_malloced_size - col - 1 < 1) {
             char *tmp_utf7_str;
-            str_malloced_size += malloc_base_size;
+            str_malloced_size *= 2;
             tmp_utf7_str = new char [str_malloced_size];
             memcpy(tmp_utf7_str, utf7_str, col);
             delete [] utf7_str;
@@ -5008,15 +7142,27 @@ char* utf8_to_utf7(const char* str) {
     }
 
     utf7_str[col] = '\0';
+    if (result_length != NULL) *result_length = col;
     return utf7_str;
 }
 
 
+/*! Convert character set from UTF-8 to UTF-7
+    @param str  UTF-8 text
+    @return Converted text (UTF-7 text)
+ */
+char* utf8_to_utf7(const char* str) {
+    return utf8_to_utf7(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from IMAP4 modified UTF-7 to UTF-8
     @param str  IMAP4 modified UTF-7 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (UTF-8 text)
  */
-char* modutf7_to_utf8(const char* str) {
+char* modutf7_to_utf8(const char* str, long length, long *result_length) {
     unsigned char c, i, bitcount;
     unsigned long ucs4, utf16, bitbuf;
     unsigned char base64[256] = {
@@ -5047,30 +7193,32 @@ char* modutf7_to_utf8(const char* str) {
     const unsigned long UTF16HIGHEND   = 0xDBFFUL;
     const unsigned long UTF16LOSTART   = 0xDC00UL;
     const unsigned long UTF16LOEND   = 0xDFFFUL;
-    const int malloc_base_size = 4096;
-    int str_malloced_size;
+    long str_malloced_size;
     char *utf8_str;
-    int col;
+    long col;
+    const char *str_end;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
+    str_end = str + length;
 
-    str_malloced_size = malloc_base_size;
+    str_malloced_size = length * 3 + 1;
     utf8_str = new char [str_malloced_size];
     col = 0;
     utf8_str[col] = '\0';
 
     // loop until end of string
-    while (*str != '\0') {
+    while (str < str_end) {
         c = *str++;
         // deal with literal characters and &-, +-
-        if (c != '&' || *str == '-') {
+        if (c != '&' || (str < str_end && *str == '-')) {
             if (c < ' ' || c > '~') {
                 // hex encode if necessary
                 if (str_malloced_size - col - 1 < 3) {
                     char *tmp_utf8_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf8_str = new char [str_malloced_size];
                     memcpy(tmp_utf8_str, utf8_str, col);
                     delete [] utf8_str;
@@ -5089,7 +7237,7 @@ char* modutf7_to_utf8(const char* str) {
                 // encode literally
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_utf8_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_utf8_str = new char [str_malloced_size];
                     memcpy(tmp_utf8_str, utf8_str, col);
                     delete [] utf8_str;
@@ -5103,7 +7251,7 @@ char* modutf7_to_utf8(const char* str) {
             bitbuf = 0;
             bitcount = 0;
             ucs4 = 0;
-            while ((c = base64[(unsigned char) *str]) != undefined_num) {
+            while (str < str_end && (c = base64[(unsigned char) *str]) != undefined_num) {
                 str++;
                 bitbuf = (bitbuf << 6) | c;
                 bitcount += 6;
@@ -5147,7 +7295,7 @@ char* modutf7_to_utf8(const char* str) {
                     for (c = 0; c < i; c++) {
                         if (str_malloced_size - col - 1 < 1) {
                             char *tmp_utf8_str;
-                            str_malloced_size += malloc_base_size;
+                            str_malloced_size *= 2;
                             tmp_utf8_str = new char [str_malloced_size];
                             memcpy(tmp_utf8_str, utf8_str, col);
                             delete [] utf8_str;
@@ -5159,20 +7307,32 @@ char* modutf7_to_utf8(const char* str) {
                 }
             }
             // skip over trailing '-' in modified UTF-7 encoding
-            if (*str == '-') str++;
+            if (str < str_end && *str == '-') str++;
         }
     }
 
     utf8_str[col] = '\0';
+    if (result_length != NULL) *result_length = col;
     return utf8_str;
 }
 
 
+/*! Convert character set from IMAP4 modified UTF-7 to UTF-8
+    @param str  IMAP4 modified UTF-7 text
+    @return Converted text (UTF-8 text)
+ */
+char* modutf7_to_utf8(const char* str) {
+    return modutf7_to_utf8(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 /*! Convert character set from UTF-8 to IMAP4 modified UTF-7
     @param str  UTF-8 text
+    @param length  byte size of str
+    @param result_length  byte size of converted text (can be NULL)
     @return Converted text (IMAP4 modified UTF-7 text)
  */
-char* utf8_to_modutf7(const char* str) {
+char* utf8_to_modutf7(const char* str, long length, long *result_length) {
     unsigned int utf8pos=0, utf8total, c, utf7mode, bitstogo, utf16flag;
     unsigned long ucs4=0, bitbuf=0;
     const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+,"; // UTF-7 modified base64
@@ -5182,15 +7342,18 @@ char* utf8_to_modutf7(const char* str) {
     const unsigned long UTF16HIGHSTART = 0xD800UL;
     const unsigned long UTF16LOSTART   = 0xDC00UL;
     const int malloc_base_size = 4096;
-    int str_malloced_size;
+    long str_malloced_size;
     char *modutf7_str;
-    int col;
+    long col;
+    const char *str_end;
 
+    if (result_length != NULL) *result_length = 0;
     if (str == NULL) {
         return NULL;
     }
+    str_end = str + length;
 
-    str_malloced_size = malloc_base_size;
+    str_malloced_size = length * 2 + malloc_base_size;
     modutf7_str = new char [str_malloced_size];
     col = 0;
     modutf7_str[col] = '\0';
@@ -5198,7 +7361,8 @@ char* utf8_to_modutf7(const char* str) {
     utf7mode = 0;
     utf8total = 0;
     bitstogo = 0;
-    while ((c = (unsigned char)*str) != '\0') {
+    while (str < str_end) {
+        c = (unsigned char)*str;
         str++;
         // normal character?
         if (0x20 <= c && c < 0x80 && c != '/' && c != '\\' && c != '~' && c != '&' && c != '-') {
@@ -5207,7 +7371,7 @@ char* utf8_to_modutf7(const char* str) {
                 if (bitstogo) {
                     if (str_malloced_size - col - 1 < 1) {
                         char *tmp_modutf7_str;
-                        str_malloced_size += malloc_base_size;
+                        str_malloced_size *= 2;
                         tmp_modutf7_str = new char [str_malloced_size];
                         memcpy(tmp_modutf7_str, modutf7_str, col);
                         delete [] modutf7_str;
@@ -5218,7 +7382,7 @@ char* utf8_to_modutf7(const char* str) {
                 }
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_modutf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_modutf7_str = new char [str_malloced_size];
                     memcpy(tmp_modutf7_str, modutf7_str, col);
                     delete [] modutf7_str;
@@ -5230,7 +7394,7 @@ char* utf8_to_modutf7(const char* str) {
             }
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_modutf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_modutf7_str = new char [str_malloced_size];
                 memcpy(tmp_modutf7_str, modutf7_str, col);
                 delete [] modutf7_str;
@@ -5242,7 +7406,7 @@ char* utf8_to_modutf7(const char* str) {
             if (c == '&') {
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_modutf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_modutf7_str = new char [str_malloced_size];
                     memcpy(tmp_modutf7_str, modutf7_str, col);
                     delete [] modutf7_str;
@@ -5257,7 +7421,7 @@ char* utf8_to_modutf7(const char* str) {
         if (!utf7mode) {
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_modutf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_modutf7_str = new char [str_malloced_size];
                 memcpy(tmp_modutf7_str, modutf7_str, col);
                 delete [] modutf7_str;
@@ -5312,7 +7476,7 @@ char* utf8_to_modutf7(const char* str) {
                 bitstogo -= 6;
                 if (str_malloced_size - col - 1 < 1) {
                     char *tmp_modutf7_str;
-                    str_malloced_size += malloc_base_size;
+                    str_malloced_size *= 2;
                     tmp_modutf7_str = new char [str_malloced_size];
                     memcpy(tmp_modutf7_str, modutf7_str, col);
                     delete [] modutf7_str;
@@ -5329,7 +7493,7 @@ char* utf8_to_modutf7(const char* str) {
         if (bitstogo) {
             if (str_malloced_size - col - 1 < 1) {
                 char *tmp_modutf7_str;
-                str_malloced_size += malloc_base_size;
+                str_malloced_size *= 2;
                 tmp_modutf7_str = new char [str_malloced_size];
                 memcpy(tmp_modutf7_str, modutf7_str, col);
                 delete [] modutf7_str;
@@ -5340,7 +7504,7 @@ char* utf8_to_modutf7(const char* str) {
         }
         if (str_malloced_size - col - 1 < 1) {
             char *tmp_modutf7_str;
-            str_malloced_size += malloc_base_size;
+            str_malloced_size *= 2;
             tmp_modutf7_str = new char [str_malloced_size];
             memcpy(tmp_modutf7_str, modutf7_str, col);
             delete [] modutf7_str;
@@ -5351,152 +7515,314 @@ char* utf8_to_modutf7(const char* str) {
     }
 
     modutf7_str[col] = '\0';
+    if (result_length != NULL) *result_length = col;
     return modutf7_str;
 }
 
 
+/*! Convert character set from UTF-8 to IMAP4 modified UTF-7
+    @param str  UTF-8 text
+    @return Converted text (IMAP4 modified UTF-7 text)
+ */
+char* utf8_to_modutf7(const char* str) {
+    return utf8_to_modutf7(str, (str != NULL)?(long)strlen(str):0L, (long *)NULL);
+}
+
+
 #endif
 
 
+/*! Display width of a code point
+    @param code  Unicode code point
+    @return 0, 1 or 2
+ */
+static inline int eawidth(long code) {
+    if (code < 0 || 0x10FFFF < code) {
+        return 1;
+    }
+    return (eawidth_block[eawidth_index[code >> 8]][(code & 0xFF) >> 2] >> ((code & 3) * 2)) & 3;
+}
+
+
+/*! Decode a UTF-8 character for width
+    @param str     UTF-8 text
+    @param length  byte size of str
+    @param code    Unicode code point (-1 if str is broken)
+    @return Byte size of the character
+ */
+static inline long width_decode(const unsigned char *str, long length, long *code) {
+    long len, i, c;
+
+    len = utf8_len(str[0]);
+    if (len == 1 || 4 < len || length < len) {
+        *code = (str[0] < 0x80)?(long)str[0]:-1;
+        return 1;
+    }
+    c = str[0] & (0x7F >> len);
+    for (i = 1; i < len; i++) {
+        if ((str[i] & 0xC0) != 0x80) {
+            *code = -1;
+            return 1;
+        }
+        c = (c << 6) | (str[i] & 0x3F);
+    }
+    *code = c;
+
+    return len;
+}
+
+
 /*! Get display width of text
     @param str     UTF-8 text
+    @param length  byte size of str
     @return Width of string
  */
-long utf8_width(const char* str) {
-    long i, width;
-    unsigned short u8len;
-    unsigned char a0, a1, b0 /*, b1 */;
-    int pos, old_pos, min, max, s;
-    char buf[7];
+long utf8_width(const char* str, long length) {
+    const unsigned char *s;
+    long i, width, span, len, code;
 
     if (str == NULL) {
         return 0;
     }
 
+    s = (const unsigned char *)str;
     width = 0;
-
     i = 0;
-    while (str[i] != '\0') {
-        u8len = utf8_len(str[i]);
-        if ((unsigned char)(str[i]) == (unsigned char)0xEF &&
-                (unsigned char)(str[i+1]) == (unsigned char)0xBB &&
-                (unsigned char)(str[i+2]) == (unsigned char)0xBF) {
-            i += 3;
-        } else if (u8len <= 1) {
+    while (i < length) {
+        if (s[i] < 0x80) {
+            // 7bit run at once
+            span = ascii_run(str + i, length - i);
+            if (0 < span) {
+                width += span;
+                i += span;
+                continue;
+            }
             width++;
             i++;
-        } else if (u8len == 2 || u8len == 3) {
-            // UTF-8 to SJIS
-            if (u8len == 2) {
-                a0 = 0x07 & (str[i] >> 2);
-                a1 = (str[i] << 6) | (0x3F & str[i+1]);
-            } else {
-                a0 = (str[i] << 4) | (0x0F & (str[i+1] >> 2));
-                a1 = (str[i+1] << 6) | (0x3F & str[i+2]);
-            }
+            continue;
+        }
+        len = width_decode(s + i, length - i, &code);
+        width += eawidth(code);
+        i += len;
+    }
 
-            buf[0] = '\0';
- 
-            // hankana
-            if (a0 == (unsigned char)0xFF && 0x60 <= a1 && a1 <= 0x9F) {
-                if (a1 == '\x60') {
-                    buf[0] = 0x20;
-                } else {
-                    buf[0] = a1 + (0xA1-0x61);
-                }
-                buf[1] = '\0';
-            } else {
-                buf[0] = '\0';
-                min = index_unicode_sjis[a0];
-                if (min < 0) {
-                    max = min;
-                } else if (a0 != 255) {
-                    max = min + 255;
-                    for (s = a0+1; s <= 255; s++) {
-                        if (0 <= index_unicode_sjis[s]) {
-                            max = index_unicode_sjis[s]-1;
-                            break;
-                        }
-                    }
-                    if (UNICODE_SJIS_TABLE_MAX-1 < max) {
-                        max = UNICODE_SJIS_TABLE_MAX-1;
-                    }
-                } else {
-                    max = UNICODE_SJIS_TABLE_MAX-1;
-                }
-                old_pos = -1;
-                pos = (min+max)/2;
-                if (0 <= min) do {
-                        if (unicode_sjis[pos][0] == a1) {
-                            buf[0] = unicode_sjis[pos][1];
-                            buf[1] = unicode_sjis[pos][2];
-                            buf[2] = '\0';
-                            break;
-                        }
+    return width;
+}
 
-                        old_pos = pos;
-                        if (unicode_sjis[old_pos][0] < a1) {
-                            pos = (old_pos+1+max)/2;
-                            min = old_pos+1;
-                        } else {
-                            pos = (min+old_pos-1)/2;
-                            max = old_pos-1;
-                        }
-                    } while (pos != old_pos && min <= max);
-            }
 
-            if (buf[0] != '\0') {
-                // check width
-                b0 = buf[0];
-                //b1 = buf[1];
-                if (ishankana(b0) || (a0 == '\0' && isascii(a1))) {
-                    width++;
-                } else {
-                    width += 2;
-                //} else if (issjis1(b0) && issjis2(b1)) {
-                //    width += 2;
-                //} else {
-                //    width++;
-                }
-            } else {
-                if (u8len == 2) {
-                    a0 = 0x07 & (str[i] >> 2);
-                    a1 = (str[i] << 6) | (0x3F & str[i+1]);
-                } else {
-                    a0 = (str[i] << 4) | (0x0F & (str[i+1] >> 2));
-                    a1 = (str[i+1] << 6) | (0x3F & str[i+2]);
-                }
+/*! Get display width of text
+    @param str     UTF-8 text
+    @return Width of string
+ */
+long utf8_width(const char* str) {
+    return utf8_width(str, (str != NULL)?(long)strlen(str):0L);
+}
 
-                if (a0 == 0) {
-                    width++;
-                } else {
-                    unsigned long ucs4;
-                    ucs4 = (a0 * 256) + a1;
-                    if (0x1100 <= ucs4 &&
-                            (ucs4 <= 0x115F || ucs4 == 0x2329 || ucs4 == 0x232A ||
-                             (0x2E80 <= ucs4 && ucs4 <= 0xA4CF && ucs4 != 0x303F) ||
-                             (0xAC00 <= ucs4 && ucs4 <= 0xD7A3) ||
-                             (0xF900 <= ucs4 && ucs4 <= 0xFAFF) ||
-                             (0xFE30 <= ucs4 && ucs4 <= 0xFE6F) ||
-                             (0xFF00 <= ucs4 && ucs4 <= 0xFF60) ||
-                             (0xFFE0 <= ucs4 && ucs4 <= 0xFFE6) ||
-                             (0x20000 <= ucs4 && ucs4 <= 0x2FFFD) ||
-                             (0x30000 <= ucs4 && ucs4 <= 0x3FFFD))) {
-                        width += 2;
-                    } else {
-                        width++;
-                    }
-                }
+
+/*! Get display width of each character
+    @param str     UTF-8 text
+    @param length  byte size of str
+    @param out     widths (0, 1 or 2) in the order of characters (length bytes at most)
+    @return Number of characters
+ */
+long widths(const char *str, long length, unsigned char *out) {
+    const unsigned char *s;
+    long i, n, span, len, code;
+
+    if (str == NULL || out == NULL) {
+        return 0;
+    }
+
+    s = (const unsigned char *)str;
+    n = 0;
+    i = 0;
+    while (i < length) {
+        if (s[i] < 0x80) {
+            span = ascii_run(str + i, length - i);
+            if (0 < span) {
+                memset(out + n, 1, span);
+                n += span;
+                i += span;
+                continue;
             }
-            i += u8len;
+            out[n++] = 1;
+            i++;
+            continue;
+        }
+        len = width_decode(s + i, length - i, &code);
+        out[n++] = (unsigned char)eawidth(code);
+        i += len;
+    }
+
+    return n;
+}
+
+
+/*! UCS-2 code of a 3 bytes UTF-8 character
+    @param s  UTF-8 character
+    @return UCS-2 code, or -1 if s is broken
+ */
+static inline long width_ucs2(const unsigned char *s) {
+    if ((s[1] & 0xC0) != 0x80 || (s[2] & 0xC0) != 0x80) {
+        return -1;
+    }
+    return ((long)(s[0] & 0x0F) << 12) | ((long)(s[1] & 0x3F) << 6) | (long)(s[2] & 0x3F);
+}
+
 
+/*! Build UCS-2 indexed pages of a width table
+    @param table  UTF-8 characters (NULL terminated)
+    @param lead   First byte omitted in table ('\0' if not omitted)
+    @return 256 pages (per UCS-2 high byte) of 256 positions in table + 1 (0: not in table)
+ */
+static const unsigned short* const* width_pages_new(const char **table, unsigned char lead) {
+    static const unsigned short unmapped_page[256] = {0};
+    const unsigned short **pages;
+    unsigned short *page;
+    unsigned char c[3];
+    const char *entry;
+    long code;
+    int num;
+
+    pages = new const unsigned short* [256];
+    for (num = 0; num < 256; num++) {
+        pages[num] = unmapped_page;
+    }
+    for (num = 0; table[num] != NULL; num++) {
+        // only single 3 bytes characters are looked up
+        entry = table[num];
+        if (lead != '\0') {
+            c[0] = lead;
+            memcpy(&c[1], entry, 2);
+            if (strlen(entry) != 2) {
+                continue;
+            }
         } else {
-            width += 2;
-            i += u8len;
+            memcpy(c, entry, 3);
+            if (strlen(entry) != 3) {
+                continue;
+            }
+        }
+        code = width_ucs2(c);
+        if (code < 0) {
+            continue;
+        }
+        if (pages[code >> 8] == unmapped_page) {
+            page = new unsigned short [256];
+            memset(page, 0, sizeof(unsigned short) * 256);
+            pages[code >> 8] = page;
+        }
+        page = (unsigned short *)pages[code >> 8];
+        // the first one is used as the old linear search did
+        if (page[code & 0xFF] == 0) {
+            page[code & 0xFF] = (unsigned short)(num + 1);
         }
     }
 
-    return width;
+    return pages;
+}
+
+
+/*! Build the table of ASCII to full width
+    @param void
+    @return 128 positions in FULL_ASCII + 1 (0: not converted)
+ */
+static const unsigned short* width_ascii_new() {
+    unsigned short *table;
+    int num;
+
+    table = new unsigned short [128];
+    memset(table, 0, sizeof(unsigned short) * 128);
+    for (num = 0; HALF_ASCII[num] != NULL; num++) {
+        if (table[(unsigned char)HALF_ASCII[num][0] & 0x7F] == 0) {
+            table[(unsigned char)HALF_ASCII[num][0] & 0x7F] = (unsigned short)(num + 1);
+        }
+    }
+
+    return table;
+}
+
+
+/*! Build the table of half width katakana followed by voiced sound mark
+    @param void
+    @return 2 positions in HALF_KANA + 1 per U+FF60-FF9F (for U+FF9E and U+FF9F)
+ */
+static const unsigned short* width_voiced_new() {
+    unsigned short *table;
+    unsigned char c[3];
+    long code;
+    int num;
+
+    table = new unsigned short [64 * 2];
+    memset(table, 0, sizeof(unsigned short) * 64 * 2);
+    for (num = 0; HALF_KANA[num] != NULL; num++) {
+        if (strlen(HALF_KANA[num]) != 5) {
+            continue;
+        }
+        c[0] = 0xEF;
+        memcpy(&c[1], HALF_KANA[num], 2);
+        code = width_ucs2(c);
+        if (0xFF60 <= code && code <= 0xFF9F) {
+            table[(code - 0xFF60) * 2 + ((unsigned char)HALF_KANA[num][4] == 0x9F)] =
+                (unsigned short)(num + 1);
+        }
+    }
+
+    return table;
+}
+
+
+/*! ASCII to full width table (built on first use, never freed)
+    @return 128 positions in FULL_ASCII + 1
+ */
+static const unsigned short* width_ascii() {
+    static const unsigned short* table = width_ascii_new();
+    return table;
+}
+
+
+/*! Half width katakana with voiced sound mark table (built on first use, never freed)
+    @return 2 positions in HALF_KANA + 1 per U+FF60-FF9F
+ */
+static const unsigned short* width_voiced() {
+    static const unsigned short* table = width_voiced_new();
+    return table;
+}
+
+
+/*! Full width ASCII table (built on first use, never freed)
+    @return 256 pages of positions in FULL_ASCII + 1
+ */
+static const unsigned short* const* width_full_ascii_pages() {
+    static const unsigned short* const* pages = width_pages_new(FULL_ASCII, '\0');
+    return pages;
+}
+
+
+/*! Full width hiragana table (built on first use, never freed)
+    @return 256 pages of positions in FULL_HIRA + 1
+ */
+static const unsigned short* const* width_full_hira_pages() {
+    static const unsigned short* const* pages = width_pages_new(FULL_HIRA, 0xE3);
+    return pages;
+}
+
+
+/*! Full width katakana table (built on first use, never freed)
+    @return 256 pages of positions in FULL_KANA + 1
+ */
+static const unsigned short* const* width_full_kana_pages() {
+    static const unsigned short* const* pages = width_pages_new(FULL_KANA, 0xE3);
+    return pages;
+}
+
+
+/*! Half width katakana table (built on first use, never freed)
+    @return 256 pages of positions in HALF_KANA + 1
+ */
+static const unsigned short* const* width_half_kana_pages() {
+    static const unsigned short* const* pages = width_pages_new(HALF_KANA, 0xEF);
+    return pages;
 }
 
 
@@ -5515,8 +7841,13 @@ long utf8_width(const char* str) {
  */
 char* utf8_change_width(const char* str, const char *options) {
     char *buf;
-    long i, j, length, length2;
+    long i, j, length, length2, code;
     int OPTION_A, OPTION_a, OPTION_H, OPTION_K, OPTION_J, OPTION_j, OPTION_I, OPTION_k;
+    const unsigned short *ascii, *voiced;
+    const unsigned short* const* full_ascii;
+    const unsigned short* const* full_hira;
+    const unsigned short* const* full_kana;
+    const unsigned short* const* half_kana;
 
     buf = NULL;
 
@@ -5531,142 +7862,97 @@ char* utf8_change_width(const char* str, const char *options) {
         OPTION_I = strchr(options, 'I')?1:0;
         OPTION_k = strchr(options, 'k')?1:0;
 
-        // Memory allocation
+        ascii = width_ascii();
+        voiced = width_voiced();
+        full_ascii = width_full_ascii_pages();
+        full_hira = width_full_hira_pages();
+        full_kana = width_full_kana_pages();
+        half_kana = width_half_kana_pages();
+
+        // Memory allocation (ASCII grows to 3 bytes, a katakana to 2 half width ones)
         length = strlen(str);
-        length2 = length*6;
+        if (OPTION_A) {
+            length2 = length * 3;
+        } else if (OPTION_j || OPTION_k) {
+            length2 = length * 2;
+        } else {
+            length2 = length;
+        }
         buf = new char[length2 + 1];
 
         // change width
         i = 0;
         j = 0;
-        while (i < length && j <= length2) {
-            int mblen, converted, convlen, num;
+        while (i < length) {
+            const unsigned char *s;
+            const char *conv;
+            int mblen, convlen, num;
+            char lead;
             mblen = utf8_len(str[i]);
             if (length < i + mblen) {
                 break;
             }
-            converted = 0;
-
-            // 'A': ASCII to full width
-            if (OPTION_A && mblen == 1 && ((unsigned char)str[i] & (unsigned char)0x80) == (unsigned char)0) {
-                for (num = 0; HALF_ASCII[num] != NULL; num++) {
-                    convlen = strlen(HALF_ASCII[num]);
-                    if (!strncmp(&str[i], HALF_ASCII[num], convlen)) {
-                        strcpy(&buf[j], FULL_ASCII[num]);
-                        i += convlen;
-                        j += strlen(FULL_ASCII[num]);
-                        converted = 1;
-                        break;
-                    }
-                }
-            }
-
-            // 'a': ASCII to half width
-            if (OPTION_a && converted == 0 && mblen == 3 && ((unsigned char)str[i] & (unsigned char)0xE0) == (unsigned char)0xE0) {
-                for (num = 0; FULL_ASCII[num] != NULL; num++) {
-                    convlen = strlen(FULL_ASCII[num]);
-                    if (!strncmp(&str[i], FULL_ASCII[num], convlen)) {
-                        strcpy(&buf[j], HALF_ASCII[num]);
-                        i += convlen;
-                        j += strlen(HALF_ASCII[num]);
-                        converted = 1;
-                        break;
-                    }
-                }
-            }
-
-            // 'H': half width katakana to full width hiragana
-            if (OPTION_H && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xEF) {
-                for (num = 0; HALF_KANA[num] != NULL; num++) {
-                    convlen = strlen(HALF_KANA[num]);
-                    if (!strncmp(&str[i+1], HALF_KANA[num], convlen)) {
-                        buf[j++] = (char)0xE3;
-                        strcpy(&buf[j], FULL_HIRA[num]);
-                        i += (convlen + 1);
-                        j += strlen(FULL_HIRA[num]);
-                        converted = 1;
-                        break;
+            s = (const unsigned char *)&str[i];
+            conv = NULL;
+            lead = '\0';
+            convlen = mblen;
+
+            if (mblen == 1) {
+                // 'A': ASCII to full width
+                if (OPTION_A && s[0] < 0x80 && 0 < (num = ascii[s[0]])) {
+                    conv = FULL_ASCII[num - 1];
+                }
+            } else if (mblen == 3 && 0 <= (code = width_ucs2(s))) {
+                // 'a': ASCII to half width
+                if (OPTION_a && 0 < (num = full_ascii[code >> 8][code & 0xFF])) {
+                    conv = HALF_ASCII[num - 1];
+                }
+
+                if (conv == NULL && s[0] == 0xEF && (OPTION_H || OPTION_K)) {
+                    // half width katakana and the following voiced sound mark make one
+                    num = 0;
+                    if (0xFF60 <= code && code <= 0xFF9F && i + 6 <= length &&
+                            s[3] == 0xEF && s[4] == 0xBE && (s[5] == 0x9E || s[5] == 0x9F)) {
+                        num = voiced[(code - 0xFF60) * 2 + (s[5] == 0x9F)];
+                        convlen = 6;
                     }
-                }
-            }
-
-            // 'K': half width katakana to full width katakana
-            if (OPTION_K && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xEF) {
-                for (num = 0; HALF_KANA[num] != NULL; num++) {
-                    convlen = strlen(HALF_KANA[num]);
-                    if (!strncmp(&str[i+1], HALF_KANA[num], convlen)) {
-                        buf[j++] = (char)0xE3;
-                        strcpy(&buf[j], FULL_KANA[num]);
-                        i += (convlen + 1);
-                        j += strlen(FULL_KANA[num]);
-                        converted = 1;
-                        break;
+                    if (num == 0) {
+                        num = half_kana[code >> 8][code & 0xFF];
+                        convlen = 3;
                     }
-                }
-            }
-
-            // 'J': full width hiragana to full width katakana
-            if (OPTION_J && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xE3) {
-                for (num = 0; FULL_HIRA[num] != NULL; num++) {
-                    convlen = strlen(FULL_HIRA[num]);
-                    if (!strncmp(&str[i+1], FULL_HIRA[num], convlen)) {
-                        buf[j++] = (char)0xE3;
-                        strcpy(&buf[j], FULL_KANA[num]);
-                        i += (convlen + 1);
-                        j += strlen(FULL_KANA[num]);
-                        converted = 1;
-                        break;
+                    if (0 < num) {
+                        // 'H': half width katakana to full width hiragana
+                        // 'K': half width katakana to full width katakana
+                        conv = OPTION_H?FULL_HIRA[num - 1]:FULL_KANA[num - 1];
+                        lead = (char)0xE3;
                     }
                 }
-            }
 
-            // 'j': full width hiragana to half width katakana
-            if (OPTION_j && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xE3) {
-                for (num = 0; FULL_HIRA[num] != NULL; num++) {
-                    convlen = strlen(FULL_HIRA[num]);
-                    if (!strncmp(&str[i+1], FULL_HIRA[num], convlen)) {
-                        buf[j++] = (char)0xEF;
-                        strcpy(&buf[j], HALF_KANA[num]);
-                        i += (convlen + 1);
-                        j += strlen(HALF_KANA[num]);
-                        converted = 1;
-                        break;
+                if (conv == NULL && s[0] == 0xE3) {
+                    if ((OPTION_J || OPTION_j) && 0 < (num = full_hira[code >> 8][code & 0xFF])) {
+                        // 'J': full width hiragana to full width katakana
+                        // 'j': full width hiragana to half width katakana
+                        conv = OPTION_J?FULL_KANA[num - 1]:HALF_KANA[num - 1];
+                        lead = OPTION_J?(char)0xE3:(char)0xEF;
+                    } else if ((OPTION_I || OPTION_k) && 0 < (num = full_kana[code >> 8][code & 0xFF])) {
+                        // 'I': full width katakana to full width hiragana
+                        // 'k': full width katakana to half width katakana
+                        conv = OPTION_I?FULL_HIRA[num - 1]:HALF_KANA[num - 1];
+                        lead = OPTION_I?(char)0xE3:(char)0xEF;
                     }
                 }
             }
 
-            // 'I': full width katakana to full width hiragana
-            if (OPTION_I && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xE3) {
-                for (num = 0; FULL_KANA[num] != NULL; num++) {
-                    convlen = strlen(FULL_KANA[num]);
-                    if (!strncmp(&str[i+1], FULL_KANA[num], convlen)) {
-                        buf[j++] = (char)0xE3;
-                        strcpy(&buf[j], FULL_HIRA[num]);
-                        i += (convlen + 1);
-                        j += strlen(FULL_HIRA[num]);
-                        converted = 1;
-                        break;
-                    }
+            if (conv != NULL) {
+                if (lead != '\0') {
+                    buf[j++] = lead;
                 }
-            }
-
-            // 'k': full width katakana to half width katakana
-            if (OPTION_k && converted == 0 && 3 <= mblen && (unsigned char)str[i] == (unsigned char)0xE3) {
-                for (num = 0; FULL_KANA[num] != NULL; num++) {
-                    convlen = strlen(FULL_KANA[num]);
-                    if (!strncmp(&str[i+1], FULL_KANA[num], convlen)) {
-                        buf[j++] = (char)0xEF;
-                        strcpy(&buf[j], HALF_KANA[num]);
-                        i += (convlen + 1);
-                        j += strlen(HALF_KANA[num]);
-                        converted = 1;
-                        break;
-                    }
+                while (*conv != '\0') {
+                    buf[j++] = *(conv++);
                 }
-            }
-
-            if (converted == 0) {
-                strncpy(&buf[j], &str[i], mblen);
+                i += convlen;
+            } else {
+                memcpy(&buf[j], &str[i], mblen);
                 i += mblen;
                 j += mblen;
             }
@@ -5684,28 +7970,40 @@ char* utf8_change_width(const char* str, const char *options) {
 
 /*! Clean up UTF-8 string (remove invalid characters)
     @param str     string for cleaning up
+    @param length  byte size of str (updated when a broken tail is cut)
     @return Pointer of cleaned up string (Same address of str)
  */
-char* utf8_clean(char* str) {
+char* utf8_clean(char* str, long *length) {
     int ucs4_code;
     int utf8_size;
     int i;
     int len;
+    long span;
     unsigned char* pstr;
     unsigned char* peob;
 
-    if (str == NULL) {
+    if (str == NULL || length == NULL) {
         return NULL;
     }
 
     pstr = (unsigned char *)str;
-    peob = pstr + strlen((char *)pstr);
+    peob = pstr + *length;
 
     while (pstr < peob) {
+        if ((pstr[0] & 0x80) == 0) {
+            // skip 7bit run at once
+            span = ascii_run((const char *)pstr, peob - pstr);
+            if (0 < span) {
+                pstr += span;
+                continue;
+            }
+        }
+
         utf8_size = utf8_len(pstr[0]);
 
         if (peob < pstr + utf8_size) {
             pstr[0] = '\0';
+            *length = (char *)pstr - str;
             break;
         }
 
@@ -5778,4 +8076,20 @@ char* utf8_clean(char* str) {
     return str;
 }
 
+
+/*! Clean up UTF-8 string (remove invalid characters)
+    @param str     string for cleaning up
+    @return Pointer of cleaned up string (Same address of str)
+ */
+char* utf8_clean(char* str) {
+    long length;
+
+    if (str == NULL) {
+        return NULL;
+    }
+    length = strlen(str);
+
+    return utf8_clean(str, &length);
+}
+
 } // namespace apolloron
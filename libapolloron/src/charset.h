@@ -57,6 +57,17 @@ extern const char *STR_EUCKR;
 extern const char *STR_GBK;
 extern const char *STR_BIG5;
 
+// Descriptor of a character set handle
+typedef struct {
+    const char *name;  // canonical name
+    TCharset family;   // handle shared by the variants (ex. CHARSET_UTF16 for CHARSET_UTF16LE_BOM)
+    int param;         // part number of ISO-8859, or table of europe_to_utf8() ('R', 'U', '1', ...)
+    char endian;       // byte order of UTF-16/32 ('b', 'l', or 'B' for BOM or big endian)
+    bool bom;          // output starts with BOM
+} TCharsetInfo;
+
+extern const TCharsetInfo CHARSET_INFO[CHARSET_MAX];
+
 char* charset_convert(const char* str, const char *src_charset, const char *dest_charset);
 const char* auto_detect(const char* str);
 const char* jis_auto_detect(const char* str);
@@ -104,10 +115,72 @@ char* utf8_to_utf7(const char* str);
 char* modutf7_to_utf8(const char* str);
 char* utf8_to_modutf7(const char* str);
 
+long ascii_span(const char* str, long length);
 long utf8_width(const char* str);
+long utf8_width(const char* str, long length);
 char* utf8_change_width(const char* str, const char* options);
 char* utf8_clean(char* str);
 
+// Length-aware variants (str[length] must be '\0', but str may contain '\0')
+char* charset_convert(const char* str, long length, const char *src_charset, const char *dest_charset,
+                      long *result_length);
+long charset_convert(const char* src, long length, char *dst, long capacity,
+                     const char *src_charset, const char *dest_charset);
+char* charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                      long *result_length);
+char* charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                      long *result_length, int threads);
+long charset_convert(const char* str, long length, TCharset src_charset, TCharset dest_charset,
+                     char *dst, long capacity);
+const char* auto_detect(const char* str, long length);
+const char* jis_auto_detect(const char* str, long length);
+const char* auto_detect(const char* str, long length, long limit, int *confidence);
+const char* jis_auto_detect(const char* str, long length, long limit, int *confidence);
+char* iso8859_to_utf8(const char* str, long length, int iso8859_num, long *result_length);
+char* utf8_to_iso8859(const char* str, long length, int iso8859_num, long *result_length);
+char* europe_to_utf8(const char* str, long length, char ch, long *result_length);
+char* utf8_to_europe(const char* str, long length, char ch, long *result_length);
+char* utf8_to_utf16(const char *str, long length, long *result_length, char en);
+char* utf16_to_utf8(const char *str, long length, char en, long *result_length);
+char* utf8_to_utf32(const char *str, long length, long *result_length, char en);
+char* utf32_to_utf8(const char *str, long length, char en, long *result_length);
+char* utf8_to_eucjpms(const char *str, long length, long *result_length);
+char* utf8_to_eucjpwin(const char* str, long length, long *result_length);
+char* sjis_to_eucjpms(const char* str, long length, long *result_length);
+char* sjis_to_eucjpwin(const char* str, long length, long *result_length);
+char* jis_to_eucjpms(const char* str, long length, long *result_length);
+char* jis_to_eucjpwin(const char* str, long length, long *result_length);
+char* eucjpms_to_sjis(const char* str, long length, long *result_length);
+char* eucjpwin_to_sjis(const char* str, long length, long *result_length);
+char* eucjpms_to_jis(const char* str, long length, long *result_length);
+char* eucjpwin_to_jis(const char* str, long length, long *result_length);
+char* eucjpms_to_utf8(const char *str, long length, long *result_length);
+char* eucjpwin_to_utf8(const char* str, long length, long *result_length);
+char* eucjpms_to_eucjpwin(const char *str, long length, long *result_length);
+char* eucjpwin_to_eucjpms(const char *str, long length, long *result_length);
+char* utf8_to_sjis(const char* str, long length, long *result_length);
+char* utf8_to_jis(const char* str, long length, long *result_length);
+char* sjis_to_utf8(const char* str, long length, long *result_length);
+char* jis_to_utf8(const char* str, long length, long *result_length);
+char* sjis_to_jis(const char* str, long length, long *result_length);
+char* jis_to_sjis(const char* str, long length, long *result_length);
+char* autojp_to_eucjpms(const char *str, long length, long *result_length);
+char* autojp_to_eucjpwin(const char* str, long length, long *result_length);
+char* autojp_to_sjis(const char* str, long length, long *result_length);
+char* autojp_to_jis(const char* str, long length, long *result_length);
+char* autojp_to_utf8(const char* str, long length, long *result_length);
+char* euckr_to_utf8(const char* str, long length, long *result_length);
+char* utf8_to_euckr(const char* str, long length, long *result_length);
+char* gbk_to_utf8(const char* str, long length, long *result_length);
+char* utf8_to_gbk(const char* str, long length, long *result_length);
+char* big5_to_utf8(const char* str, long length, long *result_length);
+char* utf8_to_big5(const char* str, long length, long *result_length);
+char* utf7_to_utf8(const char* str, long length, long *result_length);
+char* utf8_to_utf7(const char* str, long length, long *result_length);
+char* modutf7_to_utf8(const char* str, long length, long *result_length);
+char* utf8_to_modutf7(const char* str, long length, long *result_length);
+char* utf8_clean(char* str, long *length);
+
 } // namespace apolloron
 
 #endif
@@ -15,6 +15,12 @@ extern const char* FULL_KANA[];
 extern const char* FULL_HIRA[];
 extern const char* HALF_KANA[];
 
+#define EAWIDTH_INDEX_MAX 4352
+#define EAWIDTH_BLOCK_MAX 107
+
+extern const unsigned char eawidth_index[EAWIDTH_INDEX_MAX];
+extern const unsigned char eawidth_block[EAWIDTH_BLOCK_MAX][64];
+
 
 } // namespace apolloron
 #endif
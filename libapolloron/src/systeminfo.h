@@ -0,0 +1,16 @@
+/* systeminfo.h : auto-generated */
+
+#ifndef _SYSTEMINFO_H_
+#define _SYSTEMINFO_H_
+
+namespace apolloron {
+
+#define _BUILD_DATE      "2026-10-17 19:44:00 +0000 (UTC)"
+#define _BUILD_HOST      "vm"
+#define _BUILD_OS        "x86_64-linux-gnu"
+#define _BUILD_OS_DISTRO "generic"
+#define _BUILD_OS_KERNEL "6.18.44-fc-v139"
+
+} // apolloron
+
+#endif
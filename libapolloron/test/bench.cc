@@ -0,0 +1,702 @@
+/******************************************************************************/
+/*! @file bench.cc
+    @brief benchmark program for libapolloron
+    @author Masashi Astro Tachibana, Apolloron Project.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "apolloron.h"
+
+using namespace apolloron;
+
+
+#define BENCH_CORPUS_SIZE (4L*1024L*1024L)
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_TRIALS      5
+
+int bench1();
+int bench2();
+int bench3();
+int bench4();
+int bench5();
+int bench6();
+int bench7();
+int bench8();
+
+
+/*! Main  Calling Benchmark functions
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int main(int argc, char *argv[]) {
+    int status;
+
+    fprintf(stderr, "Starting Bench1 Decoding Legacy Character-Sets ...\n");
+    status = bench1();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench2 Encoding Legacy Character-Sets ...\n");
+    status = bench2();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench3 Converting ASCII-heavy And CJK-heavy Text ...\n");
+    status = bench3();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench4 Converting Small And Large Text ...\n");
+    status = bench4();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench5 Changing Width ...\n");
+    status = bench5();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench6 Measuring Width ...\n");
+    status = bench6();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench7 Converting Independent Text On Threads ...\n");
+    status = bench7();
+    if (status != 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Starting Bench8 Adding And Looking Up Keys ...\n");
+    status = bench8();
+    if (status != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*! Current time in seconds
+    @param  void
+    @return seconds
+ */
+static double bench_now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+
+/*! Append a code point to UTF-8 text
+    @param str   UTF-8 text
+    @param code  Unicode code point (BMP)
+    @return void
+ */
+static void bench_add_utf8(String &str, long code) {
+    char buf[4];
+    long length;
+
+    if (code < 0x80) {
+        buf[0] = (char)code;
+        length = 1;
+    } else if (code < 0x800) {
+        buf[0] = (char)(0xC0 | (code >> 6));
+        buf[1] = (char)(0x80 | (code & 0x3F));
+        length = 2;
+    } else {
+        buf[0] = (char)(0xE0 | (code >> 12));
+        buf[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (code & 0x3F));
+        length = 3;
+    }
+    str.addBinary(buf, length);
+}
+
+
+/*! Make CJK text of about BENCH_CORPUS_SIZE bytes
+    @param charset  character set of the text
+    @param ascii    ASCII characters between CJK characters
+    @return text in charset
+ */
+static String bench_corpus(const char *charset, int ascii) {
+    String utf8, text, corpus;
+    long code, n, i;
+
+    utf8.useAsBinary(0);
+    n = 0;
+    for (code = 0x4E00; code <= 0x9FA5; code += 7) {
+        n++;
+        for (i = 0; i < ascii; i++) {
+            bench_add_utf8(utf8, (i % 8 == 7)?' ':('a' + ((n + i) % 26)));
+        }
+        bench_add_utf8(utf8, code);
+        if (!strcasecmp(charset, "CP949")) {
+            bench_add_utf8(utf8, 0xAC00 + (code % 11172));
+        } else {
+            bench_add_utf8(utf8, 0x3041 + (code % 83));
+        }
+        if (n % 40 == 0) {
+            bench_add_utf8(utf8, '\n');
+        }
+    }
+    text = utf8.strconv("UTF-8", charset);
+
+    corpus.useAsBinary(0);
+    i = text.isBinary()?text.binaryLength():text.len();
+    while (corpus.binaryLength() < BENCH_CORPUS_SIZE) {
+        corpus.addBinary(text.c_str(), i);
+    }
+
+    return corpus;
+}
+
+
+/*! Convert text repeatedly and print the best throughput
+    @param label         label to print
+    @param text          source text
+    @param src_charset   character set of text
+    @param dest_charset  character set to convert to
+    @return MB/s of source text
+ */
+static double bench_strconv(const char *label, const String &text,
+                            const char *src_charset, const char *dest_charset) {
+    String result;
+    double start, elapsed, mbps;
+    long rounds, length;
+    int trial;
+
+    length = text.isBinary()?text.binaryLength():text.len();
+    mbps = 0.0;
+    for (trial = 0; trial < BENCH_TRIALS; trial++) {
+        rounds = 0;
+        elapsed = 0.0;
+        do {
+            // temporary Strings live as long as their source, so use a new one
+            String work;
+            work = text;
+            start = bench_now();
+            result = work.strconv(src_charset, dest_charset);
+            elapsed += bench_now() - start;
+            rounds++;
+        } while (elapsed < BENCH_MIN_SECONDS);
+        if (mbps < (double)length * rounds / elapsed / (1024.0 * 1024.0)) {
+            mbps = (double)length * rounds / elapsed / (1024.0 * 1024.0);
+        }
+    }
+    printf("  %-28s %9.1f MB/s\n", label, mbps);
+
+    return mbps;
+}
+
+
+/*! Change line breaks repeatedly and print the best throughput
+    @param label  label to print
+    @param text   source text
+    @return MB/s of source text
+ */
+static double bench_return_code(const char *label, const String &text) {
+    String result;
+    double start, elapsed, mbps;
+    long rounds, length;
+    int trial;
+
+    length = text.len();
+    mbps = 0.0;
+    for (trial = 0; trial < BENCH_TRIALS; trial++) {
+        rounds = 0;
+        elapsed = 0.0;
+        do {
+            // temporary Strings live as long as their source, so use a new one
+            String work;
+            work = text;
+            start = bench_now();
+            result = work.changeReturnCode("\r\n");
+            elapsed += bench_now() - start;
+            rounds++;
+        } while (elapsed < BENCH_MIN_SECONDS);
+        if (mbps < (double)length * rounds / elapsed / (1024.0 * 1024.0)) {
+            mbps = (double)length * rounds / elapsed / (1024.0 * 1024.0);
+        }
+    }
+    printf("  %-28s %9.1f MB/s\n", label, mbps);
+
+    return mbps;
+}
+
+
+/*! Change width repeatedly and print the best throughput
+    @param label    label to print
+    @param text     UTF-8 text
+    @param options  options of changeWidth()
+    @return MB/s of source text
+ */
+static double bench_change_width(const char *label, const String &text, const char *options) {
+    String result;
+    double start, elapsed, mbps;
+    long rounds, length;
+    int trial;
+
+    length = text.len();
+    mbps = 0.0;
+    for (trial = 0; trial < BENCH_TRIALS; trial++) {
+        rounds = 0;
+        elapsed = 0.0;
+        do {
+            // temporary Strings live as long as their source, so use a new one
+            String work;
+            work = text;
+            start = bench_now();
+            result = work.changeWidth(options, "UTF-8", "UTF-8");
+            elapsed += bench_now() - start;
+            rounds++;
+        } while (elapsed < BENCH_MIN_SECONDS);
+        if (mbps < (double)length * rounds / elapsed / (1024.0 * 1024.0)) {
+            mbps = (double)length * rounds / elapsed / (1024.0 * 1024.0);
+        }
+    }
+    printf("  %-28s %9.1f MB/s\n", label, mbps);
+
+    return mbps;
+}
+
+
+/*! Measure width repeatedly and print the best throughput
+    @param label  label to print
+    @param text   UTF-8 text
+    @param bulk   true: widths(), false: String::width()
+    @return MB/s of source text
+ */
+static double bench_width(const char *label, const String &text, bool bulk) {
+    unsigned char *out;
+    double start, elapsed, mbps;
+    long rounds, length, total;
+    int trial;
+
+    length = text.len();
+    out = new unsigned char [length + 1];
+    mbps = 0.0;
+    total = 0;
+    for (trial = 0; trial < BENCH_TRIALS; trial++) {
+        rounds = 0;
+        elapsed = 0.0;
+        do {
+            start = bench_now();
+            if (bulk) {
+                total += widths(text.c_str(), length, out);
+            } else {
+                total += text.width("UTF-8");
+            }
+            elapsed += bench_now() - start;
+            rounds++;
+        } while (elapsed < BENCH_MIN_SECONDS);
+        if (mbps < (double)length * rounds / elapsed / (1024.0 * 1024.0)) {
+            mbps = (double)length * rounds / elapsed / (1024.0 * 1024.0);
+        }
+    }
+    delete [] out;
+    printf("  %-28s %9.1f MB/s\n", label, (0 <= total)?mbps:0.0);
+
+    return mbps;
+}
+
+
+/*! Bench1  Decoding Legacy Character-Sets
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench1() {
+    const char *charsets[] = {"CP932", "CP949", "GBK", "CP950", NULL};
+    String corpus;
+    char label[64];
+    int i;
+
+    for (i = 0; charsets[i] != NULL; i++) {
+        corpus = bench_corpus(charsets[i], 0);
+        snprintf(label, sizeof(label), "%s -> UTF-8", charsets[i]);
+        bench_strconv(label, corpus, charsets[i], "UTF-8");
+    }
+
+    return 0;
+}
+
+
+/*! Bench2  Encoding Legacy Character-Sets
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench2() {
+    const char *charsets[] = {"CP932", "CP949", "GBK", "CP950", NULL};
+    String corpus;
+    char label[64];
+    int i;
+
+    for (i = 0; charsets[i] != NULL; i++) {
+        corpus = bench_corpus(charsets[i], 0).strconv(charsets[i], "UTF-8");
+        snprintf(label, sizeof(label), "UTF-8 -> %s", charsets[i]);
+        bench_strconv(label, corpus, "UTF-8", charsets[i]);
+    }
+
+    return 0;
+}
+
+
+/*! Bench3  Converting ASCII-heavy And CJK-heavy Text
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench3() {
+    const char *charsets[] = {"CP932", "EUC-JP", "CP949", "GBK", "CP950", "ISO-8859-1", NULL};
+    const int ascii[] = {64, 1, 0};
+    const char *corpus_name[] = {"ascii", "mixed", "cjk"};
+    String corpus, utf8;
+    char label[64];
+    int i, k;
+
+    for (k = 0; k < 3; k++) {
+        for (i = 0; charsets[i] != NULL; i++) {
+            corpus = bench_corpus(charsets[i], ascii[k]);
+            utf8 = corpus.strconv(charsets[i], "UTF-8");
+            snprintf(label, sizeof(label), "%s %s -> UTF-8", corpus_name[k], charsets[i]);
+            bench_strconv(label, corpus, charsets[i], "UTF-8");
+            snprintf(label, sizeof(label), "%s UTF-8 -> %s", corpus_name[k], charsets[i]);
+            bench_strconv(label, utf8, "UTF-8", charsets[i]);
+        }
+        snprintf(label, sizeof(label), "%s changeReturnCode", corpus_name[k]);
+        bench_return_code(label, utf8);
+    }
+
+    return 0;
+}
+
+
+/*! Bench8  Adding And Looking Up Keys
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench8() {
+    const long counts[] = {10, 100, 1000, 10000, 0};
+    char (*names)[16];
+    char label[64];
+    double start, elapsed, add_ns, read_ns, order_ns;
+    long rounds, n, i, r;
+    int k, trial;
+
+    // keys sharing the first character like CSV columns and headers
+    names = new char [10000][16];
+    for (i = 0; i < 10000; i++) {
+        snprintf(names[i], sizeof(names[i]), "col%ld", i + 1);
+    }
+
+    for (k = 0; counts[k] != 0; k++) {
+        n = counts[k];
+        rounds = 100000L / n;
+        add_ns = read_ns = order_ns = 0.0;
+        for (trial = 0; trial < BENCH_TRIALS; trial++) {
+            Keys *keys = new Keys [rounds];
+
+            start = bench_now();
+            for (r = 0; r < rounds; r++) {
+                for (i = 0; i < n; i++) {
+                    keys[r].addKey(names[i], "value");
+                }
+            }
+            elapsed = (bench_now() - start) * 1000000000.0 / (double)(rounds * n);
+            if (add_ns == 0.0 || elapsed < add_ns) add_ns = elapsed;
+
+            start = bench_now();
+            for (r = 0; r < rounds; r++) {
+                for (i = 0; i < n; i++) {
+                    if (keys[r].read(names[i]) == NULL) {
+                        fprintf(stderr, "Error: Bench8 key %s is not found\n", names[i]);
+                        delete [] keys;
+                        delete [] names;
+                        return -1;
+                    }
+                }
+            }
+            elapsed = (bench_now() - start) * 1000000000.0 / (double)(rounds * n);
+            if (read_ns == 0.0 || elapsed < read_ns) read_ns = elapsed;
+
+            start = bench_now();
+            for (r = 0; r < rounds; r++) {
+                for (i = 0; i < n; i++) {
+                    if (keys[r].key(i)[0] != 'c') {
+                        fprintf(stderr, "Error: Bench8 key %ld is broken\n", i);
+                        delete [] keys;
+                        delete [] names;
+                        return -1;
+                    }
+                }
+            }
+            elapsed = (bench_now() - start) * 1000000000.0 / (double)(rounds * n);
+            if (order_ns == 0.0 || elapsed < order_ns) order_ns = elapsed;
+
+            delete [] keys;
+        }
+        snprintf(label, sizeof(label), "%ld keys", n);
+        printf("  %-28s add %7.1f ns  read %7.1f ns  key(i) %7.1f ns\n", label, add_ns, read_ns, order_ns);
+    }
+
+    delete [] names;
+
+    return 0;
+}
+
+
+/*! Cut or repeat text to about size bytes at a line break
+    @param text  source text
+    @param size  size in bytes
+    @return text
+ */
+static String bench_resize(const String &text, long size) {
+    String result;
+    const char *p;
+    long length, n;
+
+    p = text.c_str();
+    length = text.isBinary()?text.binaryLength():text.len();
+    result.useAsBinary(0);
+    while (result.binaryLength() + length <= size) {
+        result.addBinary(p, length);
+    }
+    n = size - result.binaryLength();
+    while (0 < n && p[n - 1] != '\n') {
+        n--;
+    }
+    result.addBinary(p, n);
+
+    return result;
+}
+
+
+/*! Bench4  Converting Small And Large Text
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench4() {
+    const long sizes[] = {4L*1024L, 1024L*1024L, 4L*1024L*1024L, 16L*1024L*1024L, 64L*1024L*1024L, 0};
+    String corpus, text, utf8;
+    char label[64];
+    long code;
+    int i, k;
+
+    // kana which every converter (including iconv) can map
+    utf8.useAsBinary(0);
+    for (code = 0x3041; code <= 0x3093; code++) {
+        for (k = 0; k < 8; k++) {
+            bench_add_utf8(utf8, (k == 7)?' ':('a' + ((code + k) % 26)));
+        }
+        bench_add_utf8(utf8, code);
+        bench_add_utf8(utf8, code + 0x60);
+        if (code % 8 == 0) {
+            bench_add_utf8(utf8, '\n');
+        }
+    }
+    bench_add_utf8(utf8, '\n');
+    corpus = utf8.strconv("UTF-8", "EUC-JP");
+
+    // throughput should not drop as the text grows
+    for (i = 0; sizes[i] != 0; i++) {
+        text = bench_resize(corpus, sizes[i]);
+        utf8 = text.strconv("EUC-JP", "UTF-8");
+        snprintf(label, sizeof(label), "%ldKB EUC-JP -> UTF-8", sizes[i] / 1024L);
+        bench_strconv(label, text, "EUC-JP", "UTF-8");
+        snprintf(label, sizeof(label), "%ldKB UTF-8 -> EUC-JP", sizes[i] / 1024L);
+        bench_strconv(label, utf8, "UTF-8", "EUC-JP");
+    }
+
+    return 0;
+}
+
+
+/*! Bench5  Changing Width
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench5() {
+    const char *options[] = {"A", "a", "HI", "K", "J", "k", NULL};
+    String corpus, text;
+    char label[64];
+    int i;
+
+    corpus = bench_corpus("UTF-8", 8).strconv("UTF-8", "UTF-8");
+    for (i = 0; options[i] != NULL; i++) {
+        // apply each option to the text it converts
+        if (!strcmp(options[i], "a")) {
+            text = corpus.changeWidth("A", "UTF-8", "UTF-8");
+        } else if (!strcmp(options[i], "HI") || !strcmp(options[i], "K")) {
+            text = corpus.changeWidth("j", "UTF-8", "UTF-8");
+        } else if (!strcmp(options[i], "k")) {
+            text = corpus.changeWidth("J", "UTF-8", "UTF-8");
+        } else {
+            text = corpus;
+        }
+        snprintf(label, sizeof(label), "changeWidth \"%s\"", options[i]);
+        bench_change_width(label, text, options[i]);
+    }
+
+    return 0;
+}
+
+
+/*! Bench6  Measuring Width
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench6() {
+    const int ascii[] = {64, 1, 0};
+    const char *corpus_name[] = {"ascii", "mixed", "cjk"};
+    String utf8;
+    char label[64];
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        utf8 = bench_corpus("UTF-8", ascii[k]).strconv("UTF-8", "UTF-8");
+        snprintf(label, sizeof(label), "%s String::width", corpus_name[k]);
+        bench_width(label, utf8, false);
+        snprintf(label, sizeof(label), "%s widths", corpus_name[k]);
+        bench_width(label, utf8, true);
+    }
+
+    return 0;
+}
+
+
+#define BENCH_THREADS_MAX 32
+#define BENCH_DOCUMENTS   64
+
+typedef struct {
+    const String *documents;
+    String *results;
+    int next;
+    pthread_mutex_t mutex;
+} TBenchQueue;
+
+
+/*! Convert documents of a queue until it is empty
+    @param arg  queue
+    @return NULL
+ */
+static void *bench_worker(void *arg) {
+    TBenchQueue *queue = (TBenchQueue *)arg;
+    String utf8;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->mutex);
+        i = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if (BENCH_DOCUMENTS <= i) {
+            break;
+        }
+        utf8 = queue->documents[i].strconv("CP932", "UTF-8");
+        queue->results[i] = utf8.changeWidth("KJ", "UTF-8").strconv("UTF-8", "EUC-JP");
+    }
+
+    return NULL;
+}
+
+
+/*! Measure converting documents on threads
+    @param documents  CP932 documents
+    @param results    converted documents
+    @param threads    number of threads
+    @return MB/s
+ */
+static double bench_threads(const String *documents, String *results, int threads) {
+    TBenchQueue queue;
+    pthread_t thread[BENCH_THREADS_MAX];
+    double start, elapsed, mbps;
+    long length;
+    int trial, i;
+
+    length = 0;
+    for (i = 0; i < BENCH_DOCUMENTS; i++) {
+        length += documents[i].binaryLength();
+    }
+    queue.documents = documents;
+    queue.results = results;
+    pthread_mutex_init(&queue.mutex, NULL);
+    mbps = 0.0;
+    for (trial = 0; trial < BENCH_TRIALS; trial++) {
+        queue.next = 0;
+        start = bench_now();
+        for (i = 0; i < threads; i++) {
+            pthread_create(&thread[i], NULL, bench_worker, &queue);
+        }
+        for (i = 0; i < threads; i++) {
+            pthread_join(thread[i], NULL);
+        }
+        elapsed = bench_now() - start;
+        if (mbps < (double)length / elapsed / (1024.0 * 1024.0)) {
+            mbps = (double)length / elapsed / (1024.0 * 1024.0);
+        }
+    }
+    pthread_mutex_destroy(&queue.mutex);
+
+    return mbps;
+}
+
+
+/*! Bench7  Converting Independent Text On Threads
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int bench7() {
+    const int threads[] = {1, 2, 4, 8, 16, 32, 0};
+    String documents[BENCH_DOCUMENTS], expected[BENCH_DOCUMENTS], results[BENCH_DOCUMENTS];
+    String corpus;
+    char label[64];
+    double mbps, base;
+    int k, i;
+
+    corpus = bench_corpus("CP932", 0);
+    for (i = 0; i < BENCH_DOCUMENTS; i++) {
+        documents[i] = bench_resize(corpus, 64L * 1024L + i * 256L);
+        expected[i] = documents[i].strconv("CP932", "UTF-8").changeWidth("KJ", "UTF-8").strconv("UTF-8", "EUC-JP");
+    }
+
+    base = 0.0;
+    for (k = 0; threads[k] != 0; k++) {
+        for (i = 0; i < BENCH_DOCUMENTS; i++) {
+            results[i].clear();
+        }
+        mbps = bench_threads(documents, results, threads[k]);
+        for (i = 0; i < BENCH_DOCUMENTS; i++) {
+            if (results[i].len() != expected[i].len() ||
+                    memcmp(results[i].c_str(), expected[i].c_str(), expected[i].len()) != 0) {
+                fprintf(stderr, "Error: Bench7 document %d differs on %d threads\n", i, threads[k]);
+                return -1;
+            }
+        }
+        if (base == 0.0) {
+            base = mbps;
+        }
+        snprintf(label, sizeof(label), "%d threads", threads[k]);
+        printf("  %-28s %9.1f MB/s  x%.2f\n", label, mbps, mbps / base);
+    }
+
+    return 0;
+}
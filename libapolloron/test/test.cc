@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <utility>
 #include "apolloron.h"
 
 using namespace apolloron;
@@ -24,6 +26,8 @@ int test9();
 int test10();
 int test11();
 int test12();
+int test13();
+int test14();
 int example1();
 int example2();
 
@@ -124,6 +128,20 @@ int main(int argc, char *argv[]) {
     }
     fprintf(stderr, "OK\n");
 
+    fprintf(stderr, "Starting Test13 CharsetStream Class ... ");
+    status = test13();
+    if (status != 0) {
+        return -1;
+    }
+    fprintf(stderr, "OK\n");
+
+    fprintf(stderr, "Starting Test14 Detecting Character-Set ... ");
+    status = test14();
+    if (status != 0) {
+        return -1;
+    }
+    fprintf(stderr, "OK\n");
+
 //  example1();
 //  example2();
 
@@ -139,6 +157,7 @@ int main(int argc, char *argv[]) {
 int test1() {
     // Declare Strings
     String str_a, str_b, str_c, str_d, str_e;
+    long i;
 
     // Set Values
     str_a = "You get married";                         // Set String
@@ -199,6 +218,44 @@ int test1() {
     }
 #endif
 
+    // Many Temporary Strings Held Until gc()
+    for (i = 0; i < 200000; i++) {
+        str_d = str_c.mid(4, 3);
+    }
+    str_c.gc();
+    if (strcmp(str_d.c_str(), "You") != 0) {
+        fprintf(stderr, "Error: Test1 #9\n");
+        return -1;
+    }
+
+    // Chained Operations On The Same String
+    str_d = str_a;
+    str_d = str_d.mid(4, 3).upper() + "!";
+    if (strcmp(str_d.c_str(), "GET!") != 0 || strcmp(str_a.c_str(), "You get married") != 0) {
+        fprintf(stderr, "Error: Test1 #10\n");
+        return -1;
+    }
+
+#if __cplusplus >= 201103L
+    // Moving A Temporary String Releases It
+    str_d = std::move(str_c.mid(4, 3));
+    str_b = std::move(str_d);
+    if (strcmp(str_b.c_str(), "You") != 0 || strcmp(str_c.mid(0, 3).c_str(), "Wow") != 0) {
+        fprintf(stderr, "Error: Test1 #11\n");
+        return -1;
+    }
+#endif
+
+    // Character Set Names With A Suffix
+    str_d = "caf\xE9";
+    str_d = str_d.strconv("ISO-8859-1:1987", "UTF-8");
+    if (strcmp(str_d.c_str(), "caf\xC3\xA9") != 0 ||
+            charsetHandle("iso-8859-15:1998") != CHARSET_ISO8859_15 ||
+            charsetHandle("ISO-8859-12") != CHARSET_UNKNOWN) {
+        fprintf(stderr, "Error: Test1 #12\n");
+        return -1;
+    }
+
     // Clear Allocated Memories (option)
     str_b.clear();
     str_c.clear();
@@ -251,6 +308,17 @@ int test2() {
         return -1;
     }
 
+    str_a = "b\na\nb\n\nb\na\n\nc\nc\na";
+    if (strcmp(str_a.uniq().c_str(), "b\na\n\nc\n") != 0) {
+        fprintf(stderr, "Error: Test2 #5\n");
+        return -1;
+    }
+
+    if (strcmp(str_a.uniq(true).c_str(), "b\na\nb\n\nb\na\n\nc\na") != 0) {
+        fprintf(stderr, "Error: Test2 #6\n");
+        return -1;
+    }
+
     // Clear Allocated Memories (option)
     str_a.clear();
     str_b.clear();
@@ -529,6 +597,120 @@ int test4() {
         return -1;
     }
 
+    // Embedded NUL is converted, not truncated
+    str_d.setBinary("A\0\xA4\xA2", 4);
+    str_d = str_d.strconv("EUC-JP", "UTF-16BE");
+    if (!str_d.isBinary() || str_d.binaryLength() != 6 ||
+            memcmp(str_d.c_str(), "\x00\x41\x00\x00\x30\x42", 6)) {
+        fprintf(stderr, "Error: Test4 #6\n");
+        return -1;
+    }
+
+    // Names are resolved to handles once
+    if (charsetHandle("Shift_JIS") != CHARSET_SJIS ||
+            charsetHandle("utf-16le_bom") != CHARSET_UTF16LE_BOM ||
+            charsetHandle("ISO-8859-8-I") != CHARSET_ISO8859_8 ||
+            charsetHandle("x-unknown") != CHARSET_UNKNOWN) {
+        fprintf(stderr, "Error: Test4 #7\n");
+        return -1;
+    }
+    for (int i = CHARSET_UNKNOWN + 1; i < CHARSET_MAX; i++) {
+        if (charsetHandle(charsetName((TCharset)i)) != (TCharset)i) {
+            fprintf(stderr, "Error: Test4 #8\n");
+            return -1;
+        }
+    }
+    str_d = str_a.strconv(CHARSET_EUCJP, CHARSET_SJIS);
+    if (str_d != str_a.strconv("EUC-JP", "SHIFT_JIS")) {
+        fprintf(stderr, "Error: Test4 #9\n");
+        return -1;
+    }
+
+    // Half width katakana and the following voiced sound mark make one
+    str_d = "\xEF\xBD\xB6\xEF\xBE\x9E\xEF\xBD\xB7\xEF\xBE\x9F\xEF\xBE\x8A\xEF\xBE\x9F";
+    str_d = str_d.changeWidth("K", "UTF-8", "UTF-8");
+    if (strcmp(str_d.c_str(), "\xE3\x82\xAC\xE3\x82\xAD\xE3\x82\x9C\xE3\x83\x91") != 0) {
+        fprintf(stderr, "Error: Test4 #10\n");
+        return -1;
+    }
+
+    // Width of each character (combining mark, kanji, emoji, half width katakana)
+    {
+        unsigned char w[16];
+        str_d = "e\xCC\x81\xE6\xBC\xA2\xF0\x9F\x98\x80\xEF\xBD\xB1";
+        if (widths(str_d.c_str(), str_d.len(), w) != 5 ||
+                w[0] != 1 || w[1] != 0 || w[2] != 2 || w[3] != 2 || w[4] != 1 ||
+                str_d.width() != 6) {
+            fprintf(stderr, "Error: Test4 #11\n");
+            return -1;
+        }
+    }
+
+    // Large text of a stateless character set is converted on threads in pieces
+    {
+        String large;
+        large.useAsBinary(0);
+        while (large.binaryLength() < 3L * 1024L * 1024L) {
+            large.addBinary(str_a.c_str(), str_a.len());
+            large.addBinary("\r\n", 2);
+        }
+        str_d = large.strconv(CHARSET_EUCJP, CHARSET_UTF8, 4);
+        if (str_d != large.strconv(CHARSET_EUCJP, CHARSET_UTF8) ||
+                large.strconv("EUC-JP", "ISO-2022-JP", 4) != large.strconv("EUC-JP", "ISO-2022-JP")) {
+            fprintf(stderr, "Error: Test4 #12\n");
+            return -1;
+        }
+    }
+
+    // The last encoder writes into a buffer large enough, or the text is copied
+    {
+        char buf[128];
+        const TCharset dest[] = {CHARSET_JIS, CHARSET_EUCJP, CHARSET_GBK, CHARSET_UTF16BE};
+        str_c = str_a.strconv(CHARSET_EUCJP, CHARSET_UTF8);
+        for (int i = 0; i < 4; i++) {
+            str_d = str_c.strconv(CHARSET_UTF8, dest[i]);
+            long length = str_d.isBinary()?str_d.binaryLength():str_d.len();
+            for (long size = 0; size <= (long)sizeof(buf); size += 7) {
+                memset(buf, 'x', sizeof(buf));
+                if (str_c.strconv(CHARSET_UTF8, dest[i], buf, size) != length ||
+                        (length < size && (memcmp(buf, str_d.c_str(), length) || buf[length] != '\0')) ||
+                        (size < (long)sizeof(buf) && buf[size] != 'x')) {
+                    fprintf(stderr, "Error: Test4 #13\n");
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // Roman text of ISO-2022-JP is copied up to the next shift
+    {
+        String jis = "abcdefgh\x0Fijklmnop\x1B$B$\"\x1B(Bqrstuvwxyz0123";
+        if (strcmp(jis.strconv(CHARSET_JIS, CHARSET_SJIS).c_str(),
+                   "abcdefghijklmnop\x82\xA0qrstuvwxyz0123") != 0) {
+            fprintf(stderr, "Error: Test4 #14\n");
+            return -1;
+        }
+    }
+
+    // Latin-1 guessed as Shift_JIS is decoded before the width and line
+    // stages of inkf: bytes that do not decode are '?' before the stages run
+    {
+        String latin1;
+        latin1.setBinary("caf\xE9 na\xEFve\r\n", 12);
+        str_c = latin1.strconv(CHARSET_AUTODETECT, CHARSET_UTF8);
+        str_d = str_c.changeWidth("A", "UTF-8", "UTF-8");
+        if (strcmp(str_d.c_str(), "\xEF\xBD\x83\xEF\xBD\x81\xEF\xBD\x86\xEF\xBC\x9F\xEF\xBC\x9F"
+                   "\xEF\xBC\x9F\xEF\xBD\x81\xEF\xBC\x9F\xEF\xBD\x96\xEF\xBD\x85\r\n") != 0) {
+            fprintf(stderr, "Error: Test4 #15\n");
+            return -1;
+        }
+        str_d = str_c.changeReturnCode("\r").strconv(CHARSET_UTF8, CHARSET_EUCJP);
+        if (strcmp(str_d.c_str(), "caf???a?ve\r") != 0) {
+            fprintf(stderr, "Error: Test4 #15\n");
+            return -1;
+        }
+    }
+
     // Clear Allocated Memories (option)
     str_a.clear();
     str_b.clear();
@@ -953,6 +1135,33 @@ int test9() {
         fprintf(stderr, "Error: Test9 #13\n");
         return -1;
     }
+    for (i = 1; i < keys1.max(); i++) {
+        if (strcmp(keys1.key(i - 1), keys1.key(i)) >= 0 ||
+            !keys1.isKeyExist(keys1.key(i))) {
+            fprintf(stderr, "Error: Test9 #14\n");
+            return -1;
+        }
+    }
+
+    // keys added out of order and deleted over and over
+    Keys keys3;
+    for (i = 0; i < 50000; i++) {
+        keys3[String((i * 7919) % 50000)] = "bbb";
+        if (1000 <= i) {
+            keys3.delKey(String(((i - 1000) * 7919) % 50000));
+        }
+    }
+    if (keys3.max() != 1000) {
+        fprintf(stderr, "Error: Test9 #15\n");
+        return -1;
+    }
+    for (i = 1; i < keys3.max(); i++) {
+        if (strcmp(keys3.key(i - 1), keys3.key(i)) >= 0 ||
+            strcmp(keys3[keys3.key(i)].c_str(), "bbb") != 0) {
+            fprintf(stderr, "Error: Test9 #15\n");
+            return -1;
+        }
+    }
 
     keys1.saveFile("test9.txt");
     keys2.loadFile("test9.txt");
@@ -966,6 +1175,7 @@ int test9() {
     keys.clear();
     keys1.clear();
     keys2.clear();
+    keys3.clear();
 
     return 0;
 }
@@ -979,6 +1189,11 @@ int test9() {
 int test10() {
     // Declare Sheet
     Sheet sheet1, sheet2;
+    List keys;
+    String csv, csv_file, sorted_file, value;
+    const char *tmp_dir;
+    long i;
+    bool ok;
 
     // Set Values
     sheet1.addCol("COL1");
@@ -1066,6 +1281,108 @@ int test10() {
         return -1;
     }
 
+    sheet2.setCSV("A,B\r\n\"x,\"\"y\"\"\",\"1\r\n2\"\r\nz\r\n");
+    if (sheet2.maxRow() != 2 || sheet2.getValue("A", 0) != "x,\"y\"" ||
+            sheet2.getValue("B", 0) != "1\n2" || sheet2.getValue("A", 1) != "z" ||
+            sheet2.getValue("B", 1) != "") {
+        fprintf(stderr, "Error: Test10 #12\n");
+        return -1;
+    }
+
+    keys.add("A");
+    keys.add("B");
+    sheet2.setCSV("A,B,C\nx,2,a\ny,1,b\nx,10,c\ny,1,d\n");
+    sheet2.sortByCols(keys, "SN");
+    if (sheet2.getCSV() != "A,B,C\ny,1,b\ny,1,d\nx,10,c\nx,2,a\n") {
+        fprintf(stderr, "Error: Test10 #13\n");
+        return -1;
+    }
+
+    // runs of the smallest size are merged
+    csv = "A,B\n";
+    for (i = 0; i < 20000; i++) {
+        csv += String((i * 7919) % 20000);
+        csv += ",\"b\n";
+        csv += String(i % 3);
+        csv += "\"\n";
+    }
+    tmp_dir = getenv("TMPDIR");
+    if (tmp_dir == NULL || tmp_dir[0] == '\0') {
+        tmp_dir = "/tmp";
+    }
+    csv_file.sprintf("%s/apolloron-test10-%d.csv", tmp_dir, (int)getpid());
+    sorted_file.sprintf("%s/apolloron-test10-%d-sorted.csv", tmp_dir, (int)getpid());
+    csv.saveFile(csv_file);
+    sheet2.setCSV(csv);
+    sheet2.sortByCols(keys, "nS");
+    ok = (sheet1.sortCSVFile(csv_file, sorted_file, keys, "nS", "UTF-8", "UTF-8", "\n", 1) == 2 &&
+          0 <= csv.loadFile(sorted_file) && csv == sheet2.getCSV() &&
+          sheet2.getValue("A", 19999) == "19999" &&
+          sheet1.sortCSVFile(csv_file, "no-such-dir/test10.csv", keys, "nS") == -1);
+    unlink(csv_file.c_str());
+    unlink(sorted_file.c_str());
+    if (!ok) {
+        fprintf(stderr, "Error: Test10 #14\n");
+        return -1;
+    }
+
+    // parts sorted on threads are merged as one sort
+    csv = "A,B\n";
+    for (i = 0; i < 100000; i++) {
+        csv += String((i * 7919) % 100);
+        csv += ",";
+        csv += String(i);
+        csv += "\n";
+    }
+    sheet1.setCSV(csv);
+    sheet2.setCSV(csv);
+    sheet1.sortnumr("A");
+    sheet2.setThreads(4);
+    sheet2.sortnumr("A");
+    if (sheet1.getCSV() != sheet2.getCSV() || sheet2.getValue("A", 0) != "99" ||
+            sheet2.getValue("B", 0) != "21" || sheet2.getValue("B", 1) != "121") {
+        fprintf(stderr, "Error: Test10 #15\n");
+        return -1;
+    }
+
+    // BOM is not a part of the first column name
+    csv = "\xEF\xBB\xBF" "A,B\n3,x\n1,y\n2,z\n";
+    csv.saveFile(csv_file);
+    ok = (sheet1.sortCSVFile(csv_file, sorted_file, keys, "n", "UTF-8", "UTF-8", "\n", 1) == 2 &&
+          0 <= csv.loadFile(sorted_file) && csv == "A,B\n1,y\n2,z\n3,x\n");
+    unlink(csv_file.c_str());
+    unlink(sorted_file.c_str());
+    if (!ok) {
+        fprintf(stderr, "Error: Test10 #16\n");
+        return -1;
+    }
+
+    // overwritten cells are compacted without changing other cells or copies
+    sheet1.setCSV("A,B\n");
+    for (i = 0; i < 300; i++) {
+        sheet1.addRow();
+        sheet1.setValue("A", i, String(i));
+    }
+    csv = sheet1.getValue("A", 7);
+    for (i = 0; i < 300 * 40; i++) {
+        value = String(i);
+        value += String("abcdefghijklmnopqrstuvwxyzabcdefghijk").left(i % 37);
+        sheet1.setValue("B", i % 300, (i % 5 == 4)?String(""):value);
+    }
+    ok = (csv == "7");
+    for (i = 0; i < 300; i++) {
+        value = String(11700 + i);
+        value += String("abcdefghijklmnopqrstuvwxyzabcdefghijk").left((11700 + i) % 37);
+        if (sheet1.getValue("A", i) != String(i) ||
+                sheet1.getValue("B", i) != (((11700 + i) % 5 == 4)?String(""):value)) {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Test10 #17\n");
+        return -1;
+    }
+
     // Clear Allocated Memories (option)
     sheet1.clear();
 
@@ -1194,6 +1511,234 @@ int test12() {
 }
 
 
+/*! Test13  CharsetStream Class
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int test13() {
+    const char *charsets[] = {"CP932", "EUC-JP", "ISO-2022-JP", "UTF-7",
+                              "UTF-16LE", "UTF-32BE", "GB18030", NULL};
+    String str_a, str_b, str_c, str_d;
+    CharsetStream cs;
+    long i, j, step, length;
+
+    // Set Values
+    str_a = "ASCII \xE3\x81\x82\xE3\x81\x84\xE3\x81\x86 "     // Hiragana
+            "\xEF\xBD\xB6\xEF\xBE\x9E\xEF\xBE\x8A\xEF\xBE\x9F "  // Half-width Katakana
+            "\xE6\xBC\xA2\xE5\xAD\x97 a+b&c\r\n"                // Kanji
+            "\xE3\x83\x86\xE3\x82\xB9\xE3\x83\x88 end";
+
+    // Decode Pieces Of Input
+    for (i = 0; charsets[i] != NULL; i++) {
+        str_b = str_a.strconv("UTF-8", charsets[i]);
+        length = str_b.isBinary()?str_b.binaryLength():str_b.len();
+        for (step = 1; step <= 7; step += 6) {
+            cs.open(charsets[i], "UTF-8");
+            str_c.useAsBinary(0);
+            for (j = 0; j < length; j += step) {
+                cs.decode(str_b.c_str() + j, (j + step <= length)?step:(length - j), str_c);
+            }
+            cs.decodeFlush(str_c);
+            if (str_c.binaryLength() != str_a.len() ||
+                    memcmp(str_c.c_str(), str_a.c_str(), str_a.len()) != 0) {
+                fprintf(stderr, "Error: Test13 #1 (%s)\n", charsets[i]);
+                return -1;
+            }
+        }
+    }
+
+    // Convert Pieces Of Input (encoder state kept across many pieces; every line has
+    // half-width katakana, so iconv which cannot encode them leaves each line as UTF-8)
+    str_d = "";
+    for (i = 0; i < 100; i++) {
+        str_d += str_a.left(str_a.search("\r\n") + 2);
+    }
+    str_b = str_d.strconv("UTF-8", "CP932");
+    length = str_b.len();
+    cs.open("AUTODETECT", "ISO-2022-JP");
+    cs.setDetectSize(64);
+    str_c.useAsBinary(0);
+    for (j = 0; j < length; j += 3) {
+        cs.write(str_b.c_str() + j, (j + 3 <= length)?3:(length - j), str_c);
+    }
+    cs.flush(str_c);
+    if (strcmp(cs.srcCharSet(), "CP932") != 0) {
+        fprintf(stderr, "Error: Test13 #2\n");
+        return -1;
+    }
+    str_d = str_d.strconv("UTF-8", "ISO-2022-JP");
+    if (str_c.binaryLength() != str_d.len() ||
+            memcmp(str_c.c_str(), str_d.c_str(), str_d.len()) != 0) {
+        fprintf(stderr, "Error: Test13 #3\n");
+        return -1;
+    }
+
+    // Encode Pieces Of UTF-8 (BOM only once)
+    cs.open("UTF-8", "UTF-16");
+    str_c.useAsBinary(0);
+    for (j = 0; j < str_a.len(); j += 5) {
+        cs.encode(str_a.c_str() + j, (j + 5 <= str_a.len())?5:(str_a.len() - j), str_c);
+    }
+    cs.encodeFlush(str_c);
+    str_d = str_a.strconv("UTF-8", "UTF-16");
+    if (str_c.binaryLength() != str_d.binaryLength() ||
+            memcmp(str_c.c_str(), str_d.c_str(), str_d.binaryLength()) != 0) {
+        fprintf(stderr, "Error: Test13 #4\n");
+        return -1;
+    }
+
+    // Convert Unicode Without Output Character-Set (UTF-8 like strconv)
+    str_b = str_a.strconv("UTF-8", "UTF-16");
+    length = str_b.binaryLength();
+    cs.open("UTF-16", "");
+    str_c.useAsBinary(0);
+    for (j = 0; j < length; j += 3) {
+        cs.write(str_b.c_str() + j, (j + 3 <= length)?3:(length - j), str_c);
+    }
+    cs.flush(str_c);
+    if (str_c.binaryLength() != str_a.len() ||
+            memcmp(str_c.c_str(), str_a.c_str(), str_a.len()) != 0) {
+        fprintf(stderr, "Error: Test13 #5\n");
+        return -1;
+    }
+
+    // Clear Allocated Memories (option)
+    str_a.clear();
+    str_b.clear();
+    str_c.clear();
+    str_d.clear();
+    cs.clear();
+
+    return 0;
+}
+
+
+/*! Test14  Detecting Character-Set
+    @param  void
+    @retval 0  success
+    @retval -1 failure
+ */
+int test14() {
+    const char *ja = "ASCII \xE3\x81\x82\xE3\x81\x84\xE3\x81\x86 "        // Hiragana
+                     "\xEF\xBD\xB6\xEF\xBE\x9E "                        // Half-width Katakana
+                     "\xE6\xBC\xA2\xE5\xAD\x97 $5 50%\r\n"              // Kanji
+                     "\xE3\x83\x86\xE3\x82\xB9\xE3\x83\x88 end\r\n";
+    // ISO-2022-JP of iconv has no half-width katakana
+    const char *jis = "ASCII \xE3\x81\x82\xE3\x81\x84\xE3\x81\x86 "
+                      "\xE6\xBC\xA2\xE5\xAD\x97 $5 50%\r\n"
+                      "\xE3\x83\x86\xE3\x82\xB9\xE3\x83\x88 end\r\n";
+    const char *ko = "Hangul \xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4 \xEB\xAC\xB8\xEC\x9E\x90 test\r\n";
+    const char *zh = "Chinese \xE6\x88\x91\xE7\x9A\x84\xE4\xB8\xAD\xE5\x9B\xBD \xE6\xB1\x89\xE5\xAD\x97 test\r\n";
+    const char *tw = "Chinese \xE4\xB8\xAD\xE6\x96\x87\xE8\xB3\x87\xE6\x96\x99 \xE8\x87\xBA\xE7\x81\xA3 test\r\n";
+    const struct {
+        const char *text;
+        const char *charset;
+        const char *detected;
+        const char *detected_jp;
+    } corpus[] = {
+        {ja, "UTF-8",       "UTF-8",       "UTF-8"},
+        {ja, "CP932",       "CP932",       "CP932"},
+        {ja, "EUC-JP",      "EUC-JP",      "EUC-JP"},
+        {jis, "ISO-2022-JP", "ISO-2022-JP", "ISO-2022-JP"},
+        {ko, "UTF-8",       "UTF-8",       "UTF-8"},
+        {ko, "EUC-KR",      "CP949",       "EUC-JP"},
+        {zh, "GB18030",     "GB18030",     "EUC-JP"},
+        {tw, "CP950",       "CP950",       "CP932"},
+        {NULL, NULL, NULL, NULL}
+    };
+    String str_a, str_b, str_c;
+    long i, k, length;
+    int confidence;
+
+    // Set Values
+    str_a = "";
+    while (str_a.len() < 40000) {
+        str_a += "The quick brown fox jumps over the lazy dog.\n";
+    }
+
+    for (i = 0; corpus[i].text != NULL; i++) {
+        str_b = String(corpus[i].text).strconv("UTF-8", corpus[i].charset);
+        length = str_b.len();
+
+        // Short text, text after a long ASCII text and long text
+        for (k = 0; k < 3; k++) {
+            str_c.useAsBinary(0);
+            if (k == 1) {
+                str_c.addBinary(str_a.c_str(), str_a.len());
+            }
+            do {
+                str_c.addBinary(str_b.c_str(), length);
+            } while (k == 2 && str_c.binaryLength() < 40000);
+            if (strcmp(str_c.detectCharSet(), corpus[i].detected) != 0) {
+                fprintf(stderr, "Error: Test14 #1 (%s, %ld)\n", corpus[i].charset, k);
+                return -1;
+            }
+            if (strcmp(str_c.detectCharSetJP(), corpus[i].detected_jp) != 0) {
+                fprintf(stderr, "Error: Test14 #2 (%s, %ld)\n", corpus[i].charset, k);
+                return -1;
+            }
+        }
+    }
+
+    // CP1252 is a few 8bit characters in a long ASCII text
+    str_c = str_a;
+    str_c += "Caf\xE9 na\xEFve r\xE9sum\xE9 and so on, plain text\r\n";
+    if (strcmp(str_c.detectCharSet(), "CP1252") != 0) {
+        fprintf(stderr, "Error: Test14 #3\n");
+        return -1;
+    }
+
+    // ASCII
+    if (strcmp(str_a.detectCharSet(), "US-ASCII") != 0 ||
+            strcmp(str_a.detectCharSetJP(), "US-ASCII") != 0) {
+        fprintf(stderr, "Error: Test14 #4\n");
+        return -1;
+    }
+
+    // Prefix Of Long Text (settled or decided before the end)
+    for (i = 0; corpus[i].text != NULL; i++) {
+        str_b = String(corpus[i].text).strconv("UTF-8", corpus[i].charset);
+        length = str_b.len();
+        str_c.useAsBinary(0);
+        do {
+            str_c.addBinary(str_b.c_str(), length);
+        } while (str_c.binaryLength() < 200000);
+        if (strcmp(str_c.detectCharSet(0, &confidence), corpus[i].detected) != 0 ||
+                confidence != CHARSET_CONFIDENCE_HIGH) {
+            fprintf(stderr, "Error: Test14 #5 (%s)\n", corpus[i].charset);
+            return -1;
+        }
+        if (strcmp(str_c.detectCharSet(1024L*1024L, &confidence), corpus[i].detected) != 0 ||
+                confidence == CHARSET_CONFIDENCE_LOW) {
+            fprintf(stderr, "Error: Test14 #6 (%s)\n", corpus[i].charset);
+            return -1;
+        }
+        if (strcmp(str_c.detectCharSetJP(1024L*1024L, &confidence), corpus[i].detected_jp) != 0 ||
+                confidence == CHARSET_CONFIDENCE_LOW) {
+            fprintf(stderr, "Error: Test14 #7 (%s)\n", corpus[i].charset);
+            return -1;
+        }
+    }
+
+    // Limit Reached Before The Result Settles
+    str_c = str_a;
+    str_c += String(ja).strconv("UTF-8", "CP932");
+    if (strcmp(str_c.detectCharSet(1000, &confidence), "US-ASCII") != 0 ||
+            confidence != CHARSET_CONFIDENCE_LOW) {
+        fprintf(stderr, "Error: Test14 #8\n");
+        return -1;
+    }
+
+    // Clear Allocated Memories (option)
+    str_a.clear();
+    str_b.clear();
+    str_c.clear();
+
+    return 0;
+}
+
+
 /*! Example1  Socket Class
     @param  void
     @retval 0  success
@@ -10,9 +10,22 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "inkf.h"
 #include "inkf_common.h"
 
 
+/* converter context of inkf_open() */
+struct inkf_ctx {
+    TOption option;
+    int argc;
+    char **argv;
+    char *pstr;
+};
+
+static int split_option_str(const char *option_str, int *pargc, char ***pargv, char **ppstr);
+static void free_option_str(char **argv, char *pstr);
+
+
 /*! inkf text conversion
     @param src_str       Source text to convert
     @param src_str_len   Length of src_str
@@ -25,10 +38,8 @@ int inkf(const char *src_str, long src_str_len,
          char **dest_str, long *dest_str_len, const char *option_str) {
     int argc;
     char **argv;
-    char *p, *pstr;
-    long i, l;
+    char *pstr;
     TOption option;
-    int quote;
     int retval = 0;
 
     if (dest_str != NULL) {
@@ -42,11 +53,192 @@ int inkf(const char *src_str, long src_str_len,
         src_str = "";
         src_str_len = 0;
     }
+
+    /* parse option */
+    memset(&option, 0, sizeof(TOption));
+    if (split_option_str(option_str, &argc, &argv, &pstr) != 0) {
+        retval = -1;
+        goto libinkf_exit;
+    }
+
+    /* set option */
+    if (inkf_set_option(&option, argc, (const char **)argv) != 0) {
+        /* Invalid parameter(s). */
+        retval = -1;
+        goto libinkf_exit;
+    }
+
+    retval = inkf_lib_exec(src_str, src_str_len, dest_str, dest_str_len,
+                           &option);
+
+libinkf_exit:
+    free_option_str(argv, pstr);
+    inkf_free_option(&option);
+
+    return retval;
+}
+
+
+/*! inkf text conversion into a buffer of the caller
+    @param src_str       Source text to convert
+    @param src_str_len   Length of src_str
+    @param dest_buf      Buffer for the converted text (NULL terminated, written by
+                         the last encoder when its worst case fits, see inkf.h),
+                         NULL to get the required size (the text is converted to know it)
+    @param dest_buf_size Size of dest_buf
+    @param dest_str_len  Length of the converted text (without NULL terminater)
+    @retval  0  success
+    @retval -1  failure
+    @retval -2  dest_buf is too small (dest_str_len is set, and dest_buf needs
+                dest_str_len + 1 bytes)
+ */
+int inkf_buf(const char *src_str, long src_str_len,
+             char *dest_buf, long dest_buf_size, long *dest_str_len, const char *option_str) {
+    int argc;
+    char **argv;
+    char *pstr;
+    TOption option;
+    int retval = 0;
+
+    if (dest_str_len != NULL) {
+        *dest_str_len = 0;
+    }
+
+    /* parse option */
+    memset(&option, 0, sizeof(TOption));
+    if (split_option_str(option_str, &argc, &argv, &pstr) != 0) {
+        retval = -1;
+        goto libinkf_buf_exit;
+    }
+
+    /* set option */
+    if (inkf_set_option(&option, argc, (const char **)argv) != 0) {
+        /* Invalid parameter(s). */
+        retval = -1;
+        goto libinkf_buf_exit;
+    }
+
+    retval = inkf_lib_exec_buf(src_str, src_str_len, dest_buf, dest_buf_size, dest_str_len,
+                               &option);
+
+libinkf_buf_exit:
+    free_option_str(argv, pstr);
+    inkf_free_option(&option);
+
+    return retval;
+}
+
+
+/*! Open a converter context (options are parsed only once)
+    @param option_str  Options of inkf (without input/output files)
+    @return Context for inkf_convert(), NULL if the options are invalid
+ */
+inkf_ctx *inkf_open(const char *option_str) {
+    inkf_ctx *ctx;
+
+    ctx = (inkf_ctx *)malloc(sizeof(inkf_ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    memset(&(ctx->option), 0, sizeof(TOption));
+
+    if (split_option_str(option_str, &(ctx->argc), &(ctx->argv), &(ctx->pstr)) != 0) {
+        goto libinkf_open_error;
+    }
+    if (inkf_set_option(&(ctx->option), ctx->argc, (const char **)ctx->argv) != 0) {
+        /* Invalid parameter(s). */
+        goto libinkf_open_error;
+    }
+    if (ctx->option.input_filenames != NULL || ctx->option.output_filename != NULL) {
+        /* A context converts only the text given to inkf_convert(). */
+        goto libinkf_open_error;
+    }
+
+    return ctx;
+
+libinkf_open_error:
+    free_option_str(ctx->argv, ctx->pstr);
+    inkf_free_option(&(ctx->option));
+    free(ctx);
+
+    return NULL;
+}
+
+
+/*! inkf text conversion with a context
+    @param ctx           Context of inkf_open()
+    @param src_str       Source text to convert
+    @param src_str_len   Length of src_str
+    @param dest_buf      Buffer for the converted text (NULL terminated, written by
+                         the last encoder when its worst case fits, see inkf.h),
+                         NULL to get the required size
+    @param dest_buf_size Size of dest_buf
+    @param dest_str_len  Length of the converted text (without NULL terminater)
+    @retval  0  success
+    @retval -1  failure
+    @retval -2  dest_buf is too small (dest_str_len is set, and dest_buf needs
+                dest_str_len + 1 bytes)
+ */
+int inkf_convert(inkf_ctx *ctx, const char *src_str, long src_str_len,
+                 char *dest_buf, long dest_buf_size, long *dest_str_len) {
+    if (ctx == NULL) {
+        if (dest_str_len != NULL) {
+            *dest_str_len = 0;
+        }
+        return -1;
+    }
+
+    return inkf_lib_exec_buf(src_str, src_str_len, dest_buf, dest_buf_size, dest_str_len,
+                             &(ctx->option));
+}
+
+
+/*! Close a converter context
+    @param ctx  Context of inkf_open()
+    @return void
+ */
+void inkf_close(inkf_ctx *ctx) {
+    if (ctx != NULL) {
+        free_option_str(ctx->argv, ctx->pstr);
+        inkf_free_option(&(ctx->option));
+        free(ctx);
+    }
+}
+
+
+/*! Set the allocator of inkf dest_str (call before any conversion)
+    @param alloc_func  Function to allocate dest_str, NULL for the default
+    @param free_func   Function to free dest_str by inkf_free_str(), NULL for the default
+    @return void
+ */
+void inkf_set_allocator(void *(*alloc_func)(size_t size), void (*free_func)(void *ptr)) {
+    inkf_lib_set_allocator(alloc_func, free_func);
+}
+
+
+/*! Free inkf dest_str
+    @param str  Pointer of text to free
+    @return void
+ */
+void inkf_free_str(char *str) {
+    if (str != NULL) {
+        inkf_free_output_str(str);
+    }
+}
+
+
+/* Split option_str into argv (argv[0] is "inkf", returns -1 if a quote is not closed) */
+static int split_option_str(const char *option_str, int *pargc, char ***pargv, char **ppstr) {
+    int argc;
+    char **argv;
+    char *p, *pstr;
+    long i, l;
+    int quote;
+
     if (option_str == (const char *)NULL) {
         option_str = "";
     }
 
-    /* parse option */
     argc = 1;
     argv = (char **)malloc(sizeof(char *) * (1 + 1));
     argv[0] = malloc(5);
@@ -102,36 +294,20 @@ int inkf(const char *src_str, long src_str_len,
             i++;
         }
     }
-    if (quote != 0) {
-        retval = -1;
-        goto libinkf_exit;
-    }
 
-    /* set option */
-    if (inkf_set_option(&option, argc, (const char **)argv) != 0) {
-        /* Invalid parameter(s). */
-        retval = -1;
-        goto libinkf_exit;
-    }
+    *pargc = argc;
+    *pargv = argv;
+    *ppstr = pstr;
 
-    retval = inkf_lib_exec(src_str, src_str_len, dest_str, dest_str_len,
-                           &option);
-
-libinkf_exit:
-    free(argv);
-    free(pstr);
-    inkf_free_option(&option);
-
-    return retval;
+    return (quote != 0)?-1:0;
 }
 
 
-/*! Free inkf dest_str
-    @param str  Pointer of text to free
-    @return void
- */
-void inkf_free_str(char *str) {
-    if (str != NULL) {
-        inkf_free_output_str(str);
+/* Free argv and pstr of split_option_str() */
+static void free_option_str(char **argv, char *pstr) {
+    if (argv != NULL) {
+        free(argv[0]);
+        free(argv);
     }
+    free(pstr);
 }